@@ -0,0 +1,168 @@
+// Generated by tools/make_abbreviations.py from Abbreviations.txt, don't edit
+// 23 abbreviations, 128 states, 1121 bytes of flash
+
+#ifndef ABBREVIATIONS_H
+#define ABBREVIATIONS_H
+
+#include "TextExpander.h"
+
+const TextExpanderState abbreviations_states[128] = {
+  {1, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {13, 0x0000, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {1, 0x0000, 0xFFFF},
+  {3, 0x0000, 0xFFFF},
+  {27, 0x004B, 0xFFFF},
+  {3, 0x0000, 0xFFFF},
+  {31, 0x0054, 0xFFFF},
+  {36, 0x0042, 0xFFFF},
+  {24, 0x0000, 0xFFFF},
+  {32, 0x0045, 0xFFFF},
+  {0, 0x0052, 0x0113},
+  {1, 0x0000, 0xFFFF},
+  {38, 0x004E, 0xFFFF},
+  {3, 0x0000, 0xFFFF},
+  {1, 0x0000, 0xFFFF},
+  {0, 0x004D, 0x004B},
+  {46, 0x0055, 0xFFFF},
+  {13, 0x0000, 0xFFFF},
+  {6, 0x001C, 0xFFFF},
+  {42, 0x0058, 0xFFFF},
+  {3, 0x0000, 0xFFFF},
+  {4, 0x0000, 0xFFFF},
+  {19, 0x001C, 0xFFFF},
+  {16, 0x0043, 0xFFFF},
+  {17, 0x001C, 0xFFFF},
+  {49, 0x0056, 0xFFFF},
+  {15, 0x001C, 0xFFFF},
+  {29, 0x0048, 0xFFFF},
+  {35, 0x0048, 0xFFFF},
+  {23, 0x001C, 0xFFFF},
+  {42, 0x005A, 0xFFFF},
+  {24, 0x001C, 0xFFFF},
+  {48, 0x0051, 0xFFFF},
+  {51, 0x0056, 0xFFFF},
+  {0, 0x005D, 0x00E3},
+  {0, 0x005F, 0x00EE},
+  {38, 0x0048, 0xFFFF},
+  {48, 0x0047, 0xFFFF},
+  {28, 0x0051, 0xFFFF},
+  {0, 0x0057, 0x0145},
+  {0, 0x0049, 0x0053},
+  {0, 0x005C, 0x000B},
+  {0, 0x005B, 0x0021},
+  {26, 0x0048, 0xFFFF},
+  {0, 0x005B, 0x0014},
+  {0, 0x0064, 0x0031},
+  {0, 0x006B, 0x0000},
+  {46, 0x0044, 0xFFFF},
+  {0, 0x004C, 0x00CB},
+  {0, 0x0060, 0x0059},
+  {0, 0x0066, 0x009D},
+  {47, 0x0046, 0xFFFF},
+  {0, 0x0050, 0x0067},
+  {0, 0x0059, 0x010C},
+  {0, 0x0061, 0x011A},
+  {0, 0x0053, 0x00D4},
+  {0, 0x005E, 0x0125},
+  {49, 0x0065, 0xFFFF},
+  {0, 0x006F, 0x008E},
+  {0, 0x0073, 0x007F},
+  {0, 0x0079, 0x0150},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0xFFFF, 0xFFFF},
+  {0, 0x0053, 0x00FA},
+};
+
+const char abbreviations_text[] =
+  "git status\0"
+  "git diff\0"
+  "git checkout\0"
+  "git commit -m \"\0"
+  "git log --oneline --graph\0"
+  "ls -alh\0"
+  "df -h\0"
+  "ps aux | grep\0"
+  "tail -f /var/log/syslog\0"
+  "sudo systemctl\0"
+  "journalctl -fu\0"
+  "python3 -m venv .venv && . .venv/bin/activate\0"
+  "make -j4\0"
+  "KeyboardMatrix\0"
+  "PressedKey\0"
+  "ReleasedKey\0"
+  "keyboard_update()\0"
+  "#ifdef\0"
+  "#endif\0"
+  "#include \"\0"
+  "miniterm.py /dev/ttyACM0 115200\0"
+  "by the way\0"
+  "as far as I know\0"
+  ;
+
+const TextExpansionTrie abbreviations = {abbreviations_states, 128, abbreviations_text};
+
+#endif
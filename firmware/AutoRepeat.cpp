@@ -0,0 +1,53 @@
+#include "AutoRepeat.h"
+
+AutoRepeat::AutoRepeat(uint32_t delay, uint32_t interval,
+                       uint32_t min_interval, uint32_t acceleration) {
+  delay_micros = delay;
+  interval_micros = interval;
+  min_interval_micros = min_interval;
+  acceleration_micros = acceleration;
+  active = false;
+  repeat_count = 0;
+}
+
+void AutoRepeat::start(uint8_t key_row, uint8_t key_col, uint8_t key_layer,
+                       char key_ascii, uint32_t press_micros) {
+  active = true;
+  row = key_row;
+  col = key_col;
+  layer = key_layer;
+  ascii_key = key_ascii;
+  repeat_count = 0;
+  current_interval = interval_micros;
+  // measured from when the key's line was read, not when we got here
+  next_micros = press_micros + delay_micros;
+}
+
+void AutoRepeat::stop(void) {
+  active = false;
+}
+
+void AutoRepeat::key_released(uint8_t key_row, uint8_t key_col) {
+  if (active && row == key_row && col == key_col)
+    active = false;
+}
+
+bool AutoRepeat::due(uint32_t now_micros) {
+  if (!active || (int32_t) (now_micros - next_micros) < 0)
+    return false;
+
+  next_micros += current_interval;
+  // If the loop stalled for more than a whole interval drop the missed
+  // repeats rather than bursting them out
+  if ((int32_t) (now_micros - next_micros) >= 0)
+    next_micros = now_micros + current_interval;
+
+  if (current_interval > min_interval_micros + acceleration_micros)
+    current_interval -= acceleration_micros;
+  else
+    current_interval = min_interval_micros;
+
+  if (repeat_count < UINT16_MAX)
+    repeat_count++;
+  return true;
+}
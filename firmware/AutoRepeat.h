@@ -0,0 +1,45 @@
+#ifndef AUTOREPEAT_H
+#define AUTOREPEAT_H
+
+#include <Arduino.h>
+
+// Typematic auto-repeat
+//
+// Repeats the most recently pressed repeatable key. Each repeat is scheduled
+// at a deadline: the first one delay_micros after the press, then each one an
+// interval after the previous deadline (not after the loop that sent it), so
+// the cadence doesn't drift with loop jitter. The interval shrinks by
+// acceleration_micros per repeat down to min_interval_micros.
+
+class AutoRepeat {
+public:
+  AutoRepeat(uint32_t delay_micros, uint32_t interval_micros,
+             uint32_t min_interval_micros, uint32_t acceleration_micros);
+
+  uint32_t delay_micros;
+  uint32_t interval_micros;
+  uint32_t min_interval_micros;
+  uint32_t acceleration_micros;
+
+  // The key being repeated
+  bool active;
+  uint8_t row;
+  uint8_t col;
+  uint8_t layer;
+  char ascii_key;
+  uint16_t repeat_count;
+
+  void start(uint8_t key_row, uint8_t key_col, uint8_t key_layer,
+             char key_ascii, uint32_t press_micros);
+  void stop();
+  // Stop if this is the key being repeated
+  void key_released(uint8_t key_row, uint8_t key_col);
+  // Returns true once per elapsed deadline
+  bool due(uint32_t now_micros);
+
+private:
+  uint32_t next_micros;
+  uint32_t current_interval;
+};
+
+#endif
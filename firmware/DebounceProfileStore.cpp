@@ -0,0 +1,113 @@
+#include "DebounceProfileStore.h"
+#include <EEPROM.h>
+
+DebounceProfileStore::DebounceProfileStore(KeyboardMatrix *key_matrix) {
+  matrix = key_matrix;
+  num_keys = (uint16_t) matrix->num_rows * matrix->num_cols;
+  eeprom_address = DEBOUNCE_PROFILE_EEPROM_ADDRESS(num_keys);
+  last_checkpoint_millis = millis();
+  checkpoint_cursor = 0;
+  checkpoint_running = false;
+}
+
+uint16_t DebounceProfileStore::image_size(void) {
+  return DEBOUNCE_PROFILE_EEPROM_SIZE(num_keys);
+}
+
+uint8_t DebounceProfileStore::image_byte(uint16_t offset) {
+  if (offset < 4)
+    return (uint32_t) DEBOUNCE_PROFILE_EEPROM_MAGIC >> (offset*8);
+  offset -= 4;
+  if (offset < 2)
+    return num_keys >> (offset*8);
+  offset -= 2;
+  if (offset < num_keys)
+    return matrix->debounce_profiles[offset].bounce;
+  offset -= num_keys;
+  if (offset < num_keys)
+    return matrix->debounce_profiles[offset].chatter;
+  offset -= num_keys;
+  return matrix->debounce_profiles[offset].noise;
+}
+
+bool DebounceProfileStore::restore(void) {
+  uint16_t addr = eeprom_address;
+  uint32_t magic = 0;
+  uint16_t saved_keys;
+  uint16_t k;
+  uint8_t i;
+
+  if (eeprom_address + image_size() > EEPROM.length())
+    return false;
+
+  for (i=0; i<4; i++)
+    magic |= (uint32_t) EEPROM.read(addr++) << (i*8);
+  if (magic != DEBOUNCE_PROFILE_EEPROM_MAGIC)
+    return false;
+  saved_keys = EEPROM.read(addr) | (EEPROM.read(addr+1) << 8);
+  addr += 2;
+  if (saved_keys != num_keys)
+    return false;
+
+  matrix->reset_debounce_profiles();
+  for (k=0; k<num_keys; k++)
+    matrix->debounce_profiles[k].bounce = EEPROM.read(addr++);
+  for (k=0; k<num_keys; k++) {
+    uint8_t chatter = EEPROM.read(addr++);
+    matrix->debounce_profiles[k].chatter =
+      chatter > DEBOUNCE_ADAPTIVE_MAX_CHATTER ? DEBOUNCE_ADAPTIVE_MAX_CHATTER : chatter;
+  }
+  for (k=0; k<num_keys; k++) {
+    uint8_t noise = EEPROM.read(addr++);
+    matrix->debounce_profiles[k].noise =
+      noise > DEBOUNCE_ADAPTIVE_MAX_NOISE ? DEBOUNCE_ADAPTIVE_MAX_NOISE : noise;
+  }
+  return true;
+}
+
+void DebounceProfileStore::checkpoint(void) {
+#if DEBOUNCE_PROFILE_CHECKPOINT_INTERVAL > 0
+  if (!checkpoint_running) {
+    if (millis() - last_checkpoint_millis < DEBOUNCE_PROFILE_CHECKPOINT_INTERVAL)
+      return;
+    // too big for this part's EEPROM
+    if (eeprom_address + image_size() > EEPROM.length())
+      return;
+    checkpoint_running = true;
+    checkpoint_cursor = 0;
+  }
+
+  for (uint8_t n=0; n<DEBOUNCE_PROFILE_BYTES_PER_CALL && checkpoint_cursor < image_size(); n++) {
+    EEPROM.update(eeprom_address + checkpoint_cursor, image_byte(checkpoint_cursor));
+    checkpoint_cursor++;
+  }
+
+  if (checkpoint_cursor >= image_size()) {
+    checkpoint_running = false;
+    last_checkpoint_millis = millis();
+  }
+#endif
+}
+
+bool DebounceProfileStore::print_part(Print *out, uint16_t k) {
+  if (k >= num_keys)
+    return false;
+
+  debounce_profile *profile = &matrix->debounce_profiles[k];
+  if (profile->bounce != 0 || profile->chatter != 0 || profile->noise != DEBOUNCE_ADAPTIVE_MAX_NOISE) {
+    out->print((unsigned long) (k / matrix->num_cols));
+    out->print(' ');
+    out->print((unsigned long) (k % matrix->num_cols));
+    out->print(' ');
+    out->print((unsigned long) profile->bounce);
+    out->print(' ');
+    out->print((unsigned long) profile->chatter);
+    out->print(' ');
+    out->print((unsigned long) profile->noise);
+    out->print(' ');
+    out->print((unsigned long) matrix->key_steady_count(k));
+    out->print(' ');
+    out->println((unsigned long) matrix->key_transient_count(k));
+  }
+  return k+1 < num_keys;
+}
@@ -0,0 +1,55 @@
+#ifndef DEBOUNCEPROFILESTORE_H
+#define DEBOUNCEPROFILESTORE_H
+
+#include <Arduino.h>
+#include "KeyboardMatrix.h"
+#include "KeyStats.h"
+
+// Keeps KeyboardMatrix's learned debounce profiles across power cycles
+//
+// The EEPROM image is the magic number, the key count, then bounce[],
+// chatter[] and noise[] (one byte each per key). restore() is all or nothing:
+// an image for a different key count (or the older one without noise[]) is
+// ignored and every key starts from steady_count and TRANSIENT_COUNT as
+// usual. Checkpoints work like KeyStats ones, a few bytes per call
+// with EEPROM.update() so unchanged profiles cost no wear.
+//
+// The image starts right after the KeyStats one for the same key count, so
+// the two never overlap however big the matrix is. The sketch checks that
+// both fit below the serial console settings at CONSOLE_EEPROM_ADDRESS.
+
+// Save the profiles every this many milliseconds (0 disables)
+#define DEBOUNCE_PROFILE_CHECKPOINT_INTERVAL 600000
+#define DEBOUNCE_PROFILE_BYTES_PER_CALL 8
+#define DEBOUNCE_PROFILE_EEPROM_ADDRESS(num_keys) (STATS_EEPROM_ADDRESS + STATS_EEPROM_SIZE(num_keys))
+#define DEBOUNCE_PROFILE_EEPROM_SIZE(num_keys) (6 + (num_keys)*3)
+#define DEBOUNCE_PROFILE_EEPROM_MAGIC 0x44425032 // "DBP2"
+
+class DebounceProfileStore {
+public:
+  DebounceProfileStore(KeyboardMatrix *matrix);
+
+  // Load saved profiles, call before matrix->begin() so its counters start at
+  // the learned steady counts. True if there were any.
+  bool restore();
+  // Call from loop(), writes a few EEPROM bytes when a checkpoint is due
+  void checkpoint();
+  // Part k of the listing, a line if key k has learned anything:
+  //   row col bounce chatter noise steady transient
+  // Returns true while there are more keys.
+  bool print_part(Print *out, uint16_t k);
+
+private:
+  KeyboardMatrix *matrix;
+  uint16_t num_keys;
+  uint16_t eeprom_address;
+
+  uint32_t last_checkpoint_millis;
+  uint16_t checkpoint_cursor;
+  bool checkpoint_running;
+
+  uint16_t image_size();
+  uint8_t image_byte(uint16_t offset);
+};
+
+#endif
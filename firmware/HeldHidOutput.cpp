@@ -0,0 +1,139 @@
+#include "HeldHidOutput.h"
+
+HeldHidOutput::HeldHidOutput(HidOutput *hid_backend) {
+  backend = hid_backend;
+  held = 0;
+  overflows = 0;
+  queue_head = 0;
+  queue_count = 0;
+  hold_on = false;
+}
+
+void HeldHidOutput::hold(void) {
+  hold_on = true;
+}
+
+void HeldHidOutput::release_hold(void) {
+  hold_on = false;
+}
+
+bool HeldHidOutput::holding(void) {
+  return hold_on;
+}
+
+bool HeldHidOutput::queue_event(uint8_t type, uint16_t key) {
+  if (!hold_on && queue_count == 0)
+    return false;
+
+  if (queue_count == HELD_HID_QUEUE_LENGTH) {
+    overflows++;
+    // A press or tap is dropped. A release must get through or the key stays
+    // down on the host, so it takes the place of the newest queued press
+    if (type != HELD_HID_RELEASE)
+      return true;
+    int8_t press = find_press(key);
+    if (press >= 0) {
+      // the host never saw this key go down, so it needn't see it go up
+      remove_event(press);
+      return true;
+    }
+    if (!drop_newest_press()) {
+      // nothing but releases queued: send this one early rather than lose it
+      backend->release(key);
+      return true;
+    }
+  }
+  HeldHidEvent &event = queued(queue_count);
+  event.type = type;
+  event.key = key;
+  queue_count++;
+  held++;
+  return true;
+}
+
+HeldHidEvent &HeldHidOutput::queued(uint8_t i) {
+  return queue[(queue_head + i) % HELD_HID_QUEUE_LENGTH];
+}
+
+int8_t HeldHidOutput::find_press(uint16_t key) {
+  for (int8_t i=queue_count - 1; i>=0; i--) {
+    HeldHidEvent &event = queued(i);
+    if (event.key == key && event.type == HELD_HID_RELEASE)
+      return -1;
+    if (event.key == key && event.type == HELD_HID_PRESS)
+      return i;
+  }
+  return -1;
+}
+
+bool HeldHidOutput::drop_newest_press(void) {
+  for (int8_t i=queue_count - 1; i>=0; i--) {
+    HeldHidEvent &event = queued(i);
+    if (event.type == HELD_HID_TYPE) {
+      remove_event(i);
+      return true;
+    }
+    if (event.type == HELD_HID_PRESS) {
+      // and its release, if that's queued after it
+      uint16_t key = event.key;
+      for (uint8_t j=i + 1; j<queue_count; j++) {
+        if (queued(j).type == HELD_HID_RELEASE && queued(j).key == key) {
+          remove_event(j);
+          break;
+        }
+      }
+      remove_event(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+void HeldHidOutput::remove_event(uint8_t i) {
+  for (; i + 1<queue_count; i++)
+    queued(i) = queued(i + 1);
+  queue_count--;
+}
+
+void HeldHidOutput::press(uint16_t key) {
+  if (!queue_event(HELD_HID_PRESS, key))
+    backend->press(key);
+}
+
+void HeldHidOutput::release(uint16_t key) {
+  if (!queue_event(HELD_HID_RELEASE, key))
+    backend->release(key);
+}
+
+void HeldHidOutput::type(char c) {
+  if (!queue_event(HELD_HID_TYPE, (uint8_t) c))
+    backend->type(c);
+}
+
+void HeldHidOutput::mouse_buttons(uint8_t buttons) {
+  backend->mouse_buttons(buttons);
+}
+
+void HeldHidOutput::mouse_move(int8_t x, int8_t y, int8_t wheel, int8_t hwheel) {
+  backend->mouse_move(x, y, wheel, hwheel);
+}
+
+void HeldHidOutput::poll(void) {
+  while (!hold_on && queue_count > 0 && backend->ready()) {
+    HeldHidEvent &event = queue[queue_head];
+    queue_head = (queue_head + 1) % HELD_HID_QUEUE_LENGTH;
+    queue_count--;
+
+    if (event.type == HELD_HID_PRESS)
+      backend->press(event.key);
+    else if (event.type == HELD_HID_RELEASE)
+      backend->release(event.key);
+    else
+      backend->type((char) event.key);
+  }
+  backend->poll();
+}
+
+bool HeldHidOutput::ready(void) {
+  return !hold_on && queue_count == 0 && backend->ready();
+}
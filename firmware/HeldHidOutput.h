@@ -0,0 +1,73 @@
+#ifndef HELDHIDOUTPUT_H
+#define HELDHIDOUTPUT_H
+
+#include <Arduino.h>
+#include "HidOutput.h"
+
+// Keyboard output held back while something else is typing
+//
+// Sits in front of the real backend. While hold() is in effect key presses,
+// releases and taps are queued instead of sent, and once release_hold() is
+// called poll() sends them in order, as fast as the backend is ready. Until
+// the queue is empty new keys queue behind it, so nothing overtakes a key
+// typed earlier.
+//
+// The text expander holds the keys typed while it sends an expansion a
+// character at a time straight to the backend, so they come out after the
+// expansion instead of in the middle of it. Mouse reports aren't text and go
+// straight through.
+//
+// A press or tap that doesn't fit in the queue is dropped and counted. A
+// release always gets in, in place of the newest queued press (and that
+// press's release), so a key the host has seen pressed is never left down.
+
+#define HELD_HID_QUEUE_LENGTH 32
+
+#define HELD_HID_PRESS 0
+#define HELD_HID_RELEASE 1
+#define HELD_HID_TYPE 2
+
+struct HeldHidEvent {
+  uint8_t type;
+  // the key code, or the character for HELD_HID_TYPE
+  uint16_t key;
+};
+
+class HeldHidOutput : public HidOutput {
+public:
+  HeldHidOutput(HidOutput *backend);
+
+  HidOutput *backend;
+  uint32_t held;
+  uint32_t overflows;
+
+  void hold();
+  void release_hold();
+  bool holding();
+
+  void press(uint16_t key);
+  void release(uint16_t key);
+  void type(char c);
+  void mouse_buttons(uint8_t buttons);
+  void mouse_move(int8_t x, int8_t y, int8_t wheel, int8_t hwheel);
+  void poll();
+  bool ready();
+
+private:
+  HeldHidEvent queue[HELD_HID_QUEUE_LENGTH];
+  uint8_t queue_head;
+  uint8_t queue_count;
+  bool hold_on;
+
+  // true if the event went in the queue (or was dropped)
+  bool queue_event(uint8_t type, uint16_t key);
+  // the i'th queued event, oldest first
+  HeldHidEvent &queued(uint8_t i);
+  // the queued press of key with no release queued after it, or -1
+  int8_t find_press(uint16_t key);
+  // make room by dropping the newest press or tap, false if there is none
+  bool drop_newest_press();
+  void remove_event(uint8_t i);
+};
+
+#endif
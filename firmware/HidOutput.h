@@ -0,0 +1,46 @@
+#ifndef HIDOUTPUT_H
+#define HIDOUTPUT_H
+
+#include <Arduino.h>
+
+// Keyboard and mouse output backend
+//
+// The key handlers send everything through one of these instead of calling
+// the Teensy Keyboard and Mouse classes directly, so the same firmware can
+// talk USB (UsbHidOutput) or drive a Bluetooth HID module over a UART
+// (UartHidOutput).
+//
+// Keys use the Teensy key codes from usb_key_matrix: (usage | 0xF000) for
+// keys and (modifier bit | 0xE000) for modifiers. Anything else is ignored.
+
+#define HID_KEY_CODE_TYPE 0xF000
+#define HID_MODIFIER_CODE_TYPE 0xE000
+#define HID_CODE_TYPE_MASK 0xFF00
+
+// Mouse button bits, the same as the Teensy MOUSE_* values
+#define HID_MOUSE_LEFT 1
+#define HID_MOUSE_RIGHT 2
+#define HID_MOUSE_MIDDLE 4
+
+class HidOutput {
+public:
+  virtual ~HidOutput() {}
+
+  virtual void press(uint16_t key) = 0;
+  virtual void release(uint16_t key) = 0;
+  // Press and release whatever types c (with shift if needed) on a US layout
+  virtual void type(char c) = 0;
+  virtual void mouse_buttons(uint8_t buttons) = 0;
+  virtual void mouse_move(int8_t x, int8_t y, int8_t wheel, int8_t hwheel) = 0;
+  // Send anything the backend is holding back, called every loop
+  virtual void poll() {}
+  // False while reports are backed up, for senders that can wait
+  virtual bool ready() { return true; }
+
+  void mouse_click(uint8_t button) {
+    mouse_buttons(button);
+    mouse_buttons(0);
+  }
+};
+
+#endif
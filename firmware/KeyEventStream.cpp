@@ -0,0 +1,63 @@
+#include "KeyEventStream.h"
+
+KeyEventStreamWriter::KeyEventStreamWriter() {
+  dropped_events = 0;
+  seq = 0;
+  head = 0;
+  tail = 0;
+  used = 0;
+}
+
+uint8_t KeyEventStreamWriter::crc8_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i=0; i<8; i++)
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  return crc;
+}
+
+void KeyEventStreamWriter::record(uint8_t key, bool pressed, uint8_t layer, uint32_t event_micros) {
+  uint8_t frame[KEY_EVENT_FRAME_SIZE];
+  uint8_t crc = 0;
+
+  if (layer > KEY_EVENT_MAX_LAYER)
+    layer = KEY_EVENT_MAX_LAYER;
+  frame[0] = KEY_EVENT_SYNC;
+  frame[1] = key;
+  frame[2] = (pressed ? 0x80 : 0) | (layer << 4) | seq;
+  frame[3] = event_micros & 0xFF;
+  frame[4] = (event_micros >> 8) & 0xFF;
+  frame[5] = (event_micros >> 16) & 0xFF;
+  frame[6] = event_micros >> 24;
+  for (uint8_t i=1; i<KEY_EVENT_FRAME_SIZE-1; i++)
+    crc = crc8_update(crc, frame[i]);
+  frame[7] = crc;
+  // a dropped event still uses its sequence number
+  seq = (seq + 1) & KEY_EVENT_SEQ_MASK;
+
+  if (KEY_EVENT_BUFFER_SIZE - used < KEY_EVENT_FRAME_SIZE) {
+    dropped_events++;
+    return;
+  }
+  for (uint8_t i=0; i<KEY_EVENT_FRAME_SIZE; i++) {
+    buffer[head] = frame[i];
+    head = (head + 1) % KEY_EVENT_BUFFER_SIZE;
+  }
+  used += KEY_EVENT_FRAME_SIZE;
+}
+
+void KeyEventStreamWriter::stream_to(Stream *out, uint16_t max_bytes) {
+  uint16_t n, contiguous;
+  int space = out->availableForWrite();
+
+  if (space < max_bytes)
+    max_bytes = space > 0 ? space : 0;
+
+  while (used > 0 && max_bytes > 0) {
+    contiguous = (head > tail) ? head - tail : KEY_EVENT_BUFFER_SIZE - tail;
+    n = contiguous < max_bytes ? contiguous : max_bytes;
+    out->write(buffer+tail, n);
+    tail = (tail + n) % KEY_EVENT_BUFFER_SIZE;
+    used -= n;
+    max_bytes -= n;
+  }
+}
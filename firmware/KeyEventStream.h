@@ -0,0 +1,53 @@
+#ifndef KEYEVENTSTREAM_H
+#define KEYEVENTSTREAM_H
+
+#include <Arduino.h>
+
+// Binary key event stream
+//
+// Every key press and release as one fixed size frame over USB serial, for a
+// host daemon (tools/keyeventd) to inject straight into the input subsystem
+// instead of going through HID boot reports. That has no rollover limit, and
+// each event keeps the timestamp of the scan that registered it.
+//
+// Frame (8 bytes, little endian):
+//   [SYNC] [key] [pressed << 7 | layer << 4 | seq] [micros, 4 bytes] [crc8]
+//   key    row*num_cols + col
+//   layer  the layer the press was resolved on, a release carries its press's
+//   seq    counts events modulo 16, dropped ones included, so a gap tells the
+//          host to release whatever it thinks is still held
+//   crc8   poly 0x07 over everything after SYNC
+//
+// record() only buffers the frame. stream_to() writes out what fits in the
+// serial port's buffer from loop(), so a burst never blocks the scan. An event
+// that doesn't fit in the buffer is dropped and counted.
+
+#define KEY_EVENT_SYNC 0xE5
+#define KEY_EVENT_FRAME_SIZE 8
+#define KEY_EVENT_SEQ_MASK 0x0F
+#define KEY_EVENT_MAX_LAYER 7
+// 64 frames, every key of a 64 key matrix changing on the same scan
+#define KEY_EVENT_BUFFER_SIZE 512
+
+class KeyEventStreamWriter {
+public:
+  KeyEventStreamWriter();
+
+  uint32_t dropped_events;
+
+  void record(uint8_t key, bool pressed, uint8_t layer, uint32_t event_micros);
+  // Write out at most max_bytes of buffered frames without blocking
+  void stream_to(Stream *out, uint16_t max_bytes);
+
+private:
+  uint8_t seq;
+
+  uint8_t buffer[KEY_EVENT_BUFFER_SIZE];
+  uint16_t head;
+  uint16_t tail;
+  uint16_t used;
+
+  static uint8_t crc8_update(uint8_t crc, uint8_t data);
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef KEYEVENTS_H
+#define KEYEVENTS_H
+
+#include <Arduino.h>
+
+// Key event dispatch
+//
+// Each scan's new press and releases are resolved to an action once (layer
+// lookup, base layer fallback) and handed to a fixed list of handlers, so the
+// work per scan follows the keys that changed rather than every key held.
+//
+// Handlers are types with static functions, listed at compile time:
+//
+//   typedef KeyEventPipeline<HidHandler, MouseKeyHandler, TextHandler> KeyHandlers;
+//   KeyHandlers::key_pressed(event);
+//
+// Deriving from KeyEventHandler supplies empty versions of anything a handler
+// doesn't need, and the calls compile away.
+
+struct KeyEvent {
+  uint8_t row;
+  uint8_t col;
+  // layer the action was resolved on
+  uint8_t layer;
+  // the key on that layer, or on the base layer if that's undefined
+  char action;
+  // the key on the base layer
+  char base_action;
+  // press or release time of the key
+  uint32_t micros;
+  // Set by a handler that has dealt with the key itself, handlers after it
+  // that send or echo keys skip it
+  mutable bool consumed;
+};
+
+struct KeyEventHandler {
+  static void key_pressed(const KeyEvent &) {}
+  static void key_released(const KeyEvent &) {}
+  // once per scan, after any events
+  static void tick(uint32_t) {}
+};
+
+template<typename... Handlers>
+struct KeyEventPipeline;
+
+template<>
+struct KeyEventPipeline<> {
+  static void key_pressed(const KeyEvent &) {}
+  static void key_released(const KeyEvent &) {}
+  static void tick(uint32_t) {}
+};
+
+// Handlers run in the order listed
+template<typename First, typename... Rest>
+struct KeyEventPipeline<First, Rest...> {
+  static void key_pressed(const KeyEvent &event) {
+    First::key_pressed(event);
+    KeyEventPipeline<Rest...>::key_pressed(event);
+  }
+  static void key_released(const KeyEvent &event) {
+    First::key_released(event);
+    KeyEventPipeline<Rest...>::key_released(event);
+  }
+  static void tick(uint32_t now_micros) {
+    First::tick(now_micros);
+    KeyEventPipeline<Rest...>::tick(now_micros);
+  }
+};
+
+#endif
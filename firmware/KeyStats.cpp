@@ -0,0 +1,234 @@
+#include "KeyStats.h"
+#include <EEPROM.h>
+
+KeyStats::KeyStats(uint16_t numkeys) {
+  num_keys = numkeys;
+  press_count = new uint32_t[num_keys];
+  chatter_count = new uint16_t[num_keys];
+  hold_histogram = new uint16_t[num_keys*STATS_HOLD_BUCKETS];
+  last_edge_micros = new uint32_t[num_keys];
+}
+
+KeyStats::~KeyStats(void) {
+  delete [] press_count;
+  delete [] chatter_count;
+  delete [] hold_histogram;
+  delete [] last_edge_micros;
+}
+
+void KeyStats::begin(void) {
+  for (uint16_t k=0; k<num_keys; k++) {
+    press_count[k] = 0;
+    chatter_count[k] = 0;
+    last_edge_micros[k] = 0;
+    for (uint8_t b=0; b<STATS_HOLD_BUCKETS; b++)
+      hold_histogram[k*STATS_HOLD_BUCKETS+b] = 0;
+  }
+  for (uint8_t b=0; b<STATS_INTERVAL_BUCKETS; b++)
+    interval_histogram[b] = 0;
+
+  any_pressed_yet = false;
+  last_press_micros = 0;
+
+  last_checkpoint_millis = millis();
+  checkpoint_cursor = 0;
+  checkpoint_running = false;
+
+#if STATS_CHECKPOINT_INTERVAL > 0
+  restore();
+#endif
+}
+
+// log2 bucket of a duration, one count-leading-zeros instruction
+uint8_t KeyStats::bucket(uint32_t micros_value, uint8_t num_buckets) {
+  uint32_t units = micros_value >> STATS_HISTOGRAM_SHIFT;
+  uint8_t b = units ? 32 - __builtin_clz(units) : 0;
+  return b < num_buckets ? b : num_buckets - 1;
+}
+
+void KeyStats::key_pressed(uint16_t key, uint32_t now_micros) {
+  if (key >= num_keys)
+    return;
+
+  if (press_count[key] > 0 &&
+      now_micros - last_edge_micros[key] < STATS_CHATTER_WINDOW) {
+    if (chatter_count[key] < UINT16_MAX)
+      chatter_count[key]++;
+  }
+
+  if (any_pressed_yet)
+    interval_histogram[bucket(now_micros - last_press_micros, STATS_INTERVAL_BUCKETS)]++;
+
+  press_count[key]++;
+  last_edge_micros[key] = now_micros;
+  last_press_micros = now_micros;
+  any_pressed_yet = true;
+}
+
+void KeyStats::key_released(uint16_t key, uint32_t now_micros) {
+  if (key >= num_keys)
+    return;
+
+  uint16_t *h = &hold_histogram[key*STATS_HOLD_BUCKETS +
+                                bucket(now_micros - last_edge_micros[key], STATS_HOLD_BUCKETS)];
+  if (*h < UINT16_MAX)
+    (*h)++;
+  last_edge_micros[key] = now_micros;
+}
+
+void KeyStats::write_u32(Print *out, uint32_t value) {
+  uint8_t b[4] = {(uint8_t) value, (uint8_t) (value >> 8),
+                  (uint8_t) (value >> 16), (uint8_t) (value >> 24)};
+  out->write(b, 4);
+}
+
+void KeyStats::write_u16(Print *out, uint16_t value) {
+  uint8_t b[2] = {(uint8_t) value, (uint8_t) (value >> 8)};
+  out->write(b, 2);
+}
+
+void KeyStats::dump(Print *out) {
+  uint16_t k;
+  uint8_t b;
+
+  write_u32(out, STATS_DUMP_MAGIC);
+  write_u16(out, num_keys);
+  out->write((uint8_t) STATS_HOLD_BUCKETS);
+  out->write((uint8_t) STATS_INTERVAL_BUCKETS);
+  for (k=0; k<num_keys; k++)
+    write_u32(out, press_count[k]);
+  for (k=0; k<num_keys; k++)
+    write_u16(out, chatter_count[k]);
+  for (k=0; k<num_keys*STATS_HOLD_BUCKETS; k++)
+    write_u16(out, hold_histogram[k]);
+  for (b=0; b<STATS_INTERVAL_BUCKETS; b++)
+    write_u32(out, interval_histogram[b]);
+}
+
+uint16_t KeyStats::dump_size(void) {
+  return 8 + num_keys*4 + num_keys*2 + num_keys*STATS_HOLD_BUCKETS*2 + STATS_INTERVAL_BUCKETS*4;
+}
+
+// Byte offset of the dump, laid out as dump() writes it
+uint8_t KeyStats::dump_byte(uint16_t offset) {
+  if (offset < 4)
+    return (uint32_t) STATS_DUMP_MAGIC >> (offset*8);
+  if (offset < 6)
+    return num_keys >> ((offset-4)*8);
+  if (offset == 6)
+    return STATS_HOLD_BUCKETS;
+  if (offset == 7)
+    return STATS_INTERVAL_BUCKETS;
+  offset -= 8;
+  if (offset < num_keys*4)
+    return press_count[offset/4] >> ((offset%4)*8);
+  offset -= num_keys*4;
+  if (offset < num_keys*2)
+    return chatter_count[offset/2] >> ((offset%2)*8);
+  offset -= num_keys*2;
+  if (offset < num_keys*STATS_HOLD_BUCKETS*2)
+    return hold_histogram[offset/2] >> ((offset%2)*8);
+  offset -= num_keys*STATS_HOLD_BUCKETS*2;
+  return interval_histogram[offset/4] >> ((offset%4)*8);
+}
+
+bool KeyStats::dump_part(Print *out, uint16_t part) {
+  uint8_t b[STATS_DUMP_PART_SIZE];
+  uint16_t start = part * STATS_DUMP_PART_SIZE;
+  uint16_t size = dump_size();
+  uint8_t n = 0;
+
+  while (n < STATS_DUMP_PART_SIZE && start + n < size) {
+    b[n] = dump_byte(start + n);
+    n++;
+  }
+  out->write(b, n);
+  return start + n < size;
+}
+
+// The EEPROM image is press_count[], chatter_count[], the magic number and the
+// crc. checkpoint() writes the crc itself.
+uint16_t KeyStats::checkpoint_size(void) {
+  return STATS_EEPROM_SIZE(num_keys);
+}
+
+uint8_t KeyStats::checkpoint_byte(uint16_t offset) {
+  if (offset < num_keys*4)
+    return press_count[offset/4] >> ((offset%4)*8);
+  offset -= num_keys*4;
+  if (offset < num_keys*2)
+    return chatter_count[offset/2] >> ((offset%2)*8);
+  offset -= num_keys*2;
+  return (uint32_t) STATS_EEPROM_MAGIC >> (offset*8);
+}
+
+// crc8, poly 0x07
+uint8_t KeyStats::crc8_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i=0; i<8; i++)
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  return crc;
+}
+
+void KeyStats::checkpoint(void) {
+#if STATS_CHECKPOINT_INTERVAL > 0
+  uint16_t last = checkpoint_size() - 1;
+
+  if (!checkpoint_running) {
+    if (millis() - last_checkpoint_millis < STATS_CHECKPOINT_INTERVAL)
+      return;
+    // too big for this part's EEPROM
+    if (STATS_EEPROM_ADDRESS + checkpoint_size() > EEPROM.length())
+      return;
+    checkpoint_running = true;
+    checkpoint_cursor = 0;
+    checkpoint_crc = 0;
+  }
+
+  // EEPROM.update() skips bytes that haven't changed, saving wear and time.
+  // Counts can change between calls, the crc covers what was written.
+  for (uint8_t n=0; n<STATS_CHECKPOINT_BYTES_PER_CALL && checkpoint_running; n++) {
+    if (checkpoint_cursor < last) {
+      uint8_t b = checkpoint_byte(checkpoint_cursor);
+      checkpoint_crc = crc8_update(checkpoint_crc, b);
+      EEPROM.update(STATS_EEPROM_ADDRESS + checkpoint_cursor, b);
+      checkpoint_cursor++;
+    }
+    else {
+      EEPROM.update(STATS_EEPROM_ADDRESS + last, checkpoint_crc);
+      checkpoint_running = false;
+      last_checkpoint_millis = millis();
+    }
+  }
+#endif
+}
+
+void KeyStats::restore(void) {
+  uint16_t addr = STATS_EEPROM_ADDRESS;
+  uint16_t last = checkpoint_size() - 1;
+  uint16_t magic_offset = num_keys*6;
+  uint8_t crc = 0;
+  uint16_t k, i;
+
+  if (STATS_EEPROM_ADDRESS + checkpoint_size() > EEPROM.length())
+    return;
+
+  for (i=0; i<last; i++) {
+    uint8_t b = EEPROM.read(addr + i);
+    if (i >= magic_offset && b != checkpoint_byte(i))
+      return;
+    crc = crc8_update(crc, b);
+  }
+  if (crc != EEPROM.read(addr + last))
+    return;
+
+  for (k=0; k<num_keys; k++) {
+    press_count[k] = 0;
+    for (i=0; i<4; i++)
+      press_count[k] |= (uint32_t) EEPROM.read(addr++) << (i*8);
+  }
+  for (k=0; k<num_keys; k++) {
+    chatter_count[k] = EEPROM.read(addr) | (EEPROM.read(addr+1) << 8);
+    addr += 2;
+  }
+}
@@ -0,0 +1,91 @@
+#ifndef KEYSTATS_H
+#define KEYSTATS_H
+
+#include <Arduino.h>
+
+// Per-key usage statistics
+//
+// Everything is updated from key press and release events only, in constant
+// time, so there is no per-scan cost. Keys are indexed by id = row*num_cols+col.
+//
+// Histograms are log2 scale: bucket n holds durations in
+// [2^(n-1), 2^n) << STATS_HISTOGRAM_SHIFT microseconds, bucket 0 anything shorter
+// and the last bucket anything longer.
+
+#define STATS_HOLD_BUCKETS 10
+#define STATS_INTERVAL_BUCKETS 12
+// 1024us units: hold buckets run from ~1ms to ~0.5s, intervals to ~2s
+#define STATS_HISTOGRAM_SHIFT 10
+
+// A press this soon after the same key was released is counted as chatter
+//   Units are in Microseconds
+#define STATS_CHATTER_WINDOW 20000
+
+// Periodically save press and chatter counts to EEPROM, in milliseconds
+// (0 disables). Only counts that changed are written, a few bytes per call.
+#define STATS_CHECKPOINT_INTERVAL 600000
+#define STATS_CHECKPOINT_BYTES_PER_CALL 8
+#define STATS_EEPROM_ADDRESS 0
+#define STATS_EEPROM_MAGIC 0x4B535432 // "KST2"
+// 4 bytes of press count and 2 of chatter count per key, then the magic number
+// and a crc8 of everything before it. The magic and crc go last so an image
+// torn by a reset mid-checkpoint doesn't load.
+#define STATS_EEPROM_SIZE(num_keys) ((num_keys)*6 + 5)
+#define STATS_DUMP_MAGIC 0x4B535431 // "KST1"
+// Bytes of the binary dump per dump_part()
+#define STATS_DUMP_PART_SIZE 32
+
+class KeyStats {
+public:
+  KeyStats(uint16_t num_keys);
+  ~KeyStats();
+
+  uint16_t num_keys;
+
+  uint32_t *press_count;
+  uint16_t *chatter_count;
+  uint16_t *hold_histogram;  // num_keys * STATS_HOLD_BUCKETS
+  uint32_t interval_histogram[STATS_INTERVAL_BUCKETS];
+
+  void begin();
+  void key_pressed(uint16_t key, uint32_t now_micros);
+  void key_released(uint16_t key, uint32_t now_micros);
+
+  // Binary dump:
+  //   STATS_DUMP_MAGIC (4) num_keys (2) hold buckets (1) interval buckets (1)
+  //   press_count[num_keys] (4 each) chatter_count[num_keys] (2 each)
+  //   hold_histogram[num_keys][hold buckets] (2 each)
+  //   interval_histogram[interval buckets] (4 each)
+  // All integers little endian.
+  void dump(Print *out);
+  // The same dump STATS_DUMP_PART_SIZE bytes at a time, for writers that
+  // can't block. Returns true while there are more parts.
+  bool dump_part(Print *out, uint16_t part);
+
+  // Call from loop(), writes a few EEPROM bytes when a checkpoint is due
+  void checkpoint();
+
+private:
+  // press time while a key is down, release time while it is up
+  uint32_t *last_edge_micros;
+  uint32_t last_press_micros;
+  bool any_pressed_yet;
+
+  uint32_t last_checkpoint_millis;
+  uint16_t checkpoint_cursor;
+  bool checkpoint_running;
+  // of the bytes written so far
+  uint8_t checkpoint_crc;
+
+  static uint8_t bucket(uint32_t micros_value, uint8_t num_buckets);
+  static uint8_t crc8_update(uint8_t crc, uint8_t data);
+  uint16_t checkpoint_size();
+  uint8_t checkpoint_byte(uint16_t offset);
+  uint16_t dump_size();
+  uint8_t dump_byte(uint16_t offset);
+  void restore();
+  void write_u32(Print *out, uint32_t value);
+  void write_u16(Print *out, uint16_t value);
+};
+
+#endif
@@ -1,28 +1,35 @@
 #include "KeyboardMatrix.h"
 
-PressedKey::PressedKey(uint8_t key_row, uint8_t key_column, uint32_t initial_hold_time) {
+PressedKey::PressedKey(uint8_t key_row, uint8_t key_column, uint32_t key_press_micros, uint32_t key_press_scan) {
   row = key_row;
   col = key_column;
-  hold_time = initial_hold_time;
+  press_micros = key_press_micros;
+  press_scan = key_press_scan;
+  just_pressed = true;
 }
 
-// uint8_t PressedKey::row() {return _row;}
-// uint8_t PressedKey::col() {return _col;}
-// uint32_t PressedKey::hold_time() {return _hold_time;}
+// Hold durations are only worked out when someone asks
+uint32_t PressedKey::hold_time(uint32_t now_micros) {
+  return now_micros - press_micros;
+}
 
-ReleasedKey::ReleasedKey(uint8_t key_row, uint8_t key_column) {
+ReleasedKey::ReleasedKey(uint8_t key_row, uint8_t key_column, uint32_t key_press_micros, uint32_t key_release_micros) {
   row = key_row;
   col = key_column;
+  press_micros = key_press_micros;
+  release_micros = key_release_micros;
 }
 
-// uint8_t ReleasedKey::row() {return _row;}
-// uint8_t ReleasedKey::col() {return _col;}
-
 KeyboardMatrix::KeyboardMatrix(uint8_t numrows, uint8_t numcols,
                                uint8_t *rowpins, uint8_t *colpins,
-                               uint8_t diodedir) {
+                               uint8_t diodedir,
+                               uint8_t numremoterows) {
   diode_direction = diodedir;
   num_rows = numrows;
+  num_remote_rows = numremoterows;
+  num_local_rows = numrows - numremoterows;
+  remote_rows = NULL;
+  line_driver = NULL;
   num_cols = numcols;
   row_pins = (uint8_t*) rowpins;
   col_pins = (uint8_t*) colpins;
@@ -30,11 +37,51 @@ KeyboardMatrix::KeyboardMatrix(uint8_t numrows, uint8_t numcols,
   delta_micros = 0;
   last_update_micros = 0;
   this_update_micros = 0;
+  last_calibration_micros = 0;
+  scan_count = 0;
+  last_new_key = NULL;
+  new_pressed_keys_count = 0;
+  steady_count = STEADY_COUNT;
+  idle_fast_path = true;
+  idle_scans = 0;
+  track_keys = true;
+  reject_ghosts = true;
+  idle = false;
+  idle_steady_count = 0;
+  idle_adaptive = false;
+  adaptive_debounce = false;
+  reverted_transients = 0;
+
+  if (diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN) {
+    num_sense_lines = num_cols;
+    sense_pins = col_pins;
+    num_strobe_lines = num_local_rows;
+    strobe_pins = row_pins;
+  }
+  else {
+    num_sense_lines = num_local_rows;
+    sense_pins = row_pins;
+    num_strobe_lines = num_cols;
+    strobe_pins = col_pins;
+  }
 
   this_row_read = new uint16_t[num_rows];
   matrix_state = new uint16_t[num_rows];
   matrix_state_prev = new uint16_t[num_rows];
   key_states = new debounced_switch[num_rows*num_cols];
+  debounce_profiles = new debounce_profile[num_rows*num_cols];
+  reset_debounce_profiles();
+  settle_polls = new uint8_t[num_sense_lines];
+  strobe_micros = new uint32_t[num_rows > num_cols ? num_rows : num_cols];
+  line_active = new uint32_t[num_strobe_lines];
+
+#ifdef FAST_STROBE_AVAILABLE
+  fast_strobe = true;
+  strobe_mode_regs = new volatile uint8_t*[num_strobe_lines];
+  strobe_masks = new uint8_t[num_strobe_lines];
+#else
+  fast_strobe = false;
+#endif
 }
 
 KeyboardMatrix::~KeyboardMatrix(void) {
@@ -42,30 +89,43 @@ KeyboardMatrix::~KeyboardMatrix(void) {
   delete [] matrix_state_prev;
   delete [] matrix_state;
   delete [] key_states;
+  delete [] debounce_profiles;
+  delete [] settle_polls;
+  delete [] strobe_micros;
+  delete [] line_active;
+#ifdef FAST_STROBE_AVAILABLE
+  delete [] strobe_mode_regs;
+  delete [] strobe_masks;
+#endif
 }
 
 void KeyboardMatrix::begin(void) {
-  if (diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN) {
+  if (line_driver != NULL) {
+    line_driver->begin(num_strobe_lines, num_sense_lines);
+  }
+  else if (diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN) {
     // Set col pins to input and turn on pullups
     for (uint8_t i=0; i<num_cols; i++) {
       pinMode(col_pins[i], INPUT_PULLUP);
     }
-
-    // Set row pins to input - this is the 'deactivated' state
-    for (uint8_t i=0; i<num_rows; i++) {
-      pinMode(row_pins[i], INPUT);
-    }
   }
   else if (diode_direction == DIODE_DIRECTION_ROW_PIN_TO_COL_PIN) {
     // Set row pins to input and turn on pullups
-    for (uint8_t i=0; i<num_rows; i++) {
+    for (uint8_t i=0; i<num_local_rows; i++) {
       pinMode(row_pins[i], INPUT_PULLUP);
     }
+  }
 
-    // Set col pins to input - this is the 'deactivated' state
-    for (uint8_t i=0; i<num_cols; i++) {
-      pinMode(col_pins[i], INPUT);
-    }
+  // Set strobe pins to input - this is the 'deactivated' state. The output
+  // latch is set LOW first so strobing only has to change the direction.
+  for (uint8_t i=0; i<num_strobe_lines && line_driver == NULL; i++) {
+    pinMode(strobe_pins[i], OUTPUT);
+    digitalWrite(strobe_pins[i], LOW);
+    pinMode(strobe_pins[i], INPUT);
+#ifdef FAST_STROBE_AVAILABLE
+    strobe_mode_regs[i] = portModeRegister(strobe_pins[i]);
+    strobe_masks[i] = digitalPinToBitMask(strobe_pins[i]);
+#endif
   }
 
   // init default values
@@ -75,17 +135,100 @@ void KeyboardMatrix::begin(void) {
     matrix_state_prev[row] = 0xFFFF;
 
     for (uint8_t col=0; col<num_cols; col++) {
-      // hold_time[row][col] = 0;
-
-      // init key_states to not pressed
-      key_states[row*num_cols+col].counter = -STEADY_COUNT;
+      // init key_states to not pressed, at this key's own steady count when it
+      // has a learned (or restored) profile
+      key_states[row*num_cols+col].counter = -key_steady_count(row*num_cols+col);
       key_states[row*num_cols+col].state = 0;
     }
   }
+
+  calibrate_settle();
+}
+
+void KeyboardMatrix::set_remote_rows(const uint16_t *rows) {
+  remote_rows = rows;
+}
+
+void KeyboardMatrix::set_line_driver(MatrixLineDriver *driver) {
+  line_driver = driver;
+}
+
+const uint16_t *KeyboardMatrix::raw_rows(void) {
+  return this_row_read;
+}
+
+uint32_t KeyboardMatrix::scan_micros(void) {
+  return this_update_micros;
+}
+
+// Measure how long each sense line takes to be pulled back high after being
+// held low, which is what a pressed key does to it while its strobe is active.
+// All strobe lines must be deactivated (INPUT) when this is called.
+void KeyboardMatrix::calibrate_settle(void) {
+  uint8_t pin;
+  uint16_t polls, worst;
+
+  // a line driver's sense lines settle while the bus moves on, never polled
+  if (line_driver != NULL) {
+    for (uint8_t s=0; s<num_sense_lines; s++)
+      settle_polls[s] = 0;
+    last_calibration_micros = micros();
+    return;
+  }
+
+  for (uint8_t s=0; s<num_sense_lines; s++) {
+    pin = sense_pins[s];
+    worst = 0;
+
+    for (uint8_t sample=0; sample<SETTLE_CALIBRATION_SAMPLES; sample++) {
+      // discharge the line
+      pinMode(pin, OUTPUT);
+      digitalWrite(pin, LOW);
+      // release it to the pullup and count reads until it is high again
+      pinMode(pin, INPUT_PULLUP);
+      polls = 0;
+      while (digitalRead(pin) == LOW && polls < SETTLE_MAX_POLLS)
+        polls++;
+      if (polls > worst)
+        worst = polls;
+    }
+
+    worst += SETTLE_MARGIN_POLLS;
+    settle_polls[s] = worst > SETTLE_MAX_POLLS ? SETTLE_MAX_POLLS : worst;
+  }
+
+  last_calibration_micros = micros();
+}
+
+// After a strobe is deactivated, any sense line that read a pressed key is
+// still low. Wait for those lines (and only those) to recover so the next
+// strobe doesn't see a phantom press, bounded by the calibrated budget.
+void KeyboardMatrix::wait_for_settle(uint32_t active_sense_bits) {
+  for (uint8_t s=0; active_sense_bits != 0; s++, active_sense_bits >>= 1) {
+    if (active_sense_bits & 1) {
+      for (uint8_t n=0; n<settle_polls[s] && digitalRead(sense_pins[s]) == LOW; n++)
+        ;
+    }
+  }
 }
 
 bool KeyboardMatrix::debounce_update(uint8_t r, uint8_t c) {
   uint16_t index = r*num_cols+c;
+  int steady = steady_count;
+  int transient = TRANSIENT_COUNT;
+  debounce_profile *profile = NULL;
+
+  if (adaptive_debounce) {
+    profile = &debounce_profiles[index];
+    steady = profile_steady_count(profile);
+    transient = profile_transient_count(profile);
+    // a profile that just narrowed can leave the counter past the new ends
+    if (key_states[index].counter > steady)
+      key_states[index].counter = steady;
+    else if (key_states[index].counter < -steady)
+      key_states[index].counter = -steady;
+  }
+
   // if button state is active
   if (0 == (this_row_read[r] & (1<<c))) {
     // Serial.print("positive read row: ");
@@ -95,17 +238,20 @@ bool KeyboardMatrix::debounce_update(uint8_t r, uint8_t c) {
     // Serial.print("counter increment ");
     // Serial.print(key_states[index].counter);
     // Serial.print(" -> ");
-    if (key_states[index].counter < +STEADY_COUNT)
+    if (key_states[index].counter < +steady)
       ++key_states[index].counter;
     // Serial.println(key_states[index].counter);
   }
   else {
-    if (key_states[index].counter > -STEADY_COUNT)
+    if (key_states[index].counter > -steady)
       --key_states[index].counter;
   }
+  if (profile != NULL)
+    learn_profile(profile, key_states[index].state, key_states[index].counter, steady);
+
   switch (key_states[index].state) {
   case 0: // steady-state lo
-    if (key_states[index].counter >= -TRANSIENT_COUNT_ABS) {
+    if (key_states[index].counter >= -(steady - transient)) {
       // => transient lo-hi
       // Serial.print("Pressed Transient ");
       // Serial.print(ascii_key_matrix[0][r][c]);
@@ -113,29 +259,37 @@ bool KeyboardMatrix::debounce_update(uint8_t r, uint8_t c) {
       // Serial.println(key_states[index].counter);
       key_states[index].counter = 0;
       key_states[index].state = 1;
+      if (profile != NULL)
+        profile->depth = 0;
       return true;
     } else {
       return false;
     }
   case 1: // transient lo-hi
-    switch (key_states[index].counter) {
-    case +STEADY_COUNT:
+    // compared with >= and <= so a smaller steady_count set at runtime can't
+    // strand a counter past the ends
+    if (key_states[index].counter >= +steady) {
       // => steady-state hi
       // Serial.print("Pressed Steady ");
       // Serial.print(ascii_key_matrix[0][r][c]);
       // Serial.print(" counter: ");
       // Serial.println(key_states[index].counter);
       key_states[index].state = 2;
+      if (profile != NULL)
+        profile_settled(profile, &key_states[index]);
       return false;
-    case -STEADY_COUNT:
+    } else if (key_states[index].counter <= -steady) {
       // => steady-state lo
       key_states[index].state = 0;
+      reverted_transients++;
+      if (profile != NULL)
+        profile_reverted(profile, &key_states[index]);
       return true;
-    default:
+    } else {
       return false;
     }
   case 2: // steady-state hi
-    if (key_states[index].counter <= +TRANSIENT_COUNT_ABS) {
+    if (key_states[index].counter <= +(steady - transient)) {
       // => transient hi-lo
       // Serial.print("Released Transient ");
       // Serial.print(ascii_key_matrix[0][r][c]);
@@ -143,25 +297,31 @@ bool KeyboardMatrix::debounce_update(uint8_t r, uint8_t c) {
       // Serial.println(key_states[index].counter);
       key_states[index].counter = 0;
       key_states[index].state = 3;
+      if (profile != NULL)
+        profile->depth = 0;
       return true;
     } else {
       return false;
     }
   case 3: // transient hi-lo
-    switch (key_states[index].counter) {
-    case +STEADY_COUNT:
+    if (key_states[index].counter >= +steady) {
       // => steady-state hi
       key_states[index].state = 2;
+      reverted_transients++;
+      if (profile != NULL)
+        profile_reverted(profile, &key_states[index]);
       return true;
-    case -STEADY_COUNT:
+    } else if (key_states[index].counter <= -steady) {
       // => steady-state lo
       // Serial.print("Released Steady ");
       // Serial.print(ascii_key_matrix[0][r][c]);
       // Serial.print(" counter: ");
       // Serial.println(key_states[index].counter);
       key_states[index].state = 0;
+      if (profile != NULL)
+        profile_settled(profile, &key_states[index]);
       return false;
-    default:
+    } else {
       return false;
     }
   default:
@@ -170,26 +330,183 @@ bool KeyboardMatrix::debounce_update(uint8_t r, uint8_t c) {
   }
 }
 
+// --- Adaptive debounce --------------------------------------------------------
+
+// The steady count debounce_update() uses for this key
+uint8_t KeyboardMatrix::key_steady_count(uint16_t key) {
+  if (!adaptive_debounce)
+    return steady_count;
+  return profile_steady_count(&debounce_profiles[key]);
+}
+
+uint8_t KeyboardMatrix::key_transient_count(uint16_t key) {
+  if (!adaptive_debounce)
+    return TRANSIENT_COUNT;
+  return profile_transient_count(&debounce_profiles[key]);
+}
+
+uint8_t KeyboardMatrix::profile_steady_count(const debounce_profile *profile) {
+  uint16_t steady = profile->bounce + DEBOUNCE_ADAPTIVE_MARGIN;
+  if (steady < steady_count)
+    return steady_count;
+  return steady > DEBOUNCE_ADAPTIVE_MAX_STEADY ? DEBOUNCE_ADAPTIVE_MAX_STEADY : steady;
+}
+
+uint8_t KeyboardMatrix::profile_transient_count(const debounce_profile *profile) {
+  uint8_t transient = DEBOUNCE_ADAPTIVE_MIN_TRANSIENT + profile->noise + profile->chatter;
+  return transient > DEBOUNCE_ADAPTIVE_MAX_TRANSIENT ? DEBOUNCE_ADAPTIVE_MAX_TRANSIENT : transient;
+}
+
+// A transient's counter starts at 0, so bouncing contacts pull it below 0 (or
+// above, releasing). It reverts if that reaches the steady count. Only taken
+// into bounce once the transient is over, so it can't move the goalposts. In a
+// steady state the counter sits at its end, and anything that pulls it off and
+// goes back without starting a transient is noise. depth holds that excursion
+// until it's over.
+void KeyboardMatrix::learn_profile(debounce_profile *profile, uint8_t state, int counter, int steady) {
+  int depth;
+
+  if (state == 0 || state == 2) {
+    depth = state == 0 ? counter + steady : steady - counter;
+    if (depth == 0 && profile->depth > 0) {
+      uint8_t noise = profile->depth > DEBOUNCE_ADAPTIVE_MAX_NOISE ?
+        DEBOUNCE_ADAPTIVE_MAX_NOISE : profile->depth;
+      if (noise > profile->noise)
+        profile->noise = noise;
+      if (noise > profile->window_noise)
+        profile->window_noise = noise;
+      profile->depth = 0;
+    }
+  }
+  else {
+    depth = state == 1 ? -counter : counter;
+  }
+  if (depth > profile->depth)
+    profile->depth = depth > 255 ? 255 : depth;
+}
+
+// Start the steady state a transient just ended in at the (possibly changed)
+// end, otherwise a wider profile would leave the counter past the threshold for
+// the next transient and start it straight away
+void KeyboardMatrix::profile_saturate(const debounce_profile *profile, debounced_switch *key) {
+  int steady = profile_steady_count(profile);
+  key->counter = key->state == 2 ? steady : -steady;
+}
+
+// A transient ran to the steady state it started towards
+void KeyboardMatrix::profile_settled(debounce_profile *profile, debounced_switch *key) {
+  if (profile->depth > profile->bounce)
+    profile->bounce = profile->depth;
+  profile->depth = 0;
+  profile->clean++;
+  if (profile->clean % DEBOUNCE_ADAPTIVE_WINDOW == 0) {
+    if (profile->window_noise < profile->noise)
+      profile->noise--;
+    profile->window_noise = 0;
+  }
+  if (profile->clean % DEBOUNCE_ADAPTIVE_BOUNCE_DECAY == 0 && profile->bounce > 0)
+    profile->bounce--;
+  if (profile->clean % DEBOUNCE_ADAPTIVE_CHATTER_DECAY == 0 && profile->chatter > 0)
+    profile->chatter--;
+  profile_saturate(profile, key);
+}
+
+// A transient fell back to where it started: the key sent a press and release
+// (or release and press) that didn't happen
+void KeyboardMatrix::profile_reverted(debounce_profile *profile, debounced_switch *key) {
+  // the bounce reached the steady count, so it was at least that deep: double
+  // it rather than creep up a couple of samples per double character
+  uint16_t bounce = 2 * profile->depth;
+  if (bounce > profile->bounce)
+    profile->bounce = bounce > 255 ? 255 : bounce;
+  profile->depth = 0;
+  // eg the contacts opening for a moment while held, or a noise spike longer
+  // than the transient count: only a longer transient count keeps those out
+  if (profile->chatter < DEBOUNCE_ADAPTIVE_MAX_CHATTER)
+    profile->chatter++;
+  profile->clean = 0;
+  profile->window_noise = 0;
+  profile_saturate(profile, key);
+}
+
+void KeyboardMatrix::reset_debounce_profiles(void) {
+  for (uint16_t k=0; k<num_rows*num_cols; k++) {
+    debounce_profiles[k].bounce = 0;
+    debounce_profiles[k].chatter = 0;
+    // the same transient count as without adaptive debounce until the key has
+    // been seen to be quiet
+    debounce_profiles[k].noise = DEBOUNCE_ADAPTIVE_MAX_NOISE;
+    debounce_profiles[k].clean = 0;
+    debounce_profiles[k].depth = 0;
+    debounce_profiles[k].window_noise = 0;
+  }
+}
+
 // Set the row pin we want to scan to LOW (ground)
 void KeyboardMatrix::activate_row(uint8_t row) {
-  pinMode(row_pins[row], OUTPUT);
-  digitalWrite(row_pins[row], LOW);
+  activate_strobe(row);
 }
 
 // Set the row to INPUT to deactivate
 void KeyboardMatrix::deactivate_row(uint8_t row) {
-  pinMode(row_pins[row], INPUT);
+  deactivate_strobe(row);
 }
 
 // Set the column pin we want to scan to LOW (ground)
 void KeyboardMatrix::activate_column(uint8_t col) {
-  pinMode(col_pins[col], OUTPUT);
-  digitalWrite(col_pins[col], LOW);
+  activate_strobe(col);
 }
 
 // Set the column to INPUT to deactivate
 void KeyboardMatrix::deactivate_column(uint8_t col) {
-  pinMode(col_pins[col], INPUT);
+  deactivate_strobe(col);
+}
+
+// The output latch is already LOW, making the pin an output drives the line
+void KeyboardMatrix::activate_strobe(uint8_t line) {
+#ifdef FAST_STROBE_AVAILABLE
+  if (fast_strobe) {
+    *strobe_mode_regs[line] |= strobe_masks[line];
+    return;
+  }
+#endif
+  pinMode(strobe_pins[line], OUTPUT);
+  digitalWrite(strobe_pins[line], LOW);
+}
+
+void KeyboardMatrix::deactivate_strobe(uint8_t line) {
+#ifdef FAST_STROBE_AVAILABLE
+  if (fast_strobe) {
+    *strobe_mode_regs[line] &= ~strobe_masks[line];
+    return;
+  }
+#endif
+  pinMode(strobe_pins[line], INPUT);
+}
+
+uint32_t KeyboardMatrix::strobe_benchmark(uint16_t iterations) {
+  uint32_t start = micros();
+  // a line driver strobes each line once per scan
+  if (line_driver != NULL) {
+    for (uint16_t i=0; i<iterations; i++)
+      line_driver->scan(line_active, strobe_micros);
+    return micros() - start;
+  }
+  for (uint16_t i=0; i<iterations; i++) {
+    for (uint8_t line=0; line<num_strobe_lines; line++) {
+      activate_strobe(line);
+      deactivate_strobe(line);
+    }
+  }
+  return micros() - start;
+}
+
+PressedKey *KeyboardMatrix::new_key(void) {
+  return last_new_key;
+}
+
+uint8_t KeyboardMatrix::new_key_count(void) {
+  return new_pressed_keys_count;
 }
 
 bool KeyboardMatrix::button_pressed(uint8_t row, uint8_t button_bit_position) {
@@ -211,18 +528,91 @@ bool KeyboardMatrix::button_held(uint8_t row, uint8_t button_bit_position) {
 }
 
 bool KeyboardMatrix::update(void) {
-  bool matrix_changed = false;
-  uint8_t row, col, r, c;
-  uint16_t btn_bit = 0;
+  if (idle_fast_path && idle && idle_steady_count == steady_count &&
+      idle_adaptive == adaptive_debounce &&
+      remote_rows_released() && !probe_any_active()) {
+    idle_scans++;
+    return process_idle(micros());
+  }
+  scan();
+  return process(micros());
+}
 
-  last_update_micros = this_update_micros;
+bool KeyboardMatrix::remote_rows_released(void) {
+  uint16_t key_bits = (1 << num_cols) - 1;
+  if (remote_rows != NULL) {
+    for (uint8_t row=0; row<num_remote_rows; row++) {
+      if ((remote_rows[row] & key_bits) != key_bits)
+        return false;
+    }
+  }
+  return true;
+}
 
-  if (diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN) {
+// Activate every strobe line at once and read each sense line, true if any
+// key on any line is pressed
+bool KeyboardMatrix::probe_any_active(void) {
+  uint8_t line, s;
+  uint32_t active_sense_bits = 0;
+
+  if (line_driver != NULL)
+    return line_driver->probe() != 0;
+
+  for (line=0; line<num_strobe_lines; line++)
+    activate_strobe(line);
+  for (s=0; s<num_sense_lines; s++) {
+    if (digitalRead(sense_pins[s]) == LOW)
+      active_sense_bits |= (1UL << s);
+  }
+  for (line=0; line<num_strobe_lines; line++)
+    deactivate_strobe(line);
+
+  // the full scan comes next, don't let it see these lines still low
+  wait_for_settle(active_sense_bits);
+  return active_sense_bits != 0;
+}
+
+// Feed previously captured raw row words through debounce and ghost rejection
+// in place of a scan. sample_micros is when the rows were originally read.
+bool KeyboardMatrix::update_from_rows(const uint16_t *rows, uint32_t sample_micros) {
+  // strobe_micros is sized for either diode direction
+  uint8_t num_sample_times = num_rows > num_cols ? num_rows : num_cols;
+  for (uint8_t row=0; row<num_rows; row++) {
+    this_row_read[row] = rows[row];
+  }
+  for (uint8_t line=0; line<num_sample_times; line++) {
+    strobe_micros[line] = sample_micros;
+  }
+  return process(sample_micros);
+}
+
+// When the switch at r, c was last read
+uint32_t KeyboardMatrix::key_sample_micros(uint8_t r, uint8_t c) {
+  // remote rows arrive all at once
+  if (r >= num_local_rows)
+    return this_update_micros;
+  if (diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN)
+    return strobe_micros[r];
+  return strobe_micros[c];
+}
+
+// Read the raw switch states into this_row_read
+void KeyboardMatrix::scan(void) {
+  uint8_t row, col;
+  uint16_t btn_bit = 0;
+  uint32_t active_sense_bits;
+
+  if (line_driver != NULL) {
+    scan_line_driver();
+  }
+  else if (diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN) {
 
     // Scan the matrix one row at a time
     // Column pins are the input
-    for (row=0; row<num_rows; row++) {
+    for (row=0; row<num_local_rows; row++) {
       activate_row(row);
+      strobe_micros[row] = micros();
+      active_sense_bits = 0;
 
       // Read each key (each column pin) in the activated row
       for (col=0; col<num_cols; col++) {
@@ -232,6 +622,7 @@ bool KeyboardMatrix::update(void) {
         if (digitalRead(col_pins[col]) == LOW) {
           // Key is pressed
           this_row_read[row] = this_row_read[row] & ~btn_bit;
+          active_sense_bits |= (1UL << col);
         }
         else {
           // Key is released
@@ -239,6 +630,7 @@ bool KeyboardMatrix::update(void) {
         }
       }
       deactivate_row(row);
+      wait_for_settle(active_sense_bits);
     }
 
   }
@@ -248,14 +640,17 @@ bool KeyboardMatrix::update(void) {
     // Row pins are the input
     for (col=0; col<num_cols; col++) {
       activate_column(col);
+      strobe_micros[col] = micros();
+      active_sense_bits = 0;
       // Read each key (each row pin) in the activated column
-      for (row=0; row<num_rows; row++) {
+      for (row=0; row<num_local_rows; row++) {
         // Left-most key in a row == LSB
         // Right-most key in a row == MSB
         btn_bit = 1 << col;
         if (digitalRead(row_pins[row]) == LOW) {
           // Key is pressed
           this_row_read[row] = this_row_read[row] & ~btn_bit;
+          active_sense_bits |= (1UL << row);
         }
         else {
           // Key is released
@@ -263,12 +658,94 @@ bool KeyboardMatrix::update(void) {
         }
       }
       deactivate_column(col);
+      wait_for_settle(active_sense_bits);
     }
 
   }
 
-  this_update_micros = micros();
+  // Merge in rows scanned elsewhere
+  if (remote_rows != NULL) {
+    for (row=0; row<num_remote_rows; row++) {
+      this_row_read[num_local_rows+row] = remote_rows[row];
+    }
+  }
+}
+
+// Scan through the line driver and turn its sense words into row words
+void KeyboardMatrix::scan_line_driver(void) {
+  uint8_t row, col;
+
+  line_driver->scan(line_active, strobe_micros);
+
+  if (diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN) {
+    // strobe lines are rows, sense bits are already columns
+    for (row=0; row<num_local_rows; row++)
+      this_row_read[row] = ~line_active[row];
+  }
+  else {
+    // strobe lines are columns, sense bits are rows
+    for (row=0; row<num_local_rows; row++) {
+      this_row_read[row] = 0xFFFF;
+      for (col=0; col<num_cols; col++) {
+        if (line_active[col] & (1UL << row))
+          this_row_read[row] &= ~(1 << col);
+      }
+    }
+  }
+}
+
+// Keys the last update registered are no longer new. With reject_ghosts off
+// that can be a whole chord, the last new_pressed_keys_count items in
+// pressed_list.
+void KeyboardMatrix::clear_just_pressed(void) {
+  if (last_new_key != NULL) {
+    last_new_key->just_pressed = false;
+    last_new_key = NULL;
+  }
+  if (!reject_ghosts) {
+    int size = pressed_list.size();
+    int first = size - new_pressed_keys_count;
+    for (int i=first > 0 ? first : 0; i<size; i++)
+      pressed_list.get(i)->just_pressed = false;
+  }
+}
+
+// process() for a scan that read every key released while idle: the debounce
+// counters are already saturated, so only the per-update bookkeeping changes
+bool KeyboardMatrix::process_idle(uint32_t sample_micros) {
+  last_update_micros = this_update_micros;
+  this_update_micros = sample_micros;
   delta_micros = this_update_micros - last_update_micros;
+  scan_count++;
+
+  clear_just_pressed();
+  new_pressed_keys_count = 0;
+  while (released_list.size() > 0)
+    delete released_list.shift();
+  for (uint8_t row=0; row<num_rows; row++)
+    matrix_state_prev[row] = matrix_state[row];
+
+#if SETTLE_RECALIBRATE_INTERVAL > 0
+  if (this_update_micros - last_calibration_micros > SETTLE_RECALIBRATE_INTERVAL)
+    calibrate_settle();
+#endif
+
+  snapshot.publish(matrix_state, num_rows, scan_count, sample_micros);
+  return false;
+}
+
+// Debounce this_row_read and update the matrix state and key lists
+bool KeyboardMatrix::process(uint32_t sample_micros) {
+  bool matrix_changed = false;
+  uint8_t row, r, c;
+  uint16_t btn_bit = 0;
+
+  last_update_micros = this_update_micros;
+  this_update_micros = sample_micros;
+  delta_micros = this_update_micros - last_update_micros;
+  scan_count++;
+
+  clear_just_pressed();
 
   // delete all keys and data objects
   ReleasedKey *rkey;
@@ -284,6 +761,9 @@ bool KeyboardMatrix::update(void) {
 
   // debounce and count new keys
   new_pressed_keys_count = 0;
+  idle = true;
+  idle_steady_count = steady_count;
+  idle_adaptive = adaptive_debounce;
 
   for (r=0; r<num_rows; r++) {
     for (c=0; c<num_cols; c++) {
@@ -294,11 +774,15 @@ bool KeyboardMatrix::update(void) {
         if (key_states[r*num_cols+c].state == 1 || key_states[r*num_cols+c].state == 2) {
           new_pressed_keys_count++;
 
-          PressedKey *new_key = new PressedKey(r, c, 0);
-          PressedKey *last_key = pressed_list.last_item();
+          PressedKey *new_key = NULL;
+          PressedKey *last_key = NULL;
+          if (track_keys) {
+            new_key = new PressedKey(r, c, key_sample_micros(r, c), scan_count);
+            last_key = pressed_list.last_item();
+          }
 
           // Reject keys if ghost
-          if (new_pressed_keys_count > 1) {
+          if (reject_ghosts && new_pressed_keys_count > 1) {
             // ignore this new_key
             // Serial.print("THIS GHOST KEY: ");
             // Serial.print(ascii_key_matrix[0][r][c]);
@@ -307,9 +791,11 @@ bool KeyboardMatrix::update(void) {
             // Serial.print(" -> ");
             new_pressed_keys_count -= 1;
             // Serial.println(new_pressed_keys_count);
+            delete new_key;
 
-            // check for past ghost presses
-            while (new_key->hold_time == last_key->hold_time) {
+            // check for past ghost presses: keys registered on this scan or
+            // the one before
+            while (last_key != NULL && last_key->press_scan + 1 >= scan_count) {
               // Serial.print("PAST GHOST KEY: ");
               // Serial.print(ascii_key_matrix[0][last_key->row][last_key->col]);
               // Serial.print(" newpressedcount: ");
@@ -323,6 +809,8 @@ bool KeyboardMatrix::update(void) {
 
               // remove last pressed key
               last_key = pressed_list.pop();
+              if (last_key == last_new_key)
+                last_new_key = NULL;
               delete last_key;
               // get new last key
               last_key = pressed_list.last_item();
@@ -336,7 +824,10 @@ bool KeyboardMatrix::update(void) {
             matrix_state[r] = matrix_state[r] & ~btn_bit;
 
             // add the new pressed key
-            pressed_list.add(new_key);
+            if (track_keys) {
+              pressed_list.add(new_key);
+              last_new_key = new_key;
+            }
           }
         }
         // else key was released
@@ -347,35 +838,36 @@ bool KeyboardMatrix::update(void) {
           // Key is now released -> Set matrix bit to 1
           matrix_state[r] = matrix_state[r] | btn_bit;
 
-          PressedKey *key_to_delete;
-          // remove key from pressed_list
-          for (uint8_t i=0; i<pressed_list.size(); i++) {
-            key_to_delete = pressed_list.get(i);
-            if (key_to_delete->row == r &&
-                key_to_delete->col == c) {
-              key_to_delete = pressed_list.remove(i);
-              delete key_to_delete;
+          if (track_keys) {
+            PressedKey *key_to_delete;
+            uint32_t press_micros = 0;
+            // remove key from pressed_list
+            for (uint8_t i=0; i<pressed_list.size(); i++) {
+              key_to_delete = pressed_list.get(i);
+              if (key_to_delete->row == r &&
+                  key_to_delete->col == c) {
+                key_to_delete = pressed_list.remove(i);
+                press_micros = key_to_delete->press_micros;
+                if (key_to_delete == last_new_key)
+                  last_new_key = NULL;
+                delete key_to_delete;
+              }
             }
-          }
 
-          ReleasedKey *new_released_key = new ReleasedKey(r, c);
-          released_list.add(new_released_key);
+            ReleasedKey *new_released_key = new ReleasedKey(r, c, press_micros, key_sample_micros(r, c));
+            released_list.add(new_released_key);
+          }
         }
       }
+
+      if (key_states[r*num_cols+c].state != 0 ||
+          key_states[r*num_cols+c].counter > -key_steady_count(r*num_cols+c))
+        idle = false;
     }
   }
 
   // end debounce
 
-  // increment hold times for pressed keys
-  PressedKey *pkey;
-  for (uint8_t i=0; i<pressed_list.size(); i++) {
-    pkey = pressed_list.get(i);
-    if (button_held(pkey->row, pkey->col)) {
-      pkey->hold_time += delta_micros;
-    }
-  }
-
   for (row=0; row<num_rows; row++) {
     if (matrix_state[row] != matrix_state_prev[row]) {
       matrix_changed = true;
@@ -383,6 +875,15 @@ bool KeyboardMatrix::update(void) {
     }
   }
 
+#if SETTLE_RECALIBRATE_INTERVAL > 0
+  // Pullups drift with temperature, re-measure while the matrix is idle
+  if ((track_keys ? pressed_list.size() == 0 : idle) &&
+      this_update_micros - last_calibration_micros > SETTLE_RECALIBRATE_INTERVAL) {
+    calibrate_settle();
+  }
+#endif
+
+  snapshot.publish(matrix_state, num_rows, scan_count, sample_micros);
   return matrix_changed;
 }
 
@@ -3,6 +3,8 @@
 
 #include <Arduino.h>
 #include "LinkedList.h"
+#include "MatrixSnapshot.h"
+#include "MatrixLineDriver.h"
 
 // Diode Directions
 
@@ -17,30 +19,122 @@
 //   Column pins are set to input mode with pullups turned on
 
 
+// Default for steady_count, which can be changed at runtime
 #define STEADY_COUNT 20
 #define TRANSIENT_COUNT 3
-#define TRANSIENT_COUNT_ABS 17
+#define TRANSIENT_COUNT_ABS (STEADY_COUNT - TRANSIENT_COUNT)
+
+// Sense line settle calibration
+//   Each sense line is discharged and then timed (in digitalRead polls) until
+//   its pullup brings it back high. The result plus a margin is the longest the
+//   scan will wait for a line to recover after a strobe found a key pressed.
+#define SETTLE_CALIBRATION_SAMPLES 8
+#define SETTLE_MARGIN_POLLS 2
+#define SETTLE_MAX_POLLS 255
+// Re-run calibration while no keys are held, in microseconds (0 disables)
+#define SETTLE_RECALIBRATE_INTERVAL 10000000
+
+// Fast strobes
+//   begin() leaves every strobe line as an input with its output latch LOW.
+//   Strobing then only sets or clears the line's bit in the GPIO direction
+//   register, through a pointer and mask looked up once, instead of a full
+//   pinMode() + digitalWrite(). On Teensy 3.x the pointer is the bit-band
+//   alias so it's a single store. Cores without portModeRegister() use the
+//   pinMode() path.
+#ifdef portModeRegister
+#define FAST_STROBE_AVAILABLE 1
+#endif
+
+// Idle fast path
+//   Once every key is released and every debounce counter has saturated, a
+//   full scan and debounce can only confirm what is already known. update()
+//   then activates all strobe lines together and reads each sense line once
+//   instead. Only if one of them is active does it fall through to the full
+//   scan, in the same update(), so presses register on the same scan either
+//   way.
+
+// Adaptive debounce
+//   steady_count has to cover the worst switch on the board, and
+//   TRANSIENT_COUNT the noisiest, which costs every key latency. With
+//   adaptive_debounce each key instead gets its own counts from what it has
+//   done so far:
+//     - bounce: how far bouncing contacts pulled a transient's counter back
+//       towards the state it left, peak-held and decaying by one every
+//       DEBOUNCE_ADAPTIVE_BOUNCE_DECAY transients that settled cleanly. The
+//       key's steady count is bounce + DEBOUNCE_ADAPTIVE_MARGIN, never less
+//       than steady_count, so a bounce like the ones seen so far can't revert
+//       the transient.
+//     - noise: how far the counter was pulled off a steady state and went
+//       back without starting a transient (a contact opening for a sample
+//       while held, a glitch on an open key, the first touch of a bouncy
+//       press). The key needs DEBOUNCE_ADAPTIVE_MIN_TRANSIENT + noise samples
+//       to leave a steady state. It starts at TRANSIENT_COUNT and steps down
+//       by one after every DEBOUNCE_ADAPTIVE_WINDOW clean transients with
+//       nothing that deep.
+//     - chatter: transients that fell back to the state they left, decaying
+//       by one every DEBOUNCE_ADAPTIVE_CHATTER_DECAY clean transients. Each
+//       one adds a sample to the transient count. A reverted transient also
+//       doubles bounce, since it was at least as deep as the steady count.
+//   So a key starts with exactly the counts it would have without adaptive
+//   debounce, a quiet one earns a shorter transient count (which is where
+//   the latency is) and a bad one widens to fit. Narrowing the steady count
+//   below steady_count was tried and only traded a little settling time for
+//   chatter on worn switches, whose deepest bounces are too rare to learn.
+//   The profiles can be saved and restored (see DebounceProfileStore.h) so
+//   they aren't relearned after every power up.
+#define DEBOUNCE_ADAPTIVE_MAX_STEADY 40
+#define DEBOUNCE_ADAPTIVE_MARGIN 2
+#define DEBOUNCE_ADAPTIVE_MIN_TRANSIENT 2
+#define DEBOUNCE_ADAPTIVE_MAX_TRANSIENT 6
+#define DEBOUNCE_ADAPTIVE_MAX_NOISE (TRANSIENT_COUNT - DEBOUNCE_ADAPTIVE_MIN_TRANSIENT)
+#define DEBOUNCE_ADAPTIVE_MAX_CHATTER 8
+#define DEBOUNCE_ADAPTIVE_WINDOW 64
+#define DEBOUNCE_ADAPTIVE_BOUNCE_DECAY 2048
+#define DEBOUNCE_ADAPTIVE_CHATTER_DECAY 16384
 
 struct debounced_switch {
   uint8_t state;
   int counter;
 };
 
+struct debounce_profile {
+  // deepest recent bounce, in samples
+  uint8_t bounce;
+  // recent reverted transients
+  uint8_t chatter;
+  // deepest recent excursion from a steady state, in samples
+  uint8_t noise;
+  // deepest bounce in the current transient, or excursion in a steady state
+  uint8_t depth;
+  // deepest excursion in the current window
+  uint8_t window_noise;
+  // clean transients since the last reverted one, for narrowing and decay
+  uint16_t clean;
+};
+
 class PressedKey {
 public:
-  PressedKey(uint8_t key_row, uint8_t key_column, uint32_t initial_hold_time);
+  PressedKey(uint8_t key_row, uint8_t key_column, uint32_t key_press_micros, uint32_t key_press_scan);
 
   uint8_t row;
   uint8_t col;
-  uint32_t hold_time;
+  // micros() when this key's line was sampled on the scan that registered it
+  uint32_t press_micros;
+  uint32_t press_scan;
+  // true only for the update() that registered the press
+  bool just_pressed;
+
+  uint32_t hold_time(uint32_t now_micros);
 };
 
 class ReleasedKey {
 public:
-  ReleasedKey(uint8_t key_row, uint8_t key_column);
+  ReleasedKey(uint8_t key_row, uint8_t key_column, uint32_t key_press_micros, uint32_t key_release_micros);
 
   uint8_t row;
   uint8_t col;
+  uint32_t press_micros;
+  uint32_t release_micros;
 };
 
 
@@ -48,11 +142,15 @@ class KeyboardMatrix {
 public:
   KeyboardMatrix(uint8_t num_rows, uint8_t num_cols,
                  uint8_t *row_pins, uint8_t *col_pins,
-                 uint8_t diode_direction);
+                 uint8_t diode_direction,
+                 uint8_t num_remote_rows = 0);
 	~KeyboardMatrix();
 
   uint8_t diode_direction;
+  // num_rows includes any remote rows, which follow the local (scanned) rows
   uint8_t num_rows;
+  uint8_t num_local_rows;
+  uint8_t num_remote_rows;
   uint8_t num_cols;
   uint8_t *row_pins;
   uint8_t *col_pins;
@@ -61,30 +159,135 @@ public:
   uint16_t *matrix_state_prev;
 
   uint32_t delta_micros;
+  // Consecutive agreeing samples for a key to settle (TRANSIENT_COUNT less to
+  // leave a steady state)
+  uint8_t steady_count;
+  // Number of update() calls so far
+  uint32_t scan_count;
+
+  // Sense lines are the row pins for ROW_PIN_TO_COL_PIN and the column pins
+  // for COL_PIN_TO_ROW_PIN
+  uint8_t num_sense_lines;
+  uint8_t *sense_pins;
+  // Calibrated settle budget per sense line, in digitalRead polls
+  uint8_t *settle_polls;
+
+  // Strobe lines are whichever of the row and column pins aren't sense lines
+  uint8_t num_strobe_lines;
+  uint8_t *strobe_pins;
+  // Toggle the direction register directly (see FAST_STROBE_AVAILABLE), can be
+  // switched off at runtime to compare
+  bool fast_strobe;
+  // Use the idle fast path, can be switched off at runtime to compare
+  bool idle_fast_path;
+  // Number of update() calls that took the idle fast path
+  uint32_t idle_scans;
+  // Learn per-key debounce counts instead of using steady_count and
+  // TRANSIENT_COUNT for every key (see above)
+  bool adaptive_debounce;
+  // num_rows*num_cols learned profiles, indexed by row*num_cols+col
+  debounce_profile *debounce_profiles;
+  // Transients that fell back to the state they left, in either mode
+  uint32_t reverted_transients;
+
+  // Keep pressed_list and released_list (and reject ghosts registered on the
+  // scan before). Switch off to run update() from a timer interrupt: it then
+  // never touches the heap and the snapshot is the only output.
+  bool track_keys;
+  // Treat more than one key settling on the same scan as ghosting and drop
+  // them, for matrices without a diode on every switch. Switch off for chords
+  // (steno), where keys really do go down together: every key that settles is
+  // then registered, ghosts included.
+  bool reject_ghosts;
 
   LinkedList<PressedKey*> pressed_list;
   LinkedList<ReleasedKey*> released_list;
 
+  // matrix_state as of the last update(), safe to read from any context (see
+  // MatrixSnapshot.h)
+  MatrixSnapshotLatch snapshot;
+
   void begin();
   bool update();
+  bool update_from_rows(const uint16_t *rows, uint32_t sample_micros);
+  void calibrate_settle();
+  // Activate and deactivate every strobe line iterations times, returns the
+  // elapsed microseconds
+  uint32_t strobe_benchmark(uint16_t iterations);
+  // Raw row words for rows this matrix does not scan itself (eg the other half
+  // of a split keyboard), merged in before debounce on every update()
+  void set_remote_rows(const uint16_t *rows);
+  // Strobe and read the lines through driver instead of the row and column
+  // pins, which are then unused (see MatrixLineDriver.h). Call before begin().
+  void set_line_driver(MatrixLineDriver *driver);
+  // Raw (not debounced) row words from the last scan
+  const uint16_t *raw_rows();
+  // micros() when the last update() read them, the time debounce used
+  uint32_t scan_micros();
+  // The key registered by the last update(), or NULL. Always the last item in
+  // pressed_list.
+  PressedKey *new_key();
+  // With reject_ghosts off, how many keys the last update() registered: the
+  // last that many items in pressed_list
+  uint8_t new_key_count();
+  // The debounce counts in use for key row*num_cols+col
+  uint8_t key_steady_count(uint16_t key);
+  uint8_t key_transient_count(uint16_t key);
+  void reset_debounce_profiles();
   bool button_pressed(uint8_t row, uint8_t button_bit_position);
   bool button_released(uint8_t row, uint8_t button_bit_position);
   bool button_held(uint8_t row, uint8_t button_bit_position);
 
  private:
   uint16_t *this_row_read;
+  const uint16_t *remote_rows;
+  MatrixLineDriver *line_driver;
+  // sense lines pulled low per strobe line, from the line driver
+  uint32_t *line_active;
 
   uint32_t last_update_micros;
   uint32_t this_update_micros;
+  // micros() when each strobe line was activated on the last scan
+  uint32_t *strobe_micros;
+  // the last key registered by the last update(), or NULL
+  PressedKey *last_new_key;
+  uint32_t last_calibration_micros;
 
   uint8_t new_pressed_keys_count;
+  // Every key released with its counter saturated after the last process(),
+  // at idle_steady_count
+  bool idle;
+  uint8_t idle_steady_count;
+  bool idle_adaptive;
 
   debounced_switch *key_states;
 
+#ifdef FAST_STROBE_AVAILABLE
+  volatile uint8_t **strobe_mode_regs;
+  uint8_t *strobe_masks;
+#endif
+
+  void scan();
+  void scan_line_driver();
+  bool process(uint32_t sample_micros);
+  bool process_idle(uint32_t sample_micros);
+  void clear_just_pressed();
+  bool remote_rows_released();
+  bool probe_any_active();
   bool debounce_update(uint8_t r, uint8_t c);
+  uint8_t profile_steady_count(const debounce_profile *profile);
+  uint8_t profile_transient_count(const debounce_profile *profile);
+  void learn_profile(debounce_profile *profile, uint8_t state, int counter, int steady);
+  void profile_saturate(const debounce_profile *profile, debounced_switch *key);
+  void profile_settled(debounce_profile *profile, debounced_switch *key);
+  void profile_reverted(debounce_profile *profile, debounced_switch *key);
+  uint32_t key_sample_micros(uint8_t r, uint8_t c);
   void activate_column(uint8_t col);
   void deactivate_column(uint8_t col);
   void activate_row(uint8_t row);
   void deactivate_row(uint8_t row);
+  void activate_strobe(uint8_t line);
+  void deactivate_strobe(uint8_t line);
+  void wait_for_settle(uint32_t active_sense_bits);
 };
 #endif
@@ -33,4 +33,50 @@
 
 #define ASCII_ESC 27
 
+// Steno keys, numbered in GeminiPR order (see StenoEngine.h). Left bank keys
+// end in L and right bank keys in R, N1-NC are the number bar.
+#define STENO_FN 1
+#define STENO_N1 2
+#define STENO_N2 3
+#define STENO_N3 4
+#define STENO_N4 5
+#define STENO_N5 6
+#define STENO_N6 7
+#define STENO_S1 8
+#define STENO_S2 9
+#define STENO_TL 10
+#define STENO_KL 11
+#define STENO_PL 12
+#define STENO_WL 13
+#define STENO_HL 14
+#define STENO_RL 15
+#define STENO_A 16
+#define STENO_O 17
+#define STENO_ST1 18
+#define STENO_ST2 19
+#define STENO_RES1 20
+#define STENO_RES2 21
+#define STENO_PWR 22
+#define STENO_ST3 23
+#define STENO_ST4 24
+#define STENO_E 25
+#define STENO_U 26
+#define STENO_FR 27
+#define STENO_RR 28
+#define STENO_PR 29
+#define STENO_BR 30
+#define STENO_LR 31
+#define STENO_GR 32
+#define STENO_TR 33
+#define STENO_SR 34
+#define STENO_DR 35
+#define STENO_N7 36
+#define STENO_N8 37
+#define STENO_N9 38
+#define STENO_NA 39
+#define STENO_NB 40
+#define STENO_NC 41
+#define STENO_ZR 42
+#define STENO_NUM_KEYS 42
+
 #endif
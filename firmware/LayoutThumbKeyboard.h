@@ -6,6 +6,8 @@
 
 #define NUM_ROWS 6
 #define NUM_COLS 10
+// Rows scanned by the other half of a split keyboard, counted in NUM_ROWS
+#define NUM_REMOTE_ROWS 0
 
 // USB Facing Up
 // Row Pins
@@ -103,6 +105,10 @@ const char ascii_key_matrix[3][NUM_ROWS][NUM_COLS] =
   };
 
 
+// Actions other than characters that repeat when held (ENABLE_AUTOREPEAT),
+// 0 terminated. Modifiers, layer and mouse keys, escape and enter don't.
+const char autorepeat_keys[] = {'\b', '\t', ASCII_LEFT, ASCII_UP, ASCII_DOWN, ASCII_RIGHT, 0};
+
 // for all keycodes see:
 // ~/apps/arduino-1.8.5/hardware/teensy/avr/cores/teensy3/keylayouts.h
 // https://www.pjrc.com/teensy/td_keyboard.html
@@ -117,4 +123,18 @@ const uint16_t usb_key_matrix[NUM_ROWS][NUM_COLS] =
    {KEY_TAB,           MODIFIERKEY_CTRL, MODIFIERKEY_GUI, MODIFIERKEY_ALT, KEY_SPACE, KEY_SPACE, ASCII_FN,  KEY_COMMA, KEY_PERIOD,        KEY_ENTER},
   };
 
+// Steno keys for ENABLE_STENO, 0 for keys that still type. Plover's QWERTY
+// layout squeezed into ten columns: one star column, so the right bank starts
+// at y/h and -D ends the top row, -Z on backspace and the vowels on c v n m.
+// The number row is the number bar.
+const uint8_t steno_key_matrix[NUM_ROWS][NUM_COLS] =
+  {
+   {0,        0,        0,        0,        0,         0,         0,        0,        0,        0},
+   {STENO_N1, STENO_N2, STENO_N3, STENO_N4, STENO_N5,  STENO_N6,  STENO_N7, STENO_N8, STENO_N9, STENO_NA},
+   {STENO_S1, STENO_TL, STENO_PL, STENO_HL, STENO_ST1, STENO_FR,  STENO_PR, STENO_LR, STENO_TR, STENO_DR},
+   {STENO_S2, STENO_KL, STENO_WL, STENO_RL, STENO_ST2, STENO_RR,  STENO_BR, STENO_GR, STENO_SR, 0},
+   {0,        0,        0,        STENO_A,  STENO_O,   STENO_ST3, STENO_E,  STENO_U,  0,        STENO_ZR},
+   {0,        0,        0,        0,        0,         0,         0,        0,        0,        0},
+  };
+
 #endif
@@ -0,0 +1,56 @@
+#include "MCP23017Lines.h"
+
+MCP23017Lines::MCP23017Lines(uint8_t addr, uint32_t clock) {
+  address = addr;
+  i2c_clock = clock;
+  num_strobe_lines = 0;
+  sense_mask = 0;
+}
+
+void MCP23017Lines::begin(uint8_t num_strobe, uint8_t num_sense) {
+  num_strobe_lines = num_strobe > 8 ? 8 : num_strobe;
+  sense_mask = num_sense >= 8 ? 0xFF : (1 << num_sense) - 1;
+
+  Wire.begin();
+  Wire.setClock(i2c_clock);
+
+  // BANK = 0, sequential addressing
+  write_register(MCP23017_IOCON, 0x00);
+  // latch inactive before port A becomes an output, unused A pins stay inputs
+  write_register(MCP23017_OLATA, 0xFF);
+  write_register(MCP23017_IODIRA, ~((1 << num_strobe_lines) - 1));
+  write_register(MCP23017_IODIRB, 0xFF);
+  write_register(MCP23017_GPPUB, 0xFF);
+}
+
+void MCP23017Lines::write_register(uint8_t reg, uint8_t value) {
+  Wire.beginTransmission(address);
+  Wire.write(reg);
+  Wire.write(value);
+  Wire.endTransmission();
+}
+
+uint8_t MCP23017Lines::strobe_and_read(uint8_t strobe_bits) {
+  Wire.beginTransmission(address);
+  Wire.write(MCP23017_GPIOA);
+  Wire.write((uint8_t) ~strobe_bits);
+  // repeated start, the register pointer has moved on to GPIOB
+  Wire.endTransmission(false);
+  if (Wire.requestFrom(address, (uint8_t) 1) != 1)
+    return 0;
+  return ~Wire.read() & sense_mask;
+}
+
+void MCP23017Lines::scan(uint32_t *active, uint32_t *sample_micros) {
+  for (uint8_t line=0; line<num_strobe_lines; line++) {
+    sample_micros[line] = micros();
+    active[line] = strobe_and_read(1 << line);
+  }
+  write_register(MCP23017_GPIOA, 0xFF);
+}
+
+uint32_t MCP23017Lines::probe(void) {
+  uint8_t sense_bits = strobe_and_read((1 << num_strobe_lines) - 1);
+  write_register(MCP23017_GPIOA, 0xFF);
+  return sense_bits;
+}
@@ -0,0 +1,56 @@
+#ifndef MCP23017LINES_H
+#define MCP23017LINES_H
+
+#include <Arduino.h>
+#include <Wire.h>
+#include "MatrixLineDriver.h"
+
+// Matrix lines on an MCP23017 I2C GPIO expander
+//
+// Port A drives up to 8 strobe lines (GPA0 is line 0), port B reads up to 8
+// sense lines with the expander's own pullups. Inactive strobe lines are
+// driven high, so the matrix needs its diodes.
+//
+// With IOCON.BANK = 0 and sequential addressing GPIOB follows GPIOA, so each
+// strobe line is one combined transaction:
+//
+//   START addr+W GPIOA pattern  RESTART addr+R [GPIOB]  STOP
+//
+// The new pattern is on the pins from the ACK of the pattern byte and GPIOB is
+// sampled after the read address, ten bit times later, which is the sense
+// lines' settle time. A scan is one of these per strobe line and one write to
+// leave them inactive. That is I2C bound: about 0.4ms for 8x8 at 1MHz
+// (the part runs up to 1.7MHz). Use ShiftRegisterLines for big matrices.
+
+#define MCP23017_DEFAULT_ADDRESS 0x20
+#define MCP23017_I2C_CLOCK 1000000
+
+#define MCP23017_IODIRA 0x00
+#define MCP23017_IODIRB 0x01
+#define MCP23017_IOCON 0x0A
+#define MCP23017_GPPUB 0x0D
+#define MCP23017_GPIOA 0x12
+#define MCP23017_GPIOB 0x13
+#define MCP23017_OLATA 0x14
+
+class MCP23017Lines : public MatrixLineDriver {
+public:
+  MCP23017Lines(uint8_t address = MCP23017_DEFAULT_ADDRESS, uint32_t i2c_clock = MCP23017_I2C_CLOCK);
+
+  uint8_t address;
+  uint32_t i2c_clock;
+
+  void begin(uint8_t num_strobe_lines, uint8_t num_sense_lines);
+  void scan(uint32_t *active, uint32_t *sample_micros);
+  uint32_t probe();
+
+private:
+  uint8_t num_strobe_lines;
+  uint8_t sense_mask;
+
+  void write_register(uint8_t reg, uint8_t value);
+  // Drive port A with strobe_bits (1 = active) and read port B (1 = low)
+  uint8_t strobe_and_read(uint8_t strobe_bits);
+};
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef MATRIXLINEDRIVER_H
+#define MATRIXLINEDRIVER_H
+
+#include <Arduino.h>
+
+// Matrix lines behind a bus
+//
+// By default KeyboardMatrix strobes and reads Teensy pins itself. Given a
+// MatrixLineDriver (KeyboardMatrix::set_line_driver()) it hands the whole
+// strobe-and-read sequence of a scan to the driver instead, so the lines can
+// be on shift registers or a GPIO expander and a driver can batch the bus
+// transfers however suits its hardware. Debounce, ghost rejection and the idle
+// fast path work the same either way.
+//
+// Strobe and sense lines are numbered as KeyboardMatrix numbers its strobe_pins
+// and sense_pins (see DIODE_DIRECTION_*). Drivers: ShiftRegisterLines (SPI) and
+// MCP23017Lines (I2C).
+
+class MatrixLineDriver {
+public:
+  virtual ~MatrixLineDriver() {}
+
+  // Set up the bus and the lines with every strobe line inactive. Blocking,
+  // called from KeyboardMatrix::begin().
+  virtual void begin(uint8_t num_strobe_lines, uint8_t num_sense_lines) = 0;
+  // Activate each strobe line in turn and read the sense lines while it is
+  // active: active[line] gets a 1 bit for each sense line pulled low (a
+  // pressed key) and sample_micros[line] when it was read. Every strobe line
+  // is inactive again when it returns.
+  virtual void scan(uint32_t *active, uint32_t *sample_micros) = 0;
+  // Activate every strobe line at once, returns the sense lines pulled low
+  virtual uint32_t probe() = 0;
+};
+
+#endif
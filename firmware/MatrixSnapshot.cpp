@@ -0,0 +1,61 @@
+#include "MatrixSnapshot.h"
+
+MatrixSnapshotLatch::MatrixSnapshotLatch(void) {
+  seq = 0;
+  for (uint8_t copy=0; copy<2; copy++) {
+    copies[copy].scan = 0;
+    copies[copy].sample_micros = 0;
+    copies[copy].num_rows = 0;
+    for (uint8_t row=0; row<MATRIX_SNAPSHOT_MAX_ROWS; row++)
+      copies[copy].rows[row] = 0xFFFF;
+  }
+}
+
+void MatrixSnapshotLatch::write_copy(uint8_t copy, const uint16_t *rows, uint8_t num_rows,
+                                     uint32_t scan, uint32_t sample_micros) {
+  MatrixSnapshot *snapshot = &copies[copy];
+  snapshot->scan = scan;
+  snapshot->sample_micros = sample_micros;
+  snapshot->num_rows = num_rows;
+  for (uint8_t row=0; row<num_rows; row++)
+    snapshot->rows[row] = rows[row];
+}
+
+void MatrixSnapshotLatch::publish(const uint16_t *rows, uint8_t num_rows,
+                                  uint32_t scan, uint32_t sample_micros) {
+  if (num_rows > MATRIX_SNAPSHOT_MAX_ROWS)
+    num_rows = MATRIX_SNAPSHOT_MAX_ROWS;
+
+  // readers move to copy 1 while copy 0 is written, then back
+  seq = seq + 1;
+  MATRIX_SNAPSHOT_BARRIER();
+  write_copy(0, rows, num_rows, scan, sample_micros);
+  MATRIX_SNAPSHOT_BARRIER();
+  seq = seq + 1;
+  MATRIX_SNAPSHOT_BARRIER();
+  write_copy(1, rows, num_rows, scan, sample_micros);
+}
+
+bool MatrixSnapshotLatch::read(MatrixSnapshot *snapshot) {
+  uint32_t last_scan = snapshot->scan;
+  uint32_t start;
+
+  do {
+    start = seq;
+    MATRIX_SNAPSHOT_BARRIER();
+    const MatrixSnapshot *copy = &copies[start & 1];
+    snapshot->scan = copy->scan;
+    snapshot->sample_micros = copy->sample_micros;
+    snapshot->num_rows = copy->num_rows;
+    // num_rows may be torn too, don't let it run off the end
+    for (uint8_t row=0; row<snapshot->num_rows && row<MATRIX_SNAPSHOT_MAX_ROWS; row++)
+      snapshot->rows[row] = copy->rows[row];
+    MATRIX_SNAPSHOT_BARRIER();
+  } while (seq != start);
+
+  return snapshot->scan != last_scan;
+}
+
+uint32_t MatrixSnapshotLatch::sequence(void) {
+  return seq / 2;
+}
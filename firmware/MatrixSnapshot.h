@@ -0,0 +1,65 @@
+#ifndef MATRIXSNAPSHOT_H
+#define MATRIXSNAPSHOT_H
+
+#include <Arduino.h>
+
+// Matrix state snapshots
+//
+// matrix_state and the key lists are only safe to read in between update()
+// calls on the same thread. Each update() also publishes the debounced row
+// words, with the scan number and time, through a MatrixSnapshotLatch. A copy
+// can be taken from anywhere (the main loop while update() runs from a timer
+// interrupt, or another interrupt) without disabling interrupts:
+//
+//   MatrixSnapshot snapshot;
+//   if (key_matrix.snapshot.read(&snapshot)) { ...a newer scan... }
+//
+// The latch keeps two copies and a sequence number. publish() increments the
+// sequence (odd: readers use copy 1) and writes copy 0, then increments it
+// again (even: readers use copy 0) and writes copy 1. A reader copies whichever
+// copy the sequence points at and tries again if the sequence changed while it
+// did, so it never returns a half-written matrix. The writer never waits for
+// readers, and a reader that interrupts publish() always finds the other copy
+// untouched, so it succeeds the first time instead of spinning on a writer
+// that can't run. A reader can only have to retry if a publish() interrupted
+// it, so it waits at most as many copies as scans happen meanwhile.
+//
+// Single writer only.
+
+// Rows beyond this aren't published
+#define MATRIX_SNAPSHOT_MAX_ROWS 16
+
+// Orders the sequence against the copies, for the compiler and the CPU (DMB on
+// ARM)
+#define MATRIX_SNAPSHOT_BARRIER() __sync_synchronize()
+
+struct MatrixSnapshot {
+  // scan_count of the update() that published it, 0 before the first
+  uint32_t scan;
+  // micros() when that update's rows were sampled
+  uint32_t sample_micros;
+  uint8_t num_rows;
+  // debounced row words as in matrix_state: a 0 bit is a pressed key
+  uint16_t rows[MATRIX_SNAPSHOT_MAX_ROWS];
+};
+
+class MatrixSnapshotLatch {
+public:
+  MatrixSnapshotLatch();
+
+  // Writer side, from update()
+  void publish(const uint16_t *rows, uint8_t num_rows, uint32_t scan, uint32_t sample_micros);
+  // Copy the latest snapshot into snapshot, true if its scan differs from the
+  // one snapshot held before
+  bool read(MatrixSnapshot *snapshot);
+  // Number of publish() calls so far
+  uint32_t sequence();
+
+private:
+  volatile uint32_t seq;
+  MatrixSnapshot copies[2];
+
+  void write_copy(uint8_t copy, const uint16_t *rows, uint8_t num_rows, uint32_t scan, uint32_t sample_micros);
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include "ST7735Display.h"
+
+ST7735Display::ST7735Display(uint8_t cs, uint8_t dc) {
+  cs_pin = cs;
+  dc_pin = dc;
+  transfer_running = false;
+}
+
+void ST7735Display::begin(void) {
+  // after SPI.begin() so DC can take over the (unused) MISO pin
+  SPI.begin();
+  pinMode(cs_pin, OUTPUT);
+  pinMode(dc_pin, OUTPUT);
+  digitalWrite(cs_pin, HIGH);
+
+#ifdef SPI_HAS_TRANSFER_ASYNC
+  transfer_event.setContext(this);
+  transfer_event.attachImmediate(transfer_done);
+#endif
+
+  SPI.beginTransaction(SPISettings(ST7735_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+  digitalWrite(cs_pin, LOW);
+  command(ST7735_SWRESET);
+  delay(150);
+  command(ST7735_SLPOUT);
+  delay(120);
+  command(ST7735_COLMOD);
+  SPI.transfer(0x05); // 16 bit color
+  command(ST7735_MADCTL_CMD);
+  SPI.transfer(ST7735_MADCTL);
+  command(ST7735_NORON);
+  command(ST7735_DISPON);
+  digitalWrite(cs_pin, HIGH);
+  SPI.endTransaction();
+}
+
+bool ST7735Display::busy(void) {
+  return transfer_running;
+}
+
+// The command byte goes out with DC low, anything after it is data
+void ST7735Display::command(uint8_t cmd) {
+  digitalWrite(dc_pin, LOW);
+  SPI.transfer(cmd);
+  digitalWrite(dc_pin, HIGH);
+}
+
+void ST7735Display::data16(uint16_t value) {
+  SPI.transfer(value >> 8);
+  SPI.transfer(value);
+}
+
+void ST7735Display::finish(void) {
+  digitalWrite(cs_pin, HIGH);
+  SPI.endTransaction();
+  transfer_running = false;
+}
+
+#ifdef SPI_HAS_TRANSFER_ASYNC
+// Runs in the DMA interrupt
+void ST7735Display::transfer_done(EventResponderRef event) {
+  ((ST7735Display*) event.getContext())->finish();
+}
+#endif
+
+void ST7735Display::write_window(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                                 const uint8_t *pixels) {
+  x += ST7735_X_OFFSET;
+  y += ST7735_Y_OFFSET;
+
+  transfer_running = true;
+  SPI.beginTransaction(SPISettings(ST7735_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+  digitalWrite(cs_pin, LOW);
+  command(ST7735_CASET);
+  data16(x);
+  data16(x + w - 1);
+  command(ST7735_RASET);
+  data16(y);
+  data16(y + h - 1);
+  command(ST7735_RAMWR);
+
+#ifdef SPI_HAS_TRANSFER_ASYNC
+  SPI.transfer(pixels, NULL, w*h*2, transfer_event);
+#else
+  SPI.transfer(pixels, NULL, w*h*2);
+  finish();
+#endif
+}
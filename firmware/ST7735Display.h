@@ -0,0 +1,61 @@
+#ifndef ST7735DISPLAY_H
+#define ST7735DISPLAY_H
+
+#include <Arduino.h>
+#include <SPI.h>
+#include "TextDisplay.h"
+
+// ST7735 SPI display driver (the common 1.8" 160x128 TFT) on the broken-out
+// SPI pins.
+//
+// write_window() sends the short window commands directly and the pixels with
+// the SPI library's asynchronous (DMA) transfer, so it returns after a few
+// microseconds. The transfer finishes in the background and busy() stays true
+// until then. Cores without asynchronous SPI fall back to a blocking transfer.
+
+#define ST7735_WIDTH 160
+#define ST7735_HEIGHT 128
+#define ST7735_SPI_CLOCK 24000000
+
+// Landscape, BGR. Panels with RGB filters want 0x60.
+#define ST7735_MADCTL 0x68
+// Some panels map the visible area a couple of pixels into controller RAM
+#define ST7735_X_OFFSET 0
+#define ST7735_Y_OFFSET 0
+
+#define ST7735_SWRESET 0x01
+#define ST7735_SLPOUT 0x11
+#define ST7735_NORON 0x13
+#define ST7735_DISPON 0x29
+#define ST7735_CASET 0x2A
+#define ST7735_RASET 0x2B
+#define ST7735_RAMWR 0x2C
+#define ST7735_MADCTL_CMD 0x36
+#define ST7735_COLMOD 0x3A
+
+class ST7735Display : public DisplayDriver {
+public:
+  ST7735Display(uint8_t cs_pin, uint8_t dc_pin);
+
+  uint8_t cs_pin;
+  uint8_t dc_pin;
+
+  // Blocking, call from setup()
+  void begin();
+  bool busy();
+  void write_window(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                    const uint8_t *pixels);
+
+private:
+  volatile bool transfer_running;
+#ifdef SPI_HAS_TRANSFER_ASYNC
+  EventResponder transfer_event;
+  static void transfer_done(EventResponderRef event);
+#endif
+
+  void command(uint8_t cmd);
+  void data16(uint16_t value);
+  void finish();
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "ScanScheduler.h"
+
+ScanScheduler::ScanScheduler(uint8_t scansperframe, uint32_t guard) {
+  scans_per_frame = scansperframe > 0 ? scansperframe : 1;
+  guard_micros = guard;
+
+  locked = false;
+  last_phase_error = 0;
+  pipeline_micros = 0;
+  overruns = 0;
+
+  last_frame = 0;
+  have_frame = false;
+  sof_estimate = 0;
+  last_frame_change = 0;
+  lock_count = 0;
+  next_scan_micros = 0;
+  aligned_scan = false;
+  target_sof = 0;
+}
+
+void ScanScheduler::sof_poll(uint16_t frame_number, uint32_t now_micros) {
+  if (have_frame && frame_number == last_frame) {
+    if (locked && now_micros - last_frame_change > SOF_LOST_MICROS) {
+      locked = false;
+      lock_count = 0;
+    }
+    return;
+  }
+
+  if (!have_frame) {
+    have_frame = true;
+    last_frame = frame_number;
+    sof_estimate = now_micros;
+    last_frame_change = now_micros;
+    return;
+  }
+
+  // frame numbers are 11 bits
+  uint16_t elapsed = (frame_number - last_frame) & 0x7FF;
+  uint32_t predicted = sof_estimate + elapsed*SOF_FRAME_MICROS;
+  int32_t error = (int32_t) (now_micros - predicted);
+
+  last_frame = frame_number;
+  last_frame_change = now_micros;
+  last_phase_error = error;
+
+  if (error > SOF_RELOCK_MICROS || error < -SOF_RELOCK_MICROS) {
+    sof_estimate = now_micros;
+    locked = false;
+    lock_count = 0;
+    return;
+  }
+
+  // An early observation is closer to the real SOF, take it. Late ones are
+  // mostly polling delay, only follow them a little.
+  if (error < 0)
+    sof_estimate = now_micros;
+  else
+    sof_estimate = predicted + error/16;
+
+  if (!locked && ++lock_count >= SOF_LOCK_FRAMES)
+    locked = true;
+}
+
+uint32_t ScanScheduler::next_sof(uint32_t now_micros) {
+  uint32_t frames = (now_micros - sof_estimate) / SOF_FRAME_MICROS + 1;
+  return sof_estimate + frames*SOF_FRAME_MICROS;
+}
+
+bool ScanScheduler::scan_due(uint32_t now_micros) {
+  return (int32_t) (now_micros - next_scan_micros) >= 0;
+}
+
+// Pick the first scan slot starting after after_micros
+void ScanScheduler::schedule_after(uint32_t after_micros) {
+  uint32_t slot = SOF_FRAME_MICROS / scans_per_frame;
+
+  aligned_scan = false;
+  if (!locked) {
+    // free run at the same rate
+    next_scan_micros = after_micros + slot;
+    return;
+  }
+
+  uint32_t lead = pipeline_micros + guard_micros;
+  if (lead > SOF_FRAME_MICROS - slot)
+    lead = SOF_FRAME_MICROS - slot;
+
+  // the last slot of the frame ends just before its SOF
+  uint32_t sof = next_sof(after_micros);
+  if ((int32_t) (sof - lead - after_micros) <= 0)
+    sof += SOF_FRAME_MICROS;
+
+  for (uint8_t k=scans_per_frame; k-- > 0;) {
+    uint32_t start = sof - lead - k*slot;
+    if ((int32_t) (start - after_micros) > 0) {
+      next_scan_micros = start;
+      aligned_scan = (k == 0);
+      target_sof = sof;
+      return;
+    }
+  }
+}
+
+void ScanScheduler::scan_finished(uint32_t start_micros, uint32_t end_micros) {
+  // measured from the slot, so a late start counts against the lead too
+  uint32_t duration = end_micros - next_scan_micros;
+  if (duration > end_micros - start_micros + SOF_FRAME_MICROS)
+    duration = end_micros - start_micros;
+
+  // Follow longer scans quickly and shorter ones slowly, which settles near
+  // the top of the usual spread without chasing rare spikes
+  if (duration > pipeline_micros)
+    pipeline_micros += (duration - pipeline_micros + 7) / 8;
+  else
+    pipeline_micros -= (pipeline_micros - duration) / 64;
+
+  // finished after the SOF it was aimed at
+  if (aligned_scan && (int32_t) (end_micros - target_sof) > 0)
+    overruns++;
+
+  schedule_after(end_micros);
+}
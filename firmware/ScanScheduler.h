@@ -0,0 +1,68 @@
+#ifndef SCANSCHEDULER_H
+#define SCANSCHEDULER_H
+
+#include <Arduino.h>
+
+// USB start-of-frame aligned scan scheduling
+//
+// The host polls the keyboard's interrupt endpoint once per 1ms USB frame,
+// shortly after each start-of-frame (SOF). A report built just after a poll
+// waits almost a whole frame to be picked up. This schedules scans_per_frame
+// evenly spaced scans per frame, phase-locked so the last one finishes (scan,
+// debounce and report) just before the next SOF.
+//
+// SOF times are estimated from changes in the USB frame number, seen by polling
+// so they are always observed late. The estimate follows the earliest
+// observations and creeps slowly later to follow clock drift. The lead before
+// the SOF follows the measured pipeline duration, rising quickly to longer
+// scans and falling slowly, so it sits near the top of the usual spread.
+//
+// This is for scanning at a fixed rate (to save power or leave time for other
+// work). Scanning back to back as fast as possible has lower latency still,
+// since a key press arrives at a random point in the frame either way.
+
+#define SOF_FRAME_MICROS 1000
+// Frame number unchanged for this long means no SOFs (unplugged or suspended)
+#define SOF_LOST_MICROS 5000
+// Observations this far off the prediction restart the lock
+#define SOF_RELOCK_MICROS 200
+// Consistent frames needed before scans are aligned
+#define SOF_LOCK_FRAMES 8
+
+class ScanScheduler {
+public:
+  ScanScheduler(uint8_t scans_per_frame, uint32_t guard_micros);
+
+  uint8_t scans_per_frame;
+  uint32_t guard_micros;
+
+  // Diagnostics
+  bool locked;
+  int32_t last_phase_error;
+  uint32_t pipeline_micros;
+  // aligned scans that finished after their SOF
+  uint32_t overruns;
+
+  // Call as often as possible with the current USB frame number
+  void sof_poll(uint16_t frame_number, uint32_t now_micros);
+  bool scan_due(uint32_t now_micros);
+  // Report when the scan started and finished
+  void scan_finished(uint32_t start_micros, uint32_t end_micros);
+  // Predicted time of the first SOF after now_micros
+  uint32_t next_sof(uint32_t now_micros);
+
+private:
+  uint16_t last_frame;
+  bool have_frame;
+  uint32_t sof_estimate;
+  uint32_t last_frame_change;
+  uint8_t lock_count;
+  uint32_t next_scan_micros;
+  // the scheduled scan is the one that should finish before target_sof
+  bool aligned_scan;
+  uint32_t target_sof;
+
+  void schedule_after(uint32_t after_micros);
+};
+
+#endif
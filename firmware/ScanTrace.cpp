@@ -0,0 +1,278 @@
+#include "ScanTrace.h"
+
+static uint8_t put_varint(uint8_t *out, uint32_t value) {
+  uint8_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+// Returns the number of bytes used, 0 if the varint is incomplete
+static uint8_t get_varint(const uint8_t *in, uint8_t length, uint32_t *value) {
+  uint32_t v = 0;
+  for (uint8_t n=0; n<length && n<5; n++) {
+    v |= (uint32_t) (in[n] & 0x7F) << (7*n);
+    if ((in[n] & 0x80) == 0) {
+      *value = v;
+      return n+1;
+    }
+  }
+  return 0;
+}
+
+// --- Writer ------------------------------------------------------------------
+
+ScanTraceWriter::ScanTraceWriter() {
+  num_rows = 0;
+  dropped_records = 0;
+  head = 0;
+  tail = 0;
+  used = 0;
+  need_keyframe = true;
+}
+
+void ScanTraceWriter::begin(uint8_t numrows) {
+  num_rows = numrows > SCAN_TRACE_MAX_ROWS ? SCAN_TRACE_MAX_ROWS : numrows;
+  dropped_records = 0;
+  head = 0;
+  tail = 0;
+  used = 0;
+  unchanged_scans = 0;
+  need_keyframe = true;
+}
+
+bool ScanTraceWriter::push(const uint8_t *record, uint8_t length) {
+  if (SCAN_TRACE_BUFFER_SIZE - used < length) {
+    dropped_records++;
+    need_keyframe = true;
+    return false;
+  }
+  for (uint8_t i=0; i<length; i++) {
+    buffer[head] = record[i];
+    head = (head + 1) % SCAN_TRACE_BUFFER_SIZE;
+  }
+  used += length;
+  return true;
+}
+
+void ScanTraceWriter::record(const uint16_t *rows, uint32_t sample_micros) {
+  uint8_t rec[SCAN_TRACE_MAX_RECORD];
+  uint8_t length = 0;
+  uint16_t changed_mask = 0;
+  uint8_t r;
+
+  if (need_keyframe) {
+    rec[length++] = SCAN_TRACE_KEYFRAME;
+    length += put_varint(rec+length, sample_micros);
+    rec[length++] = num_rows;
+    for (r=0; r<num_rows; r++) {
+      rec[length++] = rows[r] & 0xFF;
+      rec[length++] = rows[r] >> 8;
+    }
+    if (push(rec, length)) {
+      need_keyframe = false;
+      for (r=0; r<num_rows; r++)
+        prev_rows[r] = rows[r];
+      unchanged_scans = 0;
+      last_record_micros = sample_micros;
+    }
+    return;
+  }
+
+  for (r=0; r<num_rows; r++) {
+    if (rows[r] != prev_rows[r])
+      changed_mask |= (1 << r);
+  }
+
+  if (changed_mask == 0) {
+    unchanged_scans++;
+    if (unchanged_scans < SCAN_TRACE_MAX_RUN)
+      return;
+    rec[length++] = SCAN_TRACE_RUN;
+    length += put_varint(rec+length, unchanged_scans);
+    length += put_varint(rec+length, sample_micros - last_record_micros);
+    if (push(rec, length)) {
+      unchanged_scans = 0;
+      last_record_micros = sample_micros;
+    }
+    return;
+  }
+
+  rec[length++] = SCAN_TRACE_DELTA;
+  length += put_varint(rec+length, unchanged_scans);
+  length += put_varint(rec+length, sample_micros - last_record_micros);
+  length += put_varint(rec+length, changed_mask);
+  for (r=0; r<num_rows; r++) {
+    if (changed_mask & (1 << r)) {
+      uint16_t x = rows[r] ^ prev_rows[r];
+      rec[length++] = x & 0xFF;
+      rec[length++] = x >> 8;
+    }
+  }
+  if (push(rec, length)) {
+    for (r=0; r<num_rows; r++)
+      prev_rows[r] = rows[r];
+    unchanged_scans = 0;
+    last_record_micros = sample_micros;
+  }
+}
+
+void ScanTraceWriter::stream_to(Stream *out, uint16_t max_bytes) {
+  uint16_t n, contiguous;
+  int space = out->availableForWrite();
+
+  if (space < max_bytes)
+    max_bytes = space > 0 ? space : 0;
+
+  while (used > 0 && max_bytes > 0) {
+    contiguous = (head > tail) ? head - tail : SCAN_TRACE_BUFFER_SIZE - tail;
+    n = contiguous < max_bytes ? contiguous : max_bytes;
+    out->write(buffer+tail, n);
+    tail = (tail + n) % SCAN_TRACE_BUFFER_SIZE;
+    used -= n;
+    max_bytes -= n;
+  }
+}
+
+// --- Reader ------------------------------------------------------------------
+
+ScanTraceReader::ScanTraceReader() {
+  begin();
+}
+
+void ScanTraceReader::begin(void) {
+  num_rows = 0;
+  decode_errors = 0;
+  record_length = 0;
+  synced = false;
+  pending_repeats = 0;
+  repeats_total = 0;
+  pending_change = false;
+  record_start_micros = 0;
+  record_span_micros = 0;
+}
+
+bool ScanTraceReader::has_scan(void) {
+  return pending_repeats > 0 || pending_change;
+}
+
+// Decode the buffered record.
+// Returns 1 when a complete record was applied, 0 if more bytes are needed
+// and -1 if the record is malformed.
+int ScanTraceReader::parse_record(void) {
+  uint8_t pos = 1, n, r;
+  uint32_t micros_value, repeats, mask;
+
+  switch (record[0]) {
+  case SCAN_TRACE_KEYFRAME:
+    if (!(n = get_varint(record+pos, record_length-pos, &micros_value)))
+      return 0;
+    pos += n;
+    if (record_length <= pos)
+      return 0;
+    if (record[pos] > SCAN_TRACE_MAX_ROWS)
+      return -1;
+    if (record_length < pos + 1 + record[pos]*2)
+      return 0;
+    num_rows = record[pos++];
+    for (r=0; r<num_rows; r++, pos+=2)
+      pending_rows[r] = record[pos] | (record[pos+1] << 8);
+    synced = true;
+    pending_repeats = 0;
+    repeats_total = 0;
+    pending_change = true;
+    record_start_micros = micros_value;
+    record_span_micros = 0;
+    return 1;
+
+  case SCAN_TRACE_DELTA:
+  case SCAN_TRACE_RUN:
+    if (!(n = get_varint(record+pos, record_length-pos, &repeats)))
+      return 0;
+    pos += n;
+    if (!(n = get_varint(record+pos, record_length-pos, &micros_value)))
+      return 0;
+    pos += n;
+    mask = 0;
+    if (record[0] == SCAN_TRACE_DELTA) {
+      if (!(n = get_varint(record+pos, record_length-pos, &mask)))
+        return 0;
+      pos += n;
+      // count the xor words the mask calls for
+      n = 0;
+      for (r=0; r<num_rows; r++) {
+        if (mask & (1UL << r))
+          n++;
+      }
+      if (record_length < pos + n*2)
+        return 0;
+    }
+    // deltas are meaningless without the keyframe they build on
+    if (!synced)
+      return 1;
+
+    for (r=0; r<num_rows; r++) {
+      pending_rows[r] = rows[r];
+      if (mask & (1UL << r)) {
+        pending_rows[r] ^= record[pos] | (record[pos+1] << 8);
+        pos += 2;
+      }
+    }
+    record_start_micros += record_span_micros;
+    record_span_micros = micros_value;
+    pending_repeats = repeats;
+    repeats_total = repeats;
+    pending_change = (record[0] == SCAN_TRACE_DELTA);
+    return 1;
+
+  default:
+    return -1;
+  }
+}
+
+void ScanTraceReader::feed(uint8_t b) {
+  int result;
+
+  record[record_length++] = b;
+  result = parse_record();
+
+  if (result == 1) {
+    record_length = 0;
+  }
+  else if (result < 0 || record_length == SCAN_TRACE_MAX_RECORD) {
+    // drop everything until the next keyframe
+    decode_errors++;
+    synced = false;
+    record_length = 0;
+  }
+}
+
+bool ScanTraceReader::next_scan(uint16_t *out_rows, uint32_t *sample_micros) {
+  uint32_t steps;
+
+  if (pending_repeats > 0) {
+    // unchanged scans are spread evenly over the record's time span
+    steps = repeats_total + (pending_change ? 1 : 0);
+    *sample_micros = record_start_micros +
+      (uint32_t) ((uint64_t) record_span_micros * (repeats_total - pending_repeats + 1) / steps);
+    pending_repeats--;
+    for (uint8_t r=0; r<num_rows; r++)
+      out_rows[r] = rows[r];
+    return true;
+  }
+
+  if (pending_change) {
+    pending_change = false;
+    for (uint8_t r=0; r<num_rows; r++) {
+      rows[r] = pending_rows[r];
+      out_rows[r] = rows[r];
+    }
+    *sample_micros = record_start_micros + record_span_micros;
+    return true;
+  }
+
+  return false;
+}
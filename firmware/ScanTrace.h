@@ -0,0 +1,95 @@
+#ifndef SCANTRACE_H
+#define SCANTRACE_H
+
+#include <Arduino.h>
+
+// Raw scan capture and replay
+//
+// Records the raw (not debounced) row words of every scan so bounce, ghosting
+// and missed key reports can be replayed through KeyboardMatrix::update_from_rows()
+// exactly as the firmware saw them. Debounce counts scans, not time, so every
+// scan is accounted for: runs of identical scans are stored as a count and only
+// changed rows are stored, XORed against the previous scan.
+//
+// Records (all multi-byte integers are little endian, varints are LEB128):
+//   KEYFRAME 'K' [varint micros] [num_rows] [row lo, row hi] * num_rows
+//   DELTA    'D' [varint unchanged scans before this one] [varint micros since
+//                the previous record] [varint changed row mask]
+//                [xor lo, xor hi] * changed rows
+//   RUN      'R' [varint unchanged scans] [varint micros since the previous record]
+//
+// A capture always starts with a keyframe, and a new keyframe follows any
+// records dropped because the buffer was full.
+
+#define SCAN_TRACE_BUFFER_SIZE 2048
+#define SCAN_TRACE_MAX_ROWS 16
+// Longest run of identical scans before a RUN record is written
+#define SCAN_TRACE_MAX_RUN 65535
+
+#define SCAN_TRACE_KEYFRAME 'K'
+#define SCAN_TRACE_DELTA 'D'
+#define SCAN_TRACE_RUN 'R'
+
+// Largest possible record: tag, two 5 byte varints, 3 byte mask varint, rows
+#define SCAN_TRACE_MAX_RECORD (1 + 5 + 5 + 3 + SCAN_TRACE_MAX_ROWS*2)
+
+class ScanTraceWriter {
+public:
+  ScanTraceWriter();
+
+  uint32_t dropped_records;
+
+  void begin(uint8_t num_rows);
+  // Call once per scan with that scan's raw rows
+  void record(const uint16_t *rows, uint32_t sample_micros);
+  // Write out at most max_bytes of buffered trace without blocking
+  void stream_to(Stream *out, uint16_t max_bytes);
+
+private:
+  uint8_t num_rows;
+  uint16_t prev_rows[SCAN_TRACE_MAX_ROWS];
+  uint32_t last_record_micros;
+  uint32_t unchanged_scans;
+  bool need_keyframe;
+
+  uint8_t buffer[SCAN_TRACE_BUFFER_SIZE];
+  uint16_t head;
+  uint16_t tail;
+  uint16_t used;
+
+  bool push(const uint8_t *record, uint8_t length);
+};
+
+class ScanTraceReader {
+public:
+  ScanTraceReader();
+
+  uint8_t num_rows;
+  uint32_t decode_errors;
+
+  void begin();
+  // Push the next trace byte. Only call while has_scan() is false.
+  void feed(uint8_t b);
+  bool has_scan();
+  // Pop the next scan's raw rows and its original timestamp
+  bool next_scan(uint16_t *rows, uint32_t *sample_micros);
+
+private:
+  uint8_t record[SCAN_TRACE_MAX_RECORD];
+  uint8_t record_length;
+
+  uint16_t rows[SCAN_TRACE_MAX_ROWS];
+  uint16_t pending_rows[SCAN_TRACE_MAX_ROWS];
+  bool synced;
+
+  // scans decoded but not yet returned by next_scan()
+  uint32_t pending_repeats;
+  uint32_t repeats_total;
+  bool pending_change;
+  uint32_t record_start_micros;
+  uint32_t record_span_micros;
+
+  int parse_record();
+};
+
+#endif
@@ -0,0 +1,478 @@
+#include "SerialConsole.h"
+#include <EEPROM.h>
+
+static const char *builtin_commands[] = {
+  "list", "counters", "get", "set", "save", "load", "reset", "help",
+};
+
+SerialConsole::SerialConsole(Stream *s) {
+  stream = s;
+  num_params = 0;
+  num_counters = 0;
+  num_commands = 0;
+
+  bytes_read = 0;
+  commands = 0;
+  errors = 0;
+  overflows = 0;
+  dropped = 0;
+
+  line_length = 0;
+  line_overflow = false;
+  frame_length = 0;
+  listing = 0;
+  listing_index = 0;
+  listing_command = 0;
+  save_running = false;
+  save_cursor = 0;
+  save_crc = 0;
+  names_hash = 0;
+}
+
+bool SerialConsole::add(const char *name, void *value, uint8_t size,
+                        uint32_t min, uint32_t max, void (*changed)()) {
+  if (num_params >= CONSOLE_MAX_PARAMS) {
+    dropped++;
+    return false;
+  }
+  ConsoleParam *p = &params[num_params++];
+  p->name = name;
+  p->value = value;
+  p->size = size;
+  p->min = min;
+  p->max = max;
+  p->changed = changed;
+  p->default_value = get_value(num_params-1);
+  return true;
+}
+
+bool SerialConsole::add_param(const char *name, uint8_t *value, uint32_t min, uint32_t max, void (*changed)()) {
+  return add(name, value, 1, min, max, changed);
+}
+
+bool SerialConsole::add_param(const char *name, uint16_t *value, uint32_t min, uint32_t max, void (*changed)()) {
+  return add(name, value, 2, min, max, changed);
+}
+
+bool SerialConsole::add_param(const char *name, uint32_t *value, uint32_t min, uint32_t max, void (*changed)()) {
+  return add(name, value, 4, min, max, changed);
+}
+
+// Only for non-negative values, stored as 4 bytes
+bool SerialConsole::add_param(const char *name, int *value, uint32_t min, uint32_t max, void (*changed)()) {
+  return add(name, value, sizeof(int), min, max, changed);
+}
+
+bool SerialConsole::add_counter(const char *name, const uint32_t *value) {
+  if (num_counters >= CONSOLE_MAX_COUNTERS) {
+    dropped++;
+    return false;
+  }
+  counters[num_counters].name = name;
+  counters[num_counters].value = value;
+  num_counters++;
+  return true;
+}
+
+bool SerialConsole::add_command(const char *name, bool (*run)(Print *out, uint16_t part)) {
+  if (num_commands >= CONSOLE_MAX_COMMANDS) {
+    dropped++;
+    return false;
+  }
+  extra_commands[num_commands].name = name;
+  extra_commands[num_commands].run = run;
+  num_commands++;
+  return true;
+}
+
+void SerialConsole::begin(void) {
+  names_hash = hash_names();
+  load();
+  if (dropped > 0) {
+    stream->print("console: ");
+    stream->print((unsigned long) dropped);
+    stream->println(" entries dropped, raise CONSOLE_MAX_PARAMS, _COUNTERS or _COMMANDS");
+  }
+}
+
+uint32_t SerialConsole::get_value(uint8_t index) {
+  ConsoleParam *p = &params[index];
+  switch (p->size) {
+  case 1:
+    return *(uint8_t*) p->value;
+  case 2:
+    return *(uint16_t*) p->value;
+  default:
+    return *(uint32_t*) p->value;
+  }
+}
+
+bool SerialConsole::set_value(uint8_t index, uint32_t value) {
+  ConsoleParam *p = &params[index];
+  if (value < p->min || value > p->max)
+    return false;
+  switch (p->size) {
+  case 1:
+    *(uint8_t*) p->value = value;
+    break;
+  case 2:
+    *(uint16_t*) p->value = value;
+    break;
+  default:
+    *(uint32_t*) p->value = value;
+    break;
+  }
+  if (p->changed)
+    p->changed();
+  return true;
+}
+
+int16_t SerialConsole::find_param(const char *name) {
+  for (uint8_t i=0; i<num_params; i++) {
+    if (strcmp(params[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+uint8_t SerialConsole::crc8_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i=0; i<8; i++)
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  return crc;
+}
+
+// --- EEPROM ------------------------------------------------------------------
+
+uint16_t SerialConsole::save_size(void) {
+  return CONSOLE_EEPROM_HEADER + num_params*4 + 1;
+}
+
+// Image bytes other than the trailing crc
+uint8_t SerialConsole::save_byte(uint16_t offset) {
+  if (offset < 4)
+    return (uint32_t) CONSOLE_EEPROM_MAGIC >> (offset*8);
+  if (offset == 4)
+    return num_params;
+  if (offset < CONSOLE_EEPROM_HEADER)
+    return names_hash >> ((offset-5)*8);
+  offset -= CONSOLE_EEPROM_HEADER;
+  return get_value(offset/4) >> ((offset%4)*8);
+}
+
+// FNV-1a over the names in registration order, each ending in its 0
+uint32_t SerialConsole::hash_names(void) {
+  uint32_t hash = 2166136261UL;
+  for (uint8_t i=0; i<num_params; i++) {
+    const char *c = params[i].name;
+    do {
+      hash = (hash ^ (uint8_t) *c) * 16777619UL;
+    } while (*c++);
+  }
+  return hash;
+}
+
+bool SerialConsole::start_save(void) {
+  if (CONSOLE_EEPROM_ADDRESS + save_size() > EEPROM.length())
+    return false;
+  // a save already running starts over with the current values
+  save_running = true;
+  save_cursor = 0;
+  return true;
+}
+
+void SerialConsole::save_step(void) {
+  uint16_t last = save_size() - 1;
+
+  for (uint8_t n=0; n<CONSOLE_EEPROM_BYTES_PER_POLL && save_running; n++) {
+    if (save_cursor == 0)
+      save_crc = 0;
+    if (save_cursor < last) {
+      uint8_t b = save_byte(save_cursor);
+      save_crc = crc8_update(save_crc, b);
+      EEPROM.update(CONSOLE_EEPROM_ADDRESS + save_cursor, b);
+      save_cursor++;
+    }
+    else {
+      EEPROM.update(CONSOLE_EEPROM_ADDRESS + last, save_crc);
+      save_running = false;
+    }
+  }
+}
+
+bool SerialConsole::load(void) {
+  uint16_t addr = CONSOLE_EEPROM_ADDRESS;
+  uint16_t last = save_size() - 1;
+  uint8_t crc = 0;
+  uint16_t i;
+
+  if (CONSOLE_EEPROM_ADDRESS + save_size() > EEPROM.length())
+    return false;
+
+  for (i=0; i<last; i++) {
+    uint8_t b = EEPROM.read(addr + i);
+    if (i < CONSOLE_EEPROM_HEADER && b != save_byte(i))
+      return false;
+    crc = crc8_update(crc, b);
+  }
+  if (crc != EEPROM.read(addr + last))
+    return false;
+
+  // out of range values (limits changed since the save) keep their defaults
+  for (i=0; i<num_params; i++) {
+    uint16_t v = addr + CONSOLE_EEPROM_HEADER + i*4;
+    uint32_t value = EEPROM.read(v) | (EEPROM.read(v+1) << 8) |
+      ((uint32_t) EEPROM.read(v+2) << 16) | ((uint32_t) EEPROM.read(v+3) << 24);
+    set_value(i, value);
+  }
+  return true;
+}
+
+// --- Parsing -----------------------------------------------------------------
+
+void SerialConsole::poll(void) {
+  if (save_running)
+    save_step();
+
+  // finish a listing before taking more input, a part at a time as the port
+  // has room
+  if (listing) {
+    if (stream->availableForWrite() >= CONSOLE_OUTPUT_ROOM)
+      list_step();
+    return;
+  }
+
+  for (uint8_t n=0; n<CONSOLE_BYTES_PER_POLL && stream->available() > 0; n++) {
+    uint8_t b = stream->read();
+    bytes_read++;
+
+    if (frame_length > 0) {
+      frame[frame_length++] = b;
+      if (frame_length == sizeof(frame)) {
+        run_frame();
+        frame_length = 0;
+      }
+      continue;
+    }
+
+    if (b == '\r' || b == '\n') {
+      if (line_overflow) {
+        overflows++;
+        errors++;
+        stream->println("error: line too long");
+      }
+      else if (line_length > 0) {
+        line[line_length] = '\0';
+        run_line();
+      }
+      line_length = 0;
+      line_overflow = false;
+      // a listing goes out one line per poll
+      if (listing)
+        return;
+    }
+    else if (b == CONSOLE_BINARY_SYNC && line_length == 0 && !line_overflow) {
+      frame[0] = b;
+      frame_length = 1;
+    }
+    else if (line_length < CONSOLE_LINE_MAX-1) {
+      line[line_length++] = b;
+    }
+    else {
+      line_overflow = true;
+    }
+  }
+}
+
+bool SerialConsole::listing_in_progress(void) {
+  return listing != 0;
+}
+
+void SerialConsole::list_step(void) {
+  if (listing == 'x') {
+    if (!extra_commands[listing_command].run(stream, listing_index++))
+      listing = 0;
+  }
+  else if (listing == 'p' && listing_index < num_params) {
+    ConsoleParam *p = &params[listing_index];
+    stream->print(p->name);
+    stream->print(' ');
+    stream->print((unsigned long) get_value(listing_index));
+    stream->print(' ');
+    stream->print((unsigned long) p->min);
+    stream->print("..");
+    stream->println((unsigned long) p->max);
+    listing_index++;
+  }
+  else if (listing == 'c' && listing_index < num_counters) {
+    stream->print(counters[listing_index].name);
+    stream->print(' ');
+    stream->println((unsigned long) *counters[listing_index].value);
+    listing_index++;
+  }
+  else if (listing == 'h' && listing_index < sizeof(builtin_commands)/sizeof(builtin_commands[0]) + num_commands) {
+    if (listing_index < sizeof(builtin_commands)/sizeof(builtin_commands[0]))
+      stream->println(builtin_commands[listing_index]);
+    else
+      stream->println(extra_commands[listing_index - sizeof(builtin_commands)/sizeof(builtin_commands[0])].name);
+    listing_index++;
+  }
+  else {
+    listing = 0;
+  }
+}
+
+void SerialConsole::run_line(void) {
+  char *command = strtok(line, " \t");
+  char *name = strtok(NULL, " \t");
+  char *value = strtok(NULL, " \t");
+  int16_t index = -1;
+
+  if (command == NULL)
+    return;
+  commands++;
+
+  if (name != NULL)
+    index = find_param(name);
+
+  if (strcmp(command, "list") == 0 || strcmp(command, "counters") == 0 ||
+      strcmp(command, "help") == 0) {
+    listing = command[0] == 'l' ? 'p' : command[0];
+    listing_index = 0;
+  }
+  else if (strcmp(command, "get") == 0 && index >= 0) {
+    stream->print(params[index].name);
+    stream->print(' ');
+    stream->println((unsigned long) get_value(index));
+  }
+  else if (strcmp(command, "set") == 0 && index >= 0 && value != NULL) {
+    char *end;
+    uint32_t v = strtoul(value, &end, 0);
+    if (*end == '\0' && set_value(index, v)) {
+      stream->println("ok");
+    }
+    else {
+      errors++;
+      stream->print("error: ");
+      stream->print(params[index].name);
+      stream->print(" is ");
+      stream->print((unsigned long) params[index].min);
+      stream->print("..");
+      stream->println((unsigned long) params[index].max);
+    }
+  }
+  else if ((strcmp(command, "get") == 0 || strcmp(command, "set") == 0) && name != NULL) {
+    errors++;
+    stream->println("error: unknown parameter");
+  }
+  else if (strcmp(command, "save") == 0) {
+    if (start_save()) {
+      stream->println("ok");
+    }
+    else {
+      errors++;
+      stream->println("error: no room in EEPROM");
+    }
+  }
+  else if (strcmp(command, "load") == 0) {
+    if (load()) {
+      stream->println("ok");
+    }
+    else {
+      errors++;
+      stream->println("error: nothing saved");
+    }
+  }
+  else if (strcmp(command, "reset") == 0) {
+    for (uint8_t i=0; i<num_params; i++)
+      set_value(i, params[i].default_value);
+    stream->println("ok");
+  }
+  else {
+    for (uint8_t i=0; i<num_commands; i++) {
+      if (strcmp(command, extra_commands[i].name) == 0) {
+        listing = 'x';
+        listing_command = i;
+        listing_index = 0;
+        return;
+      }
+    }
+    errors++;
+    stream->println("error: unknown command, try help");
+  }
+}
+
+void SerialConsole::send_frame(uint8_t cmd, uint8_t index, uint32_t value) {
+  uint8_t out[8];
+  uint8_t crc = 0;
+
+  out[0] = CONSOLE_BINARY_SYNC;
+  out[1] = cmd;
+  out[2] = index;
+  for (uint8_t i=0; i<4; i++)
+    out[3+i] = value >> (i*8);
+  for (uint8_t i=1; i<7; i++)
+    crc = crc8_update(crc, out[i]);
+  out[7] = crc;
+  stream->write(out, sizeof(out));
+}
+
+void SerialConsole::run_frame(void) {
+  uint8_t cmd = frame[1];
+  uint8_t index = frame[2];
+  uint32_t value = frame[3] | (frame[4] << 8) | ((uint32_t) frame[5] << 16) | ((uint32_t) frame[6] << 24);
+  uint8_t crc = 0;
+
+  for (uint8_t i=1; i<7; i++)
+    crc = crc8_update(crc, frame[i]);
+  commands++;
+
+  if (crc != frame[7]) {
+    errors++;
+    send_frame('E', index, CONSOLE_ERROR_CRC);
+    return;
+  }
+
+  switch (cmd) {
+  case 'G':
+  case 'S':
+    if (index >= num_params) {
+      errors++;
+      send_frame('E', index, CONSOLE_ERROR_INDEX);
+    }
+    else if (cmd == 'S' && !set_value(index, value)) {
+      errors++;
+      send_frame('E', index, CONSOLE_ERROR_RANGE);
+    }
+    else {
+      send_frame(cmd, index, get_value(index));
+    }
+    break;
+  case 'C':
+    if (index >= num_counters) {
+      errors++;
+      send_frame('E', index, CONSOLE_ERROR_INDEX);
+    }
+    else {
+      send_frame(cmd, index, *counters[index].value);
+    }
+    break;
+  case 'W':
+  case 'L':
+    if (cmd == 'W' ? start_save() : load()) {
+      send_frame(cmd, 0, 0);
+    }
+    else {
+      errors++;
+      send_frame('E', 0, CONSOLE_ERROR_EEPROM);
+    }
+    break;
+  case 'N':
+    send_frame(cmd, num_counters, num_params);
+    break;
+  default:
+    errors++;
+    send_frame('E', index, CONSOLE_ERROR_COMMAND);
+    break;
+  }
+}
@@ -0,0 +1,160 @@
+#ifndef SERIALCONSOLE_H
+#define SERIALCONSOLE_H
+
+#include <Arduino.h>
+
+// Runtime parameter console
+//
+// Gets and sets registered parameters (pointers to the firmware's own
+// variables) over a Stream, lists read-only counters, and saves parameters to
+// EEPROM. Input is parsed incrementally: poll() consumes at most
+// CONSOLE_BYTES_PER_POLL bytes and writes at most one line of a listing, so a
+// large paste can't hold up a scan. Commands added with add_command() are
+// resumable the same way: poll() asks for one part of their output at a time
+// (a line, or a chunk of a binary dump), and only while the port has a USB
+// packet's worth of room, so a long listing never blocks on a full USB buffer
+// either.
+//
+// Human mode, one command per line:
+//   list                 parameters with their limits
+//   counters             counter values
+//   get NAME             set NAME VALUE
+//   save                 load           reset (to the compiled defaults)
+//   help                 plus any commands added with add_command()
+//
+// Binary mode, a fixed 8 byte frame starting where a line would start:
+//   [SYNC] [cmd] [index] [value (4, little endian)] [crc8]
+//   crc8 (poly 0x07) covers cmd, index and value
+// cmd is 'G' get, 'S' set, 'C' counter, 'W' save, 'L' load or 'N' (value is
+// the number of parameters, index the number of counters). Every frame gets
+// a frame in reply with the same cmd, or cmd 'E' and an error code as the
+// value. Indices are in registration order, see "list".
+
+#define CONSOLE_BINARY_SYNC 0xC5
+#define CONSOLE_BYTES_PER_POLL 32
+#define CONSOLE_LINE_MAX 40
+#define CONSOLE_MAX_PARAMS 20
+#define CONSOLE_MAX_COUNTERS 24
+#define CONSOLE_MAX_COMMANDS 4
+// Free space in the port's transmit buffer before a listing writes its next
+// part, a full USB serial packet
+#define CONSOLE_OUTPUT_ROOM 64
+
+// Saved parameters: magic, count, a hash of the parameter names, values (4
+// bytes each) then a crc8. Written a few bytes per poll(), the crc rejects an
+// image torn by a reset mid-save and the hash one saved by firmware whose
+// parameters were different, even if there were as many.
+#define CONSOLE_EEPROM_ADDRESS 1024
+#define CONSOLE_EEPROM_MAGIC 0x43464732 // "CFG2"
+#define CONSOLE_EEPROM_BYTES_PER_POLL 4
+// Magic, count and name hash, before the values
+#define CONSOLE_EEPROM_HEADER 9
+
+// Binary error codes
+#define CONSOLE_ERROR_INDEX 1
+#define CONSOLE_ERROR_RANGE 2
+#define CONSOLE_ERROR_COMMAND 3
+#define CONSOLE_ERROR_CRC 4
+#define CONSOLE_ERROR_EEPROM 5
+
+struct ConsoleParam {
+  const char *name;
+  void *value;
+  uint8_t size;
+  uint32_t min;
+  uint32_t max;
+  uint32_t default_value;
+  // called after the value changes
+  void (*changed)();
+};
+
+struct ConsoleCounter {
+  const char *name;
+  const uint32_t *value;
+};
+
+// run() writes part number part of the command's output, about a line, and
+// returns true while there are more parts
+struct ConsoleCommand {
+  const char *name;
+  bool (*run)(Print *out, uint16_t part);
+};
+
+class SerialConsole {
+public:
+  SerialConsole(Stream *stream);
+
+  // Register before begin(), the current value becomes the default. Return
+  // false when the table is full and the entry was dropped.
+  bool add_param(const char *name, uint8_t *value, uint32_t min, uint32_t max, void (*changed)() = NULL);
+  bool add_param(const char *name, uint16_t *value, uint32_t min, uint32_t max, void (*changed)() = NULL);
+  bool add_param(const char *name, uint32_t *value, uint32_t min, uint32_t max, void (*changed)() = NULL);
+  bool add_param(const char *name, int *value, uint32_t min, uint32_t max, void (*changed)() = NULL);
+  bool add_counter(const char *name, const uint32_t *value);
+  bool add_command(const char *name, bool (*run)(Print *out, uint16_t part));
+
+  // Loads saved parameters if there are any, and reports any entries that
+  // were dropped
+  void begin();
+  // Call from loop()
+  void poll();
+  // True while a listing is part way out, anything else written to the port
+  // now would land in the middle of it
+  bool listing_in_progress();
+
+  uint8_t num_params;
+  uint8_t num_counters;
+
+  // Diagnostics
+  uint32_t bytes_read;
+  uint32_t commands;
+  uint32_t errors;
+  uint32_t overflows;
+  // Entries dropped because their table was full
+  uint32_t dropped;
+
+private:
+  Stream *stream;
+  ConsoleParam params[CONSOLE_MAX_PARAMS];
+  ConsoleCounter counters[CONSOLE_MAX_COUNTERS];
+  ConsoleCommand extra_commands[CONSOLE_MAX_COMMANDS];
+  uint8_t num_commands;
+
+  char line[CONSOLE_LINE_MAX];
+  uint8_t line_length;
+  bool line_overflow;
+  uint8_t frame[8];
+  uint8_t frame_length;
+
+  // listing in progress: 'p' params, 'c' counters, 'h' help, 'x' an added
+  // command (listing_command), or 0
+  char listing;
+  uint16_t listing_index;
+  uint8_t listing_command;
+
+  bool save_running;
+  uint16_t save_cursor;
+  uint8_t save_crc;
+  // of the parameter names, set by begin()
+  uint32_t names_hash;
+
+  bool add(const char *name, void *value, uint8_t size, uint32_t min, uint32_t max, void (*changed)());
+  uint32_t get_value(uint8_t index);
+  bool set_value(uint8_t index, uint32_t value);
+  int16_t find_param(const char *name);
+  bool start_save();
+  void save_step();
+  bool load();
+  uint16_t save_size();
+  uint8_t save_byte(uint16_t offset);
+  uint32_t hash_names();
+
+  void run_line();
+  void run_frame();
+  void send_frame(uint8_t cmd, uint8_t index, uint32_t value);
+  void list_step();
+
+  static uint8_t crc8_update(uint8_t crc, uint8_t data);
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "ShiftRegisterLines.h"
+
+ShiftRegisterLines::ShiftRegisterLines(uint8_t latch, uint32_t clock) {
+  latch_pin = latch;
+  spi_clock = clock;
+  num_strobe_lines = 0;
+  num_sense_lines = 0;
+  burst_bytes = 1;
+  sense_mask = 0;
+}
+
+void ShiftRegisterLines::begin(uint8_t num_strobe, uint8_t num_sense) {
+  num_strobe_lines = num_strobe;
+  num_sense_lines = num_sense;
+  uint8_t strobe_bytes = (num_strobe_lines + 7) / 8;
+  uint8_t sense_bytes = (num_sense_lines + 7) / 8;
+  burst_bytes = strobe_bytes > sense_bytes ? strobe_bytes : sense_bytes;
+  if (burst_bytes > SHIFT_REGISTER_MAX_BYTES)
+    burst_bytes = SHIFT_REGISTER_MAX_BYTES;
+  if (burst_bytes == 0)
+    burst_bytes = 1;
+  sense_mask = num_sense_lines >= 32 ? 0xFFFFFFFF : (1UL << num_sense_lines) - 1;
+
+  pinMode(latch_pin, OUTPUT);
+  digitalWrite(latch_pin, HIGH);
+  SPI.begin();
+
+  // every strobe line inactive, then line 0 waiting in the 595s for the first
+  // scan's first pulse (scan() and probe() leave it there too)
+  SPI.beginTransaction(SPISettings(spi_clock, MSBFIRST, SPI_MODE0));
+  transfer(0);
+  pulse_latch();
+  transfer(1);
+  SPI.endTransaction();
+}
+
+void ShiftRegisterLines::pulse_latch(void) {
+  digitalWrite(latch_pin, LOW);
+  digitalWrite(latch_pin, HIGH);
+}
+
+uint32_t ShiftRegisterLines::transfer(uint32_t strobe_bits) {
+  uint8_t out[SHIFT_REGISTER_MAX_BYTES];
+  uint8_t in[SHIFT_REGISTER_MAX_BYTES];
+  uint32_t sense_bits = 0;
+  uint8_t b;
+
+  // the last byte out ends up in the first 595, active lines are driven low
+  for (b=0; b<burst_bytes; b++)
+    out[burst_bytes-1-b] = ~(strobe_bits >> (b*8));
+  SPI.transfer(out, in, burst_bytes);
+
+  // the first byte in is from the first 165
+  for (b=0; b<burst_bytes && b<4; b++)
+    sense_bits |= (uint32_t) in[b] << (b*8);
+  return ~sense_bits & sense_mask;
+}
+
+void ShiftRegisterLines::scan(uint32_t *active, uint32_t *sample_micros) {
+  SPI.beginTransaction(SPISettings(spi_clock, MSBFIRST, SPI_MODE0));
+  for (uint8_t step=0; step<=num_strobe_lines; step++) {
+    // sample the sense lines for the line before this one and activate this
+    // one (none after the last)
+    pulse_latch();
+    if (step > 0)
+      sample_micros[step-1] = micros();
+
+    // the line after next, nothing after the last, and line 0 again ready for
+    // the next scan
+    uint32_t next;
+    if (step+1 < num_strobe_lines)
+      next = 1UL << (step+1);
+    else if (step+1 == num_strobe_lines)
+      next = 0;
+    else
+      next = 1;
+
+    uint32_t sense_bits = transfer(next);
+    if (step > 0)
+      active[step-1] = sense_bits;
+  }
+  SPI.endTransaction();
+}
+
+uint32_t ShiftRegisterLines::probe(void) {
+  uint32_t all = num_strobe_lines >= 32 ? 0xFFFFFFFF : (1UL << num_strobe_lines) - 1;
+  uint32_t sense_bits;
+
+  SPI.beginTransaction(SPISettings(spi_clock, MSBFIRST, SPI_MODE0));
+  // replaces line 0 waiting in the 595s
+  transfer(all);
+  pulse_latch();
+  transfer(0);
+  // sample with every line active, then none
+  pulse_latch();
+  sense_bits = transfer(1);
+  SPI.endTransaction();
+  return sense_bits;
+}
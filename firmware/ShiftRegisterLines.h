@@ -0,0 +1,62 @@
+#ifndef SHIFTREGISTERLINES_H
+#define SHIFTREGISTERLINES_H
+
+#include <Arduino.h>
+#include <SPI.h>
+#include "MatrixLineDriver.h"
+
+// Matrix lines on shift registers over SPI
+//
+// Strobe lines are the outputs of a chain of 74HC595s (MOSI into the first
+// one's SER), sense lines the inputs of a chain of 74HC165s (the first one's
+// QH to MISO) with a pullup on each input. Both chains share SCK and one latch
+// pin, wired to the 595s' RCLK and the 165s' SH/LD:
+//
+//   latch low   the 165s load the sense lines
+//   latch high  the 595s latch what was shifted into them
+//
+// so a single pulse samples the sense lines for the strobe line that is active
+// and then moves on to the next one. The SPI transfer that follows reads that
+// sample out of the 165s while shifting the strobe pattern after next into the
+// 595s. A scan is one pulse and one burst of max(595s, 165s) bytes per strobe
+// line, plus one to read the last line, all in one SPI transaction. The sense
+// lines get the whole previous burst to settle after a strobe changes.
+//
+// Each burst is a blocking buffer transfer. It is a few bytes, less than a DMA
+// transfer takes to set up, and the next latch pulse has to wait for it anyway.
+//
+// Line n is output/input n%8 (QA..QH, A..H) of the n/8th register counting
+// from the Teensy. Inactive strobe lines are driven high, so the matrix needs
+// its diodes. Up to SHIFT_REGISTER_MAX_BYTES registers per chain.
+//
+// The registers need the SPI bus to themselves: an asynchronous transfer (the
+// display's) would be cut into by the scan.
+
+#define SHIFT_REGISTER_SPI_CLOCK 8000000
+#define SHIFT_REGISTER_MAX_BYTES 4
+
+class ShiftRegisterLines : public MatrixLineDriver {
+public:
+  ShiftRegisterLines(uint8_t latch_pin, uint32_t spi_clock = SHIFT_REGISTER_SPI_CLOCK);
+
+  uint8_t latch_pin;
+  uint32_t spi_clock;
+
+  void begin(uint8_t num_strobe_lines, uint8_t num_sense_lines);
+  void scan(uint32_t *active, uint32_t *sample_micros);
+  uint32_t probe();
+
+private:
+  uint8_t num_strobe_lines;
+  uint8_t num_sense_lines;
+  // bytes per burst, the longer of the two chains
+  uint8_t burst_bytes;
+  uint32_t sense_mask;
+
+  void pulse_latch();
+  // Shift strobe_bits (1 = active) into the 595s and return the sense lines
+  // the 165s loaded on the last pulse (1 = pulled low)
+  uint32_t transfer(uint32_t strobe_bits);
+};
+
+#endif
@@ -0,0 +1,242 @@
+#include "SplitLink.h"
+
+// rx_state values
+#define RX_WAIT_SYNC 0
+#define RX_HEADER 1
+#define RX_SEQ 2
+#define RX_PAYLOAD 3
+#define RX_CRC 4
+
+SplitLink::SplitLink(Stream *link_port, uint8_t numrows) {
+  port = link_port;
+  num_rows = numrows > SPLIT_MAX_ROWS ? SPLIT_MAX_ROWS : numrows;
+}
+
+void SplitLink::begin(void) {
+  for (uint8_t i=0; i<SPLIT_MAX_ROWS; i++) {
+    rows[i] = 0xFFFF;
+    sent_rows[i] = 0xFFFF;
+  }
+  connected = false;
+  frames_received = 0;
+  crc_errors = 0;
+  sequence_errors = 0;
+  resyncs = 0;
+
+  last_keyframe_micros = micros();
+  keyframe_requested = true;
+  tx_seq = 0;
+
+  rx_state = RX_WAIT_SYNC;
+  expected_seq = 0;
+  synced = false;
+  last_frame_micros = micros();
+  last_request_micros = micros();
+}
+
+uint8_t SplitLink::crc8_update(uint8_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i=0; i<8; i++)
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  return crc;
+}
+
+void SplitLink::send_frame(uint8_t type, const uint8_t *payload, uint8_t length) {
+  uint8_t header = (type << 6) | length;
+  uint8_t crc = 0;
+
+  crc = crc8_update(crc, header);
+  crc = crc8_update(crc, tx_seq);
+  for (uint8_t i=0; i<length; i++)
+    crc = crc8_update(crc, payload[i]);
+
+  port->write((uint8_t) SPLIT_SYNC);
+  port->write(header);
+  port->write(tx_seq);
+  port->write(payload, length);
+  port->write(crc);
+
+  tx_seq++;
+}
+
+void SplitLink::send_keyframe(const uint16_t *current_rows) {
+  uint8_t payload[SPLIT_MAX_ROWS*2];
+
+  for (uint8_t r=0; r<num_rows; r++) {
+    payload[r*2] = current_rows[r] & 0xFF;
+    payload[r*2+1] = current_rows[r] >> 8;
+    sent_rows[r] = current_rows[r];
+  }
+  send_frame(SPLIT_FRAME_KEYFRAME, payload, num_rows*2);
+
+  last_keyframe_micros = micros();
+  keyframe_requested = false;
+}
+
+void SplitLink::send_rows(const uint16_t *current_rows) {
+  uint8_t payload[SPLIT_MAX_PAYLOAD];
+  uint8_t length = 0;
+  uint16_t changed;
+
+  if (keyframe_requested ||
+      micros() - last_keyframe_micros > SPLIT_KEYFRAME_INTERVAL) {
+    send_keyframe(current_rows);
+    return;
+  }
+
+  for (uint8_t r=0; r<num_rows; r++) {
+    changed = current_rows[r] ^ sent_rows[r];
+    if (changed) {
+      payload[length++] = r;
+      payload[length++] = changed & 0xFF;
+      payload[length++] = changed >> 8;
+      sent_rows[r] = current_rows[r];
+    }
+  }
+
+  if (length > 0)
+    send_frame(SPLIT_FRAME_DELTA, payload, length);
+}
+
+// Release every remote key, returns true if any was held
+bool SplitLink::release_rows(void) {
+  bool changed = false;
+
+  for (uint8_t r=0; r<num_rows; r++) {
+    if (rows[r] != 0xFFFF) {
+      rows[r] = 0xFFFF;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Ask the secondary for a keyframe
+void SplitLink::request_keyframe(void) {
+  send_frame(SPLIT_FRAME_RESYNC, NULL, 0);
+  last_request_micros = micros();
+}
+
+// Forget the remote state until the next keyframe and ask for one. The rows
+// are released rather than left as they were, a missed delta could have been
+// the release of a held key. Returns true if rows changed.
+bool SplitLink::lose_sync(void) {
+  synced = false;
+  resyncs++;
+  request_keyframe();
+  return release_rows();
+}
+
+// Apply a frame that passed its CRC check, returns true if rows changed
+bool SplitLink::handle_frame(void) {
+  uint8_t type = rx_header >> 6;
+  bool changed = false;
+
+  frames_received++;
+  last_frame_micros = micros();
+
+  if (type == SPLIT_FRAME_RESYNC) {
+    keyframe_requested = true;
+    return false;
+  }
+
+  if (type == SPLIT_FRAME_KEYFRAME) {
+    if (rx_length != num_rows*2)
+      return lose_sync();
+    for (uint8_t r=0; r<num_rows; r++) {
+      uint16_t row = rx_payload[r*2] | (rx_payload[r*2+1] << 8);
+      if (row != rows[r]) {
+        rows[r] = row;
+        changed = true;
+      }
+    }
+    synced = true;
+    connected = true;
+    expected_seq = rx_seq + 1;
+    return changed;
+  }
+
+  if (type == SPLIT_FRAME_DELTA) {
+    // deltas only make sense on top of the exact previous frame. Ask again,
+    // the last request or the keyframe sent for it may have been lost.
+    if (!synced) {
+      request_keyframe();
+      return false;
+    }
+    if (rx_seq != expected_seq || rx_length % 3 != 0) {
+      sequence_errors++;
+      return lose_sync();
+    }
+    expected_seq = rx_seq + 1;
+    for (uint8_t i=0; i<rx_length; i+=3) {
+      uint8_t r = rx_payload[i];
+      if (r < num_rows) {
+        rows[r] ^= rx_payload[i+1] | (rx_payload[i+2] << 8);
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  return false;
+}
+
+bool SplitLink::poll(void) {
+  bool changed = false;
+  uint8_t b;
+
+  for (uint8_t n=0; n<SPLIT_MAX_BYTES_PER_POLL && port->available() > 0; n++) {
+    b = port->read();
+
+    switch (rx_state) {
+    case RX_WAIT_SYNC:
+      if (b == SPLIT_SYNC)
+        rx_state = RX_HEADER;
+      break;
+    case RX_HEADER:
+      rx_header = b;
+      rx_length = b & 0x3F;
+      rx_crc = crc8_update(0, b);
+      rx_state = (rx_length > SPLIT_MAX_PAYLOAD) ? RX_WAIT_SYNC : RX_SEQ;
+      break;
+    case RX_SEQ:
+      rx_seq = b;
+      rx_crc = crc8_update(rx_crc, b);
+      rx_index = 0;
+      rx_state = (rx_length > 0) ? RX_PAYLOAD : RX_CRC;
+      break;
+    case RX_PAYLOAD:
+      rx_payload[rx_index++] = b;
+      rx_crc = crc8_update(rx_crc, b);
+      if (rx_index == rx_length)
+        rx_state = RX_CRC;
+      break;
+    case RX_CRC:
+      rx_state = RX_WAIT_SYNC;
+      if (b == rx_crc) {
+        changed |= handle_frame();
+      }
+      else {
+        crc_errors++;
+        // only the primary ever connects, the secondary has nothing to ask for
+        if (synced)
+          changed |= lose_sync();
+        else if (connected)
+          request_keyframe();
+      }
+      break;
+    }
+  }
+
+  if (connected && !synced && micros() - last_request_micros > SPLIT_RESYNC_RETRY)
+    request_keyframe();
+
+  // release all remote keys if the other half went quiet
+  if (connected && micros() - last_frame_micros > SPLIT_LINK_TIMEOUT) {
+    connected = false;
+    synced = false;
+    changed |= release_rows();
+  }
+
+  return changed;
+}
@@ -0,0 +1,100 @@
+#ifndef SPLITLINK_H
+#define SPLITLINK_H
+
+#include <Arduino.h>
+
+// Split keyboard link
+//
+// The secondary half scans its own matrix and streams raw row words to the
+// primary over a UART. Only rows that changed since the last frame are sent,
+// XOR-encoded against the previous value, so every delta frame depends on the
+// one before it. The primary checks the CRC and sequence number of each frame
+// and on any gap releases the remote keys and asks for a keyframe, asking
+// again for every frame it can't use until one arrives.
+//
+// Frame layout:
+//   [SYNC] [type << 6 | payload length] [seq] [payload ...] [crc8]
+//   crc8 (poly 0x07) covers everything after SYNC
+//
+// Payloads:
+//   DELTA     [row, xor lo, xor hi] per changed row
+//   KEYFRAME  [lo, hi] for every row, starting at row 0
+//   RESYNC    empty, sent primary -> secondary to request a keyframe
+
+#define SPLIT_BAUD 460800
+
+#define SPLIT_SYNC 0xA5
+#define SPLIT_FRAME_DELTA 0
+#define SPLIT_FRAME_KEYFRAME 1
+#define SPLIT_FRAME_RESYNC 2
+
+#define SPLIT_MAX_ROWS 8
+#define SPLIT_MAX_PAYLOAD (SPLIT_MAX_ROWS*3)
+
+// The secondary sends a keyframe at least this often, it doubles as a heartbeat
+//   Units are in Microseconds
+#define SPLIT_KEYFRAME_INTERVAL 100000
+// The primary asks again if the keyframe it asked for hasn't come this soon,
+// the request or the keyframe may have been lost
+#define SPLIT_RESYNC_RETRY 2000
+// The primary releases all remote keys if nothing valid arrives for this long
+#define SPLIT_LINK_TIMEOUT 250000
+// Upper bound on bytes parsed per poll() so a burst never stalls the scan
+#define SPLIT_MAX_BYTES_PER_POLL 64
+
+class SplitLink {
+public:
+  SplitLink(Stream *port, uint8_t num_rows);
+
+  uint8_t num_rows;
+
+  // Remote row words as last received, all released (0xFFFF) when the link is
+  // down or out of sync
+  uint16_t rows[SPLIT_MAX_ROWS];
+  bool connected;
+
+  // Link diagnostics
+  uint32_t frames_received;
+  uint32_t crc_errors;
+  uint32_t sequence_errors;
+  uint32_t resyncs;
+
+  void begin();
+
+  // Secondary: send rows that differ from the last transmitted state
+  void send_rows(const uint16_t *current_rows);
+  // Both: parse any pending input, returns true if the remote rows changed
+  bool poll();
+
+private:
+  Stream *port;
+
+  // secondary state
+  uint16_t sent_rows[SPLIT_MAX_ROWS];
+  uint32_t last_keyframe_micros;
+  bool keyframe_requested;
+  uint8_t tx_seq;
+
+  // primary state
+  uint8_t rx_state;
+  uint8_t rx_header;
+  uint8_t rx_seq;
+  uint8_t rx_length;
+  uint8_t rx_index;
+  uint8_t rx_crc;
+  uint8_t rx_payload[SPLIT_MAX_PAYLOAD];
+  uint8_t expected_seq;
+  bool synced;
+  uint32_t last_frame_micros;
+  uint32_t last_request_micros;
+
+  void send_frame(uint8_t type, const uint8_t *payload, uint8_t length);
+  void send_keyframe(const uint16_t *current_rows);
+  bool handle_frame();
+  void request_keyframe();
+  bool lose_sync();
+  bool release_rows();
+  static uint8_t crc8_update(uint8_t crc, uint8_t data);
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "StenoEngine.h"
+
+// TX Bolt group and bit for each key, by STENO_ code - 1, 0 for none
+static const uint8_t tx_bolt_bits[STENO_NUM_KEYS] = {
+  0,                                  // Fn
+  0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, // #1-#6
+  0x01, 0x01,                         // S1- S2-
+  0x02, 0x04, 0x08, 0x10, 0x20,       // T- K- P- W- H-
+  0x41, 0x42, 0x44,                   // R- A- O-
+  0x48, 0x48,                         // *1 *2
+  0, 0, 0,                            // res1 res2 pwr
+  0x48, 0x48,                         // *3 *4
+  0x50, 0x60,                         // -E -U
+  0x81, 0x82, 0x84, 0x88, 0x90, 0xA0, // -F -R -P -B -L -G
+  0xC1, 0xC2, 0xC4,                   // -T -S -D
+  0xD0, 0xD0, 0xD0, 0xD0, 0xD0, 0xD0, // #7-#C
+  0xC8,                               // -Z
+};
+
+StenoEngine::StenoEngine(uint8_t rows, uint8_t cols, const uint8_t *map, uint8_t steno_protocol) {
+  num_rows = rows < STENO_MAX_ROWS ? rows : STENO_MAX_ROWS;
+  num_cols = cols;
+  key_map = map;
+  protocol = steno_protocol;
+  strokes = 0;
+  dropped_strokes = 0;
+  last_stroke = 0;
+  in_stroke = false;
+  head = 0;
+  tail = 0;
+  used = 0;
+
+  for (uint8_t r=0; r<num_rows; r++) {
+    row_masks[r] = 0;
+    stroke_rows[r] = 0;
+    for (uint8_t c=0; c<num_cols && c<16; c++) {
+      if (key_map[r*num_cols + c] != 0)
+        row_masks[r] |= 1 << c;
+    }
+  }
+}
+
+bool StenoEngine::steno_key(uint8_t row, uint8_t col) {
+  return row < num_rows && (row_masks[row] & (1 << col));
+}
+
+bool StenoEngine::update(const uint16_t *matrix_state) {
+  uint16_t held = 0;
+
+  // matrix_state is active low
+  for (uint8_t r=0; r<num_rows; r++) {
+    uint16_t pressed = ~matrix_state[r] & row_masks[r];
+    stroke_rows[r] |= pressed;
+    held |= pressed;
+  }
+  if (held != 0) {
+    in_stroke = true;
+    return false;
+  }
+  if (!in_stroke)
+    return false;
+
+  // The last key of the stroke is up
+  uint8_t packet[STENO_GEMINI_PR_PACKET_SIZE];
+  uint8_t length;
+
+  in_stroke = false;
+  last_stroke = stroke_keys();
+  strokes++;
+  if (protocol == STENO_TX_BOLT)
+    length = tx_bolt_packet(last_stroke, packet);
+  else
+    length = gemini_pr_packet(last_stroke, packet);
+  if (length > 0)
+    queue(packet, length);
+  return true;
+}
+
+steno_stroke StenoEngine::stroke_keys() {
+  steno_stroke keys = 0;
+
+  for (uint8_t r=0; r<num_rows; r++) {
+    uint16_t bits = stroke_rows[r];
+    stroke_rows[r] = 0;
+    for (uint8_t c=0; bits != 0; c++, bits >>= 1) {
+      if (bits & 1)
+        keys |= STENO_BIT(key_map[r*num_cols + c]);
+    }
+  }
+  return keys;
+}
+
+uint8_t StenoEngine::gemini_pr_packet(steno_stroke keys, uint8_t *packet) {
+  for (uint8_t i=0; i<STENO_GEMINI_PR_PACKET_SIZE; i++)
+    packet[i] = 0;
+  packet[0] = 0x80;
+  for (uint8_t k=0; k<STENO_NUM_KEYS; k++) {
+    if (keys & ((steno_stroke) 1 << k))
+      packet[k / 7] |= 0x40 >> (k % 7);
+  }
+  return STENO_GEMINI_PR_PACKET_SIZE;
+}
+
+uint8_t StenoEngine::tx_bolt_packet(steno_stroke keys, uint8_t *packet) {
+  uint8_t groups[4] = {0, 0, 0, 0};
+  uint8_t length = 0;
+
+  for (uint8_t k=0; k<STENO_NUM_KEYS; k++) {
+    if ((keys & ((steno_stroke) 1 << k)) && tx_bolt_bits[k] != 0)
+      groups[tx_bolt_bits[k] >> 6] |= tx_bolt_bits[k];
+  }
+  for (uint8_t g=0; g<4; g++) {
+    // only groups with a key held are sent
+    if ((groups[g] & 0x3F) != 0)
+      packet[length++] = groups[g];
+  }
+  if (length > 0)
+    packet[length++] = 0;
+  return length;
+}
+
+void StenoEngine::queue(const uint8_t *packet, uint8_t length) {
+  if (STENO_BUFFER_SIZE - used < length) {
+    dropped_strokes++;
+    return;
+  }
+  for (uint8_t i=0; i<length; i++) {
+    buffer[head] = packet[i];
+    head = (head + 1) % STENO_BUFFER_SIZE;
+  }
+  used += length;
+}
+
+void StenoEngine::stream_to(Stream *out, uint16_t max_bytes) {
+  uint16_t n, contiguous;
+  int space = out->availableForWrite();
+
+  if (space < max_bytes)
+    max_bytes = space > 0 ? space : 0;
+
+  while (used > 0 && max_bytes > 0) {
+    contiguous = (head > tail) ? head - tail : STENO_BUFFER_SIZE - tail;
+    n = contiguous < max_bytes ? contiguous : max_bytes;
+    out->write(buffer+tail, n);
+    tail = (tail + n) % STENO_BUFFER_SIZE;
+    used -= n;
+    max_bytes -= n;
+  }
+}
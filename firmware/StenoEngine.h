@@ -0,0 +1,97 @@
+#ifndef STENOENGINE_H
+#define STENOENGINE_H
+
+#include <Arduino.h>
+#include "LayoutCommon.h"
+
+// Steno stroke engine
+//
+// Turns chords on the steno keys (the layout's steno_key_matrix, STENO_ codes
+// from LayoutCommon.h) into strokes for a host steno engine such as Plover,
+// sent over USB serial in one of the two protocols steno machines use.
+//
+// update() follows the debounced matrix_state after every scan: each row's
+// pressed steno keys are ORed into the stroke, a few word operations per row
+// and nothing else while keys are held. The stroke ends on the first scan
+// with every steno key up, so its boundary is the debounced release of its
+// last key however fast the next stroke follows. Only then are the row bits
+// turned into steno keys and a packet queued.
+//
+// GeminiPR (6 bytes, every stroke the same size):
+//   byte 0 has bit 7 set, bytes 1-5 have it clear
+//   bits 6-0 of each byte are seven keys in STENO_ order, STENO_FN is bit 6 of
+//   byte 0 and STENO_ZR bit 0 of byte 5
+//
+// TX Bolt (2 to 5 bytes):
+//   one byte per group with a key held, in group order, then a 0 byte
+//   bits 7-6 are the group, bits 5-0 its keys:
+//     0  S- T- K- P- W- H-
+//     1  R- A- O- *  -E -U
+//     2  -F -R -P -B -L -G
+//     3  -T -S -D -Z #
+//   The host also ends a stroke when a group doesn't follow the one before,
+//   the 0 byte ends one the next stroke would otherwise run on into. Keys TX
+//   Bolt has no bit for (Fn, pwr, res) are left out, and a stroke of only
+//   those isn't sent.
+//
+// Packets are buffered and stream_to() writes out what fits in the serial
+// port's buffer, like KeyEventStreamWriter. A stroke that doesn't fit is
+// dropped and counted.
+
+#define STENO_GEMINI_PR 0
+#define STENO_TX_BOLT 1
+
+#define STENO_MAX_ROWS 16
+#define STENO_GEMINI_PR_PACKET_SIZE 6
+// Four groups and the 0 byte
+#define STENO_TX_BOLT_MAX_PACKET_SIZE 5
+#define STENO_BUFFER_SIZE 64
+
+// A stroke's keys, bit (STENO_x - 1) for each
+typedef uint64_t steno_stroke;
+
+#define STENO_BIT(key) ((steno_stroke) 1 << ((key) - 1))
+
+class StenoEngine {
+public:
+  // key_map is num_rows*num_cols STENO_ codes, indexed by row*num_cols+col
+  StenoEngine(uint8_t num_rows, uint8_t num_cols, const uint8_t *key_map, uint8_t protocol);
+
+  uint8_t protocol;
+  uint32_t strokes;
+  uint32_t dropped_strokes;
+  // Keys of the last stroke
+  steno_stroke last_stroke;
+
+  // Call after every matrix update. Returns true when a stroke ended and its
+  // packet was queued.
+  bool update(const uint16_t *matrix_state);
+  // Write out at most max_bytes of queued packets without blocking
+  void stream_to(Stream *out, uint16_t max_bytes);
+  // Whether row, col is a steno key
+  bool steno_key(uint8_t row, uint8_t col);
+
+  // A stroke's packet, returns its length (0 if there's nothing to send)
+  static uint8_t gemini_pr_packet(steno_stroke keys, uint8_t *packet);
+  static uint8_t tx_bolt_packet(steno_stroke keys, uint8_t *packet);
+
+private:
+  uint8_t num_rows;
+  uint8_t num_cols;
+  const uint8_t *key_map;
+  // Bits of the steno keys in each row
+  uint16_t row_masks[STENO_MAX_ROWS];
+  // Steno keys pressed since the stroke started, active high
+  uint16_t stroke_rows[STENO_MAX_ROWS];
+  bool in_stroke;
+
+  uint8_t buffer[STENO_BUFFER_SIZE];
+  uint8_t head;
+  uint8_t tail;
+  uint8_t used;
+
+  steno_stroke stroke_keys();
+  void queue(const uint8_t *packet, uint8_t length);
+};
+
+#endif
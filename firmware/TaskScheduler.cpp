@@ -0,0 +1,140 @@
+#include "TaskScheduler.h"
+
+Task::Task() {
+  name = NULL;
+  run = NULL;
+  priority = 0;
+  period_micros = 0;
+  budget_micros = 0;
+  deadline_micros = 0;
+}
+
+Task::Task(const char *task_name, TaskFunction function, uint8_t task_priority, uint32_t period,
+           uint32_t budget, uint32_t deadline) {
+  name = task_name;
+  run = function;
+  priority = task_priority;
+  period_micros = period;
+  budget_micros = budget;
+  deadline_micros = deadline;
+  resume_line = 0;
+  due_micros = 0;
+  runs = 0;
+  jobs = 0;
+  overruns = 0;
+  late = 0;
+  deferred = 0;
+  max_run_micros = 0;
+  max_late_micros = 0;
+}
+
+TaskScheduler::TaskScheduler() {
+  passes = 0;
+  tasks = NULL;
+  num_tasks = 0;
+}
+
+void TaskScheduler::begin(Task *task_table, uint32_t now_micros) {
+  tasks = task_table;
+  for (num_tasks=0; tasks[num_tasks].run != NULL; num_tasks++) {
+    tasks[num_tasks].resume_line = 0;
+    tasks[num_tasks].due_micros = now_micros;
+  }
+}
+
+bool TaskScheduler::due(Task *task, uint32_t now_micros) {
+  return task->period_micros == 0 || task->resume_line != 0 ||
+    (int32_t) (now_micros - task->due_micros) >= 0;
+}
+
+bool TaskScheduler::fits(uint8_t index, uint32_t now_micros) {
+  uint32_t end_micros = now_micros + tasks[index].budget_micros;
+  for (uint8_t i=0; i<index; i++) {
+    Task *above = &tasks[i];
+    if (above->priority == tasks[index].priority)
+      break;
+    // a job part way through has no deadline left to keep
+    if (above->deadline_micros == 0 || above->resume_line != 0)
+      continue;
+    if ((int32_t) (above->due_micros + above->deadline_micros - end_micros) < 0)
+      return false;
+  }
+  return true;
+}
+
+void TaskScheduler::start_job(Task *task, uint32_t now_micros) {
+  uint32_t late_micros = now_micros - task->due_micros;
+  if (task->deadline_micros != 0 && late_micros > task->deadline_micros)
+    task->late++;
+  if (late_micros > task->max_late_micros)
+    task->max_late_micros = late_micros;
+
+  if (task->period_micros == 0) {
+    task->due_micros = now_micros;
+    return;
+  }
+  // missed periods are skipped rather than run back to back
+  task->due_micros += task->period_micros;
+  if ((int32_t) (now_micros - task->due_micros) >= 0)
+    task->due_micros = now_micros + task->period_micros;
+}
+
+void TaskScheduler::run() {
+  passes++;
+  for (uint8_t i=0; i<num_tasks; i++) {
+    Task *task = &tasks[i];
+    uint32_t start_micros = micros();
+    if (!due(task, start_micros))
+      continue;
+    if (task->priority > 0 && !fits(i, start_micros)) {
+      task->deferred++;
+      continue;
+    }
+
+    if (task->resume_line == 0)
+      start_job(task, start_micros);
+    task->run(task);
+    uint32_t run_micros = micros() - start_micros;
+
+    task->runs++;
+    if (task->resume_line == 0)
+      task->jobs++;
+    if (run_micros > task->budget_micros)
+      task->overruns++;
+    if (run_micros > task->max_run_micros)
+      task->max_run_micros = run_micros;
+  }
+}
+
+bool TaskScheduler::print_part(Print *out, uint16_t part) {
+  if (part == 0) {
+    out->println("task prio period budget deadline runs jobs overruns max_run late max_late deferred");
+  }
+  else if (part <= num_tasks) {
+    Task *task = &tasks[part-1];
+    out->print(task->name);
+    out->print(' ');
+    out->print((unsigned int) task->priority);
+    out->print(' ');
+    out->print((unsigned long) task->period_micros);
+    out->print(' ');
+    out->print((unsigned long) task->budget_micros);
+    out->print(' ');
+    out->print((unsigned long) task->deadline_micros);
+    out->print(' ');
+    out->print((unsigned long) task->runs);
+    out->print(' ');
+    out->print((unsigned long) task->jobs);
+    out->print(' ');
+    out->print((unsigned long) task->overruns);
+    out->print(' ');
+    out->print((unsigned long) task->max_run_micros);
+    out->print(' ');
+    out->print((unsigned long) task->late);
+    out->print(' ');
+    out->print((unsigned long) task->max_late_micros);
+    out->print(' ');
+    out->println((unsigned long) task->deferred);
+  }
+  return part < num_tasks;
+}
@@ -0,0 +1,93 @@
+#ifndef TASKSCHEDULER_H
+#define TASKSCHEDULER_H
+
+#include <Arduino.h>
+
+// Cooperative task scheduler
+//
+// What loop() does, as a static table of tasks, each with a priority (0
+// first), a period and a budget: the longest one run should take. Every run()
+// is one pass over the table in priority order, starting each task that's due:
+//   - priority 0 tasks (the scan and HID reports) always run when due
+//   - any other task only starts if its budget ends before the latest start of
+//     every task above it, so slow work waits for a gap instead of pushing a
+//     scan past its deadline
+// A task's deadline is how late it may start after it's due. A task with no
+// period is due on every pass, and its deadline counts from its last start.
+//
+// Long jobs are stackless coroutines, protothread style. The task function
+// wraps its body in TASK_BEGIN(task) and TASK_END(task), and gives the
+// processor back with TASK_YIELD(task) or TASK_WAIT_UNTIL(task, condition).
+// The next run carries on from there as soon as its budget fits again. Locals
+// don't survive a yield, so keep a job's state in statics, and don't yield
+// from inside a switch statement. A period counts from the start of a job.
+//
+// Every run is timed: one longer than its budget counts as an overrun, and a
+// job that starts after its deadline counts as late. A start held back for a
+// task above counts as deferred. print_part() lists them all, per task.
+
+#define TASK_BEGIN(task) switch ((task)->resume_line) { case 0:
+#define TASK_YIELD(task) do { (task)->resume_line = __LINE__; return; case __LINE__:; } while (0)
+#define TASK_WAIT_UNTIL(task, condition) do { (task)->resume_line = __LINE__; case __LINE__: \
+    if (!(condition)) return; } while (0)
+#define TASK_END(task) } (task)->resume_line = 0
+
+struct Task;
+typedef void (*TaskFunction)(Task *task);
+
+struct Task {
+  // No function marks the end of a table
+  Task();
+  Task(const char *name, TaskFunction run, uint8_t priority, uint32_t period_micros,
+       uint32_t budget_micros, uint32_t deadline_micros = 0);
+
+  const char *name;
+  TaskFunction run;
+  uint8_t priority;
+  //   Units are in Microseconds
+  // 0 runs on every pass
+  uint32_t period_micros;
+  uint32_t budget_micros;
+  // 0 for none
+  uint32_t deadline_micros;
+
+  // Where a yielded job carries on, 0 between jobs
+  uint16_t resume_line;
+  // Start of the next job, or of the last one with no period
+  uint32_t due_micros;
+
+  // Diagnostics
+  uint32_t runs;
+  uint32_t jobs;
+  uint32_t overruns;
+  uint32_t late;
+  uint32_t deferred;
+  uint32_t max_run_micros;
+  uint32_t max_late_micros;
+};
+
+class TaskScheduler {
+public:
+  TaskScheduler();
+
+  uint32_t passes;
+
+  // tasks in priority order, ending with Task()
+  void begin(Task *tasks, uint32_t now_micros);
+  // One pass, call from loop()
+  void run();
+  // Part 0 of the listing is the header, part i+1 task i. Returns true while
+  // there are more.
+  bool print_part(Print *out, uint16_t part);
+
+private:
+  Task *tasks;
+  uint8_t num_tasks;
+
+  bool due(Task *task, uint32_t now_micros);
+  // Whether the task's budget ends before every task above it has to start
+  bool fits(uint8_t index, uint32_t now_micros);
+  void start_job(Task *task, uint32_t now_micros);
+};
+
+#endif
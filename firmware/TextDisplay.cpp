@@ -0,0 +1,227 @@
+#include "TextDisplay.h"
+
+// 5x7 font, ASCII 32 to 126, one byte per column with the top pixel in bit 0
+static const uint8_t font_5x7[95][5] = {
+  {0x00, 0x00, 0x00, 0x00, 0x00}, // ' '
+  {0x00, 0x00, 0x5F, 0x00, 0x00}, // !
+  {0x00, 0x07, 0x00, 0x07, 0x00}, // "
+  {0x14, 0x7F, 0x14, 0x7F, 0x14}, // #
+  {0x24, 0x2A, 0x7F, 0x2A, 0x12}, // $
+  {0x23, 0x13, 0x08, 0x64, 0x62}, // %
+  {0x36, 0x49, 0x55, 0x22, 0x50}, // &
+  {0x00, 0x05, 0x03, 0x00, 0x00}, // '
+  {0x00, 0x1C, 0x22, 0x41, 0x00}, // (
+  {0x00, 0x41, 0x22, 0x1C, 0x00}, // )
+  {0x08, 0x2A, 0x1C, 0x2A, 0x08}, // *
+  {0x08, 0x08, 0x3E, 0x08, 0x08}, // +
+  {0x00, 0x50, 0x30, 0x00, 0x00}, // ,
+  {0x08, 0x08, 0x08, 0x08, 0x08}, // -
+  {0x00, 0x60, 0x60, 0x00, 0x00}, // .
+  {0x20, 0x10, 0x08, 0x04, 0x02}, // /
+  {0x3E, 0x51, 0x49, 0x45, 0x3E}, // 0
+  {0x00, 0x42, 0x7F, 0x40, 0x00}, // 1
+  {0x42, 0x61, 0x51, 0x49, 0x46}, // 2
+  {0x21, 0x41, 0x45, 0x4B, 0x31}, // 3
+  {0x18, 0x14, 0x12, 0x7F, 0x10}, // 4
+  {0x27, 0x45, 0x45, 0x45, 0x39}, // 5
+  {0x3C, 0x4A, 0x49, 0x49, 0x30}, // 6
+  {0x01, 0x71, 0x09, 0x05, 0x03}, // 7
+  {0x36, 0x49, 0x49, 0x49, 0x36}, // 8
+  {0x06, 0x49, 0x49, 0x29, 0x1E}, // 9
+  {0x00, 0x36, 0x36, 0x00, 0x00}, // :
+  {0x00, 0x56, 0x36, 0x00, 0x00}, // ;
+  {0x08, 0x14, 0x22, 0x41, 0x00}, // <
+  {0x14, 0x14, 0x14, 0x14, 0x14}, // =
+  {0x00, 0x41, 0x22, 0x14, 0x08}, // >
+  {0x02, 0x01, 0x51, 0x09, 0x06}, // ?
+  {0x32, 0x49, 0x79, 0x41, 0x3E}, // @
+  {0x7E, 0x11, 0x11, 0x11, 0x7E}, // A
+  {0x7F, 0x49, 0x49, 0x49, 0x36}, // B
+  {0x3E, 0x41, 0x41, 0x41, 0x22}, // C
+  {0x7F, 0x41, 0x41, 0x22, 0x1C}, // D
+  {0x7F, 0x49, 0x49, 0x49, 0x41}, // E
+  {0x7F, 0x09, 0x09, 0x01, 0x01}, // F
+  {0x3E, 0x41, 0x41, 0x51, 0x32}, // G
+  {0x7F, 0x08, 0x08, 0x08, 0x7F}, // H
+  {0x00, 0x41, 0x7F, 0x41, 0x00}, // I
+  {0x20, 0x40, 0x41, 0x3F, 0x01}, // J
+  {0x7F, 0x08, 0x14, 0x22, 0x41}, // K
+  {0x7F, 0x40, 0x40, 0x40, 0x40}, // L
+  {0x7F, 0x02, 0x04, 0x02, 0x7F}, // M
+  {0x7F, 0x04, 0x08, 0x10, 0x7F}, // N
+  {0x3E, 0x41, 0x41, 0x41, 0x3E}, // O
+  {0x7F, 0x09, 0x09, 0x09, 0x06}, // P
+  {0x3E, 0x41, 0x51, 0x21, 0x5E}, // Q
+  {0x7F, 0x09, 0x19, 0x29, 0x46}, // R
+  {0x46, 0x49, 0x49, 0x49, 0x31}, // S
+  {0x01, 0x01, 0x7F, 0x01, 0x01}, // T
+  {0x3F, 0x40, 0x40, 0x40, 0x3F}, // U
+  {0x1F, 0x20, 0x40, 0x20, 0x1F}, // V
+  {0x7F, 0x20, 0x18, 0x20, 0x7F}, // W
+  {0x63, 0x14, 0x08, 0x14, 0x63}, // X
+  {0x03, 0x04, 0x78, 0x04, 0x03}, // Y
+  {0x61, 0x51, 0x49, 0x45, 0x43}, // Z
+  {0x00, 0x00, 0x7F, 0x41, 0x41}, // [
+  {0x02, 0x04, 0x08, 0x10, 0x20}, // backslash
+  {0x41, 0x41, 0x7F, 0x00, 0x00}, // ]
+  {0x04, 0x02, 0x01, 0x02, 0x04}, // ^
+  {0x40, 0x40, 0x40, 0x40, 0x40}, // _
+  {0x00, 0x01, 0x02, 0x04, 0x00}, // `
+  {0x20, 0x54, 0x54, 0x54, 0x78}, // a
+  {0x7F, 0x48, 0x44, 0x44, 0x38}, // b
+  {0x38, 0x44, 0x44, 0x44, 0x20}, // c
+  {0x38, 0x44, 0x44, 0x48, 0x7F}, // d
+  {0x38, 0x54, 0x54, 0x54, 0x18}, // e
+  {0x08, 0x7E, 0x09, 0x01, 0x02}, // f
+  {0x08, 0x14, 0x54, 0x54, 0x3C}, // g
+  {0x7F, 0x08, 0x04, 0x04, 0x78}, // h
+  {0x00, 0x44, 0x7D, 0x40, 0x00}, // i
+  {0x20, 0x40, 0x44, 0x3D, 0x00}, // j
+  {0x00, 0x7F, 0x10, 0x28, 0x44}, // k
+  {0x00, 0x41, 0x7F, 0x40, 0x00}, // l
+  {0x7C, 0x04, 0x18, 0x04, 0x78}, // m
+  {0x7C, 0x08, 0x04, 0x04, 0x78}, // n
+  {0x38, 0x44, 0x44, 0x44, 0x38}, // o
+  {0x7C, 0x14, 0x14, 0x14, 0x08}, // p
+  {0x08, 0x14, 0x14, 0x18, 0x7C}, // q
+  {0x7C, 0x08, 0x04, 0x04, 0x08}, // r
+  {0x48, 0x54, 0x54, 0x54, 0x20}, // s
+  {0x04, 0x3F, 0x44, 0x40, 0x20}, // t
+  {0x3C, 0x40, 0x40, 0x20, 0x7C}, // u
+  {0x1C, 0x20, 0x40, 0x20, 0x1C}, // v
+  {0x3C, 0x40, 0x30, 0x40, 0x3C}, // w
+  {0x44, 0x28, 0x10, 0x28, 0x44}, // x
+  {0x0C, 0x50, 0x50, 0x50, 0x3C}, // y
+  {0x44, 0x64, 0x54, 0x4C, 0x44}, // z
+  {0x00, 0x08, 0x36, 0x41, 0x00}, // {
+  {0x00, 0x00, 0x7F, 0x00, 0x00}, // |
+  {0x00, 0x41, 0x36, 0x08, 0x00}, // }
+  {0x08, 0x04, 0x08, 0x10, 0x08}, // ~
+};
+
+TextDisplay::TextDisplay(DisplayDriver *d, uint8_t numcols, uint8_t numrows) {
+  driver = d;
+  num_cols = numcols;
+  num_rows = numrows;
+  foreground = DISPLAY_WHITE;
+  background = DISPLAY_BLACK;
+  windows_drawn = 0;
+  cells_drawn = 0;
+  cursor = 0xFFFF;
+
+  uint16_t num_cells = num_cols*num_rows;
+  cells = (char*) malloc(num_cells);
+  dirty = (uint8_t*) malloc((num_cells+7)/8);
+  clear();
+}
+
+TextDisplay::~TextDisplay() {
+  free(cells);
+  free(dirty);
+}
+
+void TextDisplay::clear(void) {
+  uint16_t num_cells = num_cols*num_rows;
+  memset(cells, ' ', num_cells);
+  memset(dirty, 0xFF, (num_cells+7)/8);
+  dirty_count = num_cells;
+}
+
+bool TextDisplay::is_dirty(uint16_t cell) {
+  return dirty[cell/8] & (1 << (cell%8));
+}
+
+void TextDisplay::mark_dirty(uint16_t cell) {
+  if (cell >= num_cols*num_rows || is_dirty(cell))
+    return;
+  dirty[cell/8] |= 1 << (cell%8);
+  dirty_count++;
+}
+
+void TextDisplay::set_char(uint16_t cell, char c) {
+  if (cell >= num_cols*num_rows || cells[cell] == c)
+    return;
+  cells[cell] = c;
+  mark_dirty(cell);
+}
+
+char TextDisplay::get_char(uint16_t cell) {
+  return cell < num_cols*num_rows ? cells[cell] : ' ';
+}
+
+void TextDisplay::set_cursor(uint16_t cell) {
+  if (cell == cursor)
+    return;
+  mark_dirty(cursor);
+  cursor = cell;
+  mark_dirty(cursor);
+}
+
+bool TextDisplay::idle(void) {
+  return dirty_count == 0 && !driver->busy();
+}
+
+// Column x (0 to DISPLAY_CELL_WIDTH-1) of a glyph, the last one is spacing
+uint8_t TextDisplay::glyph_column(char c, uint8_t x) {
+  if (c < 32 || c > 126 || x >= 5)
+    return 0;
+  return font_5x7[c-32][x];
+}
+
+void TextDisplay::render_cell(uint16_t cell, uint16_t *out) {
+  char c = get_char(cell);
+  uint16_t fg = (cell == cursor) ? background : foreground;
+  uint16_t bg = (cell == cursor) ? foreground : background;
+
+  for (uint8_t y=0; y<DISPLAY_CELL_HEIGHT; y++) {
+    for (uint8_t x=0; x<DISPLAY_CELL_WIDTH; x++)
+      *out++ = (glyph_column(c, x) & (1 << y)) ? fg : bg;
+  }
+}
+
+bool TextDisplay::update(void) {
+  uint16_t num_cells = num_cols*num_rows;
+  uint16_t first;
+  uint8_t span = 0;
+
+  if (dirty_count == 0 || driver->busy())
+    return false;
+
+  // first dirty cell, then every dirty cell after it on the same row
+  for (first=0; first<num_cells && !is_dirty(first); first++)
+    ;
+  if (first >= num_cells) {
+    dirty_count = 0;
+    return false;
+  }
+  while (span < DISPLAY_MAX_SPAN_CELLS &&
+         (first % num_cols) + span < num_cols &&
+         is_dirty(first + span)) {
+    uint16_t cell = first + span;
+    dirty[cell/8] &= ~(1 << (cell%8));
+    dirty_count--;
+    span++;
+  }
+
+  // rasterize the span row by row, big endian RGB565
+  uint16_t width = span*DISPLAY_CELL_WIDTH;
+  uint16_t cell_pixels[DISPLAY_CELL_WIDTH*DISPLAY_CELL_HEIGHT];
+  for (uint8_t s=0; s<span; s++) {
+    render_cell(first + s, cell_pixels);
+    for (uint8_t y=0; y<DISPLAY_CELL_HEIGHT; y++) {
+      uint8_t *p = &pixels[(y*width + s*DISPLAY_CELL_WIDTH)*2];
+      for (uint8_t x=0; x<DISPLAY_CELL_WIDTH; x++) {
+        uint16_t color = cell_pixels[y*DISPLAY_CELL_WIDTH + x];
+        *p++ = color >> 8;
+        *p++ = color;
+      }
+    }
+  }
+
+  driver->write_window((first % num_cols)*DISPLAY_CELL_WIDTH,
+                       (first / num_cols)*DISPLAY_CELL_HEIGHT,
+                       width, DISPLAY_CELL_HEIGHT, pixels);
+  windows_drawn++;
+  cells_drawn += span;
+  return true;
+}
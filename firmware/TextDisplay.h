@@ -0,0 +1,81 @@
+#ifndef TEXTDISPLAY_H
+#define TEXTDISPLAY_H
+
+#include <Arduino.h>
+
+// Incremental text rendering
+//
+// Keeps a grid of character cells and a dirty bit per cell. Changing a cell
+// (or moving the cursor) only marks it dirty; update() draws the next run of
+// dirty cells in one row as a single window and hands it to the driver,
+// returning straight away if the driver is still sending the previous one. A
+// keystroke costs one or two glyph cells on the bus, never a full redraw.
+//
+// Glyphs are 5x7 in a DISPLAY_CELL_WIDTH x DISPLAY_CELL_HEIGHT cell, ASCII 32
+// to 126. The cursor cell is drawn inverted.
+
+#define DISPLAY_CELL_WIDTH 6
+#define DISPLAY_CELL_HEIGHT 8
+// Most cells drawn per window, sets the size of the pixel buffer
+#define DISPLAY_MAX_SPAN_CELLS 8
+#define DISPLAY_PIXEL_BUFFER_SIZE (DISPLAY_MAX_SPAN_CELLS*DISPLAY_CELL_WIDTH*DISPLAY_CELL_HEIGHT*2)
+
+// RGB565 colors
+#define DISPLAY_WHITE 0xFFFF
+#define DISPLAY_BLACK 0x0000
+
+// Anything that can take a window of pixels
+class DisplayDriver {
+public:
+  virtual ~DisplayDriver() {}
+  // true while a write_window() is still in progress
+  virtual bool busy() = 0;
+  // Start writing a w by h window at x, y. pixels are RGB565, big endian,
+  // row-major and must stay untouched until busy() returns false.
+  virtual void write_window(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                            const uint8_t *pixels) = 0;
+};
+
+class TextDisplay {
+public:
+  TextDisplay(DisplayDriver *driver, uint8_t num_cols, uint8_t num_rows);
+  ~TextDisplay();
+
+  uint8_t num_cols;
+  uint8_t num_rows;
+  uint16_t foreground;
+  uint16_t background;
+
+  // Diagnostics
+  uint32_t windows_drawn;
+  uint32_t cells_drawn;
+
+  // Blank every cell, which redraws the whole screen
+  void clear();
+  void set_char(uint16_t cell, char c);
+  char get_char(uint16_t cell);
+  // Cells are numbered row-major, num_cols*num_rows or more hides the cursor
+  void set_cursor(uint16_t cell);
+  // Call from loop(), starts at most one window
+  bool update();
+  // Nothing dirty and the driver finished
+  bool idle();
+
+  // Draws one cell as it should appear, DISPLAY_CELL_WIDTH*DISPLAY_CELL_HEIGHT
+  // RGB565 values row-major (for checking a framebuffer)
+  void render_cell(uint16_t cell, uint16_t *out);
+
+private:
+  DisplayDriver *driver;
+  char *cells;
+  uint8_t *dirty;
+  uint16_t dirty_count;
+  uint16_t cursor;
+  uint8_t pixels[DISPLAY_PIXEL_BUFFER_SIZE];
+
+  void mark_dirty(uint16_t cell);
+  bool is_dirty(uint16_t cell);
+  uint8_t glyph_column(char c, uint8_t x);
+};
+
+#endif
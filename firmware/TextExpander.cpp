@@ -0,0 +1,99 @@
+#include "TextExpander.h"
+
+TextExpander::TextExpander(const TextExpansionTrie *expansion_trie) {
+  trie = expansion_trie;
+  expansions = 0;
+  skipped = 0;
+  depth = 0;
+  dead = 0;
+  lost = false;
+  backspaces = 0;
+  expansion = NULL;
+  trigger = 0;
+}
+
+void TextExpander::reset(void) {
+  lost = true;
+}
+
+bool TextExpander::busy(void) {
+  return backspaces > 0 || expansion != NULL || trigger != 0;
+}
+
+bool TextExpander::feed(char c) {
+  if (c == '\b') {
+    if (lost)
+      return false;
+    if (dead > 0)
+      dead--;
+    else if (depth > 0)
+      depth--;
+    else
+      // back into the word before, which we don't know
+      lost = true;
+    return false;
+  }
+
+  if (c == ' ' || c == '\t' || c == '\n') {
+    bool matched = false;
+    if (!lost && dead == 0 && depth > 0) {
+      uint16_t offset = trie->states[path[depth-1]].expansion;
+      if (offset != TEXT_EXPANDER_NO_EXPANSION) {
+        if (busy()) {
+          skipped++;
+        }
+        else {
+          backspaces = depth;
+          expansion = &trie->text[offset];
+          trigger = c;
+          expansions++;
+          matched = true;
+        }
+      }
+    }
+    depth = 0;
+    dead = 0;
+    lost = false;
+    return matched;
+  }
+
+  // arrows, escape and the like
+  if (c < 32 || c > 126) {
+    lost = true;
+    return false;
+  }
+
+  if (lost)
+    return false;
+  if (dead > 0 || depth == TEXT_EXPANDER_MAX_LENGTH) {
+    if (dead < 255)
+      dead++;
+    return false;
+  }
+
+  uint16_t state = depth > 0 ? path[depth-1] : TEXT_EXPANDER_ROOT;
+  uint32_t next = (uint32_t) trie->states[state].base + (c - 32);
+  if (next < trie->num_states && trie->states[next].check == state)
+    path[depth++] = next;
+  else
+    dead = 1;
+  return false;
+}
+
+char TextExpander::next_output(void) {
+  char c;
+
+  if (backspaces > 0) {
+    backspaces--;
+    return '\b';
+  }
+  if (expansion != NULL) {
+    c = *expansion++;
+    if (c != '\0')
+      return c;
+    expansion = NULL;
+  }
+  c = trigger;
+  trigger = 0;
+  return c;
+}
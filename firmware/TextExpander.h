@@ -0,0 +1,83 @@
+#ifndef TEXTEXPANDER_H
+#define TEXTEXPANDER_H
+
+#include <Arduino.h>
+
+// Abbreviation expansion
+//
+// Abbreviations live in a double-array trie in flash, generated from
+// Abbreviations.txt by tools/make_abbreviations.py. Each typed character is
+// one transition:
+//
+//   next = states[state].base + (c - 32)
+//   valid if states[next].check == state
+//
+// so matching costs the same however many abbreviations there are, and the
+// only RAM is the path through the current word (TEXT_EXPANDER_MAX_LENGTH
+// states, for backspace).
+//
+// An abbreviation has to be typed as a whole word: from a whitespace (or
+// startup) to the space, tab or enter that triggers it. When feed() returns
+// true the caller must not send the trigger (an enter would run the
+// abbreviation in a shell). The abbreviation is deleted with backspaces and
+// the expansion typed, followed by the trigger. next_output() hands these out
+// one at a time so the caller can pace them to the HID output.
+//
+// Feeding anything else that isn't text (arrows, escape, mouse keys) forgets
+// the current word, and so does reset() (for Ctrl combinations and the like):
+// nothing matches until the next whitespace.
+
+#define TEXT_EXPANDER_ROOT 0
+#define TEXT_EXPANDER_NO_EXPANSION 0xFFFF
+// Abbreviations can't be longer than this
+#define TEXT_EXPANDER_MAX_LENGTH 16
+
+struct TextExpanderState {
+  uint16_t base;
+  // the state this one is a child of, 0xFFFF for unused slots
+  uint16_t check;
+  // offset of the expansion in the trie's text, or TEXT_EXPANDER_NO_EXPANSION
+  uint16_t expansion;
+};
+
+struct TextExpansionTrie {
+  const TextExpanderState *states;
+  uint16_t num_states;
+  // NUL terminated expansions
+  const char *text;
+};
+
+class TextExpander {
+public:
+  TextExpander(const TextExpansionTrie *trie);
+
+  uint32_t expansions;
+  // Abbreviations typed while the last expansion was still being sent
+  uint32_t skipped;
+
+  // Feed one typed character, true if it triggered an expansion
+  bool feed(char c);
+  // Forget the current word, nothing matches until the next whitespace
+  void reset();
+  // The next character to send ('\b' for backspace), or 0 when done
+  char next_output();
+  bool busy();
+
+private:
+  const TextExpansionTrie *trie;
+
+  // states after each character of the current word
+  uint16_t path[TEXT_EXPANDER_MAX_LENGTH];
+  uint8_t depth;
+  // characters typed since the word left the trie
+  uint8_t dead;
+  // the current word didn't start at a known whitespace
+  bool lost;
+
+  // pending output
+  uint8_t backspaces;
+  const char *expansion;
+  char trigger;
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include "UartHidOutput.h"
+
+#define SHIFT 0x80
+#define LEFT_SHIFT_BIT 0x02
+
+// US layout usages for ASCII 32 to 126
+static const uint8_t ascii_usages[95] = {
+  0x2C,       0x1E|SHIFT, 0x34|SHIFT, 0x20|SHIFT, // space ! " #
+  0x21|SHIFT, 0x22|SHIFT, 0x24|SHIFT, 0x34,       // $ % & '
+  0x26|SHIFT, 0x27|SHIFT, 0x25|SHIFT, 0x2E|SHIFT, // ( ) * +
+  0x36,       0x2D,       0x37,       0x38,       // , - . /
+  0x27, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, // 0-9
+  0x33|SHIFT, 0x33,       0x36|SHIFT, 0x2E,       // : ; < =
+  0x37|SHIFT, 0x38|SHIFT, 0x1F|SHIFT,             // > ? @
+  0x04|SHIFT, 0x05|SHIFT, 0x06|SHIFT, 0x07|SHIFT, 0x08|SHIFT, 0x09|SHIFT, // A-F
+  0x0A|SHIFT, 0x0B|SHIFT, 0x0C|SHIFT, 0x0D|SHIFT, 0x0E|SHIFT, 0x0F|SHIFT, // G-L
+  0x10|SHIFT, 0x11|SHIFT, 0x12|SHIFT, 0x13|SHIFT, 0x14|SHIFT, 0x15|SHIFT, // M-R
+  0x16|SHIFT, 0x17|SHIFT, 0x18|SHIFT, 0x19|SHIFT, 0x1A|SHIFT, 0x1B|SHIFT, // S-X
+  0x1C|SHIFT, 0x1D|SHIFT,                                                 // Y-Z
+  0x2F,       0x31,       0x30,       0x23|SHIFT, // [ \ ] ^
+  0x2D|SHIFT, 0x35,                               // _ `
+  0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, // a-l
+  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, // m-x
+  0x1C, 0x1D,                                                             // y-z
+  0x2F|SHIFT, 0x31|SHIFT, 0x30|SHIFT, 0x35|SHIFT, // { | } ~
+};
+
+UartHidOutput::UartHidOutput(Stream *uart_port) {
+  port = uart_port;
+  coalesce = true;
+}
+
+void UartHidOutput::begin(void) {
+  tx_capacity = port->availableForWrite();
+  queue_head = 0;
+  queue_count = 0;
+  memset(keyboard, 0, sizeof(keyboard));
+  memset(sent_keyboard, 0, sizeof(sent_keyboard));
+  buttons = 0;
+  reports_sent = 0;
+  reports_coalesced = 0;
+  overflows = 0;
+  max_queue_micros = 0;
+
+  // the module may have missed our last release before a reset
+  write_report(NULL);
+}
+
+uint8_t UartHidOutput::ascii_usage(char c) {
+  if (c >= 32 && c <= 126)
+    return ascii_usages[c - 32];
+  if (c == '\n')
+    return 0x28;
+  if (c == '\b')
+    return 0x2A;
+  if (c == '\t')
+    return 0x2B;
+  return 0;
+}
+
+bool UartHidOutput::has_key(const uint8_t *report, uint8_t usage) {
+  for (uint8_t i=2; i<8; i++) {
+    if (report[i] == usage)
+      return true;
+  }
+  return false;
+}
+
+void UartHidOutput::press(uint16_t key) {
+  if ((key & HID_CODE_TYPE_MASK) == HID_MODIFIER_CODE_TYPE) {
+    if (keyboard[0] & key)
+      return;
+    keyboard[0] |= key;
+  }
+  else if ((key & HID_CODE_TYPE_MASK) == HID_KEY_CODE_TYPE) {
+    uint8_t usage = key;
+    if (has_key(keyboard, usage) || !has_key(keyboard, 0))
+      return;
+    for (uint8_t i=2; i<8; i++) {
+      if (keyboard[i] == 0) {
+        keyboard[i] = usage;
+        break;
+      }
+    }
+  }
+  else {
+    return;
+  }
+  keyboard_changed();
+}
+
+void UartHidOutput::release(uint16_t key) {
+  if ((key & HID_CODE_TYPE_MASK) == HID_MODIFIER_CODE_TYPE) {
+    if (!(keyboard[0] & key))
+      return;
+    keyboard[0] &= ~key;
+  }
+  else if ((key & HID_CODE_TYPE_MASK) == HID_KEY_CODE_TYPE) {
+    uint8_t usage = key;
+    if (!has_key(keyboard, usage))
+      return;
+    for (uint8_t i=2; i<8; i++) {
+      if (keyboard[i] == usage)
+        keyboard[i] = 0;
+    }
+  }
+  else {
+    return;
+  }
+  keyboard_changed();
+}
+
+void UartHidOutput::type(char c) {
+  uint8_t usage = ascii_usage(c);
+  uint8_t modifiers = keyboard[0];
+  if (usage == 0)
+    return;
+
+  // a held key has to go up before it can be tapped
+  release(HID_KEY_CODE_TYPE | (usage & ~SHIFT));
+  if (usage & SHIFT)
+    keyboard[0] |= LEFT_SHIFT_BIT;
+  press(HID_KEY_CODE_TYPE | (usage & ~SHIFT));
+  keyboard[0] = modifiers;
+  release(HID_KEY_CODE_TYPE | (usage & ~SHIFT));
+}
+
+void UartHidOutput::mouse_buttons(uint8_t new_buttons) {
+  if (new_buttons == buttons)
+    return;
+  buttons = new_buttons;
+  uint8_t data[4] = {buttons, 0, 0, 0};
+  queue_report(UART_HID_MOUSE, data);
+}
+
+void UartHidOutput::mouse_move(int8_t x, int8_t y, int8_t wheel, int8_t hwheel) {
+  if (x == 0 && y == 0 && wheel == 0)
+    return;
+  uint8_t data[4] = {buttons, (uint8_t) x, (uint8_t) y, (uint8_t) wheel};
+  queue_report(UART_HID_MOUSE, data);
+}
+
+void UartHidOutput::keyboard_changed(void) {
+  queue_report(UART_HID_KEYBOARD, keyboard);
+}
+
+// The keyboard state the host will have just before the queued report at
+// index (counted from the head) arrives
+const uint8_t *UartHidOutput::keyboard_before(uint8_t index) {
+  while (index-- > 0) {
+    UartHidReport *report = &queue[(queue_head + index) % UART_HID_QUEUE_LENGTH];
+    if (report->type == UART_HID_KEYBOARD)
+      return report->data;
+  }
+  return sent_keyboard;
+}
+
+// Replace the queued report unless that would hide one of its changes, or
+// lose the order of two presses (the host can't tell which key in a report
+// came first, only that modifiers apply to it)
+bool UartHidOutput::merge_keyboard(UartHidReport *tail, const uint8_t *data) {
+  const uint8_t *before = keyboard_before(queue_count - 1);
+  bool tail_pressed_key = false;
+  bool data_pressed = (data[0] & ~tail->data[0]) != 0;
+
+  // modifiers the queued report changed must stay changed
+  if ((data[0] ^ tail->data[0]) & (tail->data[0] ^ before[0]))
+    return false;
+  for (uint8_t i=2; i<8; i++) {
+    if (tail->data[i] != 0 && !has_key(before, tail->data[i])) {
+      // pressed by the queued report and released again
+      if (!has_key(data, tail->data[i]))
+        return false;
+      tail_pressed_key = true;
+    }
+    // released by the queued report and pressed again
+    if (before[i] != 0 && !has_key(tail->data, before[i]) && has_key(data, before[i]))
+      return false;
+    if (data[i] != 0 && !has_key(tail->data, data[i]))
+      data_pressed = true;
+  }
+  if (tail_pressed_key && data_pressed)
+    return false;
+  memcpy(tail->data, data, 8);
+  return true;
+}
+
+// Add the movement to a queued report with the same buttons
+bool UartHidOutput::merge_mouse(UartHidReport *tail, const uint8_t *data) {
+  int16_t sum[3];
+
+  if (tail->data[0] != data[0])
+    return false;
+  for (uint8_t i=0; i<3; i++) {
+    sum[i] = (int8_t) tail->data[i+1] + (int8_t) data[i+1];
+    if (sum[i] < -127 || sum[i] > 127)
+      return false;
+  }
+  for (uint8_t i=0; i<3; i++)
+    tail->data[i+1] = sum[i];
+  return true;
+}
+
+void UartHidOutput::queue_report(uint8_t type, const uint8_t *data) {
+  uint8_t length = type == UART_HID_KEYBOARD ? 8 : 4;
+
+  if (queue_count > 0) {
+    UartHidReport *tail = &queue[(queue_head + queue_count - 1) % UART_HID_QUEUE_LENGTH];
+    if (coalesce && tail->type == type &&
+        (type == UART_HID_KEYBOARD ? merge_keyboard(tail, data) : merge_mouse(tail, data))) {
+      reports_coalesced++;
+      return;
+    }
+    if (queue_count == UART_HID_QUEUE_LENGTH) {
+      // Never block, the newest state wins
+      tail->type = type;
+      memcpy(tail->data, data, length);
+      overflows++;
+      return;
+    }
+  }
+
+  UartHidReport *report = &queue[(queue_head + queue_count) % UART_HID_QUEUE_LENGTH];
+  report->type = type;
+  memcpy(report->data, data, length);
+  report->micros = micros();
+  queue_count++;
+
+  // straight out if the port has room
+  poll();
+}
+
+// NULL writes an all released keyboard report
+void UartHidOutput::write_report(const UartHidReport *report) {
+  uint8_t frame[UART_HID_KEYBOARD_FRAME_LENGTH] = {UART_HID_FRAME_START};
+
+  if (report == NULL || report->type == UART_HID_KEYBOARD) {
+    frame[1] = 9;
+    frame[2] = UART_HID_KEYBOARD;
+    if (report != NULL) {
+      memcpy(&frame[3], report->data, 8);
+      memcpy(sent_keyboard, report->data, 8);
+    }
+    port->write(frame, UART_HID_KEYBOARD_FRAME_LENGTH);
+  }
+  else {
+    frame[1] = 5;
+    frame[2] = UART_HID_MOUSE;
+    memcpy(&frame[3], report->data, 4);
+    port->write(frame, UART_HID_MOUSE_FRAME_LENGTH);
+  }
+}
+
+bool UartHidOutput::ready(void) {
+  return queue_count == 0;
+}
+
+void UartHidOutput::poll(void) {
+  int available, length, in_flight;
+
+  while (queue_count > 0) {
+    UartHidReport *report = &queue[queue_head];
+    length = report->type == UART_HID_KEYBOARD ? UART_HID_KEYBOARD_FRAME_LENGTH : UART_HID_MOUSE_FRAME_LENGTH;
+
+    available = port->availableForWrite();
+    if (available > tx_capacity)
+      tx_capacity = available;
+    // Ports that don't report their buffer space (tx_capacity 0) get written
+    // to regardless
+    in_flight = tx_capacity - available;
+    if (tx_capacity > 0 &&
+        (available < length || in_flight + length > UART_HID_MAX_IN_FLIGHT))
+      return;
+
+    write_report(report);
+    reports_sent++;
+    if (micros() - report->micros > max_queue_micros)
+      max_queue_micros = micros() - report->micros;
+    queue_head = (queue_head + 1) % UART_HID_QUEUE_LENGTH;
+    queue_count--;
+  }
+}
@@ -0,0 +1,107 @@
+#ifndef UARTHIDOUTPUT_H
+#define UARTHIDOUTPUT_H
+
+#include <Arduino.h>
+#include "HidOutput.h"
+
+// Bluetooth HID module output over a UART
+//
+// Sends raw HID reports in the framing used by RN-42 style modules (and the
+// many modules that copied it) in HID raw mode:
+//
+//   keyboard  [0xFD] [0x09] [0x01] [modifiers] [0x00] [key1 ... key6]
+//   mouse     [0xFD] [0x05] [0x02] [buttons] [x] [y] [wheel]
+//
+// The length byte counts the descriptor byte and the report after it. The
+// mouse report has no horizontal wheel, so that is dropped.
+//
+// Reports wait in a small ring queue and are only written while the port's
+// transmit buffer has room for the whole frame and no more than
+// UART_HID_MAX_IN_FLIGHT bytes are already waiting in it, so writing never
+// blocks the scan. With hardware flow control (CTS) the UART simply stops
+// when the module is busy and the reports back up here.
+//
+// While reports are backed up a new one is merged into the newest queued
+// report when nothing the host needs to see is lost: a keyboard report can
+// replace the queued one unless it undoes a key or modifier change the queued
+// report made (a tap that hasn't been sent yet) or presses something after a
+// key the queued report pressed, and mouse reports with the same buttons add
+// their movement. A slow link then carries the latest state
+// in fewer reports instead of falling further behind.
+
+#define UART_HID_BAUD 115200
+
+#define UART_HID_FRAME_START 0xFD
+#define UART_HID_KEYBOARD 0x01
+#define UART_HID_MOUSE 0x02
+#define UART_HID_KEYBOARD_FRAME_LENGTH 11
+#define UART_HID_MOUSE_FRAME_LENGTH 7
+
+// Reports waiting for the UART
+#define UART_HID_QUEUE_LENGTH 16
+// Most bytes left in the port's transmit buffer before another frame is
+// written. Anything past this can't be coalesced any more, so it's kept to
+// about two frames.
+#define UART_HID_MAX_IN_FLIGHT 24
+
+struct UartHidReport {
+  uint8_t type;
+  // keyboard: modifiers, 0, key1..key6
+  // mouse: buttons, x, y, wheel
+  uint8_t data[8];
+  // micros() of the oldest change in this report
+  uint32_t micros;
+};
+
+class UartHidOutput : public HidOutput {
+public:
+  UartHidOutput(Stream *port);
+
+  // Merge queued reports, can be switched off to compare
+  bool coalesce;
+
+  uint32_t reports_sent;
+  uint32_t reports_coalesced;
+  // Reports merged into a full queue even though a change was lost
+  uint32_t overflows;
+  // Longest a report waited to be written, in microseconds
+  uint32_t max_queue_micros;
+
+  void begin();
+  void press(uint16_t key);
+  void release(uint16_t key);
+  void type(char c);
+  void mouse_buttons(uint8_t buttons);
+  void mouse_move(int8_t x, int8_t y, int8_t wheel, int8_t hwheel);
+  void poll();
+  bool ready();
+
+  // US layout usage for an ASCII character, 0x80 set if it needs shift, 0 if
+  // there isn't one
+  static uint8_t ascii_usage(char c);
+
+private:
+  Stream *port;
+  // Largest availableForWrite() seen, taken as the port's empty buffer
+  int tx_capacity;
+
+  UartHidReport queue[UART_HID_QUEUE_LENGTH];
+  uint8_t queue_head;
+  uint8_t queue_count;
+
+  // current state, what the next report will say
+  uint8_t keyboard[8];
+  uint8_t buttons;
+  // keyboard state in the last report written to the port
+  uint8_t sent_keyboard[8];
+
+  void keyboard_changed();
+  void queue_report(uint8_t type, const uint8_t *data);
+  bool merge_keyboard(UartHidReport *tail, const uint8_t *data);
+  bool merge_mouse(UartHidReport *tail, const uint8_t *data);
+  const uint8_t *keyboard_before(uint8_t index);
+  void write_report(const UartHidReport *report);
+  static bool has_key(const uint8_t *report, uint8_t usage);
+};
+
+#endif
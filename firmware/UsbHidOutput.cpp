@@ -0,0 +1,39 @@
+#include "UsbHidOutput.h"
+
+void UsbHidOutput::press(uint16_t key) {
+  Keyboard.press(key);
+}
+
+void UsbHidOutput::release(uint16_t key) {
+  Keyboard.release(key);
+}
+
+void UsbHidOutput::type(char c) {
+  uint16_t key = 0;
+
+  // print() only knows printable characters
+  if (c == '\n')
+    key = KEY_ENTER;
+  else if (c == '\b')
+    key = KEY_BACKSPACE;
+  else if (c == '\t')
+    key = KEY_TAB;
+
+  if (key != 0) {
+    Keyboard.press(key);
+    Keyboard.release(key);
+  }
+  else {
+    Keyboard.print(c);
+  }
+}
+
+void UsbHidOutput::mouse_buttons(uint8_t buttons) {
+  Mouse.set_buttons(buttons & HID_MOUSE_LEFT ? 1 : 0,
+                    buttons & HID_MOUSE_MIDDLE ? 1 : 0,
+                    buttons & HID_MOUSE_RIGHT ? 1 : 0);
+}
+
+void UsbHidOutput::mouse_move(int8_t x, int8_t y, int8_t wheel, int8_t hwheel) {
+  Mouse.move(x, y, wheel, hwheel);
+}
@@ -0,0 +1,19 @@
+#ifndef USBHIDOUTPUT_H
+#define USBHIDOUTPUT_H
+
+#include <Arduino.h>
+#include "HidOutput.h"
+
+// USB output through the Teensy Keyboard and Mouse classes. The USB stack
+// keeps its own report state and sends on the next host poll.
+
+class UsbHidOutput : public HidOutput {
+public:
+  void press(uint16_t key);
+  void release(uint16_t key);
+  void type(char c);
+  void mouse_buttons(uint8_t buttons);
+  void mouse_move(int8_t x, int8_t y, int8_t wheel, int8_t hwheel);
+};
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef ARDUINO_HOST_H
+#define ARDUINO_HOST_H
+
+// Just enough of the Arduino/Teensyduino API to build the firmware's matrix
+// and protocol code on a Linux host. Pins read as released unless a benchmark
+// closes a simulated switch, and the clock is whatever the benchmark sets it
+// to.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define LOW 0
+#define HIGH 1
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+uint32_t micros(void);
+uint32_t millis(void);
+
+// Host only: set the value returned by micros()/millis()
+void host_set_micros(uint32_t now);
+// Host only: close or open a switch between a strobe pin and a sense pin. The
+// sense pin reads LOW while the strobe pin is an OUTPUT latched LOW.
+void host_set_switch(uint8_t strobe_pin, uint8_t sense_pin, bool closed);
+// Host only: digitalRead() and pinMode() calls so far
+uint32_t host_pin_reads(void);
+uint32_t host_pin_mode_changes(void);
+// Host only: called with every digitalWrite(), for simulated parts clocked
+// or latched by a pin
+void host_set_pin_listener(void (*listener)(uint8_t pin, uint8_t value));
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--)
+      n += write(*buffer++);
+    return n;
+  }
+  virtual int availableForWrite(void) { return 0; }
+
+  size_t print(const char *s);
+  size_t print(char c);
+  size_t print(int n);
+  size_t print(unsigned int n);
+  size_t print(long n);
+  size_t print(unsigned long n);
+  size_t print(double n, int digits = 2);
+  size_t println(void);
+  size_t println(const char *s);
+  size_t println(unsigned long n);
+};
+
+class Stream : public Print {
+public:
+  virtual int available(void) = 0;
+  virtual int read(void) = 0;
+};
+
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+void analogWriteResolution(uint8_t bits);
+
+// --- Teensy USB --------------------------------------------------------------
+//
+// Serial never has input and discards output. Keyboard keeps the boot
+// protocol report as the Teensy core does: a modifier byte and six key slots,
+// sent on every change, with a press that finds no free slot dropped.
+// print()ed characters are typed through a US layout as a press and release.
+
+class usb_serial_class : public Stream {
+public:
+  void begin(uint32_t baud) {}
+  size_t write(uint8_t b) { return 1; }
+  int availableForWrite(void) { return 64; }
+  int available(void) { return 0; }
+  int read(void) { return -1; }
+  operator bool() { return true; }
+};
+
+extern usb_serial_class Serial;
+
+// Key codes as in the Teensy core's keylayouts.h
+#define KEY_CODE(usage) ((usage) | 0xF000)
+#define MODIFIER_CODE(bits) ((bits) | 0xE000)
+
+#define MODIFIERKEY_CTRL        MODIFIER_CODE(0x01)
+#define MODIFIERKEY_SHIFT       MODIFIER_CODE(0x02)
+#define MODIFIERKEY_ALT         MODIFIER_CODE(0x04)
+#define MODIFIERKEY_GUI         MODIFIER_CODE(0x08)
+#define MODIFIERKEY_RIGHT_CTRL  MODIFIER_CODE(0x10)
+#define MODIFIERKEY_RIGHT_SHIFT MODIFIER_CODE(0x20)
+#define MODIFIERKEY_RIGHT_ALT   MODIFIER_CODE(0x40)
+#define MODIFIERKEY_RIGHT_GUI   MODIFIER_CODE(0x80)
+
+#define KEY_A KEY_CODE(4)
+#define KEY_B KEY_CODE(5)
+#define KEY_C KEY_CODE(6)
+#define KEY_D KEY_CODE(7)
+#define KEY_E KEY_CODE(8)
+#define KEY_F KEY_CODE(9)
+#define KEY_G KEY_CODE(10)
+#define KEY_H KEY_CODE(11)
+#define KEY_I KEY_CODE(12)
+#define KEY_J KEY_CODE(13)
+#define KEY_K KEY_CODE(14)
+#define KEY_L KEY_CODE(15)
+#define KEY_M KEY_CODE(16)
+#define KEY_N KEY_CODE(17)
+#define KEY_O KEY_CODE(18)
+#define KEY_P KEY_CODE(19)
+#define KEY_Q KEY_CODE(20)
+#define KEY_R KEY_CODE(21)
+#define KEY_S KEY_CODE(22)
+#define KEY_T KEY_CODE(23)
+#define KEY_U KEY_CODE(24)
+#define KEY_V KEY_CODE(25)
+#define KEY_W KEY_CODE(26)
+#define KEY_X KEY_CODE(27)
+#define KEY_Y KEY_CODE(28)
+#define KEY_Z KEY_CODE(29)
+#define KEY_1 KEY_CODE(30)
+#define KEY_2 KEY_CODE(31)
+#define KEY_3 KEY_CODE(32)
+#define KEY_4 KEY_CODE(33)
+#define KEY_5 KEY_CODE(34)
+#define KEY_6 KEY_CODE(35)
+#define KEY_7 KEY_CODE(36)
+#define KEY_8 KEY_CODE(37)
+#define KEY_9 KEY_CODE(38)
+#define KEY_0 KEY_CODE(39)
+#define KEY_ENTER KEY_CODE(40)
+#define KEY_ESC KEY_CODE(41)
+#define KEY_BACKSPACE KEY_CODE(42)
+#define KEY_TAB KEY_CODE(43)
+#define KEY_SPACE KEY_CODE(44)
+#define KEY_MINUS KEY_CODE(45)
+#define KEY_EQUAL KEY_CODE(46)
+#define KEY_LEFT_BRACE KEY_CODE(47)
+#define KEY_RIGHT_BRACE KEY_CODE(48)
+#define KEY_BACKSLASH KEY_CODE(49)
+#define KEY_SEMICOLON KEY_CODE(51)
+#define KEY_QUOTE KEY_CODE(52)
+#define KEY_TILDE KEY_CODE(53)
+#define KEY_COMMA KEY_CODE(54)
+#define KEY_PERIOD KEY_CODE(55)
+#define KEY_SLASH KEY_CODE(56)
+#define KEY_CAPS_LOCK KEY_CODE(57)
+#define KEY_HOME KEY_CODE(74)
+#define KEY_PAGE_UP KEY_CODE(75)
+#define KEY_DELETE KEY_CODE(76)
+#define KEY_END KEY_CODE(77)
+#define KEY_PAGE_DOWN KEY_CODE(78)
+#define KEY_RIGHT KEY_CODE(79)
+#define KEY_LEFT KEY_CODE(80)
+#define KEY_DOWN KEY_CODE(81)
+#define KEY_UP KEY_CODE(82)
+
+#define HOST_KEYBOARD_REPORT_SIZE 8
+
+class usb_keyboard_class : public Print {
+public:
+  usb_keyboard_class() : modifiers(0) { memset(keys, 0, sizeof(keys)); }
+
+  void press(uint16_t key);
+  void release(uint16_t key);
+  void releaseAll(void);
+  size_t write(uint8_t c);
+
+  uint8_t modifiers;
+  uint8_t keys[6];
+
+private:
+  void send(uint8_t report_modifiers, const uint8_t *report_keys);
+};
+
+extern usb_keyboard_class Keyboard;
+
+// Host only: called with every report Keyboard sends, modifiers first
+void host_set_keyboard_listener(void (*listener)(const uint8_t *report));
+
+#define MOUSE_LEFT 1
+#define MOUSE_MIDDLE 4
+#define MOUSE_RIGHT 2
+
+class usb_mouse_class {
+public:
+  void click(uint8_t b = MOUSE_LEFT) {}
+  void set_buttons(uint8_t left, uint8_t middle, uint8_t right) {}
+  void move(int8_t x, int8_t y, int8_t wheel = 0, int8_t hwheel = 0) {}
+};
+
+extern usb_mouse_class Mouse;
+
+#endif
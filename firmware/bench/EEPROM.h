@@ -0,0 +1,24 @@
+#ifndef EEPROM_HOST_H
+#define EEPROM_HOST_H
+
+// The Teensy 3.2's 2KB of EEPROM, erased (0xFF) at startup
+
+#include <stdint.h>
+
+#define HOST_EEPROM_SIZE 2048
+
+class EEPROMClass {
+public:
+  EEPROMClass();
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+  void update(int address, uint8_t value) { write(address, value); }
+  uint16_t length(void) { return HOST_EEPROM_SIZE; }
+
+private:
+  uint8_t bytes[HOST_EEPROM_SIZE];
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
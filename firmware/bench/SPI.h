@@ -0,0 +1,37 @@
+#ifndef SPI_HOST_H
+#define SPI_HOST_H
+
+// Host SPI: transfers go to whatever simulated part the benchmark attached,
+// or read 0xFF with nothing attached
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+// Host only: a part on the bus, shifting one byte out as one comes in
+class HostSpiDevice {
+public:
+  virtual ~HostSpiDevice() {}
+  virtual uint8_t transfer(uint8_t out) = 0;
+};
+
+// Host only: attach device (NULL detaches)
+void host_set_spi_device(HostSpiDevice *device);
+
+struct SPISettings {
+  SPISettings(uint32_t clock, uint8_t bit_order, uint8_t data_mode) {}
+};
+
+class SPIClass {
+public:
+  void begin(void) {}
+  void beginTransaction(SPISettings settings) {}
+  void endTransaction(void) {}
+  uint8_t transfer(uint8_t out);
+  void transfer(const void *out, void *in, size_t count);
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef WIRE_HOST_H
+#define WIRE_HOST_H
+
+// Host I2C: transactions go to a simulated part at the address the benchmark
+// attached it to. Anything else NAKs.
+
+#include "Arduino.h"
+
+// Host only: a part on the bus
+class HostI2cDevice {
+public:
+  virtual ~HostI2cDevice() {}
+  // The bytes of one write, after the address
+  virtual void receive(const uint8_t *data, size_t length) = 0;
+  // A read of quantity bytes is starting
+  virtual void request(uint8_t quantity) {}
+  // One byte of a read
+  virtual uint8_t send(void) = 0;
+};
+
+// Host only: attach device at address (NULL detaches)
+void host_set_i2c_device(uint8_t address, HostI2cDevice *device);
+
+#define HOST_WIRE_BUFFER 32
+
+class TwoWire {
+public:
+  void begin(void) {}
+  void setClock(uint32_t clock) {}
+  void beginTransmission(uint8_t address);
+  size_t write(uint8_t value);
+  uint8_t endTransmission(bool send_stop = true);
+  uint8_t requestFrom(uint8_t address, uint8_t quantity, bool send_stop = true);
+  int available(void);
+  int read(void);
+
+private:
+  uint8_t tx_address;
+  uint8_t tx_buffer[HOST_WIRE_BUFFER];
+  uint8_t tx_length;
+  uint8_t rx_buffer[HOST_WIRE_BUFFER];
+  uint8_t rx_length;
+  uint8_t rx_index;
+};
+
+extern TwoWire Wire;
+
+#endif
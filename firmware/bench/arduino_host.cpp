@@ -0,0 +1,287 @@
+#include "Arduino.h"
+#include "SPI.h"
+#include "Wire.h"
+#include "EEPROM.h"
+
+#include <stdarg.h>
+
+#define HOST_PINS 64
+
+static uint32_t host_micros = 0;
+static uint8_t pin_modes[HOST_PINS];
+static uint8_t pin_latches[HOST_PINS];
+// closed_switches[sense] has a bit for each strobe pin it's connected to
+static uint64_t closed_switches[HOST_PINS];
+static uint32_t pin_reads = 0;
+static uint32_t pin_mode_changes = 0;
+static void (*pin_listener)(uint8_t pin, uint8_t value) = NULL;
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  pin_mode_changes++;
+  if (pin < HOST_PINS)
+    pin_modes[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < HOST_PINS)
+    pin_latches[pin] = value;
+  if (pin_listener != NULL)
+    pin_listener(pin, value);
+}
+
+// Low if a closed switch connects the pin to a strobe line driven low
+int digitalRead(uint8_t pin) {
+  pin_reads++;
+  if (pin >= HOST_PINS)
+    return HIGH;
+  uint64_t strobes = closed_switches[pin];
+  for (uint8_t s=0; strobes != 0; s++, strobes >>= 1) {
+    if ((strobes & 1) && pin_modes[s] == OUTPUT && pin_latches[s] == LOW)
+      return LOW;
+  }
+  return HIGH;
+}
+
+uint32_t micros(void) { return host_micros; }
+uint32_t millis(void) { return host_micros / 1000; }
+
+void host_set_micros(uint32_t now) { host_micros = now; }
+
+void host_set_switch(uint8_t strobe_pin, uint8_t sense_pin, bool closed) {
+  if (strobe_pin >= HOST_PINS || sense_pin >= HOST_PINS)
+    return;
+  if (closed)
+    closed_switches[sense_pin] |= (1ULL << strobe_pin);
+  else
+    closed_switches[sense_pin] &= ~(1ULL << strobe_pin);
+}
+
+uint32_t host_pin_reads(void) { return pin_reads; }
+uint32_t host_pin_mode_changes(void) { return pin_mode_changes; }
+void host_set_pin_listener(void (*listener)(uint8_t pin, uint8_t value)) { pin_listener = listener; }
+
+// --- SPI ---------------------------------------------------------------------
+
+SPIClass SPI;
+static HostSpiDevice *spi_device = NULL;
+
+void host_set_spi_device(HostSpiDevice *device) { spi_device = device; }
+
+uint8_t SPIClass::transfer(uint8_t out) {
+  return spi_device != NULL ? spi_device->transfer(out) : 0xFF;
+}
+
+void SPIClass::transfer(const void *out, void *in, size_t count) {
+  for (size_t i=0; i<count; i++) {
+    uint8_t b = transfer(out != NULL ? ((const uint8_t*) out)[i] : 0xFF);
+    if (in != NULL)
+      ((uint8_t*) in)[i] = b;
+  }
+}
+
+// --- I2C ---------------------------------------------------------------------
+
+#define HOST_I2C_ADDRESSES 128
+
+TwoWire Wire;
+static HostI2cDevice *i2c_devices[HOST_I2C_ADDRESSES];
+
+void host_set_i2c_device(uint8_t address, HostI2cDevice *device) {
+  if (address < HOST_I2C_ADDRESSES)
+    i2c_devices[address] = device;
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+  tx_address = address;
+  tx_length = 0;
+}
+
+size_t TwoWire::write(uint8_t value) {
+  if (tx_length >= HOST_WIRE_BUFFER)
+    return 0;
+  tx_buffer[tx_length++] = value;
+  return 1;
+}
+
+// 2: address NAK, as the Teensy and AVR Wire libraries return
+uint8_t TwoWire::endTransmission(bool send_stop) {
+  if (tx_address >= HOST_I2C_ADDRESSES || i2c_devices[tx_address] == NULL)
+    return 2;
+  i2c_devices[tx_address]->receive(tx_buffer, tx_length);
+  return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity, bool send_stop) {
+  rx_length = 0;
+  rx_index = 0;
+  if (address >= HOST_I2C_ADDRESSES || i2c_devices[address] == NULL)
+    return 0;
+  i2c_devices[address]->request(quantity);
+  while (rx_length < quantity && rx_length < HOST_WIRE_BUFFER)
+    rx_buffer[rx_length++] = i2c_devices[address]->send();
+  return rx_length;
+}
+
+int TwoWire::available(void) {
+  return rx_length - rx_index;
+}
+
+int TwoWire::read(void) {
+  return rx_index < rx_length ? rx_buffer[rx_index++] : -1;
+}
+
+void delay(uint32_t ms) { host_micros += ms * 1000; }
+void delayMicroseconds(uint32_t us) { host_micros += us; }
+int analogRead(uint8_t pin) { return 0; }
+void analogWrite(uint8_t pin, int value) {}
+void analogWriteResolution(uint8_t bits) {}
+
+// --- Print -------------------------------------------------------------------
+
+size_t Print::print(const char *s) { return write((const uint8_t*) s, strlen(s)); }
+size_t Print::print(char c) { return write((uint8_t) c); }
+
+static size_t print_formatted(Print *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static size_t print_formatted(Print *out, const char *format, ...) {
+  char buffer[32];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  return n > 0 ? out->write((const uint8_t*) buffer, strlen(buffer)) : 0;
+}
+
+size_t Print::print(int n) { return print_formatted(this, "%d", n); }
+size_t Print::print(unsigned int n) { return print_formatted(this, "%u", n); }
+size_t Print::print(long n) { return print_formatted(this, "%ld", n); }
+size_t Print::print(unsigned long n) { return print_formatted(this, "%lu", n); }
+size_t Print::print(double n, int digits) { return print_formatted(this, "%.*f", digits, n); }
+size_t Print::println(void) { return print("\r\n"); }
+size_t Print::println(const char *s) { return print(s) + println(); }
+size_t Print::println(unsigned long n) { return print(n) + println(); }
+
+// --- EEPROM ------------------------------------------------------------------
+
+EEPROMClass EEPROM;
+
+EEPROMClass::EEPROMClass() { memset(bytes, 0xFF, sizeof(bytes)); }
+
+uint8_t EEPROMClass::read(int address) {
+  return address >= 0 && address < HOST_EEPROM_SIZE ? bytes[address] : 0xFF;
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  if (address >= 0 && address < HOST_EEPROM_SIZE)
+    bytes[address] = value;
+}
+
+// --- USB ---------------------------------------------------------------------
+
+usb_serial_class Serial;
+usb_keyboard_class Keyboard;
+usb_mouse_class Mouse;
+static void (*keyboard_listener)(const uint8_t *report) = NULL;
+
+void host_set_keyboard_listener(void (*listener)(const uint8_t *report)) { keyboard_listener = listener; }
+
+void usb_keyboard_class::send(uint8_t report_modifiers, const uint8_t *report_keys) {
+  uint8_t report[HOST_KEYBOARD_REPORT_SIZE];
+  report[0] = report_modifiers;
+  report[1] = 0;
+  memcpy(report + 2, report_keys, 6);
+  if (keyboard_listener != NULL)
+    keyboard_listener(report);
+}
+
+void usb_keyboard_class::press(uint16_t key) {
+  if ((key & 0xFF00) == 0xE000) {
+    if ((modifiers & key) == (key & 0xFF))
+      return;
+    modifiers |= key & 0xFF;
+  }
+  else if ((key & 0xFF00) == 0xF000) {
+    uint8_t usage = key & 0xFF;
+    uint8_t i;
+    for (i=0; i<6; i++) {
+      if (keys[i] == usage)
+        return;
+    }
+    for (i=0; i<6 && keys[i] != 0; i++)
+      ;
+    // no free slot, the press is lost
+    if (i == 6)
+      return;
+    keys[i] = usage;
+  }
+  else
+    return;
+  send(modifiers, keys);
+}
+
+void usb_keyboard_class::release(uint16_t key) {
+  if ((key & 0xFF00) == 0xE000) {
+    if ((modifiers & key & 0xFF) == 0)
+      return;
+    modifiers &= ~(key & 0xFF);
+  }
+  else if ((key & 0xFF00) == 0xF000) {
+    uint8_t usage = key & 0xFF;
+    bool found = false;
+    for (uint8_t i=0; i<6; i++) {
+      if (keys[i] == usage) {
+        keys[i] = 0;
+        found = true;
+      }
+    }
+    if (!found)
+      return;
+  }
+  else
+    return;
+  send(modifiers, keys);
+}
+
+void usb_keyboard_class::releaseAll(void) {
+  modifiers = 0;
+  memset(keys, 0, sizeof(keys));
+  send(modifiers, keys);
+}
+
+// US layout usage for ASCII 32-126, 0x80 set for shifted characters
+static const uint8_t us_layout[95] = {
+  44, 30|0x80, 52|0x80, 32|0x80, 33|0x80, 34|0x80, 36|0x80, 52,        // space ! " # $ % & '
+  38|0x80, 39|0x80, 37|0x80, 46|0x80, 54, 45, 55, 56,                 // ( ) * + , - . /
+  39, 30, 31, 32, 33, 34, 35, 36, 37, 38,                             // 0-9
+  51|0x80, 51, 54|0x80, 46, 55|0x80, 56|0x80, 31|0x80,                // : ; < = > ? @
+  4|0x80, 5|0x80, 6|0x80, 7|0x80, 8|0x80, 9|0x80, 10|0x80, 11|0x80,   // A-Z
+  12|0x80, 13|0x80, 14|0x80, 15|0x80, 16|0x80, 17|0x80, 18|0x80,
+  19|0x80, 20|0x80, 21|0x80, 22|0x80, 23|0x80, 24|0x80, 25|0x80,
+  26|0x80, 27|0x80, 28|0x80, 29|0x80,
+  47, 49, 48, 35|0x80, 45|0x80, 53,                                   // [ \ ] ^ _ `
+  4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,   // a-z
+  22, 23, 24, 25, 26, 27, 28, 29,
+  47|0x80, 49|0x80, 48|0x80, 53|0x80,                                 // { | } ~
+};
+
+// Like the Teensy core this replaces the whole report for the tap, so any held
+// keys and modifiers are forgotten
+size_t usb_keyboard_class::write(uint8_t c) {
+  uint8_t usage;
+  // like the Teensy core, enter is the only control character print() types
+  if (c == '\n')
+    usage = 40;
+  else if (c >= 32 && c <= 126)
+    usage = us_layout[c - 32];
+  else
+    return 0;
+
+  memset(keys, 0, sizeof(keys));
+  modifiers = usage & 0x80 ? 0x02 : 0;
+  keys[0] = usage & 0x7F;
+  send(modifiers, keys);
+  modifiers = 0;
+  keys[0] = 0;
+  send(modifiers, keys);
+  return 1;
+}
@@ -0,0 +1,471 @@
+// Debounce benchmark
+//
+// Drives candidate debounce algorithms, including the firmware's own
+// KeyboardMatrix, through synthetic bounce models and recorded scan traces
+// (captured with ENABLE_SCAN_CAPTURE) and reports per algorithm:
+//   - press and release latency percentiles from the first raw edge
+//   - chatter (extra events) and missed events per 1000 keystrokes
+//   - host nanoseconds per 60 key scan and state bytes per key
+//
+// Usage: debounce_bench [-s scan_period_us] [-n keystrokes] [-t trace.bin ...]
+//                       [--max-press-p99 us] [--max-chatter per1000]
+//                       [--adaptive-no-worse]
+// The --max options gate the KeyboardMatrix results on the typical bounce model
+// and make the exit status non-zero when exceeded, to catch latency regressions.
+// --adaptive-no-worse does the same whenever adaptive debounce (from scratch or
+// learned) chatters more than the static counts on any corpus.
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../KeyboardMatrix.h"
+#include "../ScanTrace.h"
+
+struct Sample {
+  uint32_t t;
+  bool active;
+};
+
+struct Edge {
+  uint32_t t;
+  bool pressed;
+};
+
+// One switch's raw samples and the keystrokes that really happened
+struct SwitchTrace {
+  std::string source;
+  std::vector<Sample> samples;
+  std::vector<Edge> truth;
+};
+
+// --- Candidate algorithms ----------------------------------------------------
+
+class Debouncer {
+public:
+  virtual ~Debouncer() {}
+  virtual std::string name() = 0;
+  virtual size_t state_bytes() = 0;
+  virtual void reset() = 0;
+  // Returns the debounced state after this raw sample (true == pressed)
+  virtual bool update(bool active, uint32_t t) = 0;
+  // Called after reset() with the samples about to be run
+  virtual void prepare(const std::vector<Sample> &samples) {}
+};
+
+// The firmware itself: a one key KeyboardMatrix fed through update_from_rows(),
+// optionally with adaptive debounce. That either learns from nothing on each
+// corpus or, as if the profile had been restored at power up, starts with what
+// it learned from one run through the corpus beforehand.
+enum FirmwareMode {FIRMWARE_STATIC, FIRMWARE_ADAPTIVE, FIRMWARE_LEARNED};
+
+class FirmwareDebouncer : public Debouncer {
+public:
+  FirmwareDebouncer(FirmwareMode mode = FIRMWARE_STATIC)
+    : mode(mode), matrix(1, 1, pins, pins, DIODE_DIRECTION_ROW_PIN_TO_COL_PIN) {}
+  std::string name() {
+    const char *names[] = {"KeyboardMatrix", "KeyboardMatrix+adapt", "KeyboardMatrix+learned"};
+    return names[mode];
+  }
+  size_t state_bytes() {
+    return sizeof(debounced_switch) + (mode != FIRMWARE_STATIC ? sizeof(debounce_profile) : 0);
+  }
+  void reset() {
+    // profiles first, begin() starts each counter at its key's steady count
+    matrix.adaptive_debounce = mode != FIRMWARE_STATIC;
+    matrix.reset_debounce_profiles();
+    matrix.begin();
+  }
+  void prepare(const std::vector<Sample> &samples) {
+    if (mode != FIRMWARE_LEARNED)
+      return;
+    for (const Sample &s : samples)
+      update(s.active, s.t);
+    matrix.begin();
+  }
+  bool update(bool active, uint32_t t) {
+    uint16_t row = active ? 0xFFFE : 0xFFFF;
+    matrix.update_from_rows(&row, t);
+    return !(matrix.matrix_state[0] & 1);
+  }
+private:
+  FirmwareMode mode;
+  uint8_t pins[1] = {0};
+  KeyboardMatrix matrix;
+};
+
+// The firmware's counter state machine with its constants as parameters
+class CounterDebouncer : public Debouncer {
+public:
+  CounterDebouncer(int steady, int transient_abs) : steady(steady), transient_abs(transient_abs) {}
+  std::string name() {
+    return "counter(" + std::to_string(steady) + "," + std::to_string(transient_abs) + ")";
+  }
+  size_t state_bytes() { return 2; }
+  void reset() { counter = -steady; state = 0; }
+  bool update(bool active, uint32_t t) {
+    if (active) { if (counter < steady) counter++; }
+    else { if (counter > -steady) counter--; }
+    switch (state) {
+    case 0: if (counter >= -transient_abs) { counter = 0; state = 1; } break;
+    case 1: if (counter == steady) state = 2; else if (counter == -steady) state = 0; break;
+    case 2: if (counter <= transient_abs) { counter = 0; state = 3; } break;
+    case 3: if (counter == steady) state = 2; else if (counter == -steady) state = 0; break;
+    }
+    return state == 1 || state == 2;
+  }
+private:
+  int steady, transient_abs;
+  int8_t counter;
+  uint8_t state;
+};
+
+// Change state only after the raw input has agreed for N consecutive scans
+class DeferDebouncer : public Debouncer {
+public:
+  DeferDebouncer(uint8_t scans) : scans(scans) {}
+  std::string name() { return "defer(" + std::to_string(scans) + ")"; }
+  size_t state_bytes() { return 2; }
+  void reset() { state = false; count = 0; }
+  bool update(bool active, uint32_t t) {
+    if (active == state) count = 0;
+    else if (++count >= scans) { state = active; count = 0; }
+    return state;
+  }
+private:
+  uint8_t scans;
+  bool state;
+  uint8_t count;
+};
+
+// Change state on the first differing sample, then ignore input for a lockout
+class EagerDebouncer : public Debouncer {
+public:
+  EagerDebouncer(uint32_t lockout_us) : lockout_us(lockout_us) {}
+  std::string name() { return "eager(" + std::to_string(lockout_us) + "us)"; }
+  size_t state_bytes() { return 5; }
+  void reset() { state = false; locked_until = 0; locked = false; }
+  bool update(bool active, uint32_t t) {
+    if (locked && (int32_t) (t - locked_until) < 0)
+      return state;
+    locked = false;
+    if (active != state) {
+      state = active;
+      locked = true;
+      locked_until = t + lockout_us;
+    }
+    return state;
+  }
+private:
+  uint32_t lockout_us;
+  bool state;
+  bool locked;
+  uint32_t locked_until;
+};
+
+// Saturating integrator with hysteresis at both ends
+class IntegratorDebouncer : public Debouncer {
+public:
+  IntegratorDebouncer(uint8_t max) : max(max) {}
+  std::string name() { return "integrator(" + std::to_string(max) + ")"; }
+  size_t state_bytes() { return 1; }
+  void reset() { integrator = 0; state = false; }
+  bool update(bool active, uint32_t t) {
+    if (active) { if (integrator < max) integrator++; }
+    else if (integrator > 0) integrator--;
+    if (integrator == 0) state = false;
+    else if (integrator >= max) state = true;
+    return state;
+  }
+private:
+  uint8_t max;
+  uint8_t integrator;
+  bool state;
+};
+
+// --- Corpus ------------------------------------------------------------------
+
+struct BounceModel {
+  const char *name;
+  uint32_t press_bounce_max_us;
+  uint32_t release_bounce_max_us;
+  // probability per scan of a one sample dropout while held
+  double hold_dropout;
+  // probability per scan of a one sample glitch while released
+  double idle_glitch;
+};
+
+static const BounceModel models[] = {
+  {"clean",   0,    0,    0.0,    0.0},
+  {"typical", 2000, 1000, 0.0,    0.0},
+  {"worn",    8000, 5000, 0.002,  0.0},
+  {"emi",     1000, 500,  0.0,    0.001},
+};
+
+// Sample one switch at a fixed scan period through num_keystrokes presses
+static SwitchTrace synthesize(const BounceModel &model, uint32_t scan_us,
+                              int num_keystrokes, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> hold(30000, 150000);
+  std::uniform_int_distribution<uint32_t> gap(30000, 200000);
+  std::uniform_int_distribution<uint32_t> toggle(20, 400);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  SwitchTrace trace;
+  trace.source = std::string("synthetic:") + model.name;
+
+  // Raw contact transitions: times at which the contact changes state
+  std::vector<Edge> contact;
+  uint32_t t = 10000;
+  for (int k=0; k<num_keystrokes; k++) {
+    for (int phase=0; phase<2; phase++) {
+      bool pressed = (phase == 0);
+      uint32_t bounce_max = pressed ? model.press_bounce_max_us : model.release_bounce_max_us;
+      uint32_t bounce = bounce_max ? (uint32_t) (unit(rng) * bounce_max) : 0;
+      trace.truth.push_back({t, pressed});
+      contact.push_back({t, pressed});
+      uint32_t bt = t;
+      bool level = pressed;
+      while (bounce > 0) {
+        bt += toggle(rng);
+        if (bt >= t + bounce)
+          break;
+        level = !level;
+        contact.push_back({bt, level});
+      }
+      if (level != pressed)
+        contact.push_back({t + bounce, pressed});
+      t += pressed ? hold(rng) : gap(rng);
+    }
+  }
+
+  size_t ci = 0;
+  bool level = false;
+  for (uint32_t st=0; st<t; st+=scan_us) {
+    while (ci < contact.size() && contact[ci].t <= st)
+      level = contact[ci++].pressed;
+    bool sample = level;
+    if (level && unit(rng) < model.hold_dropout)
+      sample = false;
+    if (!level && unit(rng) < model.idle_glitch)
+      sample = true;
+    trace.samples.push_back({st, sample});
+  }
+  return trace;
+}
+
+// Split a recorded trace into per switch sample streams. Without ground truth a
+// keystroke is taken to be a burst of raw edges separated by a quiet gap, timed
+// from its first edge.
+static void load_recorded(const char *path, std::vector<SwitchTrace> &corpus) {
+  const uint32_t quiet_us = 20000;
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "can't open %s\n", path);
+    exit(2);
+  }
+
+  ScanTraceReader reader;
+  std::vector<SwitchTrace> switches;
+  uint16_t rows[SCAN_TRACE_MAX_ROWS];
+  uint32_t t;
+  int c;
+
+  while ((c = fgetc(f)) != EOF) {
+    reader.feed(c);
+    while (reader.next_scan(rows, &t)) {
+      if (switches.empty())
+        switches.resize(reader.num_rows * 16);
+      for (uint8_t r=0; r<reader.num_rows; r++)
+        for (uint8_t col=0; col<16; col++)
+          switches[r*16+col].samples.push_back({t, !(rows[r] & (1 << col))});
+    }
+  }
+  fclose(f);
+
+  for (size_t i=0; i<switches.size(); i++) {
+    SwitchTrace &sw = switches[i];
+    bool level = false, any = false;
+    uint32_t last_edge = 0;
+    for (const Sample &s : sw.samples) {
+      if (s.active == level)
+        continue;
+      level = s.active;
+      any = true;
+      if (sw.truth.empty() || s.t - last_edge > quiet_us) {
+        if (sw.truth.empty() || sw.truth.back().pressed != level)
+          sw.truth.push_back({s.t, level});
+      }
+      last_edge = s.t;
+    }
+    if (!any)
+      continue;
+    sw.source = std::string(path) + ":r" + std::to_string(i/16) + "c" + std::to_string(i%16);
+    corpus.push_back(sw);
+  }
+}
+
+// --- Measurement -------------------------------------------------------------
+
+struct Result {
+  std::vector<uint32_t> press_latency;
+  std::vector<uint32_t> release_latency;
+  uint64_t keystrokes = 0;
+  uint64_t chatter = 0;
+  uint64_t missed = 0;
+  uint64_t updates = 0;
+  double nanoseconds = 0;
+};
+
+static void run(Debouncer &d, const SwitchTrace &trace, Result &result) {
+  std::vector<Edge> output;
+  bool state = false;
+
+  d.reset();
+  d.prepare(trace.samples);
+  auto start = std::chrono::steady_clock::now();
+  for (const Sample &s : trace.samples) {
+    host_set_micros(s.t);
+    bool next = d.update(s.active, s.t);
+    if (next != state) {
+      output.push_back({s.t, next});
+      state = next;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  result.nanoseconds += std::chrono::duration<double, std::nano>(end - start).count();
+  result.updates += trace.samples.size();
+
+  // Match each true edge with the first output edge of the same polarity before
+  // the next true edge. Everything else the algorithm emitted is chatter.
+  size_t oi = 0;
+  for (size_t ti=0; ti<trace.truth.size(); ti++) {
+    const Edge &truth = trace.truth[ti];
+    uint32_t window_end = (ti+1 < trace.truth.size()) ? trace.truth[ti+1].t : UINT32_MAX;
+    bool matched = false;
+
+    while (oi < output.size() && output[oi].t < truth.t) {
+      result.chatter++;
+      oi++;
+    }
+    while (oi < output.size() && output[oi].t < window_end) {
+      if (!matched && output[oi].pressed == truth.pressed) {
+        matched = true;
+        uint32_t latency = output[oi].t - truth.t;
+        (truth.pressed ? result.press_latency : result.release_latency).push_back(latency);
+      }
+      else {
+        result.chatter++;
+      }
+      oi++;
+    }
+    if (!matched)
+      result.missed++;
+    if (truth.pressed)
+      result.keystrokes++;
+  }
+  result.chatter += output.size() - oi;
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, double p) {
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size()-1, (size_t) (p * v.size()))];
+}
+
+int main(int argc, char **argv) {
+  uint32_t scan_us = 250;
+  int num_keystrokes = 2000;
+  uint32_t max_press_p99 = 0;
+  double max_chatter = -1;
+  bool adaptive_no_worse = false;
+  std::vector<const char *> traces;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-s" && i+1 < argc) scan_us = atoi(argv[++i]);
+    else if (arg == "-n" && i+1 < argc) num_keystrokes = atoi(argv[++i]);
+    else if (arg == "-t" && i+1 < argc) traces.push_back(argv[++i]);
+    else if (arg == "--max-press-p99" && i+1 < argc) max_press_p99 = atoi(argv[++i]);
+    else if (arg == "--max-chatter" && i+1 < argc) max_chatter = atof(argv[++i]);
+    else if (arg == "--adaptive-no-worse") adaptive_no_worse = true;
+    else {
+      fprintf(stderr, "usage: %s [-s scan_us] [-n keystrokes] [-t trace.bin ...] "
+              "[--max-press-p99 us] [--max-chatter per1000] [--adaptive-no-worse]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  std::vector<SwitchTrace> corpus;
+  uint32_t seed = 1;
+  for (const BounceModel &model : models)
+    corpus.push_back(synthesize(model, scan_us, num_keystrokes, seed++));
+  for (const char *path : traces)
+    load_recorded(path, corpus);
+
+  std::vector<Debouncer *> algorithms = {
+    new FirmwareDebouncer(),
+    new FirmwareDebouncer(FIRMWARE_ADAPTIVE),
+    new FirmwareDebouncer(FIRMWARE_LEARNED),
+    new CounterDebouncer(STEADY_COUNT, TRANSIENT_COUNT_ABS),
+    new CounterDebouncer(10, 8),
+    new DeferDebouncer(5),
+    new DeferDebouncer(20),
+    new EagerDebouncer(5000),
+    new IntegratorDebouncer(8),
+  };
+
+  bool failed = false;
+  printf("scan period %u us, %d keystrokes per synthetic model\n\n", scan_us, num_keystrokes);
+  printf("%-28s %-22s %25s %25s %9s %9s %8s %6s\n", "corpus", "algorithm",
+         "press us p50/p99/max", "release us p50/p99/max",
+         "chat/1k", "miss/1k", "ns/scan", "B/key");
+
+  for (const SwitchTrace &trace : corpus) {
+    uint64_t static_chatter = 0;
+    for (Debouncer *d : algorithms) {
+      Result r;
+      run(*d, trace, r);
+      double per1k = r.keystrokes ? 1000.0 / r.keystrokes : 0;
+      double chatter = r.chatter * per1k;
+      uint32_t press_p99 = percentile(r.press_latency, 0.99);
+      char press[32], release[32];
+      snprintf(press, sizeof(press), "%u/%u/%u", percentile(r.press_latency, 0.5),
+               press_p99, percentile(r.press_latency, 1.0));
+      snprintf(release, sizeof(release), "%u/%u/%u", percentile(r.release_latency, 0.5),
+               percentile(r.release_latency, 0.99), percentile(r.release_latency, 1.0));
+      printf("%-28s %-22s %25s %25s %9.1f %9.1f %8.0f %6zu\n",
+             trace.source.substr(0, 28).c_str(), d->name().c_str(), press, release,
+             chatter, r.missed * per1k, r.nanoseconds / r.updates * 60, d->state_bytes());
+
+      if (d == algorithms[0])
+        static_chatter = r.chatter;
+      else if (adaptive_no_worse && (d == algorithms[1] || d == algorithms[2]) &&
+               r.chatter > static_chatter) {
+        fprintf(stderr, "FAIL %s: %s chatter %llu > %llu without adaptive debounce\n",
+                trace.source.c_str(), d->name().c_str(), (unsigned long long) r.chatter,
+                (unsigned long long) static_chatter);
+        failed = true;
+      }
+
+      if (d == algorithms[0] && trace.source == "synthetic:typical") {
+        if (max_press_p99 && press_p99 > max_press_p99) {
+          fprintf(stderr, "FAIL %s: press p99 %u us > %u us\n", trace.source.c_str(), press_p99, max_press_p99);
+          failed = true;
+        }
+        if (max_chatter >= 0 && chatter > max_chatter) {
+          fprintf(stderr, "FAIL %s: chatter %.1f > %.1f per 1000\n", trace.source.c_str(), chatter, max_chatter);
+          failed = true;
+        }
+      }
+    }
+  }
+
+  for (Debouncer *d : algorithms)
+    delete d;
+  return failed ? 1 : 0;
+}
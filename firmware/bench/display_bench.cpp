@@ -0,0 +1,154 @@
+// Incremental display rendering benchmark
+//
+// Drives TextDisplay with the firmware's typing echo (a 63 character ring with
+// a cursor) against an in-memory framebuffer standing in for the SPI display.
+// The framebuffer driver stays busy for a while after each window, like a DMA
+// transfer would, so update() has to skip polls. After every keystroke the
+// display is run until idle and the framebuffer is checked against a full
+// render of the text.
+//
+// Reports bytes sent per keystroke against a full redraw and how many polls a
+// keystroke takes to reach the screen. Exits non-zero on any mismatch.
+//
+// Usage: display_bench [-n keystrokes] [--busy polls] [--seed n]
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../TextDisplay.h"
+
+#define SCREEN_WIDTH 160
+#define SCREEN_HEIGHT 128
+// same as the firmware's test_string
+#define TEXT_LENGTH 63
+
+class FramebufferDisplay : public DisplayDriver {
+public:
+  FramebufferDisplay(uint32_t busy) : busy_polls(busy), busy_left(0), windows(0), bytes(0) {
+    pixels.assign(SCREEN_WIDTH*SCREEN_HEIGHT, 0x1234);
+  }
+
+  std::vector<uint16_t> pixels;
+  uint32_t busy_polls;
+  uint32_t busy_left;
+  uint32_t windows;
+  uint64_t bytes;
+
+  bool busy() {
+    if (busy_left == 0)
+      return false;
+    busy_left--;
+    return true;
+  }
+
+  void write_window(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const uint8_t *data) {
+    if (busy_left > 0) {
+      fprintf(stderr, "write_window() while busy\n");
+      exit(1);
+    }
+    for (uint16_t row=0; row<h; row++) {
+      for (uint16_t col=0; col<w; col++) {
+        const uint8_t *p = &data[(row*w + col)*2];
+        if (x+col < SCREEN_WIDTH && y+row < SCREEN_HEIGHT)
+          pixels[(y+row)*SCREEN_WIDTH + x+col] = (p[0] << 8) | p[1];
+      }
+    }
+    windows++;
+    bytes += w*h*2;
+    busy_left = busy_polls;
+  }
+};
+
+static uint32_t check(TextDisplay &display, FramebufferDisplay &fb) {
+  uint16_t cell_pixels[DISPLAY_CELL_WIDTH*DISPLAY_CELL_HEIGHT];
+  uint32_t bad = 0;
+
+  for (uint16_t cell=0; cell<display.num_cols*display.num_rows; cell++) {
+    display.render_cell(cell, cell_pixels);
+    uint16_t x0 = (cell % display.num_cols)*DISPLAY_CELL_WIDTH;
+    uint16_t y0 = (cell / display.num_cols)*DISPLAY_CELL_HEIGHT;
+    for (uint8_t y=0; y<DISPLAY_CELL_HEIGHT; y++) {
+      for (uint8_t x=0; x<DISPLAY_CELL_WIDTH; x++) {
+        if (fb.pixels[(y0+y)*SCREEN_WIDTH + x0+x] != cell_pixels[y*DISPLAY_CELL_WIDTH + x])
+          bad++;
+      }
+    }
+  }
+  return bad;
+}
+
+// Poll until everything is on screen, returns the number of polls
+static uint32_t settle(TextDisplay &display) {
+  uint32_t polls = 0;
+  while (!display.idle()) {
+    display.update();
+    polls++;
+  }
+  return polls;
+}
+
+int main(int argc, char **argv) {
+  uint32_t keystrokes = 20000;
+  uint32_t busy = 20;
+  uint32_t seed = 1;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) keystrokes = atoi(argv[++i]);
+    else if (arg == "--busy" && i+1 < argc) busy = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n keystrokes] [--busy polls] [--seed n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  FramebufferDisplay fb(busy);
+  TextDisplay display(&fb, SCREEN_WIDTH / DISPLAY_CELL_WIDTH, SCREEN_HEIGHT / DISPLAY_CELL_HEIGHT);
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> printable(32, 126);
+  std::uniform_int_distribution<int> percent(0, 99);
+
+  uint8_t index = 0;
+  display.set_cursor(index);
+  uint32_t initial_polls = settle(display);
+  uint64_t initial_bytes = fb.bytes;
+  uint32_t initial_windows = fb.windows;
+  uint32_t mismatches = check(display, fb);
+
+  uint32_t max_polls = 0;
+  uint64_t total_polls = 0;
+  for (uint32_t k=0; k<keystrokes; k++) {
+    // same ring and cursor handling as the firmware
+    if (percent(rng) < 15) {
+      index = (index + TEXT_LENGTH-1) % TEXT_LENGTH;
+      display.set_char(index, ' ');
+    }
+    else {
+      display.set_char(index, printable(rng));
+      index = (index + 1) % TEXT_LENGTH;
+    }
+    display.set_cursor(index);
+
+    uint32_t polls = settle(display);
+    total_polls += polls;
+    if (polls > max_polls)
+      max_polls = polls;
+    if (k % 97 == 0)
+      mismatches += check(display, fb);
+  }
+  mismatches += check(display, fb);
+
+  uint32_t full_redraw = SCREEN_WIDTH*SCREEN_HEIGHT*2;
+  double per_key = (double) (fb.bytes - initial_bytes) / keystrokes;
+  printf("%u keystrokes, driver busy for %u polls per window\n\n", keystrokes, busy);
+  printf("first draw          %8llu bytes in %u polls\n", (unsigned long long) initial_bytes, initial_polls);
+  printf("bytes per keystroke %8.0f (full redraw %u, %.1f%%)\n", per_key, full_redraw, 100.0*per_key/full_redraw);
+  printf("windows per key     %8.2f\n", (double) (fb.windows - initial_windows) / keystrokes);
+  printf("polls per key       %8.1f avg %u max\n", (double) total_polls / keystrokes, max_polls);
+  printf("pixel mismatches    %8u\n", mismatches);
+
+  return mismatches ? 1 : 0;
+}
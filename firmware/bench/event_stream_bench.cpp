@@ -0,0 +1,486 @@
+// Key event stream benchmark
+//
+// Streams a long run of key events with heavy rollover (chords of up to 30
+// keys, and everything on the layout held at once) through the firmware's
+// KeyEventStreamWriter into a pty, the way loop() streams it to USB serial.
+// keyeventd's KeyEventReader drains the other end without blocking into a
+// recording sink. Checks that every event arrives in order with its exact
+// timestamp, that nothing is dropped, and that closing the port releases
+// whatever was still held.
+//
+// Frames are then corrupted (bytes replaced, runs of bytes lost) and decoded
+// again: no key may be left held once clean frames resume, and a bad frame
+// must never turn into a key the firmware didn't send, beyond what the crc8
+// lets through.
+//
+// Last, the decode cost per event is compared with diffing 6KRO boot reports
+// the way the kernel's usbkbd driver does, for the same events typed through
+// the host Keyboard class, along with how many presses 6KRO loses. The timing
+// is reported, not checked.
+//
+// Usage: event_stream_bench [-n events] [--seed n]
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../KeyEventStream.h"
+#include "../LayoutThumbKeyboard.h"
+#include "KeyEventReader.h"
+
+#define SCAN_MICROS 1000
+#define LOOP_MICROS 100
+// as in the .ino
+#define KEY_EVENT_STREAM_BYTES 64
+// Teensy USB serial packet buffer
+#define USB_PACKET_SIZE 64
+#define MAX_CHORD 30
+#define MIN_ROLLOVER 20
+
+struct ScriptEvent {
+  uint32_t micros;
+  uint8_t key;
+  bool pressed;
+};
+
+struct SinkEvent {
+  uint16_t code;
+  bool pressed;
+  uint32_t micros;
+};
+
+// Keys whose base layer sends a plain held key, by key id. Only the first key
+// on each code: the reader holds a code shared by two keys (the space bars)
+// until both are up, which the script's one event per key wouldn't match.
+static std::vector<uint8_t> typing_keys;
+static uint16_t base_code[NUM_ROWS * NUM_COLS];
+
+class RecordingSink : public EventSink {
+public:
+  RecordingSink() : max_down(0), double_presses(0), stray_releases(0), syncs(0) {}
+
+  std::vector<SinkEvent> events;
+  std::set<uint16_t> down;
+  size_t max_down;
+  uint32_t double_presses;
+  uint32_t stray_releases;
+  uint32_t syncs;
+
+  void key(uint16_t code, bool pressed, uint32_t micros) {
+    SinkEvent e = {code, pressed, micros};
+    events.push_back(e);
+    if (pressed) {
+      if (!down.insert(code).second)
+        double_presses++;
+      max_down = std::max(max_down, down.size());
+    }
+    else if (down.erase(code) == 0)
+      stray_releases++;
+  }
+  void sync() { syncs++; }
+};
+
+class CountingSink : public EventSink {
+public:
+  CountingSink() : keys(0), syncs(0) {}
+  uint32_t keys;
+  uint32_t syncs;
+  void key(uint16_t code, bool pressed, uint32_t micros) { keys += code + pressed; }
+  void sync() { syncs++; }
+};
+
+// Teensy USB serial on the firmware side of a pty, room for a packet at a time
+class PtyStream : public Stream {
+public:
+  PtyStream(int pty_fd) : fd(pty_fd), short_writes(0) {}
+
+  int fd;
+  uint32_t short_writes;
+
+  size_t write(uint8_t b) { return write(&b, 1); }
+  size_t write(const uint8_t *buffer, size_t size) {
+    ssize_t n = ::write(fd, buffer, size);
+    if (n != (ssize_t) size)
+      short_writes++;
+    return n > 0 ? n : 0;
+  }
+  int availableForWrite(void) { return USB_PACKET_SIZE; }
+  int available(void) { return 0; }
+  int read(void) { return -1; }
+};
+
+class MemoryStream : public Stream {
+public:
+  std::vector<uint8_t> bytes;
+  size_t write(uint8_t b) { bytes.push_back(b); return 1; }
+  int availableForWrite(void) { return KEY_EVENT_BUFFER_SIZE; }
+  int available(void) { return 0; }
+  int read(void) { return -1; }
+};
+
+// Random key events one scan apart at most: chords pressed and released in a
+// single scan, every typing key held at once, and random rollover in between
+static std::vector<ScriptEvent> make_script(uint32_t count, std::mt19937 &rng, bool release_at_end) {
+  std::vector<ScriptEvent> script;
+  std::set<uint8_t> held;
+  uint32_t now = SCAN_MICROS;
+
+  auto press = [&](uint8_t key) { script.push_back({now, key, true}); held.insert(key); };
+  auto release = [&](uint8_t key) { script.push_back({now, key, false}); held.erase(key); };
+  auto release_all = [&]() {
+    std::vector<uint8_t> keys(held.begin(), held.end());
+    for (uint8_t key : keys)
+      release(key);
+  };
+
+  while (script.size() < count) {
+    uint32_t kind = rng() % 8;
+    release_all();
+    now += SCAN_MICROS * (5 + rng() % 20);
+
+    if (kind == 0) {
+      // everything down, a scan at a time, then up
+      std::vector<uint8_t> keys = typing_keys;
+      std::shuffle(keys.begin(), keys.end(), rng);
+      for (uint8_t key : keys) {
+        press(key);
+        now += SCAN_MICROS;
+      }
+      now += SCAN_MICROS * 20;
+    }
+    else if (kind == 1) {
+      std::vector<uint8_t> keys = typing_keys;
+      std::shuffle(keys.begin(), keys.end(), rng);
+      uint32_t size = MIN_ROLLOVER + rng() % (MAX_CHORD - MIN_ROLLOVER + 1);
+      for (uint32_t i=0; i<size; i++)
+        press(keys[i]);
+      now += SCAN_MICROS * (10 + rng() % 50);
+    }
+    else {
+      for (uint32_t step=0; step<200; step++) {
+        uint8_t key = typing_keys[rng() % typing_keys.size()];
+        if (held.count(key))
+          release(key);
+        else if (held.size() < 12)
+          press(key);
+        now += SCAN_MICROS * (1 + rng() % 4);
+      }
+    }
+  }
+  if (release_at_end)
+    release_all();
+  return script;
+}
+
+static bool open_pty(int *master, int *slave) {
+  *master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (*master < 0 || grantpt(*master) != 0 || unlockpt(*master) != 0)
+    return false;
+  *slave = open(ptsname(*master), O_RDONLY | O_NOCTTY | O_NONBLOCK);
+  if (*slave < 0)
+    return false;
+  struct termios tio;
+  tcgetattr(*slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(*slave, TCSANOW, &tio);
+  fcntl(*master, F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+// Whether the sink got exactly the script's events, with their timestamps
+static bool matches_script(const std::vector<ScriptEvent> &script, const std::vector<SinkEvent> &events,
+                           size_t *first_difference) {
+  size_t i;
+  for (i=0; i<script.size() && i<events.size(); i++) {
+    const ScriptEvent &s = script[i];
+    const SinkEvent &e = events[i];
+    if (e.code != base_code[s.key] || e.pressed != s.pressed || e.micros != s.micros)
+      break;
+  }
+  *first_difference = i;
+  return i == script.size() && i == events.size();
+}
+
+static bool check_pty(const std::vector<ScriptEvent> &script) {
+  int master, slave;
+  if (!open_pty(&master, &slave)) {
+    perror("pty");
+    return false;
+  }
+
+  KeyEventStreamWriter writer;
+  PtyStream pty(master);
+  RecordingSink sink;
+  KeyEventReader reader(&sink);
+
+  size_t next = 0;
+  uint32_t now = 0;
+  uint32_t last_event = script.back().micros;
+  while (next < script.size() || now < last_event + SCAN_MICROS * 10) {
+    // a scan's worth of events, then the rest of loop()
+    if (now % SCAN_MICROS == 0) {
+      while (next < script.size() && script[next].micros <= now) {
+        writer.record(script[next].key, script[next].pressed, 0, script[next].micros);
+        next++;
+      }
+    }
+    writer.stream_to(&pty, KEY_EVENT_STREAM_BYTES);
+    // the daemon wakes up about once a millisecond
+    if (now % SCAN_MICROS == SCAN_MICROS / 2) {
+      struct pollfd pfd = {slave, POLLIN, 0};
+      if (poll(&pfd, 1, 0) > 0)
+        reader.drain(slave);
+    }
+    now += LOOP_MICROS;
+  }
+  reader.drain(slave);
+  size_t events_before_close = sink.events.size();
+  size_t held_before_close = sink.down.size();
+
+  // unplugged with keys held
+  close(master);
+  bool closed = !reader.drain(slave);
+  close(slave);
+
+  size_t difference;
+  std::vector<SinkEvent> streamed(sink.events.begin(), sink.events.begin() + events_before_close);
+  bool intact = matches_script(script, streamed, &difference);
+  bool ok = intact && writer.dropped_events == 0 && pty.short_writes == 0 && reader.crc_errors == 0 &&
+    reader.sequence_errors == 0 && sink.max_down >= MIN_ROLLOVER && closed && sink.down.empty() &&
+    sink.double_presses == 0 && sink.stray_releases == 0;
+
+  printf("pty: %zu events, %u frames, %u reads, %u syncs, max %zu keys held\n", script.size(), reader.frames,
+         reader.reads, sink.syncs, sink.max_down);
+  printf("  dropped %u, short writes %u, crc errors %u, sequence errors %u\n", writer.dropped_events,
+         pty.short_writes, reader.crc_errors, reader.sequence_errors);
+  printf("  in order with exact timestamps: %s", intact ? "yes" : "NO");
+  if (!intact)
+    printf(" (first difference at event %zu)", difference);
+  printf("\n  %zu held at close, released on hangup: %s\n", held_before_close,
+         closed && sink.down.empty() ? "yes" : "NO");
+  return ok;
+}
+
+enum Corruption { REPLACE_BYTES, LOSE_BYTES };
+
+static bool check_corruption(Corruption corruption, const std::vector<ScriptEvent> &script, std::mt19937 &rng) {
+  KeyEventStreamWriter writer;
+  MemoryStream memory;
+  std::set<std::pair<uint16_t, uint32_t> > sent_presses;
+
+  for (const ScriptEvent &e : script) {
+    writer.record(e.key, e.pressed, 0, e.micros);
+    writer.stream_to(&memory, KEY_EVENT_BUFFER_SIZE);
+    if (e.pressed)
+      sent_presses.insert(std::make_pair(base_code[e.key], e.micros));
+  }
+
+  // one frame in 20 hit
+  std::vector<uint8_t> bytes;
+  uint32_t hits = 0;
+  for (size_t i=0; i<memory.bytes.size(); i+=KEY_EVENT_FRAME_SIZE) {
+    std::vector<uint8_t> frame(memory.bytes.begin() + i, memory.bytes.begin() + i + KEY_EVENT_FRAME_SIZE);
+    if (rng() % 20 == 0) {
+      hits++;
+      size_t at = rng() % KEY_EVENT_FRAME_SIZE;
+      if (corruption == REPLACE_BYTES)
+        frame[at] ^= 1 + rng() % 255;
+      else
+        frame.erase(frame.begin() + at, frame.begin() + std::min<size_t>(at + 1 + rng() % 12, frame.size()));
+    }
+    bytes.insert(bytes.end(), frame.begin(), frame.end());
+  }
+
+  // a few clean frames after the last hit
+  std::vector<ScriptEvent> tail;
+  uint32_t now = script.back().micros;
+  for (uint32_t i=0; i<4; i++) {
+    now += SCAN_MICROS * 50;
+    tail.push_back({now, typing_keys[i], true});
+    tail.push_back({now + SCAN_MICROS * 30, typing_keys[i], false});
+  }
+  memory.bytes.clear();
+  for (const ScriptEvent &e : tail) {
+    writer.record(e.key, e.pressed, 0, e.micros);
+    writer.stream_to(&memory, KEY_EVENT_BUFFER_SIZE);
+    if (e.pressed)
+      sent_presses.insert(std::make_pair(base_code[e.key], e.micros));
+  }
+  bytes.insert(bytes.end(), memory.bytes.begin(), memory.bytes.end());
+
+  RecordingSink sink;
+  KeyEventReader reader(&sink);
+  for (size_t i=0; i<bytes.size(); i+=USB_PACKET_SIZE)
+    reader.feed(&bytes[i], std::min<size_t>(USB_PACKET_SIZE, bytes.size() - i));
+
+  uint32_t wrong = 0, presses = 0;
+  for (const SinkEvent &e : sink.events) {
+    if (!e.pressed)
+      continue;
+    presses++;
+    if (sent_presses.count(std::make_pair(e.code, e.micros)) == 0)
+      wrong++;
+  }
+  wrong += sink.double_presses + sink.stray_releases;
+
+  // A frame that lost bytes is made up from the start of the next one, which
+  // the crc8 lets through one time in 256. Replaced bytes never get past it.
+  uint32_t max_wrong = corruption == REPLACE_BYTES ? 0 : reader.crc_errors * 2 / 256;
+  bool ok = sink.down.empty() && wrong <= max_wrong;
+  printf("%-14s %6u frames hit, %6u crc errors, %6u sequence errors, %6u of %zu presses injected, "
+         "%u wrong, %zu stuck\n", corruption == REPLACE_BYTES ? "replace bytes:" : "lose bytes:", hits,
+         reader.crc_errors, reader.sequence_errors, presses, sent_presses.size(), wrong, sink.down.size());
+  return ok;
+}
+
+// The kernel's usbkbd: modifier bits, then each key missing from the other
+// report
+static uint16_t usage_to_linux[256];
+static const uint8_t modifier_to_linux[8] = {29, 42, 56, 125, 97, 54, 100, 126};
+
+static void parse_boot_report(const uint8_t *old_report, const uint8_t *report, EventSink *sink) {
+  for (uint8_t i=0; i<8; i++) {
+    if ((old_report[0] ^ report[0]) & (1 << i))
+      sink->key(modifier_to_linux[i], (report[0] >> i) & 1, 0);
+  }
+  for (uint8_t i=2; i<8; i++) {
+    if (old_report[i] > 3 && memchr(report + 2, old_report[i], 6) == NULL)
+      sink->key(usage_to_linux[old_report[i]], false, 0);
+    if (report[i] > 3 && memchr(old_report + 2, report[i], 6) == NULL)
+      sink->key(usage_to_linux[report[i]], true, 0);
+  }
+  sink->sync();
+}
+
+static std::vector<uint8_t> hid_reports;
+
+static void collect_report(const uint8_t *report) {
+  hid_reports.insert(hid_reports.end(), report, report + HOST_KEYBOARD_REPORT_SIZE);
+}
+
+static double nanoseconds_per(uint32_t count, std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count() / count;
+}
+
+static void compare_hid(const std::vector<ScriptEvent> &script) {
+  KeyEventStreamWriter writer;
+  MemoryStream memory;
+  for (const ScriptEvent &e : script) {
+    writer.record(e.key, e.pressed, 0, e.micros);
+    writer.stream_to(&memory, KEY_EVENT_BUFFER_SIZE);
+  }
+  const std::vector<uint8_t> &stream_bytes = memory.bytes;
+
+  hid_reports.clear();
+  host_set_keyboard_listener(collect_report);
+  for (const ScriptEvent &e : script) {
+    uint16_t usb_key = usb_key_matrix[e.key / NUM_COLS][e.key % NUM_COLS];
+    if (e.pressed)
+      Keyboard.press(usb_key);
+    else
+      Keyboard.release(usb_key);
+  }
+  Keyboard.releaseAll();
+  host_set_keyboard_listener(NULL);
+
+  uint32_t num_reports = hid_reports.size() / HOST_KEYBOARD_REPORT_SIZE;
+  uint32_t presses = 0, hid_presses = 0;
+  for (const ScriptEvent &e : script)
+    presses += e.pressed;
+  RecordingSink parsed;
+  uint8_t empty[HOST_KEYBOARD_REPORT_SIZE] = {0};
+  for (uint32_t r=0; r<num_reports; r++)
+    parse_boot_report(r ? &hid_reports[(r - 1) * HOST_KEYBOARD_REPORT_SIZE] : empty,
+                      &hid_reports[r * HOST_KEYBOARD_REPORT_SIZE], &parsed);
+  for (const SinkEvent &e : parsed.events)
+    hid_presses += e.pressed;
+
+  // enough repetitions for a few hundred milliseconds each
+  const uint32_t repeat = 50;
+  CountingSink counting;
+
+  auto start = std::chrono::steady_clock::now();
+  uint32_t frames = 0;
+  for (uint32_t n=0; n<repeat; n++) {
+    KeyEventReader reader(&counting);
+    for (size_t i=0; i<stream_bytes.size(); i+=KEY_EVENT_READ_SIZE) {
+      reader.feed(&stream_bytes[i], std::min<size_t>(KEY_EVENT_READ_SIZE, stream_bytes.size() - i));
+      counting.sync();
+    }
+    frames += reader.frames;
+  }
+  double stream_ns = nanoseconds_per(frames, start);
+
+  start = std::chrono::steady_clock::now();
+  for (uint32_t n=0; n<repeat; n++) {
+    for (uint32_t r=0; r<num_reports; r++)
+      parse_boot_report(r ? &hid_reports[(r - 1) * HOST_KEYBOARD_REPORT_SIZE] : empty,
+                        &hid_reports[r * HOST_KEYBOARD_REPORT_SIZE], &counting);
+  }
+  double hid_ns = nanoseconds_per(num_reports * repeat, start);
+
+  printf("\n%-22s %10s %12s %14s\n", "host decode", "ns/event", "presses", "timestamps");
+  printf("%-22s %10.1f %5u of %-5u %14s\n", "key event stream", stream_ns, presses, presses, "per event");
+  printf("%-22s %10.1f %5u of %-5u %14s\n", "6KRO boot reports", hid_ns, hid_presses, presses, "none");
+}
+
+int main(int argc, char **argv) {
+  uint32_t count = 20000;
+  uint32_t seed = 1;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) count = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n events] [--seed n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  for (uint16_t key=0; key<keymap_num_keys(); key++) {
+    KeyAction action;
+    if (keymap_action(key, 0, &action) && action.code != 0 && !action.tap && !action.modifier &&
+        usage_to_linux[usb_key_matrix[key / NUM_COLS][key % NUM_COLS] & 0xFF] == 0) {
+      uint16_t usb_key = usb_key_matrix[key / NUM_COLS][key % NUM_COLS];
+      typing_keys.push_back(key);
+      base_code[key] = action.code;
+      usage_to_linux[usb_key & 0xFF] = action.code;
+    }
+  }
+  printf("%zu typing keys on the base layer\n\n", typing_keys.size());
+
+  std::mt19937 rng(seed);
+  bool failed = false;
+
+  // ends with keys held for the hangup check
+  std::vector<ScriptEvent> script = make_script(count, rng, false);
+  if (!check_pty(script))
+    failed = true;
+
+  printf("\n");
+  std::vector<ScriptEvent> released = make_script(count, rng, true);
+  if (!check_corruption(REPLACE_BYTES, released, rng))
+    failed = true;
+  if (!check_corruption(LOSE_BYTES, released, rng))
+    failed = true;
+
+  compare_hid(released);
+
+  if (failed) {
+    printf("\nFAILED\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,484 @@
+// I/O expander matrix benchmark
+//
+// Runs the same typing script (random keys with contact bounce, some rolled
+// over into the next, separated by idle gaps) through two KeyboardMatrix
+// instances in lockstep: one on simulated Teensy pins, one through a
+// MatrixLineDriver talking to a simulated part on the host SPI or I2C bus:
+//
+//   - ShiftRegisterLines: 74HC595 strobe and 74HC165 sense chains sharing SCK
+//     and a latch pin, modelled a byte at a time
+//   - MCP23017Lines: the expander's register file with sequential addressing,
+//     port A driving strobe lines and port B reading sense lines
+//
+// on matrices from the thumb keyboard's 6x10 up to 24x16, in both diode
+// directions. Every scan's matrix_state and key events must match the pin
+// scan's, and the idle fast path (the driver's probe()) must be taken on the
+// same scans.
+//
+// Bus time is the bits on the wire at the driver's clock (for I2C counting a
+// start or stop as one bit), not the Teensy's time per burst around them.
+// Pin reads for the native scan are there for scale.
+//
+// Exits non-zero if anything differs.
+//
+// Usage: expander_bench [-n keystrokes] [--seed n]
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "Wire.h"
+#include "../KeyboardMatrix.h"
+#include "../ShiftRegisterLines.h"
+#include "../MCP23017Lines.h"
+
+#define SCAN_MICROS 250
+#define LATCH_PIN 60
+#define MAX_LINES 32
+
+// Switches between strobe and sense lines, shared by the simulated parts
+class SimulatedMatrix {
+public:
+  uint32_t closed[MAX_LINES];
+
+  SimulatedMatrix() { memset(closed, 0, sizeof(closed)); }
+
+  // Sense lines pulled low by the strobe lines in active_strobes
+  uint32_t pulled_low(uint32_t active_strobes) {
+    uint32_t low = 0;
+    for (uint8_t line=0; line<MAX_LINES; line++) {
+      if (active_strobes & (1UL << line))
+        low |= closed[line];
+    }
+    return low;
+  }
+};
+
+class ShiftRegisterChains : public HostSpiDevice {
+public:
+  ShiftRegisterChains(SimulatedMatrix *switches, uint8_t strobe_registers, uint8_t sense_registers)
+    : switches(switches), num_595(strobe_registers), num_165(sense_registers) {
+    memset(shift_595, 0xFF, sizeof(shift_595));
+    memset(outputs_595, 0xFF, sizeof(outputs_595));
+    memset(shift_165, 0xFF, sizeof(shift_165));
+    bytes = 0;
+    pulses = 0;
+  }
+
+  uint32_t bytes;
+  uint32_t pulses;
+
+  // The first 595 takes the byte that comes in, the first 165 sends its byte
+  uint8_t transfer(uint8_t out) {
+    bytes++;
+    uint8_t in = shift_165[0];
+    for (uint8_t r=0; r+1<num_165; r++)
+      shift_165[r] = shift_165[r+1];
+    // SER of the last 165 tied high
+    shift_165[num_165-1] = 0xFF;
+    for (uint8_t r=num_595-1; r>0; r--)
+      shift_595[r] = shift_595[r-1];
+    shift_595[0] = out;
+    return in;
+  }
+
+  // latch low: the 165s load, latch high: the 595s latch
+  void latch(uint8_t value) {
+    if (value == LOW) {
+      pulses++;
+      uint32_t active = 0;
+      for (uint8_t r=0; r<num_595; r++)
+        active |= (uint32_t) (uint8_t) ~outputs_595[r] << (r*8);
+      uint32_t high = ~switches->pulled_low(active);
+      for (uint8_t r=0; r<num_165; r++)
+        shift_165[r] = high >> (r*8);
+    }
+    else {
+      memcpy(outputs_595, shift_595, sizeof(shift_595));
+    }
+  }
+
+private:
+  SimulatedMatrix *switches;
+  uint8_t num_595;
+  uint8_t num_165;
+  uint8_t shift_595[4];
+  uint8_t outputs_595[4];
+  uint8_t shift_165[4];
+};
+
+static ShiftRegisterChains *latched_chains;
+
+static void latch_listener(uint8_t pin, uint8_t value) {
+  if (pin == LATCH_PIN && latched_chains != NULL)
+    latched_chains->latch(value);
+}
+
+class MCP23017 : public HostI2cDevice {
+public:
+  MCP23017(SimulatedMatrix *switches) : switches(switches) {
+    memset(registers, 0, sizeof(registers));
+    registers[MCP23017_IODIRA] = 0xFF;
+    registers[MCP23017_IODIRB] = 0xFF;
+    pointer = 0;
+    bits = 0;
+    bytes = 0;
+    transactions = 0;
+  }
+
+  uint32_t bits;
+  uint32_t bytes;
+  // a read after a write without a stop is part of the write's transaction
+  uint32_t transactions;
+
+  void receive(const uint8_t *data, size_t length) {
+    transactions++;
+    count(length);
+    if (length == 0)
+      return;
+    pointer = data[0];
+    for (size_t i=1; i<length; i++) {
+      // writes to GPIOx land in OLATx
+      uint8_t reg = pointer == MCP23017_GPIOA ? MCP23017_OLATA : pointer;
+      registers[reg] = data[i];
+      advance();
+    }
+  }
+
+  uint8_t send(void) {
+    uint8_t value;
+    if (pointer == MCP23017_GPIOB) {
+      // port A outputs latched low strobe their lines, port B reads with its
+      // pullups
+      uint8_t active = ~registers[MCP23017_IODIRA] & ~registers[MCP23017_OLATA];
+      value = ~switches->pulled_low(active);
+    }
+    else {
+      value = registers[pointer];
+    }
+    advance();
+    return value;
+  }
+
+  void request(uint8_t quantity) {
+    count(quantity);
+  }
+
+  // start, address, data with ACKs, stop (or repeated start)
+  void count(size_t data_bytes) {
+    bytes += 1 + data_bytes;
+    bits += 1 + 9 * (1 + data_bytes) + 1;
+  }
+
+private:
+  SimulatedMatrix *switches;
+  uint8_t registers[0x16];
+  uint8_t pointer;
+
+  void advance() {
+    pointer = (pointer + 1) % sizeof(registers);
+  }
+};
+
+enum Backend { SHIFT_REGISTERS, EXPANDER_MCP23017 };
+
+struct Config {
+  const char *name;
+  Backend backend;
+  uint8_t rows;
+  uint8_t cols;
+  uint8_t diode_direction;
+};
+
+struct Result {
+  uint32_t scans;
+  uint32_t idle_scans_native;
+  uint32_t idle_scans_driver;
+  uint32_t events;
+  uint32_t differ;
+  uint32_t native_reads;
+  // bus cost of one full scan and one probe
+  double scan_bus_micros;
+  double probe_bus_micros;
+  uint32_t scan_bursts;
+  uint32_t scan_bytes;
+  // bus time over the whole script
+  double total_bus_micros;
+};
+
+struct Events {
+  std::vector<uint32_t> keys;
+
+  void collect(KeyboardMatrix &matrix) {
+    keys.clear();
+    for (int i=0; i<matrix.released_list.size(); i++) {
+      ReleasedKey *key = matrix.released_list.get(i);
+      keys.push_back(0x10000 | key->row << 8 | key->col);
+    }
+    PressedKey *key = matrix.new_key();
+    if (key != NULL)
+      keys.push_back(key->row << 8 | key->col);
+  }
+};
+
+class Run {
+public:
+  Run(const Config &config) : config(config) {
+    for (uint8_t r=0; r<config.rows; r++)
+      row_pins[r] = r;
+    for (uint8_t c=0; c<config.cols; c++)
+      col_pins[c] = 32 + c;
+    for (uint8_t r=0; r<config.rows; r++) {
+      for (uint8_t c=0; c<config.cols; c++) {
+        host_set_switch(col_pins[c], row_pins[r], false);
+        host_set_switch(row_pins[r], col_pins[c], false);
+      }
+    }
+    chains = NULL;
+    expander = NULL;
+    shift_register_lines = NULL;
+    mcp23017_lines = NULL;
+  }
+
+  ~Run() {
+    delete native;
+    delete driven;
+    delete shift_register_lines;
+    delete mcp23017_lines;
+    host_set_spi_device(NULL);
+    host_set_i2c_device(MCP23017_DEFAULT_ADDRESS, NULL);
+    host_set_pin_listener(NULL);
+    latched_chains = NULL;
+    delete chains;
+    delete expander;
+  }
+
+  Result go(uint32_t keystrokes, uint32_t seed) {
+    Result result = Result();
+    uint32_t now = 1000;
+    host_set_micros(now);
+
+    native = new KeyboardMatrix(config.rows, config.cols, row_pins, col_pins, config.diode_direction);
+    driven = new KeyboardMatrix(config.rows, config.cols, NULL, NULL, config.diode_direction);
+    uint8_t strobe_lines = driven->num_strobe_lines;
+    uint8_t sense_lines = driven->num_sense_lines;
+
+    MatrixLineDriver *driver;
+    if (config.backend == SHIFT_REGISTERS) {
+      chains = new ShiftRegisterChains(&switches, (strobe_lines + 7) / 8, (sense_lines + 7) / 8);
+      latched_chains = chains;
+      host_set_pin_listener(latch_listener);
+      host_set_spi_device(chains);
+      shift_register_lines = new ShiftRegisterLines(LATCH_PIN);
+      driver = shift_register_lines;
+    }
+    else {
+      expander = new MCP23017(&switches);
+      host_set_i2c_device(MCP23017_DEFAULT_ADDRESS, expander);
+      mcp23017_lines = new MCP23017Lines();
+      driver = mcp23017_lines;
+    }
+    driven->set_line_driver(driver);
+    native->begin();
+    driven->begin();
+
+    // cost of one full scan and one probe, all keys open
+    measure(driver, &result);
+    double bus_before = bus_micros();
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> row(0, config.rows-1);
+    std::uniform_int_distribution<int> col(0, config.cols-1);
+    std::uniform_int_distribution<int> bounce_scans(0, 6);
+    std::uniform_int_distribution<int> hold_scans(40, 400);
+    std::uniform_int_distribution<int> gap_scans(20, 1000);
+    std::uniform_int_distribution<int> percent(0, 99);
+
+    // 0: idle gap, 1: press bounce, 2: held, 3: release bounce
+    int phase = 0;
+    int left = gap_scans(rng);
+    uint8_t r = 0, c = 0;
+    // a key still held from the last keystroke (rollover), released partway
+    // into this one's hold
+    int rolled_r = -1, rolled_c = -1;
+    uint32_t done = 0;
+    Events native_events, driven_events;
+
+    while (done < keystrokes || phase != 0 || left > 0) {
+      if (left <= 0) {
+        phase = (phase + 1) % 4;
+        if (phase == 0) {
+          if (percent(rng) < 30) {
+            rolled_r = r;
+            rolled_c = c;
+            phase = 1;
+            r = row(rng);
+            c = col(rng);
+            left = bounce_scans(rng);
+          }
+          else {
+            set_key(r, c, false);
+            left = done < keystrokes ? gap_scans(rng) : 50;
+          }
+          done++;
+        }
+        else if (phase == 1) {
+          r = row(rng);
+          c = col(rng);
+          left = bounce_scans(rng);
+        }
+        else if (phase == 2) {
+          set_key(r, c, true);
+          left = hold_scans(rng);
+        }
+        else {
+          left = bounce_scans(rng);
+        }
+      }
+      if (phase == 1 || phase == 3)
+        set_key(r, c, percent(rng) < 50);
+      if (phase == 2 && rolled_r >= 0) {
+        if (rolled_r != r || rolled_c != c)
+          set_key(rolled_r, rolled_c, false);
+        rolled_r = -1;
+      }
+      left--;
+
+      now += SCAN_MICROS;
+      host_set_micros(now);
+      uint32_t reads_before = host_pin_reads();
+      bool native_changed = native->update();
+      result.native_reads += host_pin_reads() - reads_before;
+      bool driven_changed = driven->update();
+
+      bool same = native_changed == driven_changed;
+      for (uint8_t row_index=0; row_index<config.rows; row_index++) {
+        if (native->matrix_state[row_index] != driven->matrix_state[row_index])
+          same = false;
+      }
+      native_events.collect(*native);
+      driven_events.collect(*driven);
+      if (native_events.keys != driven_events.keys)
+        same = false;
+      result.events += native_events.keys.size();
+      if (!same)
+        result.differ++;
+    }
+
+    result.scans = native->scan_count;
+    result.idle_scans_native = native->idle_scans;
+    result.idle_scans_driver = driven->idle_scans;
+    result.total_bus_micros = bus_micros() - bus_before;
+    return result;
+  }
+
+private:
+  Config config;
+  uint8_t row_pins[MAX_LINES];
+  uint8_t col_pins[16];
+  SimulatedMatrix switches;
+  ShiftRegisterChains *chains;
+  MCP23017 *expander;
+  ShiftRegisterLines *shift_register_lines;
+  MCP23017Lines *mcp23017_lines;
+  KeyboardMatrix *native;
+  KeyboardMatrix *driven;
+
+  void set_key(uint8_t r, uint8_t c, bool closed) {
+    uint8_t strobe, sense;
+    if (config.diode_direction == DIODE_DIRECTION_COL_PIN_TO_ROW_PIN) {
+      host_set_switch(row_pins[r], col_pins[c], closed);
+      strobe = r;
+      sense = c;
+    }
+    else {
+      host_set_switch(col_pins[c], row_pins[r], closed);
+      strobe = c;
+      sense = r;
+    }
+    if (closed)
+      switches.closed[strobe] |= (1UL << sense);
+    else
+      switches.closed[strobe] &= ~(1UL << sense);
+  }
+
+  double bus_micros() {
+    if (chains != NULL)
+      return chains->bytes * 8 * 1e6 / shift_register_lines->spi_clock;
+    return expander->bits * 1e6 / mcp23017_lines->i2c_clock;
+  }
+
+  uint32_t bus_bursts() {
+    return chains != NULL ? chains->pulses : expander->transactions;
+  }
+
+  uint32_t bus_bytes() {
+    return chains != NULL ? chains->bytes : expander->bytes;
+  }
+
+  void measure(MatrixLineDriver *driver, Result *result) {
+    uint32_t active[MAX_LINES];
+    uint32_t sample_micros[MAX_LINES];
+
+    double micros_before = bus_micros();
+    uint32_t bursts_before = bus_bursts();
+    uint32_t bytes_before = bus_bytes();
+    driver->scan(active, sample_micros);
+    result->scan_bus_micros = bus_micros() - micros_before;
+    result->scan_bursts = bus_bursts() - bursts_before;
+    result->scan_bytes = bus_bytes() - bytes_before;
+
+    micros_before = bus_micros();
+    driver->probe();
+    result->probe_bus_micros = bus_micros() - micros_before;
+  }
+};
+
+int main(int argc, char **argv) {
+  uint32_t keystrokes = 2000;
+  uint32_t seed = 1;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) keystrokes = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n keystrokes] [--seed n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const Config configs[] = {
+    {"shift registers", SHIFT_REGISTERS, 6, 10, DIODE_DIRECTION_ROW_PIN_TO_COL_PIN},
+    {"shift registers", SHIFT_REGISTERS, 16, 16, DIODE_DIRECTION_COL_PIN_TO_ROW_PIN},
+    {"shift registers", SHIFT_REGISTERS, 24, 16, DIODE_DIRECTION_ROW_PIN_TO_COL_PIN},
+    {"mcp23017", EXPANDER_MCP23017, 8, 6, DIODE_DIRECTION_ROW_PIN_TO_COL_PIN},
+    {"mcp23017", EXPANDER_MCP23017, 8, 8, DIODE_DIRECTION_COL_PIN_TO_ROW_PIN},
+  };
+  uint32_t failures = 0;
+
+  printf("%u keystrokes per matrix, scan period %d us\n\n", keystrokes, SCAN_MICROS);
+  printf("backend          matrix  bursts  bytes  bus us/scan  bus us/probe  bus us/update"
+         "  pin reads/update  idle scans     key events  differ\n");
+  for (const Config &config : configs) {
+    Run run(config);
+    Result result = run.go(keystrokes, seed);
+    bool idle_same = result.idle_scans_native == result.idle_scans_driver;
+    if (result.differ || !idle_same)
+      failures++;
+
+    char matrix[16];
+    snprintf(matrix, sizeof(matrix), "%ux%u", config.rows, config.cols);
+    printf("%-16s %6s  %6u  %5u  %11.1f  %12.1f  %13.1f  %16.1f  %5.1f%% %-4s  %10u  %6u\n",
+           config.name, matrix, result.scan_bursts, result.scan_bytes,
+           result.scan_bus_micros, result.probe_bus_micros,
+           result.total_bus_micros / result.scans,
+           (double) result.native_reads / result.scans,
+           100.0 * result.idle_scans_driver / result.scans, idle_same ? "same" : "DIFF",
+           result.events, result.differ);
+  }
+
+  return failures ? 1 : 0;
+}
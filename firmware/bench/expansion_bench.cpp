@@ -0,0 +1,365 @@
+// Text expansion benchmark
+//
+// Types random text into TextExpander with tries of 50, 500 and 2000
+// synthetic abbreviations (generated by tools/make_abbreviations.py): whole
+// abbreviations, words that only start like one or run past one, typos fixed
+// with backspace and arrow keys that move the cursor mid-word. Expander
+// output is applied to an editor buffer and compared with a reference that
+// rescans the buffer for the last word at every trigger.
+//
+// The same typing is then replayed in time the way the firmware sends it:
+// keys arrive 1-8ms apart (a burst, so plenty land mid-expansion) and go out
+// through HeldHidOutput, while the expansion is typed straight to the backend
+// a character every TEXT_EXPANSION_CHAR_MICROS on 1ms scan ticks. Abbreviations
+// triggered while another is still being sent are skipped, so the reference
+// leaves those alone.
+//
+// Reports the trie's flash size, the expander's time per keystroke, and, for
+// scale, a matcher that checks the end of a history buffer against every
+// abbreviation on each keystroke. Exits non-zero if the text ever differs,
+// or if a key is left down on the host after HeldHidOutput's queue overflows
+// during a long expansion.
+//
+// Usage: expansion_bench [-n keystrokes] [--seed n]
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../TextExpander.h"
+#include "../HeldHidOutput.h"
+#include "synthetic_50.h"
+#include "synthetic_500.h"
+#include "synthetic_2000.h"
+
+#define ARROW_LEFT 1
+#define HISTORY_LENGTH 32
+// The firmware's pacing and scan period
+#define TEXT_EXPANSION_CHAR_MICROS 2000
+#define TICK_MICROS 1000
+
+typedef std::map<std::string, std::string> Abbreviations;
+
+// Walk the trie to list what's in it
+static void list(const TextExpansionTrie &trie, uint16_t state, std::string prefix, Abbreviations &out) {
+  if (trie.states[state].expansion != TEXT_EXPANDER_NO_EXPANSION)
+    out[prefix] = &trie.text[trie.states[state].expansion];
+  for (int c=33; c<=126; c++) {
+    uint32_t next = (uint32_t) trie.states[state].base + (c - 32);
+    if (next < trie.num_states && trie.states[next].check == state)
+      list(trie, next, prefix + (char) c, out);
+  }
+}
+
+static bool whitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n';
+}
+
+static std::string random_word(std::mt19937 &rng, const std::vector<std::string> &keys) {
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::uniform_int_distribution<size_t> pick(0, keys.size() - 1);
+  const std::string &abbreviation = keys[pick(rng)];
+
+  int kind = percent(rng);
+  if (kind < 50)
+    return abbreviation;
+  if (kind < 60)
+    return abbreviation.substr(0, abbreviation.size() - 1);
+  if (kind < 70)
+    return abbreviation + (char) letter(rng);
+  std::string word;
+  int n = 1 + percent(rng) % 20;
+  for (int i=0; i<n; i++)
+    word += (char) letter(rng);
+  return word;
+}
+
+// Keystrokes: words, typos fixed with backspace, cursor moves, triggers
+static std::string make_typing(uint32_t keystrokes, const Abbreviations &abbreviations, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<int> letter('a', 'z');
+  std::vector<std::string> keys;
+  for (const auto &entry : abbreviations)
+    keys.push_back(entry.first);
+
+  std::string typed;
+  const char triggers[] = {' ', ' ', ' ', ' ', '\n', '\t'};
+  while (typed.size() < keystrokes) {
+    std::string word = random_word(rng, keys);
+    for (size_t i=0; i<word.size(); i++) {
+      if (percent(rng) < 5) {
+        typed += (char) letter(rng);
+        typed += '\b';
+      }
+      if (percent(rng) < 2)
+        typed += (char) ARROW_LEFT;
+      typed += word[i];
+    }
+    typed += triggers[percent(rng) % 6];
+  }
+  return typed;
+}
+
+static void apply(std::string &buffer, char c) {
+  if (c == '\b') {
+    if (!buffer.empty())
+      buffer.pop_back();
+  }
+  else if (c != ARROW_LEFT) {
+    buffer += c;
+  }
+}
+
+// What the text should be: at each trigger look at the last word in the
+// buffer, unless the cursor moved since the last whitespace or the trigger is
+// one of skipped (keystroke indexes)
+static std::string reference(const std::string &typed, const Abbreviations &abbreviations,
+                             const std::set<size_t> &skipped = std::set<size_t>()) {
+  std::string buffer;
+  bool moved = false;
+  for (size_t i=0; i<typed.size(); i++) {
+    char c = typed[i];
+    if (c == ARROW_LEFT) {
+      moved = true;
+      continue;
+    }
+    if (whitespace(c)) {
+      size_t start = buffer.find_last_of(" \t\n");
+      std::string word = buffer.substr(start == std::string::npos ? 0 : start + 1);
+      auto match = abbreviations.find(word);
+      if (!moved && match != abbreviations.end() && !skipped.count(i))
+        buffer = buffer.substr(0, buffer.size() - word.size()) + match->second;
+      moved = false;
+    }
+    apply(buffer, c);
+  }
+  return buffer;
+}
+
+static std::string expand(const std::string &typed, const TextExpansionTrie &trie, uint32_t *expansions) {
+  TextExpander expander(&trie);
+  std::string buffer;
+  for (char c : typed) {
+    if (!expander.feed(c))
+      apply(buffer, c);
+    while (expander.busy())
+      apply(buffer, expander.next_output());
+  }
+  *expansions = expander.expansions;
+  return buffer;
+}
+
+// The host end of the HID output: taps are applied to the text, and a press
+// or release would be a key the bench never sends
+class TextOutput : public HidOutput {
+public:
+  std::string buffer;
+  uint32_t other = 0;
+
+  void press(uint16_t) { other++; }
+  void release(uint16_t) { other++; }
+  void type(char c) { apply(buffer, c); }
+  void mouse_buttons(uint8_t) {}
+  void mouse_move(int8_t, int8_t, int8_t, int8_t) {}
+};
+
+struct PacedResult {
+  std::string text;
+  std::set<size_t> skipped;
+  uint32_t held;
+  uint32_t overflows;
+  uint32_t other;
+};
+
+// Keys at random times, the expansion paced on scan ticks like
+// TextExpansionHandler
+static PacedResult expand_paced(const std::string &typed, const TextExpansionTrie &trie, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> gap(1000, 8000);
+  TextExpander expander(&trie);
+  TextOutput backend;
+  HeldHidOutput output(&backend);
+  PacedResult result;
+  uint32_t now = 0;
+  uint32_t sent = 0;
+  uint32_t next_key = gap(rng);
+  size_t i = 0;
+
+  while (i < typed.size() || expander.busy() || !output.ready()) {
+    now += TICK_MICROS;
+    // keys are handled before the tick, as in the pipeline
+    while (i < typed.size() && next_key <= now) {
+      uint32_t skipped = expander.skipped;
+      if (expander.feed(typed[i]))
+        output.hold();
+      else
+        output.type(typed[i]);
+      if (expander.skipped != skipped)
+        result.skipped.insert(i);
+      i++;
+      next_key += gap(rng);
+    }
+
+    if (!expander.busy())
+      output.release_hold();
+    else if (now - sent >= TEXT_EXPANSION_CHAR_MICROS) {
+      backend.type(expander.next_output());
+      sent = now;
+      if (!expander.busy())
+        output.release_hold();
+    }
+    output.poll();
+  }
+  result.text = backend.buffer;
+  result.held = output.held;
+  result.overflows = output.overflows;
+  result.other = backend.other;
+  return result;
+}
+
+// Keys the backend has down
+class KeyOutput : public HidOutput {
+public:
+  std::set<uint16_t> down;
+
+  void press(uint16_t key) { down.insert(key); }
+  void release(uint16_t key) { down.erase(key); }
+  void type(char) {}
+  void mouse_buttons(uint8_t) {}
+  void mouse_move(int8_t, int8_t, int8_t, int8_t) {}
+};
+
+// Keys pressed and released at random, some before the hold, far more than
+// fit in the queue while it holds. Returns the keys left down afterwards.
+static size_t overflow_stuck_keys(uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint16_t> key(1, 40);
+  KeyOutput backend;
+  HeldHidOutput output(&backend);
+  std::set<uint16_t> pressed;
+
+  for (int i=0; i<4; i++) {
+    uint16_t k = key(rng);
+    pressed.insert(k);
+    output.press(k);
+  }
+  output.hold();
+  for (int i=0; i<HELD_HID_QUEUE_LENGTH * 8; i++) {
+    uint16_t k = key(rng);
+    if (pressed.count(k)) {
+      pressed.erase(k);
+      output.release(k);
+    }
+    else {
+      pressed.insert(k);
+      output.press(k);
+    }
+  }
+  for (uint16_t k : pressed)
+    output.release(k);
+  output.release_hold();
+  while (!output.ready())
+    output.poll();
+  return backend.down.size();
+}
+
+// nanoseconds per keystroke for feed() alone
+static double time_expander(const std::string &typed, const TextExpansionTrie &trie) {
+  TextExpander expander(&trie);
+  uint32_t matches = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int repeat=0; repeat<10; repeat++) {
+    for (char c : typed) {
+      matches += expander.feed(c);
+      while (expander.busy())
+        expander.next_output();
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  if (matches == 0)
+    printf("no matches\n");
+  return elapsed.count() / (typed.size() * 10);
+}
+
+// nanoseconds per keystroke checking a history buffer against every entry
+static double time_history_scan(const std::string &typed, const Abbreviations &abbreviations) {
+  std::vector<std::string> keys;
+  for (const auto &entry : abbreviations)
+    keys.push_back(" " + entry.first);
+  char history[HISTORY_LENGTH+1];
+  memset(history, ' ', sizeof(history));
+  uint32_t matches = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (char c : typed) {
+    memmove(history, history + 1, HISTORY_LENGTH);
+    history[HISTORY_LENGTH] = c;
+    for (const std::string &key : keys) {
+      if (memcmp(history + HISTORY_LENGTH - key.size(), key.data(), key.size()) == 0)
+        matches++;
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  if (matches == 0)
+    printf("no matches\n");
+  return elapsed.count() / typed.size();
+}
+
+int main(int argc, char **argv) {
+  uint32_t keystrokes = 200000;
+  uint32_t seed = 1;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) keystrokes = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n keystrokes] [--seed n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const TextExpansionTrie *tries[] = {&synthetic_50, &synthetic_500, &synthetic_2000};
+  uint32_t mismatches = 0;
+
+  printf("%u keystrokes per trie\n\n", keystrokes);
+  printf("entries  states  flash bytes  expansions  ns/key  history scan ns/key  text  "
+         "paced: skipped  held keys  overflows  text\n");
+  for (const TextExpansionTrie *trie : tries) {
+    Abbreviations abbreviations;
+    list(*trie, TEXT_EXPANDER_ROOT, "", abbreviations);
+    uint32_t flash = trie->num_states * sizeof(TextExpanderState);
+    for (const auto &entry : abbreviations)
+      flash += entry.second.size() + 1;
+
+    std::string typed = make_typing(keystrokes, abbreviations, seed);
+    uint32_t expansions;
+    bool same = expand(typed, *trie, &expansions) == reference(typed, abbreviations);
+    if (!same)
+      mismatches++;
+
+    PacedResult paced = expand_paced(typed, *trie, seed);
+    bool paced_same = paced.overflows == 0 && paced.other == 0 &&
+      paced.text == reference(typed, abbreviations, paced.skipped);
+    if (!paced_same)
+      mismatches++;
+
+    printf("%7zu  %6u  %11u  %10u  %6.1f  %19.1f  %-4s  %14zu  %9u  %9u  %s\n", abbreviations.size(),
+           trie->num_states, flash, expansions, time_expander(typed, *trie),
+           time_history_scan(typed, abbreviations), same ? "same" : "DIFFERENT",
+           paced.skipped.size(), paced.held, paced.overflows, paced_same ? "same" : "DIFFERENT");
+  }
+
+  size_t stuck = overflow_stuck_keys(seed);
+  printf("\nkeys left down after the held queue overflowed: %zu\n", stuck);
+  if (stuck != 0)
+    mismatches++;
+
+  return mismatches ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+// Idle fast path benchmark
+//
+// Runs KeyboardMatrix::update() on a simulated 6x10 matrix (same shape and
+// diode direction as the thumb keyboard) through a typing script: random keys
+// pressed and released with contact bounce, separated by idle gaps. The script
+// runs once with the idle fast path off and once with it on.
+//
+// Reports pin reads, pinMode() calls (the host build has no direction
+// register, so that is how strobes show up) and host time per idle scan for
+// both, measured over the scans the fast path took, and checks
+// that every press and release registers on the same scan with the same keys.
+// Exits non-zero if they differ.
+//
+// Usage: idle_bench [-n keystrokes] [--seed n]
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../KeyboardMatrix.h"
+
+#define ROWS 6
+#define COLS 10
+#define SCAN_MICROS 250
+
+static const uint8_t row_pins[ROWS] = {0, 1, 2, 3, 4, 5};
+static const uint8_t col_pins[COLS] = {10, 11, 12, 13, 14, 15, 16, 17, 18, 19};
+
+struct Event {
+  uint32_t scan;
+  uint8_t row;
+  uint8_t col;
+  bool pressed;
+
+  bool operator!=(const Event &other) const {
+    return scan != other.scan || row != other.row || col != other.col || pressed != other.pressed;
+  }
+};
+
+struct Result {
+  std::vector<Event> events;
+  // scans that took the fast path
+  std::vector<bool> idle;
+  uint32_t scans;
+  uint32_t idle_scans;
+  // pin operations and time over the idle scans
+  uint32_t reads;
+  uint32_t mode_changes;
+  double nanoseconds;
+};
+
+static void set_key(uint8_t r, uint8_t c, bool closed) {
+  host_set_switch(col_pins[c], row_pins[r], closed);
+}
+
+// idle_scans: which scans to measure, or NULL to measure the ones that took
+// the fast path
+static Result run(uint32_t keystrokes, uint32_t seed, bool fast_path,
+                  const std::vector<bool> *idle_scans) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> row(0, ROWS-1);
+  std::uniform_int_distribution<int> col(0, COLS-1);
+  std::uniform_int_distribution<int> bounce_scans(0, 6);
+  std::uniform_int_distribution<int> hold_scans(40, 400);
+  std::uniform_int_distribution<int> gap_scans(100, 2000);
+  std::uniform_int_distribution<int> coin(0, 1);
+
+  KeyboardMatrix matrix(ROWS, COLS, (uint8_t*) row_pins, (uint8_t*) col_pins,
+                        DIODE_DIRECTION_ROW_PIN_TO_COL_PIN);
+  uint32_t now = 1000;
+  host_set_micros(now);
+  matrix.begin();
+  matrix.idle_fast_path = fast_path;
+
+  Result result = Result();
+  std::chrono::duration<double, std::nano> elapsed(0);
+
+  // 0: idle gap, 1: press bounce, 2: held, 3: release bounce
+  int phase = 0;
+  int left = gap_scans(rng);
+  uint8_t r = 0, c = 0;
+  uint32_t done = 0;
+
+  while (done < keystrokes || phase != 0 || left > 0) {
+    if (left <= 0) {
+      phase = (phase + 1) % 4;
+      if (phase == 0) {
+        set_key(r, c, false);
+        done++;
+        left = done < keystrokes ? gap_scans(rng) : 50;
+      }
+      else if (phase == 1) {
+        r = row(rng);
+        c = col(rng);
+        left = bounce_scans(rng);
+      }
+      else if (phase == 2) {
+        set_key(r, c, true);
+        left = hold_scans(rng);
+      }
+      else {
+        left = bounce_scans(rng);
+      }
+    }
+    if (phase == 1 || phase == 3)
+      set_key(r, c, coin(rng));
+    left--;
+
+    now += SCAN_MICROS;
+    host_set_micros(now);
+    uint32_t idle_before = matrix.idle_scans;
+    uint32_t reads_before = host_pin_reads();
+    uint32_t modes_before = host_pin_mode_changes();
+    auto start = std::chrono::steady_clock::now();
+    bool changed = matrix.update();
+    auto end = std::chrono::steady_clock::now();
+
+    bool idle = matrix.idle_scans != idle_before;
+    result.idle.push_back(idle);
+    if (idle_scans != NULL)
+      idle = matrix.scan_count <= idle_scans->size() && (*idle_scans)[matrix.scan_count-1];
+    if (idle) {
+      result.reads += host_pin_reads() - reads_before;
+      result.mode_changes += host_pin_mode_changes() - modes_before;
+      elapsed += end - start;
+    }
+
+    if (changed) {
+      for (int i=0; i<matrix.released_list.size(); i++) {
+        ReleasedKey *key = matrix.released_list.get(i);
+        result.events.push_back({matrix.scan_count, key->row, key->col, false});
+      }
+      PressedKey *key = matrix.new_key();
+      if (key != NULL)
+        result.events.push_back({matrix.scan_count, key->row, key->col, true});
+    }
+  }
+
+  result.scans = matrix.scan_count;
+  result.idle_scans = matrix.idle_scans;
+  result.nanoseconds = elapsed.count();
+  return result;
+}
+
+int main(int argc, char **argv) {
+  uint32_t keystrokes = 2000;
+  uint32_t seed = 1;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) keystrokes = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n keystrokes] [--seed n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  Result fast = run(keystrokes, seed, true, NULL);
+  Result full = run(keystrokes, seed, false, &fast.idle);
+
+  uint32_t mismatches = 0;
+  size_t n = full.events.size() > fast.events.size() ? full.events.size() : fast.events.size();
+  for (size_t i=0; i<n; i++) {
+    if (i >= full.events.size() || i >= fast.events.size() || full.events[i] != fast.events[i])
+      mismatches++;
+  }
+
+  printf("%u keystrokes, %u scans, %u idle fast path scans (%.1f%%)\n\n",
+         keystrokes, fast.scans, fast.idle_scans, 100.0*fast.idle_scans/fast.scans);
+  printf("per idle scan    reads  pinModes   host ns\n");
+  printf("full scan        %5.1f  %8.1f  %8.1f\n",
+         (double) full.reads / fast.idle_scans, (double) full.mode_changes / fast.idle_scans,
+         full.nanoseconds / fast.idle_scans);
+  printf("idle fast path   %5.1f  %8.1f  %8.1f\n\n",
+         (double) fast.reads / fast.idle_scans, (double) fast.mode_changes / fast.idle_scans,
+         fast.nanoseconds / fast.idle_scans);
+  printf("key events       %zu full scan, %zu fast path, %u differ\n",
+         full.events.size(), fast.events.size(), mismatches);
+
+  return mismatches ? 1 : 0;
+}
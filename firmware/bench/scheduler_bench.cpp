@@ -0,0 +1,278 @@
+// Task scheduler benchmark
+//
+// Runs a model of the firmware's main loop on a simulated clock: every task
+// advances micros() by what its work would take on the Teensy. Alongside the
+// scan and HID output there are slow jobs written as coroutines:
+//   display   a frame every 16ms, sent as 20 chunks of 80us
+//   dump      4KB over USB serial every 500ms, 64 bytes at a time whenever the
+//             (simulated) USB buffer has room
+//   battery   an analogRead and a line of output every 3s, 150us
+//   checkpoint a few EEPROM bytes every 1ms, 30us, except that every 97th run
+//             takes 400us: the overruns the scheduler has to report
+//
+// The same tasks run as the old fixed loop did (everything due, in order, each
+// job to completion, waiting for USB buffer space) and under TaskScheduler.
+// Reports scan intervals and how many exceeded the scan deadline, and jobs
+// completed per task. Exits non-zero if, under the scheduler, a scan is late
+// other than after an injected overrun, the scheduler's own counts of late
+// scans and overruns don't match what happened, or a slow job falls behind.
+//
+// Usage: scheduler_bench [-t seconds] [-d deadline_us]
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../TaskScheduler.h"
+
+#define PASS_MICROS 2
+#define SCAN_MICROS 60
+#define HID_MICROS 10
+#define DISPLAY_CHUNKS 20
+#define DISPLAY_CHUNK_MICROS 80
+#define DUMP_BYTES 4096
+#define DUMP_CHUNK 64
+#define DUMP_CHUNK_MICROS 20
+// USB serial takes a 64 byte packet off the buffer every 100us
+#define USB_BUFFER_SIZE 256
+#define USB_PACKET_MICROS 100
+#define BATTERY_MICROS 150
+#define CHECKPOINT_MICROS 30
+#define CHECKPOINT_OVERRUN_MICROS 400
+#define CHECKPOINT_OVERRUN_EVERY 97
+
+static void spend(uint32_t us) {
+  host_set_micros(micros() + us);
+}
+
+// --- Model tasks -------------------------------------------------------------
+
+static std::vector<uint32_t> scan_starts;
+
+static void scan_task(Task *) {
+  scan_starts.push_back(micros());
+  spend(SCAN_MICROS);
+}
+
+static void hid_task(Task *) {
+  spend(HID_MICROS);
+}
+
+static void display_task(Task *task) {
+  static uint8_t chunk;
+
+  TASK_BEGIN(task);
+  for (chunk=0; chunk<DISPLAY_CHUNKS; chunk++) {
+    spend(DISPLAY_CHUNK_MICROS);
+    TASK_YIELD(task);
+  }
+  TASK_END(task);
+}
+
+static uint32_t usb_buffered;
+static uint32_t usb_drained_micros;
+
+static uint32_t usb_room() {
+  uint32_t packets = (micros() - usb_drained_micros) / USB_PACKET_MICROS;
+  usb_drained_micros += packets * USB_PACKET_MICROS;
+  usb_buffered = packets * DUMP_CHUNK >= usb_buffered ? 0 : usb_buffered - packets * DUMP_CHUNK;
+  if (usb_buffered == 0)
+    usb_drained_micros = micros();
+  return USB_BUFFER_SIZE - usb_buffered;
+}
+
+static void dump_task(Task *task) {
+  static uint32_t sent;
+
+  TASK_BEGIN(task);
+  for (sent=0; sent<DUMP_BYTES; sent+=DUMP_CHUNK) {
+    TASK_WAIT_UNTIL(task, usb_room() >= DUMP_CHUNK);
+    usb_buffered += DUMP_CHUNK;
+    spend(DUMP_CHUNK_MICROS);
+    TASK_YIELD(task);
+  }
+  TASK_END(task);
+}
+
+static void battery_task(Task *) {
+  spend(BATTERY_MICROS);
+}
+
+static uint32_t checkpoint_runs;
+static uint32_t injected_overruns;
+
+static void checkpoint_task(Task *) {
+  if (++checkpoint_runs % CHECKPOINT_OVERRUN_EVERY == 0) {
+    injected_overruns++;
+    spend(CHECKPOINT_OVERRUN_MICROS);
+  }
+  else {
+    spend(CHECKPOINT_MICROS);
+  }
+}
+
+#define SCAN 0
+#define HID 1
+#define DISPLAY 2
+#define DUMP 3
+#define CHECKPOINT 4
+#define BATTERY 5
+
+static void make_tasks(std::vector<Task> *tasks, uint32_t deadline) {
+  tasks->clear();
+  tasks->push_back(Task("scan", scan_task, 0, 0, 100, deadline));
+  tasks->push_back(Task("hid", hid_task, 0, 0, 20));
+  tasks->push_back(Task("display", display_task, 2, 16000, 100));
+  tasks->push_back(Task("dump", dump_task, 2, 500000, 50));
+  tasks->push_back(Task("checkpoint", checkpoint_task, 3, 1000, 100));
+  tasks->push_back(Task("battery", battery_task, 3, 3000000, 200));
+  tasks->push_back(Task());
+}
+
+// --- The two loops -----------------------------------------------------------
+
+// The old loop(): everything due, in order, each job run to the end
+static void fixed_loop(std::vector<Task> &tasks, uint32_t *next_due, uint32_t *jobs) {
+  for (size_t i=0; tasks[i].run != NULL; i++) {
+    Task *task = &tasks[i];
+    if (task->period_micros != 0 && (int32_t) (micros() - next_due[i]) < 0)
+      continue;
+    next_due[i] += task->period_micros;
+    if ((int32_t) (micros() - next_due[i]) >= 0)
+      next_due[i] = micros() + task->period_micros;
+    // a blocking write polls until there's room
+    do {
+      task->run(task);
+      if (task->resume_line != 0)
+        spend(PASS_MICROS);
+    } while (task->resume_line != 0);
+    jobs[i]++;
+  }
+}
+
+struct Result {
+  uint32_t scans;
+  uint32_t late_scans;
+  uint32_t p99_interval;
+  uint32_t max_interval;
+  uint32_t jobs[BATTERY+1];
+};
+
+static uint32_t percentile(std::vector<uint32_t> v, double p) {
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size()-1, (size_t) (p * v.size()))];
+}
+
+static Result run(bool use_scheduler, uint32_t seconds, uint32_t deadline, std::vector<Task> &tasks,
+                  TaskScheduler &scheduler) {
+  Result result;
+  uint32_t next_due[BATTERY+1];
+  memset(&result, 0, sizeof(result));
+
+  scan_starts.clear();
+  usb_buffered = 0;
+  usb_drained_micros = 0;
+  checkpoint_runs = 0;
+  injected_overruns = 0;
+  host_set_micros(0);
+  make_tasks(&tasks, deadline);
+  scheduler.begin(&tasks[0], micros());
+  for (uint8_t i=0; i<=BATTERY; i++)
+    next_due[i] = 0;
+
+  uint32_t end = seconds * 1000000;
+  while (micros() < end) {
+    if (use_scheduler)
+      scheduler.run();
+    else
+      fixed_loop(tasks, next_due, result.jobs);
+    spend(PASS_MICROS);
+  }
+
+  std::vector<uint32_t> intervals;
+  for (size_t i=1; i<scan_starts.size(); i++) {
+    uint32_t interval = scan_starts[i] - scan_starts[i-1];
+    intervals.push_back(interval);
+    if (interval > deadline)
+      result.late_scans++;
+  }
+  result.scans = scan_starts.size();
+  result.p99_interval = percentile(intervals, 0.99);
+  result.max_interval = percentile(intervals, 1.0);
+  if (use_scheduler) {
+    for (uint8_t i=0; i<=BATTERY; i++)
+      result.jobs[i] = tasks[i].jobs;
+  }
+  return result;
+}
+
+int main(int argc, char **argv) {
+  uint32_t seconds = 20;
+  uint32_t deadline = 500;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-t" && i+1 < argc) seconds = atoi(argv[++i]);
+    else if (arg == "-d" && i+1 < argc) deadline = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-t seconds] [-d deadline_us]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  std::vector<Task> tasks;
+  TaskScheduler scheduler;
+  uint32_t expected[BATTERY+1] = {0, 0, seconds * 1000000 / 16000, seconds * 2, seconds * 1000,
+                                  seconds / 3 + 1};
+
+  printf("%u s simulated, scan deadline %u us\n\n", seconds, deadline);
+  printf("%-10s %8s %6s %9s %9s %8s %6s %10s %8s\n", "loop", "scans", "late", "p99 us", "max us",
+         "display", "dumps", "checkpoint", "battery");
+
+  Result fixed = run(false, seconds, deadline, tasks, scheduler);
+  printf("%-10s %8u %6u %9u %9u %8u %6u %10u %8u\n", "fixed", fixed.scans, fixed.late_scans,
+         fixed.p99_interval, fixed.max_interval, fixed.jobs[DISPLAY], fixed.jobs[DUMP],
+         fixed.jobs[CHECKPOINT], fixed.jobs[BATTERY]);
+
+  Result scheduled = run(true, seconds, deadline, tasks, scheduler);
+  printf("%-10s %8u %6u %9u %9u %8u %6u %10u %8u\n", "scheduler", scheduled.scans, scheduled.late_scans,
+         scheduled.p99_interval, scheduled.max_interval, scheduled.jobs[DISPLAY], scheduled.jobs[DUMP],
+         scheduled.jobs[CHECKPOINT], scheduled.jobs[BATTERY]);
+  printf("expected   %8s %6s %9s %9s %8u %6u %10u %8u\n\n", "", "", "", "", expected[DISPLAY],
+         expected[DUMP], expected[CHECKPOINT], expected[BATTERY]);
+
+  for (size_t i=0; tasks[i].run != NULL; i++) {
+    printf("%-10s runs %8u jobs %7u overruns %4u max %4u us  late %4u max %5u us  deferred %u\n",
+           tasks[i].name, tasks[i].runs, tasks[i].jobs, tasks[i].overruns, tasks[i].max_run_micros,
+           tasks[i].late, tasks[i].max_late_micros, tasks[i].deferred);
+  }
+  printf("injected checkpoint overruns %u\n", injected_overruns);
+
+  bool failed = false;
+  if (scheduled.late_scans > injected_overruns || scheduled.late_scans != tasks[SCAN].late) {
+    printf("late scans: %u, scheduler counted %u, at most %u expected\n", scheduled.late_scans,
+           tasks[SCAN].late, injected_overruns);
+    failed = true;
+  }
+  for (size_t i=0; tasks[i].run != NULL; i++) {
+    uint32_t expected_overruns = i == CHECKPOINT ? injected_overruns : 0;
+    if (tasks[i].overruns != expected_overruns) {
+      printf("%s: %u overruns counted, %u expected\n", tasks[i].name, tasks[i].overruns, expected_overruns);
+      failed = true;
+    }
+  }
+  // every job due in the run, give or take the one still going at the end
+  for (uint8_t i=DISPLAY; i<=BATTERY; i++) {
+    if (scheduled.jobs[i] + 1 < expected[i]) {
+      printf("%s fell behind: %u of %u jobs\n", tasks[i].name, scheduled.jobs[i], expected[i]);
+      failed = true;
+    }
+  }
+
+  if (failed) {
+    printf("\nFAILED\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,317 @@
+// Matrix snapshot benchmark
+//
+// Stands in for a timer interrupt with a POSIX timer signal, which can land
+// between any two instructions of the main loop just as an interrupt does on
+// the Teensy.
+//
+// Latch: the "scan interrupt" publishes a made-up matrix every 20us, each row
+// a function of the scan number. The main loop reads it through
+// MatrixSnapshotLatch and, to show what the latch prevents, straight out of
+// the arrays the interrupt writes in place. A second, higher priority "reader
+// interrupt" reads the latch too, sometimes in the middle of publish(). Every
+// copy is checked against its scan number.
+//
+// Matrix: KeyboardMatrix::update() runs from the scan interrupt on a simulated
+// 6x10 matrix with track_keys off, through a script of bouncy key presses.
+// Every snapshot the main loop reads is compared with the matrix_state the
+// interrupt logged for that scan, and the whole log with the same script run
+// in the main loop with track_keys on.
+//
+// Exits non-zero if any latch read is torn or anything differs.
+//
+// Usage: snapshot_bench [-n scans]
+
+#include <chrono>
+#include <signal.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "Arduino.h"
+#include "../KeyboardMatrix.h"
+#include "../MatrixSnapshot.h"
+
+#define ROWS 6
+#define COLS 10
+#define SCAN_INTERVAL_NS 20000
+#define READER_INTERVAL_NS 47000
+// simulated micros() per scan
+#define SCAN_MICROS 250
+// script: one key per window, held for the first half with bounce
+#define KEY_WINDOW_SCANS 400
+
+static const uint8_t row_pins[ROWS] = {0, 1, 2, 3, 4, 5};
+static const uint8_t col_pins[COLS] = {10, 11, 12, 13, 14, 15, 16, 17, 18, 19};
+
+struct ReadStats {
+  uint32_t reads;
+  uint32_t torn;
+  // reads that interrupted publish()
+  uint32_t nested;
+};
+
+// Shared with the signal handlers
+static MatrixSnapshotLatch *latch;
+static volatile uint32_t isr_scan;
+static volatile uint32_t scan_limit;
+static volatile bool in_publish;
+static volatile uint32_t direct_scan;
+static volatile uint16_t direct_rows[ROWS];
+static volatile ReadStats reader_isr_stats;
+static MatrixSnapshot reader_isr_snapshot;
+
+static KeyboardMatrix *isr_matrix;
+static uint16_t *isr_log;
+
+static uint16_t pattern(uint32_t scan, uint8_t row) {
+  return (uint16_t) (scan * 40503u + row * 0x9E37u);
+}
+
+static bool consistent(const MatrixSnapshot &snapshot) {
+  if (snapshot.scan == 0)
+    return true;
+  if (snapshot.num_rows != ROWS || snapshot.sample_micros != snapshot.scan * SCAN_MICROS)
+    return false;
+  for (uint8_t r=0; r<ROWS; r++) {
+    if (snapshot.rows[r] != pattern(snapshot.scan, r))
+      return false;
+  }
+  return true;
+}
+
+static void publish_isr(int) {
+  uint32_t scan = isr_scan + 1;
+  uint16_t rows[ROWS];
+  for (uint8_t r=0; r<ROWS; r++)
+    rows[r] = pattern(scan, r);
+
+  in_publish = true;
+  latch->publish(rows, ROWS, scan, scan * SCAN_MICROS);
+  in_publish = false;
+
+  // what reading matrix_state directly would see
+  direct_scan = scan;
+  for (uint8_t r=0; r<ROWS; r++)
+    direct_rows[r] = rows[r];
+  isr_scan = scan;
+}
+
+static void reader_isr(int) {
+  bool nested = in_publish;
+  latch->read(&reader_isr_snapshot);
+  reader_isr_stats.reads++;
+  if (!consistent(reader_isr_snapshot))
+    reader_isr_stats.torn++;
+  if (nested)
+    reader_isr_stats.nested++;
+}
+
+// Advance the key script to the matrix's next scan and run it
+static void script_update(KeyboardMatrix *matrix) {
+  uint32_t scan = matrix->scan_count + 1;
+  uint32_t key = (scan / KEY_WINDOW_SCANS) % (ROWS * COLS);
+  uint32_t phase = scan % KEY_WINDOW_SCANS;
+  bool closed = phase < KEY_WINDOW_SCANS / 2;
+  // bounce on press and release
+  if (phase == 1 || phase == 3 || phase == KEY_WINDOW_SCANS / 2 + 1)
+    closed = !closed;
+  host_set_switch(col_pins[key % COLS], row_pins[key / COLS], closed);
+  host_set_micros(scan * SCAN_MICROS);
+  matrix->update();
+}
+
+static void matrix_isr(int) {
+  if (isr_matrix->scan_count >= scan_limit)
+    return;
+  script_update(isr_matrix);
+  uint32_t scan = isr_matrix->scan_count;
+  for (uint8_t r=0; r<ROWS; r++)
+    isr_log[scan * ROWS + r] = isr_matrix->matrix_state[r];
+  isr_scan = scan;
+}
+
+// sa_mask: signals the handler blocks (ie lower priority ones)
+static timer_t start_timer(int signo, void (*handler)(int), long interval_ns, int masked_signo) {
+  struct sigaction action = {};
+  action.sa_handler = handler;
+  sigemptyset(&action.sa_mask);
+  if (masked_signo)
+    sigaddset(&action.sa_mask, masked_signo);
+  sigaction(signo, &action, NULL);
+
+  struct sigevent event = {};
+  event.sigev_notify = SIGEV_SIGNAL;
+  event.sigev_signo = signo;
+  timer_t timer;
+  timer_create(CLOCK_MONOTONIC, &event, &timer);
+
+  struct itimerspec spec = {};
+  spec.it_interval.tv_nsec = interval_ns;
+  spec.it_value.tv_nsec = interval_ns;
+  timer_settime(timer, 0, &spec, NULL);
+  return timer;
+}
+
+static void stop_timer(timer_t timer, int signo) {
+  timer_delete(timer);
+  signal(signo, SIG_IGN);
+}
+
+static KeyboardMatrix *make_matrix(bool track_keys) {
+  for (uint8_t r=0; r<ROWS; r++) {
+    for (uint8_t c=0; c<COLS; c++)
+      host_set_switch(col_pins[c], row_pins[r], false);
+  }
+  host_set_micros(0);
+  KeyboardMatrix *matrix = new KeyboardMatrix(ROWS, COLS, (uint8_t*) row_pins, (uint8_t*) col_pins,
+                                              DIODE_DIRECTION_ROW_PIN_TO_COL_PIN);
+  matrix->begin();
+  matrix->track_keys = track_keys;
+  return matrix;
+}
+
+static void print_stats(const char *name, const ReadStats &stats) {
+  printf("%-22s %10u  %10u  %6u\n", name, stats.reads, stats.nested, stats.torn);
+}
+
+// Latch under interrupts, true if no latch read was torn
+static bool run_latch(uint32_t scans) {
+  latch = new MatrixSnapshotLatch();
+  isr_scan = 0;
+  ReadStats latch_stats = ReadStats();
+  ReadStats direct_stats = ReadStats();
+  reader_isr_snapshot = MatrixSnapshot();
+
+  timer_t scan_timer = start_timer(SIGALRM, publish_isr, SCAN_INTERVAL_NS, 0);
+  // the reader interrupt can interrupt the scan one, not the other way round
+  timer_t reader_timer = start_timer(SIGUSR1, reader_isr, READER_INTERVAL_NS, SIGALRM);
+
+  MatrixSnapshot snapshot = MatrixSnapshot();
+  MatrixSnapshot direct = MatrixSnapshot();
+  while (isr_scan < scans) {
+    latch->read(&snapshot);
+    latch_stats.reads++;
+    if (!consistent(snapshot))
+      latch_stats.torn++;
+
+    direct.scan = direct_scan;
+    direct.sample_micros = direct.scan * SCAN_MICROS;
+    direct.num_rows = ROWS;
+    for (uint8_t r=0; r<ROWS; r++)
+      direct.rows[r] = direct_rows[r];
+    direct_stats.reads++;
+    if (!consistent(direct))
+      direct_stats.torn++;
+  }
+
+  stop_timer(reader_timer, SIGUSR1);
+  stop_timer(scan_timer, SIGALRM);
+
+  ReadStats isr_stats;
+  isr_stats.reads = reader_isr_stats.reads;
+  isr_stats.torn = reader_isr_stats.torn;
+  isr_stats.nested = reader_isr_stats.nested;
+
+  printf("%u scans published from the scan interrupt\n\n", isr_scan);
+  printf("reader                      reads  in publish    torn\n");
+  print_stats("main loop, latch", latch_stats);
+  print_stats("main loop, direct", direct_stats);
+  print_stats("interrupt, latch", isr_stats);
+  printf("\n");
+
+  delete latch;
+  return latch_stats.torn == 0 && isr_stats.torn == 0;
+}
+
+// KeyboardMatrix scanning from the interrupt, true if nothing differs
+static bool run_matrix(uint32_t scans) {
+  // main loop reference with the key lists
+  std::vector<uint16_t> reference((scans + 1) * ROWS, 0xFFFF);
+  KeyboardMatrix *matrix = make_matrix(true);
+  for (uint32_t scan=1; scan<=scans; scan++) {
+    script_update(matrix);
+    for (uint8_t r=0; r<ROWS; r++)
+      reference[scan * ROWS + r] = matrix->matrix_state[r];
+  }
+  delete matrix;
+
+  std::vector<uint16_t> log((scans + 1) * ROWS, 0xFFFF);
+  std::vector<MatrixSnapshot> seen;
+  seen.reserve(scans + 1);
+  isr_log = log.data();
+  isr_matrix = make_matrix(false);
+  latch = &isr_matrix->snapshot;
+  isr_scan = 0;
+  scan_limit = scans;
+
+  timer_t scan_timer = start_timer(SIGALRM, matrix_isr, SCAN_INTERVAL_NS, 0);
+  MatrixSnapshot snapshot = MatrixSnapshot();
+  uint32_t reads = 0;
+  while (isr_scan < scans) {
+    reads++;
+    if (latch->read(&snapshot) && seen.size() < seen.capacity())
+      seen.push_back(snapshot);
+  }
+  stop_timer(scan_timer, SIGALRM);
+
+  uint32_t torn = 0;
+  for (const MatrixSnapshot &s : seen) {
+    if (s.num_rows != ROWS || s.sample_micros != s.scan * SCAN_MICROS ||
+        memcmp(s.rows, &log[s.scan * ROWS], ROWS * sizeof(uint16_t)) != 0)
+      torn++;
+  }
+  uint32_t differ = 0;
+  for (uint32_t scan=1; scan<=scans; scan++) {
+    if (memcmp(&log[scan * ROWS], &reference[scan * ROWS], ROWS * sizeof(uint16_t)) != 0)
+      differ++;
+  }
+
+  printf("KeyboardMatrix::update() from the scan interrupt, track_keys off\n");
+  printf("  %u scans, %u main loop reads, %zu new snapshots checked, %u differ from the scan's matrix_state\n",
+         scans, reads, seen.size(), torn);
+  printf("  %u scans differ from the main loop run with track_keys on\n", differ);
+  printf("  %u pressed_list entries\n\n", isr_matrix->pressed_list.size());
+
+  delete isr_matrix;
+  return torn == 0 && differ == 0;
+}
+
+static void run_timing(void) {
+  const uint32_t iterations = 1000000;
+  MatrixSnapshotLatch timing_latch;
+  uint16_t rows[ROWS] = {};
+  MatrixSnapshot snapshot = MatrixSnapshot();
+
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i=0; i<iterations; i++) {
+    rows[0] = i;
+    timing_latch.publish(rows, ROWS, i, i);
+  }
+  std::chrono::duration<double, std::nano> publish = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  for (uint32_t i=0; i<iterations; i++)
+    timing_latch.read(&snapshot);
+  std::chrono::duration<double, std::nano> read = std::chrono::steady_clock::now() - start;
+
+  printf("host ns, %d rows: publish %.1f, read %.1f\n", ROWS,
+         publish.count() / iterations, read.count() / iterations);
+}
+
+int main(int argc, char **argv) {
+  uint32_t scans = 50000;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) scans = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n scans]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  bool ok = run_latch(scans);
+  ok = run_matrix(scans) && ok;
+  run_timing();
+  return ok ? 0 : 1;
+}
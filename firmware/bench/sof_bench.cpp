@@ -0,0 +1,185 @@
+// USB start-of-frame scheduling benchmark
+//
+// Simulates a host sending SOFs every 1ms and polling the keyboard's endpoint
+// just after each one, and a device main loop with jittery scan pipeline and
+// idle work durations whose clock runs at a slightly different rate. Random
+// key presses are detected on the DETECT_SCANS'th scan sampling after the
+// press; the report is picked up at the first host poll after that scan ends.
+//
+// Compares key-to-host latency of:
+//   free run    scans back to back with idle work in between (no scheduler)
+//   unlocked    ScanScheduler without SOF information (fixed rate)
+//   sof locked  ScanScheduler following the frame number
+//
+// Locking to the SOF is off in the firmware by default because free running
+// came out faster here. Exits non-zero if that stops being true, so the
+// default gets revisited, or if the locked mode stops earning its keep: it
+// must lock, beat the unlocked fixed rate and miss its SOF on at most
+// MAX_OVERRUN_PERCENT of frames.
+//
+// Usage: sof_bench [-n presses] [-s scans_per_frame] [-p pipeline_us] [-j jitter_us]
+//                  [--ppm ppm]
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../ScanScheduler.h"
+
+#define DETECT_SCANS 3
+#define HOST_POLL_DELAY 10
+#define GUARD_MICROS 20
+#define MAX_OVERRUN_PERCENT 2
+
+struct Config {
+  int presses = 20000;
+  uint32_t pipeline_us = 120;
+  uint32_t jitter_us = 40;
+  double ppm = 300;
+  uint8_t scans_per_frame = 4;
+};
+
+struct Stats {
+  std::vector<uint32_t> latency;
+  uint32_t overruns = 0;
+  uint32_t frames = 0;
+  bool locked = false;
+  int32_t phase_error = 0;
+};
+
+enum Mode { FREE_RUN, UNLOCKED, SOF_LOCKED };
+
+static Stats simulate(const Config &config, Mode mode, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<uint32_t> idle(2, 30);
+  std::uniform_int_distribution<uint32_t> jitter(0, config.jitter_us);
+  std::uniform_int_distribution<uint32_t> gap(5000, 15000);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  ScanScheduler scheduler(config.scans_per_frame, GUARD_MICROS);
+  Stats stats;
+
+  // host time in microseconds, the device sees it through its own clock
+  double host = 12345.0;
+  double host_start = host;
+  double rate = 1.0 + config.ppm * 1e-6;
+  auto device_now = [&]() { return (uint32_t) (host * rate); };
+
+  double next_press = host + gap(rng);
+  double pressed_at = -1;
+  int scans_since_press = 0;
+
+  while ((int) stats.latency.size() < config.presses) {
+    if (mode == SOF_LOCKED)
+      scheduler.sof_poll(((uint32_t) (host / 1000)) & 0x7FF, device_now());
+
+    bool scan = (mode == FREE_RUN) || scheduler.scan_due(device_now());
+    if (!scan) {
+      host += idle(rng) / rate;
+      continue;
+    }
+
+    // a scan samples the matrix at its start
+    double scan_start = host;
+    uint32_t device_start = device_now();
+    if (pressed_at >= 0 && scan_start >= pressed_at)
+      scans_since_press++;
+    if (pressed_at < 0 && scan_start >= next_press) {
+      pressed_at = next_press;
+      scans_since_press = 1;
+    }
+
+    uint32_t duration = config.pipeline_us + jitter(rng);
+    if (unit(rng) < 0.01)
+      duration += 300;
+    host += duration / rate;
+    if (mode != FREE_RUN)
+      scheduler.scan_finished(device_start, device_now());
+
+    if (pressed_at >= 0 && scans_since_press >= DETECT_SCANS) {
+      // picked up at the first host poll after the report is ready
+      double frame_start = std::floor(host / 1000) * 1000;
+      double poll = frame_start + HOST_POLL_DELAY;
+      if (poll < host)
+        poll += 1000;
+      stats.latency.push_back((uint32_t) (poll - pressed_at));
+      pressed_at = -1;
+      next_press = host + gap(rng);
+    }
+
+    if (mode == FREE_RUN)
+      host += idle(rng) / rate;
+  }
+
+  stats.overruns = scheduler.overruns;
+  stats.frames = (uint32_t) ((host - host_start) / 1000);
+  stats.locked = scheduler.locked;
+  stats.phase_error = scheduler.last_phase_error;
+  return stats;
+}
+
+static uint32_t percentile(std::vector<uint32_t> v, double p) {
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size()-1, (size_t) (p * v.size()))];
+}
+
+int main(int argc, char **argv) {
+  Config config;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) config.presses = atoi(argv[++i]);
+    else if (arg == "-p" && i+1 < argc) config.pipeline_us = atoi(argv[++i]);
+    else if (arg == "-j" && i+1 < argc) config.jitter_us = atoi(argv[++i]);
+    else if (arg == "--ppm" && i+1 < argc) config.ppm = atof(argv[++i]);
+    else if (arg == "-s" && i+1 < argc) config.scans_per_frame = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n presses] [-s scans_per_frame] [-p pipeline_us] [-j jitter_us] [--ppm ppm]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  printf("pipeline %u+%u us, %u scans per frame, device clock %+.0f ppm, %d presses, detect on scan %d\n\n",
+         config.pipeline_us, config.jitter_us, config.scans_per_frame, config.ppm, config.presses, DETECT_SCANS);
+  printf("%-12s %10s %10s %10s %10s %9s %7s\n", "mode", "avg us", "p50 us", "p99 us",
+         "max us", "overruns", "locked");
+
+  const char *names[] = {"free run", "unlocked", "sof locked"};
+  Stats stats[SOF_LOCKED + 1];
+  double average[SOF_LOCKED + 1];
+  for (int mode=FREE_RUN; mode<=SOF_LOCKED; mode++) {
+    Stats &s = stats[mode];
+    s = simulate(config, (Mode) mode, 1);
+    double sum = 0;
+    for (uint32_t l : s.latency)
+      sum += l;
+    average[mode] = sum / s.latency.size();
+    printf("%-12s %10.0f %10u %10u %10u %9u %7s\n", names[mode], average[mode],
+           percentile(s.latency, 0.5), percentile(s.latency, 0.99), percentile(s.latency, 1.0),
+           s.overruns, mode == SOF_LOCKED ? (s.locked ? "yes" : "no") : "-");
+  }
+
+  const Stats &locked = stats[SOF_LOCKED];
+  bool failed = false;
+  printf("\nsof locked vs free run: %+.0f us\n", average[SOF_LOCKED] - average[FREE_RUN]);
+  if (average[SOF_LOCKED] <= average[FREE_RUN]) {
+    printf("sof locked beat free run, ENABLE_SOF_SCHEDULING should be the default\n");
+    failed = true;
+  }
+  if (!locked.locked) {
+    printf("sof locked never locked\n");
+    failed = true;
+  }
+  if (average[SOF_LOCKED] >= average[UNLOCKED]) {
+    printf("sof locked no faster than unlocked\n");
+    failed = true;
+  }
+  if (locked.overruns * 100 > (uint64_t) locked.frames * MAX_OVERRUN_PERCENT) {
+    printf("sof locked missed %u of %u SOFs\n", locked.overruns, locked.frames);
+    failed = true;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,326 @@
+// Split link benchmark
+//
+// Runs two SplitLink instances, a secondary and a primary, over a simulated
+// UART pipe in each direction that delivers one byte per bit time at
+// SPLIT_BAUD. The secondary types on its half (random keys, some held for a
+// second or more like modifiers) and sends its rows every scan, the primary
+// polls every scan. Each pipe can corrupt bytes (one bit flipped) and drop
+// whole frames, everything one send_rows() or poll() call wrote.
+//
+// For each fault model reports the link counters and how the primary's
+// remote rows follow the secondary's:
+//   stale    episodes of a key shown held on the primary after it was
+//            released on the secondary, and the longest
+//   resynced of those, episodes still stale after the primary found the gap
+//            and asked for a keyframe
+//   missed   episodes of a key held on the secondary shown released on the
+//            primary, and the longest
+// Episodes shorter than LATENCY_MICROS (a frame in flight) aren't counted. A
+// lost frame is only noticed when the next one arrives, up to a keyframe
+// interval later, so stale keys can't be avoided; holding them once the
+// primary knows its rows are out of date can. Exits non-zero if a clean link
+// diverges at all, if a key stays stale past a resync, or if the rows differ
+// once the link has been quiet.
+//
+// Usage: split_bench [-t seconds] [--seed n]
+
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../SplitLink.h"
+
+#define ROWS 5
+#define COLS 8
+#define SCAN_MICROS 500
+#define STEP_MICROS 50
+// Longest frame (a keyframe) at SPLIT_BAUD plus a scan either side
+#define LATENCY_MICROS (2*SCAN_MICROS + (5 + ROWS*2) * 10000000 / SPLIT_BAUD)
+
+struct FaultModel {
+  const char *name;
+  // chance a byte has a bit flipped
+  double corrupt;
+  // chance everything written by one call is lost
+  double drop;
+};
+
+// One direction of the UART: bytes written are delivered a bit time apart
+class UartPipe {
+public:
+  UartPipe(std::mt19937 *random) : rng(random), corrupt(0), dropping(false), next_free(0) {}
+
+  std::mt19937 *rng;
+  double corrupt;
+  // set around a call to lose what it writes
+  bool dropping;
+
+  void write(uint8_t b) {
+    if (dropping)
+      return;
+    if (corrupt > 0 && std::uniform_real_distribution<double>(0, 1)(*rng) < corrupt)
+      b ^= 1 << ((*rng)() % 8);
+    double start = std::max(next_free, (double) micros());
+    next_free = start + 10e6 / SPLIT_BAUD;
+    wire.push_back(std::make_pair(next_free, b));
+  }
+  bool available(void) {
+    return !wire.empty() && wire.front().first <= micros();
+  }
+  uint8_t read(void) {
+    uint8_t b = wire.front().second;
+    wire.pop_front();
+    return b;
+  }
+
+private:
+  // arrival time and byte
+  std::deque<std::pair<double, uint8_t> > wire;
+  double next_free;
+};
+
+// One half's Serial1: writes go down one pipe, reads come up the other
+class UartPort : public Stream {
+public:
+  UartPort(UartPipe *tx_pipe, UartPipe *rx_pipe) : tx(tx_pipe), rx(rx_pipe) {}
+
+  UartPipe *tx;
+  UartPipe *rx;
+
+  size_t write(uint8_t b) {
+    tx->write(b);
+    return 1;
+  }
+  int availableForWrite(void) { return 64; }
+  int available(void) { return rx->available() ? 1 : 0; }
+  int read(void) { return rx->available() ? rx->read() : -1; }
+};
+
+struct Divergence {
+  uint32_t episodes;
+  uint32_t longest;
+};
+
+struct Result {
+  uint32_t frames;
+  uint32_t crc_errors;
+  uint32_t sequence_errors;
+  uint32_t resyncs;
+  Divergence stale;
+  uint32_t stale_after_resync;
+  Divergence missed;
+  bool settled;
+};
+
+// Tracks how long each key's bit on the primary has differed from the
+// secondary's
+class DivergenceTracker {
+public:
+  DivergenceTracker() {
+    for (int k=0; k<ROWS*COLS; k++) {
+      since[k] = 0;
+      past_resync[k] = false;
+    }
+    stale = Divergence();
+    stale_after_resync = 0;
+    missed = Divergence();
+  }
+
+  uint32_t since[ROWS*COLS];
+  bool past_resync[ROWS*COLS];
+  Divergence stale;
+  uint32_t stale_after_resync;
+  Divergence missed;
+
+  // last_resync is when the primary last asked for a keyframe, 0 for never
+  void update(const uint16_t *secondary, const uint16_t *primary, uint32_t last_resync, uint32_t now) {
+    for (int r=0; r<ROWS; r++) {
+      for (int c=0; c<COLS; c++) {
+        int k = r*COLS + c;
+        bool held = !(secondary[r] & (1 << c));
+        bool shown = !(primary[r] & (1 << c));
+        if (held == shown) {
+          if (since[k] != 0)
+            end(k, shown, now);
+          since[k] = 0;
+          past_resync[k] = false;
+        }
+        else if (since[k] == 0) {
+          since[k] = now;
+        }
+        else if (shown && !past_resync[k] && last_resync >= since[k] &&
+                 now - last_resync > LATENCY_MICROS) {
+          past_resync[k] = true;
+          stale_after_resync++;
+        }
+      }
+    }
+  }
+
+  void finish(const uint16_t *primary, uint32_t now) {
+    for (int k=0; k<ROWS*COLS; k++) {
+      if (since[k] != 0)
+        end(k, !(primary[k / COLS] & (1 << (k % COLS))), now);
+    }
+  }
+
+private:
+  // an episode ended with the key shown as it had been
+  void end(int k, bool shown_now, uint32_t now) {
+    uint32_t length = now - since[k];
+    if (length < LATENCY_MICROS)
+      return;
+    // shown now is what the secondary has now, the primary showed the
+    // opposite: held on the primary means it was stale
+    Divergence *d = shown_now ? &missed : &stale;
+    d->episodes++;
+    d->longest = std::max(d->longest, length);
+  }
+};
+
+static Result run(const FaultModel &model, uint32_t seconds, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> key(0, ROWS*COLS - 1);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<uint32_t> hold(30000, 150000);
+  std::uniform_int_distribution<uint32_t> long_hold(1000000, 3000000);
+  std::exponential_distribution<double> gap(1 / 60000.0);
+  std::uniform_real_distribution<double> chance(0, 1);
+
+  UartPipe to_primary(&rng);
+  UartPipe to_secondary(&rng);
+  to_primary.corrupt = model.corrupt;
+  to_secondary.corrupt = model.corrupt;
+
+  UartPort secondary_port(&to_primary, &to_secondary);
+  UartPort primary_port(&to_secondary, &to_primary);
+
+  uint32_t now = 1;
+  host_set_micros(now);
+  SplitLink secondary(&secondary_port, ROWS);
+  SplitLink primary(&primary_port, ROWS);
+  secondary.begin();
+  primary.begin();
+
+  uint16_t rows[ROWS];
+  uint32_t release_at[ROWS*COLS];
+  for (int r=0; r<ROWS; r++)
+    rows[r] = 0xFFFF;
+  for (int k=0; k<ROWS*COLS; k++)
+    release_at[k] = 0;
+
+  DivergenceTracker tracker;
+  uint32_t end = seconds * 1000000;
+  // the last second has no key changes and no faults, so the link settles
+  uint32_t quiet = end - 1000000;
+  uint32_t next_press = now + (uint32_t) gap(rng);
+  uint32_t next_scan = now;
+  uint32_t resyncs = 0;
+  uint32_t last_resync = 0;
+
+  for (; now<end; now+=STEP_MICROS) {
+    host_set_micros(now);
+
+    if (now < quiet) {
+      while (next_press <= now) {
+        int k = key(rng);
+        if (release_at[k] == 0) {
+          rows[k / COLS] &= ~(1 << (k % COLS));
+          release_at[k] = now + (percent(rng) < 5 ? long_hold(rng) : hold(rng));
+        }
+        next_press += 1 + (uint32_t) gap(rng);
+      }
+    }
+    for (int k=0; k<ROWS*COLS; k++) {
+      if (release_at[k] != 0 && (release_at[k] <= now || now >= quiet)) {
+        rows[k / COLS] |= 1 << (k % COLS);
+        release_at[k] = 0;
+      }
+    }
+
+    if (now >= next_scan) {
+      bool faults = now < quiet;
+      to_primary.corrupt = faults ? model.corrupt : 0;
+      to_secondary.corrupt = faults ? model.corrupt : 0;
+
+      to_primary.dropping = faults && chance(rng) < model.drop;
+      secondary.send_rows(rows);
+      to_primary.dropping = false;
+      next_scan += SCAN_MICROS;
+    }
+
+    // a resync request the primary writes can be lost too
+    to_secondary.dropping = now < quiet && chance(rng) < model.drop;
+    primary.poll();
+    to_secondary.dropping = false;
+    secondary.poll();
+
+    if (primary.resyncs != resyncs) {
+      resyncs = primary.resyncs;
+      last_resync = now;
+    }
+    tracker.update(rows, primary.rows, last_resync, now);
+  }
+  tracker.finish(primary.rows, now);
+
+  Result result = Result();
+  result.frames = primary.frames_received;
+  result.crc_errors = primary.crc_errors;
+  result.sequence_errors = primary.sequence_errors;
+  result.resyncs = primary.resyncs;
+  result.stale = tracker.stale;
+  result.stale_after_resync = tracker.stale_after_resync;
+  result.missed = tracker.missed;
+  result.settled = true;
+  for (int r=0; r<ROWS; r++)
+    result.settled &= primary.rows[r] == rows[r];
+  return result;
+}
+
+int main(int argc, char **argv) {
+  uint32_t seconds = 60;
+  uint32_t seed = 1;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-t" && i+1 < argc) seconds = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-t seconds] [--seed n]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (seconds < 2)
+    seconds = 2;
+
+  const FaultModel models[] = {
+    {"clean", 0, 0},
+    {"corrupt 1e-4", 1e-4, 0},
+    {"corrupt 1e-3", 1e-3, 0},
+    {"drop 1%", 0, 0.01},
+    {"drop 5%", 0, 0.05},
+    {"corrupt+drop", 1e-3, 0.01},
+  };
+
+  printf("%u s, %dx%d keys, scan every %u us, %u baud\n\n", seconds, ROWS, COLS, SCAN_MICROS, SPLIT_BAUD);
+  printf("%-14s %7s %6s %6s %7s %7s %10s %8s %7s %10s  %s\n", "link", "frames", "crc", "seq",
+         "resyncs", "stale", "longest us", "resynced", "missed", "longest us", "settled");
+
+  bool failed = false;
+  for (const FaultModel &model : models) {
+    Result r = run(model, seconds, seed);
+    bool clean = model.corrupt == 0 && model.drop == 0;
+    bool ok = r.settled && r.stale_after_resync == 0 &&
+              (!clean || (r.stale.episodes == 0 && r.missed.episodes == 0 && r.resyncs == 0));
+    printf("%-14s %7u %6u %6u %7u %7u %10u %8u %7u %10u  %s%s\n", model.name, r.frames, r.crc_errors,
+           r.sequence_errors, r.resyncs, r.stale.episodes, r.stale.longest, r.stale_after_resync,
+           r.missed.episodes, r.missed.longest, r.settled ? "yes" : "no", ok ? "" : "  *");
+    if (!ok)
+      failed = true;
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,555 @@
+// Steno stroke benchmark
+//
+// Replays stroke sequences on the layout's steno keys through the firmware's
+// KeyboardMatrix and StenoEngine, decodes the GeminiPR and TX Bolt packets the
+// way a host steno engine does, and checks every stroke comes out exactly as
+// it was written: none merged with the next, split in two, dropped or with a
+// key missing.
+//
+// Strokes are in steno order ("STKPWHRAO*EUFRPBLGTSDZ", a '-' before right
+// bank keys with no vowel or star, '#' for the number bar), from a built-in
+// sample or a file (-f, separated by spaces, newlines or '/'), followed by
+// random chords up to -n strokes. Each steno key is typed on one of its
+// physical keys at random (either S-, any star, any number bar key).
+//
+// The stenographer, at a given speed (STROKES_PER_WORD strokes a word):
+//   - starts strokes a gamma distributed interval apart, cv --interval-cv
+//   - rolls a chord's keys down over the first fifth of the interval, and up
+//     from 60% to 75% of it, so the keyboard is all up for the last quarter
+//   - bounces every contact for up to --bounce us on press and half that on
+//     release
+// Speeds increase until two in a row get a stroke wrong. The maximum exact WPM
+// is the fastest that, like every slower one, got them all right; at high
+// enough speeds the all up gap (min gap, the shortest between two strokes)
+// gets shorter than the release debounce and strokes merge.
+//
+// The matrix has a diode on every switch, no electrical ghosts, and runs with
+// reject_ghosts off as steno mode does. One run with it on shows what it does
+// to chords, whose keys often settle on the same scan.
+//
+// Every packet is also checked against the stroke's keys (both protocols'
+// encodings of every key alone and of random chords), and the cost of
+// update() per scan is reported.
+//
+// Usage: steno_bench [-n strokes] [-f file] [-s scan_us] [--seed n]
+//                    [--wpm from:to:step] [--interval-cv cv] [--bounce us]
+//                    [--min-wpm n]
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../KeyboardMatrix.h"
+#include "../StenoEngine.h"
+#include "../LayoutThumbKeyboard.h"
+
+#define STROKES_PER_WORD 1.2
+#define REST_MICROS 1000000
+#define MIN_INTERVAL_MICROS 2000
+// Speed of the run that leaves KeyboardMatrix's ghost rejection on
+#define GHOST_REJECTION_WPM 200
+
+// --- Steno notation ----------------------------------------------------------
+
+static const char steno_order[] = "#STKPWHRAO*EUFRPBLGTSDZ";
+#define STENO_ORDER_KEYS 23
+// Index of -F, the first right bank key
+#define STENO_ORDER_RIGHT 13
+
+// Steno order index of each STENO_ code, -1 for keys with no letter
+static int order_index[STENO_NUM_KEYS + 1];
+
+static void make_order_index() {
+  for (int k=0; k<=STENO_NUM_KEYS; k++)
+    order_index[k] = -1;
+  const uint8_t numbers[] = {STENO_N1, STENO_N2, STENO_N3, STENO_N4, STENO_N5, STENO_N6,
+                             STENO_N7, STENO_N8, STENO_N9, STENO_NA, STENO_NB, STENO_NC};
+  for (uint8_t k : numbers)
+    order_index[k] = 0;
+  const uint8_t keys[] = {STENO_S1, STENO_TL, STENO_KL, STENO_PL, STENO_WL, STENO_HL, STENO_RL,
+                          STENO_A, STENO_O, STENO_ST1, STENO_E, STENO_U, STENO_FR, STENO_RR,
+                          STENO_PR, STENO_BR, STENO_LR, STENO_GR, STENO_TR, STENO_SR, STENO_DR,
+                          STENO_ZR};
+  for (int i=0; i<STENO_ORDER_KEYS-1; i++)
+    order_index[keys[i]] = i + 1;
+  order_index[STENO_S2] = order_index[STENO_S1];
+  order_index[STENO_ST2] = order_index[STENO_ST1];
+  order_index[STENO_ST3] = order_index[STENO_ST1];
+  order_index[STENO_ST4] = order_index[STENO_ST1];
+}
+
+// A stroke as a bit per steno order key
+typedef uint32_t Chord;
+
+static Chord chord_from_keys(steno_stroke keys) {
+  Chord chord = 0;
+  for (int k=1; k<=STENO_NUM_KEYS; k++) {
+    if ((keys & STENO_BIT(k)) && order_index[k] >= 0)
+      chord |= 1 << order_index[k];
+  }
+  return chord;
+}
+
+static bool parse_stroke(const std::string &text, Chord *chord) {
+  int pos = 0;
+  *chord = 0;
+  for (char ch : text) {
+    if (ch == '-') {
+      pos = std::max(pos, STENO_ORDER_RIGHT);
+      continue;
+    }
+    const char *found = strchr(steno_order + pos, ch);
+    if (ch == 0 || found == NULL)
+      return false;
+    pos = found - steno_order;
+    *chord |= 1 << pos;
+    pos++;
+  }
+  return *chord != 0;
+}
+
+static std::string format_stroke(Chord chord) {
+  std::string text;
+  bool middle = false;
+  for (int i=0; i<STENO_ORDER_KEYS; i++) {
+    if (!(chord & (1 << i)))
+      continue;
+    if (i >= 8 && i < STENO_ORDER_RIGHT)
+      middle = true;
+    if (i >= STENO_ORDER_RIGHT && !middle) {
+      text += '-';
+      middle = true;
+    }
+    text += steno_order[i];
+  }
+  return text;
+}
+
+static const char *sample_strokes =
+  "-T SKP TO OF A TPH -S HA -F WAS THAT -B WE HE PWE KWR TKPW SREU -PB TPOR "
+  "STPH TKPWOEUPBG KPA* TP-PL HRAOEUBG STKPWHRAO*EUFRPBLGTSDZ # * "
+  "PROEPBT EUPB -Z KWRAOUR TKAOEUL -D -G TPHAOE/TKOUS KOPL/PHAEUPB RAOEUT "
+  "PHRO*EFR S-P PHRAOEFS TKPWHRA*EUPBLG STKPWHR -FRPBLGTSDZ AO*EU #-T #S #-Z";
+
+// --- Stenographer ------------------------------------------------------------
+
+struct KeyPosition {
+  uint8_t row;
+  uint8_t col;
+};
+
+// The physical keys each steno order key can be typed on
+static std::vector<KeyPosition> key_positions[STENO_ORDER_KEYS];
+
+static void find_positions() {
+  for (uint8_t r=0; r<NUM_ROWS; r++) {
+    for (uint8_t c=0; c<NUM_COLS; c++) {
+      uint8_t k = steno_key_matrix[r][c];
+      if (k != 0 && order_index[k] >= 0)
+        key_positions[order_index[k]].push_back({r, c});
+    }
+  }
+}
+
+struct StenoModel {
+  double wpm;
+  double interval_cv;
+  uint32_t bounce_us;
+};
+
+// A switch contact changing, sorted by time
+struct Contact {
+  uint64_t t;
+  KeyPosition key;
+  bool closed;
+
+  bool operator<(const Contact &other) const { return t < other.t; }
+};
+
+// The ends of one key's part in a stroke: contact from press to release, with
+// bounce
+static void key_contacts(KeyPosition key, uint64_t press, uint64_t release, uint32_t bounce_us,
+                         std::mt19937 &rng, std::vector<Contact> &contacts) {
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  std::uniform_int_distribution<uint32_t> toggle(20, 400);
+
+  for (int phase=0; phase<2; phase++) {
+    bool closed = phase == 0;
+    uint64_t t = closed ? press : release;
+    uint32_t bounce = (uint32_t) (unit(rng) * (closed ? bounce_us : bounce_us / 2));
+    bool level = closed;
+    uint64_t bt = t;
+    contacts.push_back({t, key, closed});
+    while (bounce > 0) {
+      bt += toggle(rng);
+      if (bt >= t + bounce)
+        break;
+      level = !level;
+      contacts.push_back({bt, key, level});
+    }
+    if (level != closed)
+      contacts.push_back({t + bounce, key, closed});
+  }
+}
+
+// Physical contacts for strokes starting at start, returns when the last one
+// is released. min_gap is the shortest time every contact was open between two
+// strokes.
+static uint64_t write_strokes(const std::vector<Chord> &strokes, const StenoModel &model,
+                              uint64_t start, std::mt19937 &rng, std::vector<Contact> &contacts,
+                              uint32_t *min_gap) {
+  double mean_interval = 60e6 / (model.wpm * STROKES_PER_WORD);
+  double shape = 1.0 / (model.interval_cv * model.interval_cv);
+  std::gamma_distribution<double> interval(shape, mean_interval / shape);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  uint64_t t = start;
+  uint64_t end = start;
+
+  *min_gap = UINT32_MAX;
+  for (Chord chord : strokes) {
+    double p = std::max(interval(rng), (double) MIN_INTERVAL_MICROS);
+    uint64_t first_press = UINT64_MAX;
+    size_t first_contact = contacts.size();
+    for (int i=0; i<STENO_ORDER_KEYS; i++) {
+      if (!(chord & (1 << i)))
+        continue;
+      const std::vector<KeyPosition> &positions = key_positions[i];
+      KeyPosition key = positions[(size_t) (unit(rng) * positions.size())];
+      uint64_t press = t + (uint64_t) (unit(rng) * 0.2 * p);
+      uint64_t release = t + (uint64_t) ((0.6 + unit(rng) * 0.15) * p);
+      key_contacts(key, press, release, model.bounce_us, rng, contacts);
+      first_press = std::min(first_press, press);
+    }
+    if (t > start)
+      *min_gap = std::min(*min_gap, first_press > end ? (uint32_t) (first_press - end) : 0);
+    for (size_t i=first_contact; i<contacts.size(); i++)
+      end = std::max(end, contacts[i].t);
+    t += (uint64_t) p;
+  }
+  return end;
+}
+
+// --- Host side ---------------------------------------------------------------
+
+class MemoryStream : public Stream {
+public:
+  std::vector<uint8_t> bytes;
+  size_t write(uint8_t b) { bytes.push_back(b); return 1; }
+  int availableForWrite(void) { return 64; }
+  int available(void) { return 0; }
+  int read(void) { return -1; }
+};
+
+// As a GeminiPR machine driver reads it: a byte with bit 7 set starts a packet
+static std::vector<steno_stroke> decode_gemini_pr(const std::vector<uint8_t> &bytes) {
+  std::vector<steno_stroke> strokes;
+  uint8_t packet[STENO_GEMINI_PR_PACKET_SIZE];
+  size_t length = 0;
+
+  for (uint8_t b : bytes) {
+    if (b & 0x80)
+      length = 0;
+    else if (length == 0)
+      continue;
+    packet[length++] = b;
+    if (length < STENO_GEMINI_PR_PACKET_SIZE)
+      continue;
+    steno_stroke keys = 0;
+    for (int k=0; k<STENO_NUM_KEYS; k++) {
+      if (packet[k / 7] & (0x40 >> (k % 7)))
+        keys |= (steno_stroke) 1 << k;
+    }
+    strokes.push_back(keys);
+    length = 0;
+  }
+  return strokes;
+}
+
+// As a TX Bolt machine driver reads it: a stroke ends on a 0 byte or a group
+// that doesn't follow the last one
+static std::vector<Chord> decode_tx_bolt(const std::vector<uint8_t> &bytes) {
+  // steno order index of each group's bits
+  static const int group_keys[4][6] = {
+    {1, 2, 3, 4, 5, 6},
+    {7, 8, 9, 10, 11, 12},
+    {13, 14, 15, 16, 17, 18},
+    {19, 20, 21, 22, 0, -1},
+  };
+  std::vector<Chord> strokes;
+  Chord chord = 0;
+  int last_group = -1;
+
+  for (uint8_t b : bytes) {
+    int group = b >> 6;
+    if (chord != 0 && (b == 0 || group <= last_group)) {
+      strokes.push_back(chord);
+      chord = 0;
+    }
+    last_group = b == 0 ? -1 : group;
+    for (int i=0; i<6; i++) {
+      if ((b & (1 << i)) && group_keys[group][i] >= 0)
+        chord |= 1 << group_keys[group][i];
+    }
+  }
+  if (chord != 0)
+    strokes.push_back(chord);
+  return strokes;
+}
+
+// --- Runs --------------------------------------------------------------------
+
+static uint8_t pins[NUM_COLS] = {0};
+
+struct Result {
+  double wpm;
+  uint32_t strokes;
+  uint32_t gemini_wrong;
+  uint32_t tx_bolt_wrong;
+  uint32_t dropped;
+  uint32_t min_gap;
+
+  uint32_t errors() const { return gemini_wrong + tx_bolt_wrong + dropped; }
+};
+
+// Strokes that don't line up with the ones expected (longest common
+// subsequence), so a merge counts as two wrong rather than every stroke after
+template<typename T>
+static uint32_t mismatches(const std::vector<T> &got, const std::vector<T> &expected) {
+  std::vector<uint32_t> last(expected.size() + 1, 0), row(expected.size() + 1, 0);
+  for (size_t i=0; i<got.size(); i++) {
+    for (size_t j=0; j<expected.size(); j++)
+      row[j+1] = got[i] == expected[j] ? last[j] + 1 : std::max(last[j+1], row[j]);
+    std::swap(last, row);
+  }
+  return std::max(got.size(), expected.size()) - last[expected.size()];
+}
+
+static Result run_speed(const std::vector<Chord> &strokes, const StenoModel &model, uint32_t scan_us,
+                        bool reject_ghosts, std::mt19937 &rng, bool show_first_error) {
+  KeyboardMatrix matrix(NUM_ROWS, NUM_COLS, pins, pins, DIODE_DIRECTION_ROW_PIN_TO_COL_PIN);
+  StenoEngine gemini(NUM_ROWS, NUM_COLS, &steno_key_matrix[0][0], STENO_GEMINI_PR);
+  StenoEngine tx_bolt(NUM_ROWS, NUM_COLS, &steno_key_matrix[0][0], STENO_TX_BOLT);
+  MemoryStream gemini_out, tx_bolt_out;
+  std::vector<Contact> contacts;
+  std::vector<steno_stroke> gemini_sent;
+  Result result = Result();
+
+  matrix.begin();
+  // only the debounced matrix_state is needed, kept off the heap
+  matrix.track_keys = false;
+  matrix.reject_ghosts = reject_ghosts;
+
+  uint64_t end = write_strokes(strokes, model, REST_MICROS, rng, contacts, &result.min_gap) + REST_MICROS;
+  std::stable_sort(contacts.begin(), contacts.end());
+
+  uint16_t rows[NUM_ROWS];
+  for (uint8_t r=0; r<NUM_ROWS; r++)
+    rows[r] = 0xFFFF;
+  size_t next = 0;
+  for (uint64_t t=0; t<end; t+=scan_us) {
+    while (next < contacts.size() && contacts[next].t <= t) {
+      const Contact &c = contacts[next++];
+      if (c.closed)
+        rows[c.key.row] &= ~(1 << c.key.col);
+      else
+        rows[c.key.row] |= 1 << c.key.col;
+    }
+    matrix.update_from_rows(rows, (uint32_t) t);
+    if (gemini.update(matrix.matrix_state))
+      gemini_sent.push_back(gemini.last_stroke);
+    tx_bolt.update(matrix.matrix_state);
+    gemini.stream_to(&gemini_out, 64);
+    tx_bolt.stream_to(&tx_bolt_out, 64);
+  }
+
+  std::vector<steno_stroke> gemini_keys = decode_gemini_pr(gemini_out.bytes);
+  std::vector<Chord> gemini_strokes, tx_bolt_strokes = decode_tx_bolt(tx_bolt_out.bytes);
+  for (steno_stroke keys : gemini_keys)
+    gemini_strokes.push_back(chord_from_keys(keys));
+
+  result.wpm = model.wpm;
+  result.strokes = strokes.size();
+  // GeminiPR carries every key exactly, TX Bolt the steno order keys
+  result.gemini_wrong = mismatches(gemini_keys, gemini_sent) + mismatches(gemini_strokes, strokes);
+  result.tx_bolt_wrong = mismatches(tx_bolt_strokes, strokes);
+  result.dropped = gemini.dropped_strokes + tx_bolt.dropped_strokes;
+
+  if (show_first_error && result.errors() > 0) {
+    for (size_t i=0; i<strokes.size(); i++) {
+      Chord got = i < gemini_strokes.size() ? gemini_strokes[i] : 0;
+      if (got != strokes[i]) {
+        printf("         first wrong stroke %zu: wrote %s, got %s\n", i, format_stroke(strokes[i]).c_str(),
+               got ? format_stroke(got).c_str() : "nothing");
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+// Every key alone and random chords through both encoders and decoders
+static bool check_packets(std::mt19937 &rng) {
+  std::uniform_int_distribution<int> key(1, STENO_NUM_KEYS);
+  uint32_t wrong = 0;
+
+  for (int n=0; n<STENO_NUM_KEYS + 10000; n++) {
+    steno_stroke keys = 0;
+    if (n < STENO_NUM_KEYS)
+      keys = STENO_BIT(n + 1);
+    else
+      for (int i=0, count=1 + n % 12; i<count; i++)
+        keys |= STENO_BIT(key(rng));
+
+    uint8_t packet[STENO_GEMINI_PR_PACKET_SIZE];
+    uint8_t length = StenoEngine::gemini_pr_packet(keys, packet);
+    std::vector<steno_stroke> gemini = decode_gemini_pr(std::vector<uint8_t>(packet, packet + length));
+    if (gemini.size() != 1 || gemini[0] != keys)
+      wrong++;
+
+    Chord chord = chord_from_keys(keys);
+    length = StenoEngine::tx_bolt_packet(keys, packet);
+    std::vector<Chord> tx_bolt = decode_tx_bolt(std::vector<uint8_t>(packet, packet + length));
+    if (chord == 0 ? length != 0 : tx_bolt.size() != 1 || tx_bolt[0] != chord)
+      wrong++;
+  }
+  printf("packets: %d strokes encoded and decoded, %u wrong\n", STENO_NUM_KEYS + 10000, wrong);
+  return wrong == 0;
+}
+
+static double update_nanoseconds() {
+  StenoEngine engine(NUM_ROWS, NUM_COLS, &steno_key_matrix[0][0], STENO_GEMINI_PR);
+  uint16_t rows[2][NUM_ROWS];
+  const uint32_t scans = 10000000;
+  uint32_t strokes = 0;
+
+  // a chord held for 100 scans, then all up for one
+  for (uint8_t r=0; r<NUM_ROWS; r++) {
+    rows[0][r] = r == 2 ? 0xFF00 : 0xFFFF;
+    rows[1][r] = 0xFFFF;
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t n=0; n<scans; n++)
+    strokes += engine.update(rows[n % 101 == 100]);
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  if (strokes != scans / 101)
+    printf("update(): %u strokes, %u expected\n", strokes, scans / 101);
+  return elapsed.count() / scans;
+}
+
+int main(int argc, char **argv) {
+  size_t num_strokes = 2000;
+  uint32_t scan_us = 250;
+  uint32_t seed = 1;
+  double wpm_from = 100, wpm_to = 2000, wpm_step = 100;
+  StenoModel model = {0, 0.3, 2000};
+  double min_wpm = 0;
+  std::string file;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) num_strokes = atoi(argv[++i]);
+    else if (arg == "-f" && i+1 < argc) file = argv[++i];
+    else if (arg == "-s" && i+1 < argc) scan_us = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else if (arg == "--wpm" && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf:%lf:%lf", &wpm_from, &wpm_to, &wpm_step) != 3 || wpm_step <= 0) {
+        fprintf(stderr, "--wpm wants from:to:step\n");
+        return 2;
+      }
+    }
+    else if (arg == "--interval-cv" && i+1 < argc) model.interval_cv = atof(argv[++i]);
+    else if (arg == "--bounce" && i+1 < argc) model.bounce_us = atoi(argv[++i]);
+    else if (arg == "--min-wpm" && i+1 < argc) min_wpm = atof(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n strokes] [-f file] [-s scan_us] [--seed n] [--wpm from:to:step] "
+              "[--interval-cv cv] [--bounce us] [--min-wpm n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  make_order_index();
+  find_positions();
+  for (int i=0; i<STENO_ORDER_KEYS; i++) {
+    if (key_positions[i].empty()) {
+      fprintf(stderr, "the layout has no %c key\n", steno_order[i]);
+      return 2;
+    }
+  }
+  std::mt19937 rng(seed);
+
+  // the sample (or the file), then random chords
+  std::string text = sample_strokes;
+  if (!file.empty()) {
+    std::ifstream in(file);
+    if (!in) {
+      fprintf(stderr, "can't read %s\n", file.c_str());
+      return 2;
+    }
+    text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  std::replace(text.begin(), text.end(), '/', ' ');
+  std::vector<Chord> strokes;
+  size_t from = 0;
+  while (from < text.size()) {
+    size_t to = text.find_first_of(" \t\r\n", from);
+    if (to == std::string::npos)
+      to = text.size();
+    std::string word = text.substr(from, to - from);
+    from = to + 1;
+    if (word.empty())
+      continue;
+    Chord chord;
+    if (!parse_stroke(word, &chord)) {
+      fprintf(stderr, "not a stroke: %s\n", word.c_str());
+      return 2;
+    }
+    strokes.push_back(chord);
+  }
+  std::uniform_int_distribution<int> order_key(0, STENO_ORDER_KEYS - 1);
+  std::uniform_int_distribution<int> chord_size(1, 8);
+  while (strokes.size() < num_strokes) {
+    Chord chord = 0;
+    for (int i=0, n=chord_size(rng); i<n; i++)
+      chord |= 1 << order_key(rng);
+    strokes.push_back(chord);
+  }
+
+  bool failed = !check_packets(rng);
+  printf("update(): %.1f ns per scan\n\n", update_nanoseconds());
+
+  printf("scan period %u us, %zu strokes per speed, interval cv %.2f, bounce %u us, "
+         "%.1f strokes per word\n\n", scan_us, strokes.size(), model.interval_cv, model.bounce_us,
+         STROKES_PER_WORD);
+  printf("%6s %11s %10s %8s %8s %11s\n", "wpm", "strokes/s", "gemini", "txbolt", "dropped", "min gap us");
+
+  double exact = 0;
+  bool failing = false;
+  int failures_in_a_row = 0;
+  for (double wpm=wpm_from; wpm<=wpm_to && failures_in_a_row < 2; wpm+=wpm_step) {
+    model.wpm = wpm;
+    Result r = run_speed(strokes, model, scan_us, false, rng, !failing);
+    bool ok = r.errors() == 0;
+    if (ok && !failing)
+      exact = wpm;
+    failing = failing || !ok;
+    failures_in_a_row = ok ? 0 : failures_in_a_row + 1;
+    printf("%6.0f %11.1f %10u %8u %8u %11u%s\n", wpm, wpm * STROKES_PER_WORD / 60, r.gemini_wrong,
+           r.tx_bolt_wrong, r.dropped, r.min_gap, ok ? "" : "  *");
+  }
+
+  printf("\nmax exact: %.0f wpm\n", exact);
+
+  model.wpm = GHOST_REJECTION_WPM;
+  Result ghosts = run_speed(strokes, model, scan_us, true, rng, false);
+  printf("with ghost rejection at %.0f wpm: %u of %u strokes wrong\n", model.wpm,
+         ghosts.gemini_wrong, ghosts.strokes);
+  if (min_wpm > 0 && exact < min_wpm) {
+    fprintf(stderr, "FAIL max exact %.0f wpm < %.0f wpm\n", exact, min_wpm);
+    failed = true;
+  }
+  return failed ? 1 : 0;
+}
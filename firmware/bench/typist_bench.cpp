@@ -0,0 +1,512 @@
+// Synthetic typist benchmark
+//
+// Types text on the whole firmware: the sketch itself is built for the host, so
+// key_matrix, keyboard_update() and every key event handler run exactly as
+// configured in the .ino. A model typist closes and opens the layout's switches
+// (with contact bounce) while loop() runs once per scan period, and the USB
+// keyboard reports the sketch sends are decoded the way a host would (see the
+// Keyboard class in Arduino.h).
+//
+// The typist, at a given speed:
+//   - presses keys a gamma distributed interval apart, the mean set by WPM (5
+//     characters per word) and the spread by --interval-cv
+//   - holds each key for the interval times a log-normal overlap factor, with
+//     median --overlap: above 1 the next key goes down first (rollover).
+//     Holds stay under the autorepeat delay, and a key is released before
+//     it's pressed again, at least MIN_REPEAT_MICROS after the last time.
+//   - bounces every contact for up to --bounce us on press and half that on
+//     release
+//   - holds shift (on the other half) for capitals and fn for the fn layer's
+//     brackets, pressed a fraction of the interval before the key and released
+//     after it
+// Text is random sentences from a word list, avoiding anything that would
+// trigger a text expansion.
+//
+// Each speed's decoded text is aligned with what was typed (edit distance
+// with transpositions) and reported as dropped, duplicated, extra, wrong
+// (eg a missed shift) and reordered characters, with latency percentiles from
+// a key's first contact to the report that carries it. Speeds increase until
+// two in a row exceed --max-errors per 1000 characters. The maximum
+// sustainable WPM is the fastest speed that, like every slower one, didn't.
+//
+// Usage: typist_bench [-n chars] [-s scan_us] [--seed n] [--wpm from:to:step]
+//                     [--interval-cv cv] [--overlap median] [--bounce us]
+//                     [--caps fraction] [--symbols fraction]
+//                     [--max-errors per1000] [--min-wpm n]
+// --min-wpm makes the exit status non-zero when the maximum sustainable WPM is
+// lower, to catch regressions.
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../teensy32_thumb_keyboard.ino"
+
+#define REST_MICROS 1000000
+// Longest hold, under the autorepeat delay
+#define MAX_HOLD_MICROS (HOLD_INTERVAL - 50000)
+#define MIN_HOLD_MICROS 15000
+// No finger strikes the same key twice faster than this
+#define MIN_REPEAT_MICROS 60000
+
+// --- Typist ------------------------------------------------------------------
+
+struct KeyPosition {
+  uint8_t row;
+  uint8_t col;
+};
+
+// How to type one character: its key and the modifier held for it
+struct Stroke {
+  bool valid;
+  KeyPosition key;
+  // 0, 1 (shift) or 2 (fn), as the layer it comes from
+  uint8_t layer;
+};
+
+static Stroke strokes[128];
+
+static const KeyPosition left_shift = {4, 0};
+static const KeyPosition right_shift = {4, 8};
+static const KeyPosition fn_key = {5, 6};
+
+// Lowest layer each character is on
+static void find_strokes() {
+  for (uint8_t layer=0; layer<3; layer++) {
+    for (uint8_t r=0; r<NUM_ROWS; r++) {
+      for (uint8_t c=0; c<NUM_COLS; c++) {
+        char a = ascii_key_matrix[layer][r][c];
+        bool text = printable_character(a) || (layer == 0 && a == '\n');
+        if (!text || strokes[(uint8_t) a].valid)
+          continue;
+        strokes[(uint8_t) a] = {true, {r, c}, layer};
+      }
+    }
+  }
+}
+
+static const char *words[] = {
+  "the", "of", "and", "to", "in", "is", "you", "that", "it", "he", "was", "for",
+  "on", "are", "as", "with", "his", "they", "at", "be", "this", "have", "from",
+  "or", "one", "had", "by", "word", "but", "not", "what", "all", "were", "we",
+  "when", "your", "can", "said", "there", "use", "an", "each", "which", "she",
+  "do", "how", "their", "if", "will", "up", "other", "about", "out", "many",
+  "then", "them", "these", "so", "some", "her", "would", "make", "like", "him",
+  "into", "time", "has", "look", "two", "more", "write", "go", "see", "number",
+  "no", "way", "could", "people", "my", "than", "first", "water", "been",
+  "call", "who", "oil", "its", "now", "find", "long", "down", "day", "did",
+  "get", "come", "made", "may", "part", "keyboard", "matrix", "switch", "scan",
+  "press", "release", "bounce", "still", "small", "need", "feel", "book",
+  "keep", "off", "good", "too", "letter", "little", "happen", "quick", "jump",
+  "lazy", "fox", "zebra", "vexing",
+};
+
+static bool expands(const std::string &token) {
+  TextExpander expander(&abbreviations);
+  expander.feed(' ');
+  for (char c : token)
+    expander.feed(c);
+  return expander.feed(' ');
+}
+
+// Sentences of words, some capitalized, some numbers, some in fn layer brackets
+static std::string make_text(size_t length, double caps, double symbols, std::mt19937 &rng) {
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  std::uniform_int_distribution<size_t> pick(0, sizeof(words)/sizeof(words[0]) - 1);
+  std::uniform_int_distribution<int> sentence_words(4, 12);
+  std::string text;
+
+  while (text.size() < length) {
+    int n = sentence_words(rng);
+    for (int w=0; w<n; w++) {
+      std::string token;
+      double kind = unit(rng);
+      if (kind < 0.03)
+        token = std::to_string((int) (unit(rng) * 1000));
+      else
+        token = words[pick(rng)];
+      if (w == 0 || unit(rng) < caps)
+        token[0] = toupper(token[0]);
+      if (unit(rng) < symbols) {
+        const char *brackets[] = {"[]", "{}", "||"};
+        const char *b = brackets[(int) (unit(rng) * 3)];
+        token = b[0] + token + b[1];
+      }
+      if (w == n-1)
+        token += '.';
+      else if (unit(rng) < 0.05)
+        token += ',';
+      if (expands(token)) {
+        w--;
+        continue;
+      }
+      text += token;
+      text += (w == n-1 && unit(rng) < 0.2) ? '\n' : ' ';
+    }
+  }
+  return text;
+}
+
+struct TypistModel {
+  double wpm;
+  double interval_cv;
+  double overlap;
+  uint32_t bounce_us;
+};
+
+// A switch contact changing, sorted by time
+struct Contact {
+  uint64_t t;
+  KeyPosition key;
+  bool closed;
+
+  bool operator<(const Contact &other) const { return t < other.t; }
+};
+
+// The ends of one keystroke: contact from press to release, with bounce
+static void stroke_contacts(KeyPosition key, uint64_t press, uint64_t release, uint32_t bounce_us,
+                            std::mt19937 &rng, std::vector<Contact> &contacts) {
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  std::uniform_int_distribution<uint32_t> toggle(20, 400);
+
+  for (int phase=0; phase<2; phase++) {
+    bool closed = phase == 0;
+    uint64_t t = closed ? press : release;
+    uint32_t bounce = (uint32_t) (unit(rng) * (closed ? bounce_us : bounce_us / 2));
+    bool level = closed;
+    uint64_t bt = t;
+    contacts.push_back({t, key, closed});
+    while (bounce > 0) {
+      bt += toggle(rng);
+      if (bt >= t + bounce)
+        break;
+      level = !level;
+      contacts.push_back({bt, key, level});
+    }
+    if (level != closed)
+      contacts.push_back({t + bounce, key, closed});
+  }
+}
+
+// Physical contacts for text starting at start, the time each character's key
+// first closes and how many keys were still down when the next one went down
+static uint64_t type_text(const std::string &text, const TypistModel &model, uint64_t start,
+                          std::mt19937 &rng, std::vector<Contact> &contacts,
+                          std::vector<uint64_t> &press_times, uint32_t &rollovers) {
+  double mean_interval = 60e6 / (model.wpm * 5);
+  double shape = 1.0 / (model.interval_cv * model.interval_cv);
+  std::gamma_distribution<double> interval(shape, mean_interval / shape);
+  std::lognormal_distribution<double> overlap(log(model.overlap), 0.3);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  // press times first, holds depend on the next press
+  std::vector<uint64_t> press(text.size());
+  uint64_t key_last_press[NUM_ROWS*NUM_COLS] = {0};
+  uint64_t t = start;
+  for (size_t i=0; i<text.size(); i++) {
+    const KeyPosition &key = strokes[(uint8_t) text[i]].key;
+    uint64_t &last = key_last_press[key.row*NUM_COLS + key.col];
+    if (last != 0 && t < last + MIN_REPEAT_MICROS)
+      t = last + MIN_REPEAT_MICROS;
+    press[i] = last = t;
+    t += (uint64_t) interval(rng) + 1;
+  }
+
+  // when each character's key goes down again
+  std::vector<uint64_t> press_again(text.size(), UINT64_MAX);
+  uint64_t key_next_press[NUM_ROWS*NUM_COLS];
+  std::fill(key_next_press, key_next_press + NUM_ROWS*NUM_COLS, UINT64_MAX);
+  for (size_t i=text.size(); i-- > 0; ) {
+    const KeyPosition &key = strokes[(uint8_t) text[i]].key;
+    press_again[i] = key_next_press[key.row*NUM_COLS + key.col];
+    key_next_press[key.row*NUM_COLS + key.col] = press[i];
+  }
+
+  for (size_t i=0; i<text.size(); i++) {
+    const Stroke &stroke = strokes[(uint8_t) text[i]];
+    uint64_t next = i+1 < text.size() ? press[i+1] : press[i] + (uint64_t) mean_interval;
+    uint64_t gap = next - press[i];
+    uint64_t hold = (uint64_t) (gap * overlap(rng));
+    hold = std::max<uint64_t>(MIN_HOLD_MICROS, std::min<uint64_t>(MAX_HOLD_MICROS, hold));
+    // a key has to come up before it can go down again
+    if (press_again[i] != UINT64_MAX)
+      hold = std::min(hold, (press_again[i] - press[i]) / 2);
+    if (hold > gap)
+      rollovers++;
+    stroke_contacts(stroke.key, press[i], press[i] + hold, model.bounce_us, rng, contacts);
+    press_times.push_back(press[i]);
+
+    if (stroke.layer != 0) {
+      // down some of the way from the last press, up before the next one
+      uint64_t prev_gap = i > 0 ? press[i] - press[i-1] : (uint64_t) mean_interval;
+      // at most half of each gap, so the next capital's shift comes after
+      uint64_t lead = (uint64_t) (prev_gap * (0.1 + 0.4 * unit(rng))) + 1;
+      uint64_t lag = (uint64_t) (std::min(gap, hold) * (0.1 + 0.4 * unit(rng))) + 1;
+      KeyPosition modifier = fn_key;
+      if (stroke.layer == 1)
+        modifier = stroke.key.col < NUM_COLS/2 ? right_shift : left_shift;
+      stroke_contacts(modifier, press[i] - lead, press[i] + lag, model.bounce_us, rng, contacts);
+    }
+  }
+  return press.empty() ? start : press.back() + MAX_HOLD_MICROS;
+}
+
+// --- Host --------------------------------------------------------------------
+
+struct TypedChar {
+  char c;
+  uint64_t t;
+};
+
+static uint64_t now = 0;
+static uint8_t last_report[HOST_KEYBOARD_REPORT_SIZE];
+static std::vector<TypedChar> typed;
+static char us_chars[2][256];
+
+static uint8_t first_report[HOST_KEYBOARD_REPORT_SIZE];
+static bool reported;
+
+static void capture_report(const uint8_t *report) {
+  if (!reported)
+    memcpy(first_report, report, HOST_KEYBOARD_REPORT_SIZE);
+  reported = true;
+}
+
+// Inverse of the US layout the Keyboard class types with
+static void make_us_chars() {
+  host_set_keyboard_listener(capture_report);
+  for (uint8_t c=32; c<127; c++) {
+    reported = false;
+    Keyboard.write(c);
+    us_chars[first_report[0] & 0x22 ? 1 : 0][first_report[2]] = c;
+  }
+  for (uint8_t shift=0; shift<2; shift++) {
+    us_chars[shift][40] = '\n';
+    us_chars[shift][42] = '\b';
+    us_chars[shift][43] = '\t';
+  }
+  host_set_keyboard_listener(NULL);
+}
+
+// A key in this report but not the last one types a character, ctrl, alt and
+// gui combinations type 0x01 (never in the text)
+static void keyboard_report(const uint8_t *report) {
+  for (uint8_t i=2; i<HOST_KEYBOARD_REPORT_SIZE; i++) {
+    uint8_t usage = report[i];
+    if (usage == 0 || memchr(last_report + 2, usage, 6) != NULL)
+      continue;
+    char c = us_chars[report[0] & 0x22 ? 1 : 0][usage];
+    if (report[0] & ~0x22)
+      c = 0x01;
+    typed.push_back({c ? c : (char) 0x01, now});
+  }
+  memcpy(last_report, report, HOST_KEYBOARD_REPORT_SIZE);
+}
+
+// Run loop() once per scan period until end, closing and opening switches as
+// the contacts say
+static void run_until(uint64_t end, uint32_t scan_us, const std::vector<Contact> &contacts,
+                      size_t &next_contact) {
+  while (now < end) {
+    now += scan_us;
+    while (next_contact < contacts.size() && contacts[next_contact].t <= now) {
+      const Contact &contact = contacts[next_contact++];
+      host_set_switch(col_pins[contact.key.col], row_pins[contact.key.row], contact.closed);
+    }
+    host_set_micros((uint32_t) now);
+    loop();
+  }
+}
+
+// --- Checking ----------------------------------------------------------------
+
+struct Result {
+  double wpm;
+  size_t chars;
+  uint32_t rollovers;
+  uint32_t dropped;
+  uint32_t duplicated;
+  uint32_t extra;
+  uint32_t wrong;
+  uint32_t reordered;
+  std::vector<uint32_t> latency;
+
+  uint32_t errors() const { return dropped + duplicated + extra + wrong + reordered; }
+};
+
+// Optimal string alignment of what was typed against the text, counting each
+// kind of edit on the way back
+static void align(const std::string &text, const std::vector<uint64_t> &press_times,
+                  const std::vector<TypedChar> &out, Result &result) {
+  size_t n = text.size(), m = out.size();
+  std::vector<uint32_t> d((n+1) * (m+1));
+  #define D(i, j) d[(i)*(m+1) + (j)]
+
+  for (size_t i=0; i<=n; i++)
+    D(i, 0) = i;
+  for (size_t j=0; j<=m; j++)
+    D(0, j) = j;
+  for (size_t i=1; i<=n; i++) {
+    for (size_t j=1; j<=m; j++) {
+      uint32_t best = std::min(D(i-1, j) + 1, D(i, j-1) + 1);
+      best = std::min(best, D(i-1, j-1) + (text[i-1] == out[j-1].c ? 0 : 1));
+      if (i > 1 && j > 1 && text[i-1] == out[j-2].c && text[i-2] == out[j-1].c)
+        best = std::min(best, D(i-2, j-2) + 1);
+      D(i, j) = best;
+    }
+  }
+
+  size_t i = n, j = m;
+  while (i > 0 || j > 0) {
+    // a character can't come out before its key went down, it belongs to an
+    // earlier one of the same
+    bool early = i > 0 && j > 0 && out[j-1].t < press_times[i-1] && D(i, j) == D(i-1, j) + 1;
+    if (i > 0 && j > 0 && text[i-1] == out[j-1].c && D(i, j) == D(i-1, j-1) && !early) {
+      result.latency.push_back((uint32_t) (out[j-1].t - press_times[i-1]));
+      i--, j--;
+    }
+    else if (i > 1 && j > 1 && text[i-1] == out[j-2].c && text[i-2] == out[j-1].c &&
+             D(i, j) == D(i-2, j-2) + 1) {
+      result.reordered++;
+      i -= 2, j -= 2;
+    }
+    else if (i > 0 && j > 0 && D(i, j) == D(i-1, j-1) + 1 && !early) {
+      result.wrong++;
+      i--, j--;
+    }
+    else if (i > 0 && D(i, j) == D(i-1, j) + 1) {
+      result.dropped++;
+      i--;
+    }
+    else {
+      // the same character as its neighbour in the output
+      if ((j > 1 && out[j-2].c == out[j-1].c) || (j < m && out[j].c == out[j-1].c))
+        result.duplicated++;
+      else
+        result.extra++;
+      j--;
+    }
+  }
+  #undef D
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, double p) {
+  if (v.empty())
+    return 0;
+  std::sort(v.begin(), v.end());
+  return v[std::min(v.size()-1, (size_t) (p * v.size()))];
+}
+
+// Type text at model's speed on a rested keyboard
+static Result run_speed(const std::string &text, const TypistModel &model, uint32_t scan_us,
+                        std::mt19937 &rng) {
+  std::vector<Contact> contacts;
+  std::vector<uint64_t> press_times;
+  Result result = Result();
+
+  // nothing held over from the last speed
+  keyboard_state = KeyboardState();
+#ifdef ENABLE_TEXT_EXPANSION
+  text_expander.reset();
+#endif
+#ifdef ENABLE_AUTOREPEAT
+  autorepeat.stop();
+#endif
+  Keyboard.releaseAll();
+  memset(last_report, 0, sizeof(last_report));
+  typed.clear();
+
+  uint64_t start = now + REST_MICROS;
+  uint64_t end = type_text(text, model, start, rng, contacts, press_times, result.rollovers);
+  std::stable_sort(contacts.begin(), contacts.end());
+  size_t next_contact = 0;
+  run_until(end + REST_MICROS, scan_us, contacts, next_contact);
+
+  result.wpm = model.wpm;
+  result.chars = text.size();
+  align(text, press_times, typed, result);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  size_t num_chars = 3000;
+  uint32_t scan_us = 250;
+  uint32_t seed = 1;
+  double wpm_from = 40, wpm_to = 800, wpm_step = 20;
+  TypistModel model = {0, 0.5, 1.0, 2000};
+  double caps = 0.1;
+  double symbols = 0.03;
+  double max_errors = 1.0;
+  double min_wpm = 0;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) num_chars = atoi(argv[++i]);
+    else if (arg == "-s" && i+1 < argc) scan_us = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else if (arg == "--wpm" && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf:%lf:%lf", &wpm_from, &wpm_to, &wpm_step) != 3 || wpm_step <= 0) {
+        fprintf(stderr, "--wpm wants from:to:step\n");
+        return 2;
+      }
+    }
+    else if (arg == "--interval-cv" && i+1 < argc) model.interval_cv = atof(argv[++i]);
+    else if (arg == "--overlap" && i+1 < argc) model.overlap = atof(argv[++i]);
+    else if (arg == "--bounce" && i+1 < argc) model.bounce_us = atoi(argv[++i]);
+    else if (arg == "--caps" && i+1 < argc) caps = atof(argv[++i]);
+    else if (arg == "--symbols" && i+1 < argc) symbols = atof(argv[++i]);
+    else if (arg == "--max-errors" && i+1 < argc) max_errors = atof(argv[++i]);
+    else if (arg == "--min-wpm" && i+1 < argc) min_wpm = atof(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n chars] [-s scan_us] [--seed n] [--wpm from:to:step] "
+              "[--interval-cv cv] [--overlap median] [--bounce us] [--caps fraction] "
+              "[--symbols fraction] [--max-errors per1000] [--min-wpm n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  find_strokes();
+  make_us_chars();
+  host_set_keyboard_listener(keyboard_report);
+  host_set_micros(0);
+  setup();
+
+  printf("scan period %u us, %zu characters per speed, interval cv %.2f, overlap %.2f, "
+         "bounce %u us\n\n", scan_us, num_chars, model.interval_cv, model.overlap, model.bounce_us);
+  printf("%6s %8s %8s %8s %8s %8s %8s %10s %25s\n", "wpm", "rollover", "dropped", "dup",
+         "extra", "wrong", "reorder", "err/1k", "latency us p50/p99/max");
+
+  std::mt19937 rng(seed);
+  double sustained = 0;
+  bool failing = false;
+  int failures_in_a_row = 0;
+  for (double wpm=wpm_from; wpm<=wpm_to && failures_in_a_row < 2; wpm+=wpm_step) {
+    std::string text = make_text(num_chars, caps, symbols, rng);
+    model.wpm = wpm;
+    Result r = run_speed(text, model, scan_us, rng);
+
+    double per1k = 1000.0 * r.errors() / r.chars;
+    bool ok = per1k <= max_errors;
+    if (ok && !failing)
+      sustained = wpm;
+    failing = failing || !ok;
+    failures_in_a_row = ok ? 0 : failures_in_a_row + 1;
+
+    char latency[32];
+    snprintf(latency, sizeof(latency), "%u/%u/%u", percentile(r.latency, 0.5),
+             percentile(r.latency, 0.99), percentile(r.latency, 1.0));
+    printf("%6.0f %7.0f%% %8u %8u %8u %8u %8u %10.2f %25s%s\n", wpm, 100.0 * r.rollovers / r.chars,
+           r.dropped, r.duplicated, r.extra, r.wrong, r.reordered, per1k, latency,
+           ok ? "" : "  *");
+  }
+
+  printf("\nmax sustainable: %.0f wpm (at most %.1f errors per 1000 characters)\n",
+         sustained, max_errors);
+  if (min_wpm > 0 && sustained < min_wpm) {
+    fprintf(stderr, "FAIL max sustainable %.0f wpm < %.0f wpm\n", sustained, min_wpm);
+    return 1;
+  }
+  return 0;
+}
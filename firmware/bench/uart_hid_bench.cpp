@@ -0,0 +1,373 @@
+// UART HID output benchmark
+//
+// Types random text (and mouse key bursts) through UartHidOutput into a
+// simulated UART whose transmit buffer drains at the link baud rate into a
+// pty. The other end of the pty stands in for the Bluetooth module: it parses
+// the raw HID frames and rebuilds what the host would see. The module can
+// also hold off the UART (CTS) for a while every so often, like a radio busy
+// retransmitting.
+//
+// For each link, with coalescing on and off, reports frames sent, key press
+// to module latency, and whether the typed text and the total mouse movement
+// and clicks arrived intact. Exits non-zero if anything is lost with
+// coalescing on, or if the output ever wrote to a full transmit buffer.
+//
+// Usage: uart_hid_bench [-n characters] [--wpm wpm] [--seed n]
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "../UartHidOutput.h"
+
+// Teensy 3.x Serial2 transmit buffer
+#define TX_BUFFER_SIZE 40
+#define STEP_MICROS 100
+#define SHIFT_KEY (HID_MODIFIER_CODE_TYPE | 0x02)
+
+struct Link {
+  const char *name;
+  uint32_t baud;
+  // CTS held off for stall_micros every stall_period micros (0 for never)
+  uint32_t stall_period;
+  uint32_t stall_micros;
+};
+
+// A UART transmit buffer that sends one byte per bit time into a pty
+class PtyUart : public Stream {
+public:
+  PtyUart(int pty_fd, uint32_t baud) : fd(pty_fd), byte_micros(10e6 / baud), next_byte(0),
+                                       cts_blocked(false), overruns(0) {}
+
+  int fd;
+  std::deque<uint8_t> fifo;
+  double byte_micros;
+  double next_byte;
+  bool cts_blocked;
+  uint32_t overruns;
+
+  size_t write(uint8_t b) {
+    if (fifo.size() >= TX_BUFFER_SIZE) {
+      // a real port would block the scan here
+      overruns++;
+    }
+    fifo.push_back(b);
+    return 1;
+  }
+  int availableForWrite(void) { return fifo.size() >= TX_BUFFER_SIZE ? 0 : TX_BUFFER_SIZE - fifo.size(); }
+  int available(void) { return 0; }
+  int read(void) { return -1; }
+
+  void drain(uint32_t now) {
+    if (fifo.empty() || cts_blocked) {
+      next_byte = now;
+      return;
+    }
+    while (!fifo.empty() && next_byte <= now) {
+      uint8_t b = fifo.front();
+      if (::write(fd, &b, 1) != 1)
+        return;
+      fifo.pop_front();
+      next_byte += byte_micros;
+    }
+  }
+};
+
+// The Bluetooth module end: parses frames and tracks what the host sees
+class Module {
+public:
+  Module(int pty_fd) : fd(pty_fd), state(0), frames(0), mouse_x(0), mouse_y(0), mouse_wheel(0),
+                       clicks(0), buttons(0) {
+    memset(keyboard, 0, sizeof(keyboard));
+    for (int c=32; c<=126; c++)
+      chars[UartHidOutput::ascii_usage(c)] = c;
+  }
+
+  int fd;
+  int state;
+  uint8_t frame[16];
+  uint8_t length;
+  uint32_t frames;
+  uint8_t keyboard[8];
+  std::map<uint8_t, char> chars;
+  std::string text;
+  // press times waiting for their usage to show up, per usage
+  std::map<uint8_t, std::deque<uint32_t> > pending;
+  std::vector<uint32_t> latency;
+  int32_t mouse_x, mouse_y, mouse_wheel;
+  uint32_t clicks;
+  uint8_t buttons;
+
+  void poll(uint32_t now) {
+    uint8_t b;
+    while (::read(fd, &b, 1) == 1) {
+      if (state == 0) {
+        if (b == UART_HID_FRAME_START)
+          state = 1;
+      }
+      else if (state == 1) {
+        length = b;
+        state = length > 0 && length < sizeof(frame) ? 2 : 0;
+        frame[0] = 0;
+      }
+      else {
+        frame[frame[0] + 1] = b;
+        if (++frame[0] == length) {
+          handle(now);
+          state = 0;
+        }
+      }
+    }
+  }
+
+  bool has_key(const uint8_t *report, uint8_t usage) {
+    for (int i=2; i<8; i++) {
+      if (report[i] == usage)
+        return true;
+    }
+    return false;
+  }
+
+  void handle(uint32_t now) {
+    uint8_t *report = &frame[2];
+    frames++;
+    if (frame[1] == UART_HID_KEYBOARD && length == 9) {
+      bool shift = report[0] & 0x22;
+      for (int i=2; i<8; i++) {
+        uint8_t usage = report[i];
+        if (usage == 0 || has_key(keyboard, usage))
+          continue;
+        uint8_t key = usage | (shift ? 0x80 : 0);
+        text += chars.count(key) ? chars[key] : '?';
+        if (!pending[usage].empty()) {
+          latency.push_back(now - pending[usage].front());
+          pending[usage].pop_front();
+        }
+      }
+      memcpy(keyboard, report, 8);
+    }
+    else if (frame[1] == UART_HID_MOUSE && length == 5) {
+      if ((report[0] & HID_MOUSE_LEFT) && !(buttons & HID_MOUSE_LEFT))
+        clicks++;
+      buttons = report[0];
+      mouse_x += (int8_t) report[1];
+      mouse_y += (int8_t) report[2];
+      mouse_wheel += (int8_t) report[3];
+    }
+  }
+};
+
+struct Action {
+  uint32_t micros;
+  // 0 press, 1 release, 2 mouse move, 3 click
+  int type;
+  uint16_t key;
+};
+
+struct Script {
+  std::vector<Action> actions;
+  std::string text;
+  int32_t mouse_x;
+  uint32_t clicks;
+};
+
+static Script make_script(uint32_t characters, uint32_t wpm, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int> letter(0, 25);
+  std::uniform_int_distribution<int> word_length(1, 8);
+  std::uniform_int_distribution<int> percent(0, 99);
+  std::uniform_int_distribution<int> hold(40000, 120000);
+  std::exponential_distribution<double> gap(wpm * 5.0 / 60e6);
+  const char *punctuation = ".,;:!?'\"()-_";
+
+  Script script = Script();
+  uint32_t t = 10000;
+  // last release of each usage, so a key is never pressed again while down
+  std::map<uint8_t, uint32_t> released;
+
+  while (script.text.size() < characters) {
+    std::string word;
+    int n = word_length(rng);
+    for (int i=0; i<n; i++)
+      word += percent(rng) < 8 ? 'A' + letter(rng) : 'a' + letter(rng);
+    if (percent(rng) < 20)
+      word += punctuation[percent(rng) % strlen(punctuation)];
+    word += ' ';
+
+    for (char c : word) {
+      uint8_t key = UartHidOutput::ascii_usage(c);
+      uint8_t usage = key & 0x7F;
+      t += 15000 + (uint32_t) gap(rng);
+      if (released.count(usage) && t <= released[usage])
+        t = released[usage] + 1000;
+      uint32_t up = t + hold(rng);
+      if (key & 0x80) {
+        // shifted keys don't overlap their neighbours
+        script.actions.push_back({t - 5000, 0, SHIFT_KEY});
+        script.actions.push_back({t, 0, (uint16_t) (HID_KEY_CODE_TYPE | usage)});
+        script.actions.push_back({up, 1, (uint16_t) (HID_KEY_CODE_TYPE | usage)});
+        script.actions.push_back({up + 2000, 1, SHIFT_KEY});
+        t = up + 7000;
+      }
+      else {
+        script.actions.push_back({t, 0, (uint16_t) (HID_KEY_CODE_TYPE | usage)});
+        script.actions.push_back({up, 1, (uint16_t) (HID_KEY_CODE_TYPE | usage)});
+      }
+      released[usage] = up;
+      script.text += c;
+    }
+
+    // now and then a mouse key burst, moving every 10ms like the mouse keys
+    if (percent(rng) < 10) {
+      t += 50000;
+      for (int i=0; i<40; i++) {
+        script.actions.push_back({t, 2, 0});
+        script.mouse_x += 5;
+        t += 10000;
+      }
+      script.actions.push_back({t, 3, 0});
+      script.clicks++;
+      t += 50000;
+    }
+  }
+
+  std::stable_sort(script.actions.begin(), script.actions.end(),
+                   [](const Action &a, const Action &b) { return a.micros < b.micros; });
+  return script;
+}
+
+struct Result {
+  uint32_t frames;
+  uint32_t coalesced;
+  uint32_t overflows;
+  uint32_t overruns;
+  std::vector<uint32_t> latency;
+  bool text_ok;
+  bool mouse_ok;
+};
+
+static Result run(const Script &script, const Link &link, bool coalesce) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("pty");
+    exit(2);
+  }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  fcntl(slave, F_SETFL, O_NONBLOCK);
+
+  PtyUart uart(slave, link.baud);
+  Module module(master);
+  UartHidOutput output(&uart);
+  uint32_t now = 0;
+  host_set_micros(now);
+  output.coalesce = coalesce;
+  output.begin();
+
+  size_t next = 0;
+  uint32_t end = script.actions.back().micros + 2000000;
+  for (now=0; now<end; now+=STEP_MICROS) {
+    host_set_micros(now);
+    uart.cts_blocked = link.stall_period > 0 && now % link.stall_period < link.stall_micros;
+
+    while (next < script.actions.size() && script.actions[next].micros <= now) {
+      const Action &action = script.actions[next++];
+      if (action.type == 0) {
+        if ((action.key & HID_CODE_TYPE_MASK) == HID_KEY_CODE_TYPE)
+          module.pending[action.key & 0xFF].push_back(now);
+        output.press(action.key);
+      }
+      else if (action.type == 1) {
+        output.release(action.key);
+      }
+      else if (action.type == 2) {
+        output.mouse_move(5, 0, 0, 0);
+      }
+      else {
+        output.mouse_click(HID_MOUSE_LEFT);
+      }
+    }
+
+    output.poll();
+    uart.drain(now);
+    module.poll(now);
+  }
+
+  close(slave);
+  close(master);
+
+  Result result = Result();
+  result.frames = module.frames;
+  result.coalesced = output.reports_coalesced;
+  result.overflows = output.overflows;
+  result.overruns = uart.overruns;
+  result.latency = module.latency;
+  std::sort(result.latency.begin(), result.latency.end());
+  result.text_ok = module.text == script.text;
+  result.mouse_ok = module.mouse_x == script.mouse_x && module.clicks == script.clicks;
+  return result;
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  return sorted[std::min(sorted.size() - 1, (size_t) (p * sorted.size()))];
+}
+
+int main(int argc, char **argv) {
+  uint32_t characters = 2000;
+  uint32_t wpm = 150;
+  uint32_t seed = 1;
+
+  for (int i=1; i<argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i+1 < argc) characters = atoi(argv[++i]);
+    else if (arg == "--wpm" && i+1 < argc) wpm = atoi(argv[++i]);
+    else if (arg == "--seed" && i+1 < argc) seed = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: %s [-n characters] [--wpm wpm] [--seed n]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  const Link links[] = {
+    {"115200", 115200, 0, 0},
+    {"9600", 9600, 0, 0},
+    {"2400", 2400, 0, 0},
+    {"115200 cts stalls", 115200, 200000, 30000},
+  };
+
+  Script script = make_script(characters, wpm, seed);
+  printf("%zu characters at %u wpm, %u mouse bursts\n\n", script.text.size(), wpm, script.clicks);
+  printf("%-20s %-9s %7s %9s %9s %9s %9s %9s  %s\n", "link", "coalesce", "frames", "merged",
+         "overflows", "p50 us", "p99 us", "max us", "intact");
+
+  bool failed = false;
+  for (const Link &link : links) {
+    for (int coalesce=1; coalesce>=0; coalesce--) {
+      Result r = run(script, link, coalesce);
+      bool intact = r.text_ok && r.mouse_ok;
+      printf("%-20s %-9s %7u %9u %9u %9u %9u %9u  %s%s\n", link.name, coalesce ? "on" : "off",
+             r.frames, r.coalesced, r.overflows, percentile(r.latency, 0.5),
+             percentile(r.latency, 0.99), percentile(r.latency, 1.0),
+             intact ? "yes" : (r.text_ok ? "mouse lost" : "text lost"),
+             r.overruns ? " (wrote to a full buffer)" : "");
+      if (r.overruns || (coalesce && !intact))
+        failed = true;
+    }
+  }
+
+  return failed ? 1 : 0;
+}
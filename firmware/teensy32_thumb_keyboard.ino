@@ -1,8 +1,33 @@
 #include "KeyboardMatrix.h"
+#include "ShiftRegisterLines.h"
+#include "MCP23017Lines.h"
+#include "SplitLink.h"
+#include "ScanTrace.h"
+#include "KeyEventStream.h"
+#include "StenoEngine.h"
+#include "KeyStats.h"
+#include "DebounceProfileStore.h"
+#include "AutoRepeat.h"
+#include "ScanScheduler.h"
+#include "TaskScheduler.h"
+#include "SerialConsole.h"
+#include "TextDisplay.h"
+#include "ST7735Display.h"
+#include "KeyEvents.h"
+#include "UsbHidOutput.h"
+#include "UartHidOutput.h"
+#include "HeldHidOutput.h"
+#include "TextExpander.h"
+#include "Abbreviations.h"
 
 // Uncomment to show matrix debug messages over serial
 // #define DEBUG
 
+// Uncomment to time strobing every line with pinMode() and with the direction
+// register at startup, printed over serial in nanoseconds per strobe
+// #define STROBE_BENCHMARK
+#define STROBE_BENCHMARK_ITERATIONS 1000
+
 
 // --- LAYOUT OPTIONS ----------------------------------------------------------
 
@@ -11,20 +36,50 @@
 KeyboardMatrix key_matrix = KeyboardMatrix(NUM_ROWS, NUM_COLS,
                                            (uint8_t*) row_pins,
                                            (uint8_t*) col_pins,
-                                           DIODE_DIRECTION_ROW_PIN_TO_COL_PIN);
+                                           DIODE_DIRECTION_ROW_PIN_TO_COL_PIN,
+                                           NUM_REMOTE_ROWS);
 
 // For AppleM0110a:
 // #include "LayoutAppleM0110a.h"
 // KeyboardMatrix key_matrix = KeyboardMatrix(NUM_ROWS, NUM_COLS,
 //                                            (uint8_t*) row_pins,
 //                                            (uint8_t*) col_pins,
-//                                            DIODE_DIRECTION_COL_PIN_TO_ROW_PIN);
+//                                            DIODE_DIRECTION_COL_PIN_TO_ROW_PIN,
+//                                            NUM_REMOTE_ROWS);
+
+// Scan the matrix through 74HC595 (strobe) and 74HC165 (sense) shift registers
+// on SPI instead of the layout's pins, see ShiftRegisterLines.h. The latch pin
+// goes to the 595s' RCLK and the 165s' SH/LD.
+// #define USE_SHIFT_REGISTER_MATRIX
+#define SHIFT_REGISTER_LATCH_PIN 10
+
+// Or through an MCP23017 I2C expander, 8x8 at most, see MCP23017Lines.h
+// #define USE_MCP23017_MATRIX
+#define MCP23017_MATRIX_ADDRESS 0x20
+
+#if defined(USE_SHIFT_REGISTER_MATRIX)
+ShiftRegisterLines matrix_lines = ShiftRegisterLines(SHIFT_REGISTER_LATCH_PIN);
+#elif defined(USE_MCP23017_MATRIX)
+MCP23017Lines matrix_lines = MCP23017Lines(MCP23017_MATRIX_ADDRESS);
+#endif
 
 // --- ADDITIONAL FEATURES ----------------------------------------------------------
 
 // Optional USB support using the Teensy Keyboard and Mouse classes
 #define USE_TEENSY_USB_KEYBOARD
 
+// Send keyboard and mouse reports to a Bluetooth HID module over a UART
+// instead of USB (RN-42 style raw reports, see UartHidOutput.h). Serial2 is
+// moved to its alternate pins since 9 and 10 are used by the matrix and
+// display.
+// #define USE_UART_HID
+#define UART_HID_PORT Serial2
+#define UART_HID_RX_PIN 26
+#define UART_HID_TX_PIN 31
+// The module's RTS wired to one of the port's CTS pins (see the Teensy pinout
+// card) stops the UART while the module is busy
+// #define UART_HID_CTS_PIN 23
+
 // Allow a single shift or fn key-press to apply the modifier to the next key press
 #define ENABLE_ONESHOT_SHIFT_FN
 
@@ -38,6 +93,143 @@ KeyboardMatrix key_matrix = KeyboardMatrix(NUM_ROWS, NUM_COLS,
 // Repeat interval after initial delay
 #define REPEAT_INTERVAL 200000
 
+// Each repeat shortens the interval by this much, down to REPEAT_INTERVAL_MIN
+#define REPEAT_ACCELERATION 15000
+#define REPEAT_INTERVAL_MIN 50000
+
+// Send repeatable keys to the USB host as taps and repeat them in firmware,
+// so the host's own key repeat never kicks in. Off by default: the host never
+// sees those keys held, which breaks anything that reads held keys (games,
+// press and hold shortcuts)
+// #define AUTOREPEAT_USB_TAPS
+
+// Split keyboard: the other half is scanned by a second Teensy which streams its
+// raw rows over Serial1. The layout's NUM_REMOTE_ROWS rows come from the link.
+// #define SPLIT_KEYBOARD_PRIMARY
+
+// Firmware for the other half of a split keyboard: only scan and stream rows
+// #define SPLIT_KEYBOARD_SECONDARY
+
+// Capture every raw matrix scan and stream the binary trace over USB serial
+//   Battery voltage output is turned off so it doesn't corrupt the trace
+// #define ENABLE_SCAN_CAPTURE
+
+// Replay a trace received over USB serial through debounce instead of scanning
+// #define ENABLE_SCAN_REPLAY
+
+// Most trace bytes written to USB serial per loop
+#define SCAN_TRACE_STREAM_BYTES 64
+
+// Stream every key press and release over USB serial as a binary frame with
+// its layer and microsecond timestamp (see KeyEventStream.h), for
+// tools/keyeventd to inject through uinput on a Linux host. Battery output and
+// the serial console are turned off so they don't corrupt the stream. Turn
+// USE_TEENSY_USB_KEYBOARD off as well or the host gets every key twice.
+// #define ENABLE_KEY_EVENT_STREAM
+
+// Most event bytes written to USB serial per loop
+#define KEY_EVENT_STREAM_BYTES 64
+
+#if defined(ENABLE_KEY_EVENT_STREAM) && defined(ENABLE_SCAN_CAPTURE)
+#error "The key event stream and scan capture both need USB serial to themselves"
+#endif
+
+// Steno mode: chords on the layout's steno keys (steno_key_matrix) go out over
+// USB serial as strokes for Plover or another steno engine instead of as key
+// presses (see StenoEngine.h). Keys that aren't steno keys still type. Battery
+// output and the serial console are turned off so they don't corrupt the
+// packets. Ghost rejection is turned off so chords register, which needs a
+// diode on every switch: without, a chord on three corners of a rectangle
+// also closes the fourth.
+// #define ENABLE_STENO
+
+// STENO_GEMINI_PR or STENO_TX_BOLT, set the same machine in the steno engine
+#define STENO_PROTOCOL STENO_GEMINI_PR
+
+// Most steno packet bytes written to USB serial per loop
+#define STENO_STREAM_BYTES 64
+
+#if defined(ENABLE_STENO) && (defined(ENABLE_KEY_EVENT_STREAM) || defined(ENABLE_SCAN_CAPTURE))
+#error "Steno output needs USB serial to itself"
+#endif
+
+// Scan at a fixed rate phase-locked to the USB start-of-frame so a fresh scan
+// finishes just before the host polls for the next report. Without this the
+// matrix is scanned every loop, which is lower latency but never idles.
+// #define ENABLE_SOF_SCHEDULING
+
+// Evenly spaced scans per 1ms USB frame, and how long before the SOF the last
+// one should finish beyond the measured scan time (microseconds)
+#define SOF_SCANS_PER_FRAME 4
+#define SOF_GUARD_MICROS 20
+
+// loop() runs the tasks in the table above it (see TaskScheduler.h). Anything
+// else only starts when its budget fits before the next scan is due, which is
+// at most this long after the last one started (microseconds).
+#define SCAN_DEADLINE_MICROS 1000
+
+// The scan always runs when due, its budget only sets what the tasks listing
+// counts as an overrun. A pin scan takes under 300us. expander_bench puts a
+// full scan's bus time at up to 51us through shift registers (24x16) and 421us
+// through an MCP23017 (8x8 at 1MHz), which is on top of that.
+#if defined(USE_MCP23017_MATRIX)
+#define SCAN_BUDGET_MICROS 730
+#elif defined(USE_SHIFT_REGISTER_MATRIX)
+#define SCAN_BUDGET_MICROS 360
+#else
+#define SCAN_BUDGET_MICROS 300
+#endif
+static_assert(SCAN_BUDGET_MICROS < SCAN_DEADLINE_MICROS, "the scan can't keep its own deadline");
+
+// Keep per-key press counts, hold time and typing interval histograms
+//   Send 'S' over USB serial to get a binary dump (see KeyStats.h)
+#define ENABLE_KEY_STATS
+
+// Learn each key's debounce counts from its own bounce, noise and chatter
+// instead of using steady_count and TRANSIENT_COUNT for every key, and keep
+// them in EEPROM (see KeyboardMatrix.h and DebounceProfileStore.h). The
+// "debounce" console command lists the keys that have learned anything.
+// #define ENABLE_ADAPTIVE_DEBOUNCE
+
+// Echo the typed text on an ST7735 160x128 SPI display. SCK 13 and MOSI 11 as
+// usual, the display never talks back so its DC line uses the MISO pin.
+// #define ENABLE_DISPLAY
+#define DISPLAY_CS_PIN 10
+#define DISPLAY_DC_PIN 12
+
+#if defined(USE_SHIFT_REGISTER_MATRIX) && defined(ENABLE_DISPLAY)
+#error "The shift register matrix needs the SPI bus to itself"
+#endif
+
+// Expand abbreviations typed as words, eg "gst " types "git status ". Edit
+// Abbreviations.txt and regenerate Abbreviations.h to change them (see
+// TextExpander.h). An enter that triggers an expansion is sent after it, so a
+// command in the table runs as soon as it's typed: keep them harmless.
+// #define ENABLE_TEXT_EXPANSION
+
+// Time between the characters of an expansion, enough for the USB host to
+// poll each press and release
+#define TEXT_EXPANSION_CHAR_MICROS 2000
+
+// Get and set repeat, debounce, mouse key and brightness settings at runtime
+// over USB serial, see SerialConsole.h. Send "help" for the commands. Key stats
+// are dumped with the "stats" command instead of 'S'.
+#define ENABLE_SERIAL_CONSOLE
+
+// Scan replay reads USB serial itself, the event stream and steno mode write it
+#if defined(ENABLE_SCAN_REPLAY) || defined(ENABLE_KEY_EVENT_STREAM) || defined(ENABLE_STENO)
+#undef ENABLE_SERIAL_CONSOLE
+#endif
+
+#if defined(USE_TEENSY_USB_KEYBOARD) || defined(USE_UART_HID)
+#define ENABLE_HID_OUTPUT
+#endif
+
+// Expansions are typed through the HID output
+#ifndef ENABLE_HID_OUTPUT
+#undef ENABLE_TEXT_EXPANSION
+#endif
+
 // --- Code --------------------------------------------------------------------
 
 // Represents the current keyboard state between updates
@@ -58,8 +250,15 @@ public:
   bool modifier_ctrl_held = false;
   bool modifier_alt_held = false;
   bool modifier_super_held = false;
+  // number of each modifier key held
+  int8_t modifier_shift_count = 0;
+  int8_t modifier_fn_count = 0;
+  int8_t modifier_ctrl_count = 0;
+  int8_t modifier_alt_count = 0;
+  int8_t modifier_super_count = 0;
+
 
-#ifdef USE_TEENSY_USB_KEYBOARD
+#ifdef ENABLE_HID_OUTPUT
   // Mouse keystate variables
   uint8_t mouse_btn1_held = 0;
   uint8_t mouse_btn2_held = 0;
@@ -67,15 +266,93 @@ public:
   uint8_t mousekey_repeat =  0;
   uint8_t mousekey_accel = 0;
   uint32_t mousekey_last_timer = 0;
+  // bit (ascii_key - ASCII_MOUSE_LEFT) set for each mouse key held
+  uint16_t mousekeys_held = 0;
 #endif
 
 };
 
 KeyboardState keyboard_state = KeyboardState();
 
+// Where keyboard and mouse reports go
+#if defined(USE_UART_HID)
+UartHidOutput uart_hid_output = UartHidOutput(&UART_HID_PORT);
+HidOutput *hid_backend = &uart_hid_output;
+#elif defined(USE_TEENSY_USB_KEYBOARD)
+UsbHidOutput usb_hid_output;
+HidOutput *hid_backend = &usb_hid_output;
+#endif
+
+#if defined(ENABLE_TEXT_EXPANSION)
+// Keys typed while an expansion is being sent wait until it's done
+HeldHidOutput held_hid_output = HeldHidOutput(hid_backend);
+HidOutput *hid_output = &held_hid_output;
+#elif defined(ENABLE_HID_OUTPUT)
+HidOutput *hid_output = hid_backend;
+#endif
+
+// Resolved action and layer of each key while it's down, so its release goes
+// to the same action even if the layer changed since
+#define KEY_NOT_PRESSED 0xFF
+char key_actions[NUM_ROWS*NUM_COLS];
+uint8_t key_layers[NUM_ROWS*NUM_COLS];
+
+#ifdef ENABLE_AUTOREPEAT
+AutoRepeat autorepeat = AutoRepeat(HOLD_INTERVAL, REPEAT_INTERVAL,
+                                   REPEAT_INTERVAL_MIN, REPEAT_ACCELERATION);
+#endif
+
+#ifdef SPLIT_KEYBOARD_PRIMARY
+SplitLink split_link = SplitLink(&Serial1, NUM_REMOTE_ROWS);
+#endif
+#ifdef SPLIT_KEYBOARD_SECONDARY
+SplitLink split_link = SplitLink(&Serial1, NUM_ROWS);
+#endif
+
+#ifdef ENABLE_SCAN_CAPTURE
+ScanTraceWriter scan_trace_writer = ScanTraceWriter();
+#endif
+#ifdef ENABLE_SCAN_REPLAY
+ScanTraceReader scan_trace_reader = ScanTraceReader();
+#endif
+
+#ifdef ENABLE_KEY_EVENT_STREAM
+KeyEventStreamWriter key_event_stream = KeyEventStreamWriter();
+#endif
+
+#ifdef ENABLE_STENO
+StenoEngine steno_engine = StenoEngine(NUM_ROWS, NUM_COLS, &steno_key_matrix[0][0], STENO_PROTOCOL);
+#endif
+
+#ifdef ENABLE_SOF_SCHEDULING
+ScanScheduler scan_scheduler = ScanScheduler(SOF_SCANS_PER_FRAME, SOF_GUARD_MICROS);
+
+uint16_t usb_frame_number() {
+  // 11 bit frame number of the last SOF, from the Kinetis USB controller
+  return USB0_FRMNUML | ((USB0_FRMNUMH & 0x07) << 8);
+}
+#endif
+
+TaskScheduler task_scheduler = TaskScheduler();
+// Defined above loop()
+extern Task tasks[];
+
+#ifdef ENABLE_KEY_STATS
+KeyStats key_stats = KeyStats(NUM_ROWS*NUM_COLS);
+#endif
+
+#ifdef ENABLE_ADAPTIVE_DEBOUNCE
+DebounceProfileStore debounce_profile_store = DebounceProfileStore(&key_matrix);
+#endif
+
+// The EEPROM images, in address order, mustn't run into each other
+static_assert(DEBOUNCE_PROFILE_EEPROM_ADDRESS(NUM_ROWS*NUM_COLS) +
+              DEBOUNCE_PROFILE_EEPROM_SIZE(NUM_ROWS*NUM_COLS) <= CONSOLE_EEPROM_ADDRESS,
+              "key stats and debounce profiles run into the console settings in EEPROM");
+
 
 // --- Mouse key constants and functions ---------------------------------------
-#ifdef USE_TEENSY_USB_KEYBOARD
+#ifdef ENABLE_HID_OUTPUT
 
 // User configurable mouse speed values
 #define MOUSEKEY_DELAY 100
@@ -99,19 +376,20 @@ KeyboardState keyboard_state = KeyboardState();
  *
  *  speed = delta * max_speed * (repeat / time_to_max)**((1000+curve)/1000)
  */
+/* Not const so they can be tuned from the serial console */
 /* milliseconds between the initial key press and first repeated motion event (0-2550) */
-const uint8_t mk_delay = MOUSEKEY_DELAY/10;
+uint8_t mk_delay = MOUSEKEY_DELAY/10;
 /* milliseconds between repeated motion events (0-255) */
-const uint8_t mk_interval = MOUSEKEY_INTERVAL;
+uint8_t mk_interval = MOUSEKEY_INTERVAL;
 /* steady speed (in action_delta units) applied each event (0-255) */
-const uint8_t mk_max_speed = MOUSEKEY_MAX_SPEED;
+uint8_t mk_max_speed = MOUSEKEY_MAX_SPEED;
 /* number of events (count) accelerating to steady speed (0-255) */
-const uint8_t mk_time_to_max = MOUSEKEY_TIME_TO_MAX;
+uint8_t mk_time_to_max = MOUSEKEY_TIME_TO_MAX;
 /* ramp used to reach maximum pointer speed (NOT SUPPORTED) */
 //int8_t mk_curve = 0;
 /* wheel params */
-const uint8_t mk_wheel_max_speed = MOUSEKEY_WHEEL_MAX_SPEED;
-const uint8_t mk_wheel_time_to_max = MOUSEKEY_WHEEL_TIME_TO_MAX;
+uint8_t mk_wheel_max_speed = MOUSEKEY_WHEEL_MAX_SPEED;
+uint8_t mk_wheel_time_to_max = MOUSEKEY_WHEEL_TIME_TO_MAX;
 
 uint8_t mouse_move_unit(void) {
   uint16_t unit;
@@ -156,11 +434,25 @@ uint8_t mouse_wheel_unit(void) {
 char test_string[64];
 uint8_t test_string_index = 0;
 
+#ifdef ENABLE_DISPLAY
+ST7735Display display_driver = ST7735Display(DISPLAY_CS_PIN, DISPLAY_DC_PIN);
+TextDisplay text_display = TextDisplay(&display_driver,
+                                       ST7735_WIDTH / DISPLAY_CELL_WIDTH,
+                                       ST7735_HEIGHT / DISPLAY_CELL_HEIGHT);
+#endif
+
+#ifdef ENABLE_TEXT_EXPANSION
+TextExpander text_expander = TextExpander(&abbreviations);
+uint32_t text_expansion_sent_micros = 0;
+#endif
+
 // Allow printing (eg with Serial) using the stream operator
 template<class T> inline Print& operator <<(Print &obj,     T arg) { obj.print(arg);    return obj; }
 template<>        inline Print& operator <<(Print &obj, float arg) { obj.print(arg, 4); return obj; }
 
 int brightness = 200;
+// Fn + , / Fn + . change brightness by this much
+int brightness_step = 5;
 
 static const uint16_t gamma_table_2_5[] = {
         /* gamma = 2.5 */
@@ -202,7 +494,94 @@ void set_brightness(int b) {
   analogWrite(23, gamma_table_2_5[b]);
 }
 
-uint32_t batt_read_millis = millis();
+#ifdef ENABLE_SERIAL_CONSOLE
+SerialConsole serial_console = SerialConsole(&Serial);
+
+void brightness_changed() {
+  set_brightness(brightness);
+}
+
+// Console commands write their output a part per call (see SerialConsole.h)
+#ifdef ENABLE_KEY_STATS
+bool key_stats_dump(Print *out, uint16_t part) {
+  return key_stats.dump_part(out, part);
+}
+#endif
+
+#ifdef ENABLE_ADAPTIVE_DEBOUNCE
+bool debounce_profiles_print(Print *out, uint16_t part) {
+  return debounce_profile_store.print_part(out, part);
+}
+#endif
+
+bool task_scheduler_print(Print *out, uint16_t part) {
+  return task_scheduler.print_part(out, part);
+}
+
+void serial_console_begin() {
+#ifdef ENABLE_AUTOREPEAT
+  serial_console.add_param("hold_interval", &autorepeat.delay_micros, 10000, 2000000);
+  serial_console.add_param("repeat_interval", &autorepeat.interval_micros, 10000, 2000000);
+  serial_console.add_param("repeat_interval_min", &autorepeat.min_interval_micros, 10000, 2000000);
+  serial_console.add_param("repeat_acceleration", &autorepeat.acceleration_micros, 0, 1000000);
+#endif
+  // at least one sample more than it takes to leave a steady state
+  serial_console.add_param("steady_count", &key_matrix.steady_count, TRANSIENT_COUNT+1, 100);
+#ifdef ENABLE_HID_OUTPUT
+  serial_console.add_param("mk_delay", &mk_delay, 0, 255);
+  serial_console.add_param("mk_interval", &mk_interval, 1, 255);
+  serial_console.add_param("mk_max_speed", &mk_max_speed, 1, 255);
+  serial_console.add_param("mk_time_to_max", &mk_time_to_max, 1, 255);
+  serial_console.add_param("mk_wheel_max_speed", &mk_wheel_max_speed, 1, 255);
+  serial_console.add_param("mk_wheel_time_to_max", &mk_wheel_time_to_max, 1, 255);
+#endif
+  serial_console.add_param("brightness", &brightness, 5, 255, brightness_changed);
+  serial_console.add_param("brightness_step", &brightness_step, 1, 50);
+
+  serial_console.add_counter("scan_count", &key_matrix.scan_count);
+  serial_console.add_counter("idle_scans", &key_matrix.idle_scans);
+  serial_console.add_counter("reverted_transients", &key_matrix.reverted_transients);
+#ifdef ENABLE_TEXT_EXPANSION
+  serial_console.add_counter("text_expansions", &text_expander.expansions);
+  serial_console.add_counter("text_expansions_skipped", &text_expander.skipped);
+  serial_console.add_counter("text_expansion_held_keys", &held_hid_output.held);
+  serial_console.add_counter("text_expansion_held_overflows", &held_hid_output.overflows);
+#endif
+  serial_console.add_counter("console_bytes", &serial_console.bytes_read);
+  serial_console.add_counter("console_commands", &serial_console.commands);
+  serial_console.add_counter("console_errors", &serial_console.errors);
+  serial_console.add_counter("console_overflows", &serial_console.overflows);
+  serial_console.add_counter("console_dropped", &serial_console.dropped);
+#ifdef USE_UART_HID
+  serial_console.add_counter("uart_hid_reports", &uart_hid_output.reports_sent);
+  serial_console.add_counter("uart_hid_coalesced", &uart_hid_output.reports_coalesced);
+  serial_console.add_counter("uart_hid_overflows", &uart_hid_output.overflows);
+  serial_console.add_counter("uart_hid_max_queue_micros", &uart_hid_output.max_queue_micros);
+#endif
+#ifdef SPLIT_KEYBOARD_PRIMARY
+  serial_console.add_counter("split_frames", &split_link.frames_received);
+  serial_console.add_counter("split_crc_errors", &split_link.crc_errors);
+  serial_console.add_counter("split_sequence_errors", &split_link.sequence_errors);
+  serial_console.add_counter("split_resyncs", &split_link.resyncs);
+#endif
+#ifdef ENABLE_SCAN_CAPTURE
+  serial_console.add_counter("trace_dropped", &scan_trace_writer.dropped_records);
+#endif
+#ifdef ENABLE_SOF_SCHEDULING
+  serial_console.add_counter("sof_overruns", &scan_scheduler.overruns);
+  serial_console.add_counter("sof_pipeline_micros", &scan_scheduler.pipeline_micros);
+#endif
+#ifdef ENABLE_KEY_STATS
+  serial_console.add_command("stats", key_stats_dump);
+#endif
+#ifdef ENABLE_ADAPTIVE_DEBOUNCE
+  serial_console.add_command("debounce", debounce_profiles_print);
+#endif
+  serial_console.add_command("tasks", task_scheduler_print);
+
+  serial_console.begin();
+}
+#endif
 
 void setup() {
   Serial.begin(115200);
@@ -214,12 +593,82 @@ void setup() {
   analogWriteResolution(16);
   set_brightness(brightness);
 
+#if defined(USE_SHIFT_REGISTER_MATRIX) || defined(USE_MCP23017_MATRIX)
+  key_matrix.set_line_driver(&matrix_lines);
+#endif
+#ifdef ENABLE_ADAPTIVE_DEBOUNCE
+  key_matrix.adaptive_debounce = true;
+  debounce_profile_store.restore();
+#endif
+#ifdef ENABLE_STENO
+  // a chord's keys settle on the same scan
+  key_matrix.reject_ghosts = false;
+#endif
   key_matrix.begin();
 
+#ifdef STROBE_BENCHMARK
+  // give the serial monitor a chance to connect
+  delay(2000);
+  key_matrix.fast_strobe = false;
+  uint32_t pinmode_micros = key_matrix.strobe_benchmark(STROBE_BENCHMARK_ITERATIONS);
+#ifdef FAST_STROBE_AVAILABLE
+  key_matrix.fast_strobe = true;
+#endif
+  uint32_t fast_micros = key_matrix.strobe_benchmark(STROBE_BENCHMARK_ITERATIONS);
+  uint32_t strobes = (uint32_t) STROBE_BENCHMARK_ITERATIONS * key_matrix.num_strobe_lines;
+  Serial << "strobe (activate + deactivate) ns, pinMode: " << (pinmode_micros*1000 / strobes)
+         << " fast: " << (fast_micros*1000 / strobes) << '\n';
+#endif
+
+#ifdef USE_UART_HID
+  UART_HID_PORT.setRX(UART_HID_RX_PIN);
+  UART_HID_PORT.setTX(UART_HID_TX_PIN);
+  UART_HID_PORT.begin(UART_HID_BAUD);
+#ifdef UART_HID_CTS_PIN
+  UART_HID_PORT.attachCts(UART_HID_CTS_PIN);
+#endif
+  uart_hid_output.begin();
+#endif
+
+#if defined(SPLIT_KEYBOARD_PRIMARY) || defined(SPLIT_KEYBOARD_SECONDARY)
+  Serial1.begin(SPLIT_BAUD);
+  split_link.begin();
+#endif
+#ifdef SPLIT_KEYBOARD_PRIMARY
+  key_matrix.set_remote_rows(split_link.rows);
+#endif
+
+#ifdef ENABLE_SCAN_CAPTURE
+  scan_trace_writer.begin(key_matrix.num_rows);
+#endif
+
+#ifdef ENABLE_KEY_STATS
+  key_stats.begin();
+#endif
+
+#ifdef ENABLE_SERIAL_CONSOLE
+  serial_console_begin();
+#endif
+
+#ifdef ENABLE_DISPLAY
+  display_driver.begin();
+  text_display.set_cursor(test_string_index);
+#endif
+
+#ifdef DEBUG
+  // Report calibrated sense line settle times
+  for (uint8_t s=0; s<key_matrix.num_sense_lines; s++) {
+    Serial << "settle_polls[" << s << "]: " << key_matrix.settle_polls[s] << '\n';
+  }
+#endif
+
   for (uint8_t i=0; i<63; i++) {
     test_string[i] = ' ';
   }
   test_string[63] = '\0';
+
+  memset(key_layers, KEY_NOT_PRESSED, sizeof(key_layers));
+  task_scheduler.begin(tasks, micros());
 #ifdef DEBUG
   Serial.println("Finished setup();");
 #endif
@@ -257,293 +706,234 @@ bool printable_character(char ascii_key) {
 void press_backspace() {
   test_string_index = (test_string_index + 62) % 63;
   test_string[test_string_index] = ' ';
+#ifdef ENABLE_DISPLAY
+  text_display.set_char(test_string_index, ' ');
+  text_display.set_cursor(test_string_index);
+#endif
 }
 
 void press_printable_character(uint8_t ascii_key) {
   // TODO: handle modifiers other than shift/fn. eg Ctrl-C
+#ifdef ENABLE_DISPLAY
+  text_display.set_char(test_string_index, ascii_key);
+#endif
   test_string[test_string_index] = ascii_key;
   test_string_index = (test_string_index + 1) % 63;
+#ifdef ENABLE_DISPLAY
+  text_display.set_cursor(test_string_index);
+#endif
 }
 
-void keyboard_update() {
-  // reset these on each scan
-  bool matrix_changed = false;
-  char ascii_key;
-
-  PressedKey *pkey;
-  ReleasedKey *rkey;
-
-  // assume modifiers not held
-  keyboard_state.modifier_shift_held = false;
-  keyboard_state.modifier_fn_held = false;
-  keyboard_state.modifier_ctrl_held = false;
-  keyboard_state.modifier_alt_held = false;
-  keyboard_state.modifier_super_held = false;
+#ifdef ENABLE_AUTOREPEAT
+// Keys that repeat when held: characters and the layout's autorepeat_keys
+bool autorepeat_allowed(char ascii_key) {
+  if (printable_character(ascii_key))
+    return true;
+  for (uint8_t i=0; autorepeat_keys[i] != 0; i++) {
+    if (autorepeat_keys[i] == ascii_key)
+      return true;
+  }
+  return false;
+}
 
-  // Scan the key matrix
-  matrix_changed = key_matrix.update();
+bool modifier_key(char ascii_key) {
+  return (ascii_key == ASCII_SHIFT ||
+          ascii_key == ASCII_SHIFT_RIGHT ||
+          ascii_key == ASCII_CTRL ||
+          ascii_key == ASCII_ALT ||
+          ascii_key == ASCII_SUPER ||
+          ascii_key == ASCII_FN);
+}
 
-  // check for held modifiers
-  for (uint8_t i=0; i<key_matrix.pressed_list.size(); i++) {
-    pkey = key_matrix.pressed_list.get(i);
-
-    // button_held requires that the button was initially pressed on the last
-    // keyboard scan technically not neccessary here
-    if (key_matrix.button_held(pkey->row, pkey->col)) {
-      // get layer 0 key
-      ascii_key = ascii_key_matrix[0][pkey->row][pkey->col];
-      if (ascii_key == ASCII_CTRL)
-        keyboard_state.modifier_ctrl_held = true;
-      if (ascii_key == ASCII_ALT)
-        keyboard_state.modifier_alt_held = true;
-      if (ascii_key == ASCII_SUPER)
-        keyboard_state.modifier_super_held = true;
-      if (ascii_key == ASCII_SHIFT)
-        keyboard_state.modifier_shift_held = true;
-      if (ascii_key == ASCII_FN)
-        keyboard_state.modifier_fn_held = true;
-    }
-  }  // end check modifiers
+void send_autorepeat() {
+  char ascii_key = autorepeat.ascii_key;
 
-  // if matrix changed
-  // There should only be one new key press or release per matrix update
-  if (matrix_changed) {
-    // Print key matrix for debugging
-#ifdef DEBUG
-    Serial << "\n\n\n";
-    // microseconds since last matrix scan
-    Serial << "delta_micros: " << key_matrix.delta_micros << '\n';
-    for (uint8_t r=0; r<key_matrix.num_rows; r++) {
-      Serial << "ROW" << r << ": ";
-      print_16_bits_reversed(key_matrix.matrix_state[r]);
-    }
+#ifdef ENABLE_TEXT_EXPANSION
+  // Repeats are typing too, a repeated trigger is sent with the expansion
+  if (text_expander.feed(ascii_key)) {
+    held_hid_output.hold();
+    return;
+  }
 #endif
 
-    // Assume layer 0
-    keyboard_state.current_layer = 0;
-
-    // change layers for held modifiers (only shift and fn)
-    if (keyboard_state.modifier_shift_held)
-      keyboard_state.current_layer = 1;
-    else if (keyboard_state.modifier_fn_held || keyboard_state.fn_lock)
-      keyboard_state.current_layer = 2;
+#ifdef ENABLE_HID_OUTPUT
+  if (autorepeat.layer == 2) {
+    // Fn layer characters are always sent as taps
+    if (printable_character(ascii_key))
+      hid_output->type(ascii_key);
+  }
+#ifdef AUTOREPEAT_USB_TAPS
+  else {
+    hid_output->press(usb_key_matrix[autorepeat.row][autorepeat.col]);
+    hid_output->release(usb_key_matrix[autorepeat.row][autorepeat.col]);
+  }
+#endif
+#endif
 
-    // process pressed keys
-    for (uint8_t i=0; i<key_matrix.pressed_list.size(); i++) {
-      pkey = key_matrix.pressed_list.get(i);
+  if (ascii_key == '\b')
+    press_backspace();
+  else if (printable_character(ascii_key))
+    press_printable_character(ascii_key);
 
 #ifdef DEBUG
-      Serial << "pressed key: " << pkey->row << ", " << pkey->col << ", " << pkey->hold_time << '\n';
+  Serial.println(test_string);
+#endif
+}
 #endif
 
-      // if button just pressed (not being held)
-      // if pkey->hold_time > 0 then this is the second or more time the key was seen
-      if (pkey->hold_time == 0) {
-
-        ascii_key = ascii_key_matrix[0][pkey->row][pkey->col];
+// --- Key event handlers ------------------------------------------------------
+// Each gets every new press and release with its resolved action, and a tick
+// once per scan (see KeyEvents.h). Add new features here rather than walking
+// key_matrix.pressed_list again.
 
-#ifdef ENABLE_ONESHOT_SHIFT_FN
-        if (!keyboard_state.fn_lock) {
-          // enable or disable oneshot
-          if (ascii_key == ASCII_SHIFT) {
-            if (keyboard_state.oneshot_shift) {
-              // Serial.println("keyboard_state.oneshot_shift = false");
-              keyboard_state.oneshot_shift = false;
-            }
-            // disable onshot if modifier is pressed a second time
-            else {
-              // Serial.println("keyboard_state.oneshot_shift = true");
-              keyboard_state.oneshot_shift = true;
-            }
-          }
-          else if (ascii_key == ASCII_FN) {
-            if (keyboard_state.oneshot_fn) {
-              // Serial.println("keyboard_state.oneshot_fn = false");
-              keyboard_state.oneshot_fn = false;
-            }
-            // disable onshot if modifier is pressed a second time
-            else {
-              // Serial.println("keyboard_state.oneshot_fn = true");
-              keyboard_state.oneshot_fn = true;
-            }
-          }
-
-          // change layers for oneshot modes
-          if (keyboard_state.oneshot_shift)
-            keyboard_state.current_layer = 1;
-          else if (keyboard_state.oneshot_fn)
-            keyboard_state.current_layer = 2;
-        }
-#endif
-
-        ascii_key = ascii_key_matrix[keyboard_state.current_layer][pkey->row][pkey->col];
-
-        // Use base layer if key is undefined
-        if (ascii_key == 0)
-          ascii_key = ascii_key_matrix[0][pkey->row][pkey->col];
-
-#ifdef USE_TEENSY_USB_KEYBOARD
-        if (keyboard_state.current_layer == 2) {
-          if (printable_character(ascii_key)) {
-            Keyboard.print(ascii_key);
-          }
-          else if (ascii_key == ASCII_MOUSE_BTN1)
-            Mouse.click();
-          else if (ascii_key == ASCII_MOUSE_BTN2)
-            Mouse.click(MOUSE_RIGHT);
-          else if (ascii_key == ASCII_MOUSE_BTN3)
-            Mouse.click(MOUSE_MIDDLE);
-          // TODO: else other keys like mouse buttons?
-        }
-        else
-          Keyboard.press(usb_key_matrix[pkey->row][pkey->col]);
+#ifdef ENABLE_KEY_EVENT_STREAM
+// Every press and release, whatever the other handlers do with it
+struct KeyEventStreamHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    key_event_stream.record(event.row*NUM_COLS + event.col, true, event.layer, event.micros);
+  }
+  static void key_released(const KeyEvent &event) {
+    key_event_stream.record(event.row*NUM_COLS + event.col, false, event.layer, event.micros);
+  }
+};
 #endif
 
-#ifdef ENABLE_ONESHOT_SHIFT_FN
-        // if oneshot is active, and this is not the modifier key, oneshot is used up so set to false
-        if (ascii_key != ASCII_SHIFT && keyboard_state.oneshot_shift) {
-          // Serial.println("clear keyboard_state.oneshot_shift = false");
-          keyboard_state.oneshot_shift = false;
-        }
-        else if (ascii_key != ASCII_FN && keyboard_state.oneshot_fn) {
-          // Serial.println("clear keyboard_state.oneshot_fn = false");
-          keyboard_state.oneshot_fn = false;
-        }
-#endif
-
-        // if backspace
-        if (ascii_key == '\b') {
-          press_backspace();
-        }
-        // if printable character
-        else if (printable_character(ascii_key)) {
-          press_printable_character(ascii_key);
-        }
-        else if (ascii_key == ASCII_FN_LOCK_TOGGLE)
-          keyboard_state.fn_lock = !keyboard_state.fn_lock;
-
-        // TODO: handle more keys
-        // else if (ascii_key == ASCII_CTRL) {
-        // }
-        // else if (ascii_key == ASCII_ALT) {
-        // }
-        // else if (ascii_key == ASCII_SUPER) {
-        // }
-        // else if (ascii_key == ASCII_ESC) {
-        // }
-        // else if (ascii_key == ASCII_UP) {
-        // }
-        // else if (ascii_key == ASCII_DOWN) {
-        // }
-        // else if (ascii_key == ASCII_LEFT) {
-        // }
-        // else if (ascii_key == ASCII_RIGHT) {
-        // }
-      }  // end if just pressed
-
-    }  // end process pressed keys
-
-
-    // process released keys
-    for (uint8_t i=0; i<key_matrix.released_list.size(); i++) {
-      rkey = key_matrix.released_list.get(i);
-
-      // ascii_key = ascii_key_matrix[0][rkey->row][rkey->col];
-#ifdef DEBUG
-      Serial << "released key: " << rkey->row << ", " << rkey->col << ", " << '\n';
+#ifdef ENABLE_KEY_STATS
+struct KeyStatsHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    key_stats.key_pressed(event.row*NUM_COLS + event.col, event.micros);
+  }
+  static void key_released(const KeyEvent &event) {
+    key_stats.key_released(event.row*NUM_COLS + event.col, event.micros);
+  }
+};
 #endif
 
-#ifdef USE_TEENSY_USB_KEYBOARD
-      Keyboard.release(usb_key_matrix[rkey->row][rkey->col]);
+#ifdef ENABLE_STENO
+// Steno keys are only part of a stroke, the engine follows the debounced
+// matrix itself so a stroke ends on the scan its last key is released
+struct StenoHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    if (steno_engine.steno_key(event.row, event.col))
+      event.consumed = true;
+  }
+  static void tick(uint32_t) {
+    steno_engine.update(key_matrix.matrix_state);
+  }
+};
 #endif
+
+#ifdef ENABLE_TEXT_EXPANSION
+// Follows the typed text and sends expansions a character at a time, so a
+// long one never holds up the scan. Runs before the HID handler so it can
+// keep the trigger key from being sent. The expansion goes straight to the
+// backend while everything else is held back, so keys typed meanwhile come
+// out after it.
+struct TextExpansionHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    if (event.consumed || modifier_key(event.action))
+      return;
+    if (keyboard_state.modifier_ctrl_held || keyboard_state.modifier_alt_held ||
+        keyboard_state.modifier_super_held)
+      text_expander.reset();
+    else if (text_expander.feed(event.action)) {
+      event.consumed = true;
+      held_hid_output.hold();
     }
+  }
 
-    // print test string
-#ifdef DEBUG
-    Serial.println(test_string);
+  static void tick(uint32_t now_micros) {
+    if (!text_expander.busy()) {
+      held_hid_output.release_hold();
+      return;
+    }
+    if (!hid_backend->ready() ||
+        now_micros - text_expansion_sent_micros < TEXT_EXPANSION_CHAR_MICROS)
+      return;
+    char c = text_expander.next_output();
+    hid_backend->type(c);
+    if (!text_expander.busy())
+      held_hid_output.release_hold();
+    if (c == '\b')
+      press_backspace();
+    else if (printable_character(c))
+      press_printable_character(c);
+    text_expansion_sent_micros = now_micros;
+  }
+};
 #endif
 
-  }  // end if matrix updated
-
-
-#ifdef ENABLE_AUTOREPEAT
-  // Auto-repeat the last key held
-  if (key_matrix.pressed_list.size() > 0) {
-    // get the last key press
-    pkey = key_matrix.pressed_list.last_item();
-
-    // check that it's been held long enough
-    if (pkey->hold_time > HOLD_INTERVAL) {
-      // get keycode value
-      ascii_key = ascii_key_matrix[keyboard_state.current_layer][pkey->row][pkey->col];
-
-      if (printable_character(ascii_key)) {
-        press_printable_character(ascii_key);
-#ifdef DEBUG
-        Serial.println(test_string);
-#endif
-      }
-      else if (ascii_key == '\b') {
-        press_backspace();
-#ifdef DEBUG
-        Serial.println(test_string);
+#ifdef ENABLE_HID_OUTPUT
+// Keyboard reports
+struct HidHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    if (event.consumed)
+      return;
+    if (event.layer == 2) {
+      // Fn layer characters are sent as taps
+      if (printable_character(event.action))
+        hid_output->type(event.action);
+    }
+    else {
+      hid_output->press(usb_key_matrix[event.row][event.col]);
+#if defined(ENABLE_AUTOREPEAT) && defined(AUTOREPEAT_USB_TAPS)
+      if (autorepeat_allowed(event.action))
+        hid_output->release(usb_key_matrix[event.row][event.col]);
 #endif
-      }
-      pkey->hold_time = HOLD_INTERVAL - REPEAT_INTERVAL;
     }
   }
-#endif
+  static void key_released(const KeyEvent &event) {
+    hid_output->release(usb_key_matrix[event.row][event.col]);
+  }
+};
+
+bool mouse_key(char ascii_key) {
+  return (ascii_key >= ASCII_MOUSE_LEFT && ascii_key <= ASCII_MOUSE_WHEEL_DOWN &&
+          ascii_key != ASCII_FN_LOCK_TOGGLE && ascii_key != ASCII_ESC);
+}
 
-#ifdef USE_TEENSY_USB_KEYBOARD
-  // Mouse key update
-
-  // assume no buttons are held
-  keyboard_state.mouse_btn1_held = 0;
-  keyboard_state.mouse_btn2_held = 0;
-  keyboard_state.mouse_btn3_held = 0;
-
-  bool mouse_left = false;
-  bool mouse_up = false;
-  bool mouse_down = false;
-  bool mouse_right = false;
-  bool mouse_wheel_left = false;
-  bool mouse_wheel_up = false;
-  bool mouse_wheel_down = false;
-  bool mouse_wheel_right = false;
-
-  if (millis() - keyboard_state.mousekey_last_timer >
-      (keyboard_state.mousekey_repeat ? mk_interval : mk_delay*10)) {
-
-    for (uint8_t i=0; i<key_matrix.pressed_list.size(); i++) {
-      pkey = key_matrix.pressed_list.get(i);
-      ascii_key = ascii_key_matrix[keyboard_state.current_layer][pkey->row][pkey->col];
-
-      // check for a mousekey press
-      if (ascii_key == ASCII_MOUSE_BTN1)
-        keyboard_state.mouse_btn1_held = 1;
-      else if (ascii_key == ASCII_MOUSE_BTN2)
-        keyboard_state.mouse_btn2_held = 1;
-      else if (ascii_key == ASCII_MOUSE_BTN3)
-        keyboard_state.mouse_btn3_held = 1;
-
-      else if (ascii_key == ASCII_MOUSE_LEFT)
-        mouse_left = true;
-      else if (ascii_key == ASCII_MOUSE_UP)
-        mouse_up = true;
-      else if (ascii_key == ASCII_MOUSE_DOWN)
-        mouse_down = true;
-      else if (ascii_key == ASCII_MOUSE_RIGHT)
-        mouse_right = true;
-
-      else if (ascii_key == ASCII_MOUSE_WHEEL_LEFT)
-        mouse_wheel_left = true;
-      else if (ascii_key == ASCII_MOUSE_WHEEL_UP)
-        mouse_wheel_up = true;
-      else if (ascii_key == ASCII_MOUSE_WHEEL_DOWN)
-        mouse_wheel_down = true;
-      else if (ascii_key == ASCII_MOUSE_WHEEL_RIGHT)
-        mouse_wheel_right = true;
+#define MOUSE_HELD(ascii_key) (keyboard_state.mousekeys_held & (1 << ((ascii_key) - ASCII_MOUSE_LEFT)))
+
+// Mouse buttons click on press, held mouse keys move the pointer and wheel
+// every mk_interval
+struct MouseKeyHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    if (event.consumed)
+      return;
+    if (event.layer == 2) {
+      if (event.action == ASCII_MOUSE_BTN1)
+        hid_output->mouse_click(HID_MOUSE_LEFT);
+      else if (event.action == ASCII_MOUSE_BTN2)
+        hid_output->mouse_click(HID_MOUSE_RIGHT);
+      else if (event.action == ASCII_MOUSE_BTN3)
+        hid_output->mouse_click(HID_MOUSE_MIDDLE);
     }
+    if (mouse_key(event.action))
+      keyboard_state.mousekeys_held |= 1 << (event.action - ASCII_MOUSE_LEFT);
+  }
+
+  static void key_released(const KeyEvent &event) {
+    if (mouse_key(event.action))
+      keyboard_state.mousekeys_held &= ~(1 << (event.action - ASCII_MOUSE_LEFT));
+  }
+
+  static void tick(uint32_t) {
+    if (millis() - keyboard_state.mousekey_last_timer <=
+        (uint32_t) (keyboard_state.mousekey_repeat ? mk_interval : mk_delay*10))
+      return;
+
+    keyboard_state.mouse_btn1_held = MOUSE_HELD(ASCII_MOUSE_BTN1) ? 1 : 0;
+    keyboard_state.mouse_btn2_held = MOUSE_HELD(ASCII_MOUSE_BTN2) ? 1 : 0;
+    keyboard_state.mouse_btn3_held = MOUSE_HELD(ASCII_MOUSE_BTN3) ? 1 : 0;
+
+    bool mouse_left = MOUSE_HELD(ASCII_MOUSE_LEFT);
+    bool mouse_up = MOUSE_HELD(ASCII_MOUSE_UP);
+    bool mouse_down = MOUSE_HELD(ASCII_MOUSE_DOWN);
+    bool mouse_right = MOUSE_HELD(ASCII_MOUSE_RIGHT);
+    bool mouse_wheel_left = MOUSE_HELD(ASCII_MOUSE_WHEEL_LEFT);
+    bool mouse_wheel_up = MOUSE_HELD(ASCII_MOUSE_WHEEL_UP);
+    bool mouse_wheel_down = MOUSE_HELD(ASCII_MOUSE_WHEEL_DOWN);
+    bool mouse_wheel_right = MOUSE_HELD(ASCII_MOUSE_WHEEL_RIGHT);
 
     // is there a mousekey (move command)
     if (mouse_left || mouse_up || mouse_down || mouse_right ||
@@ -551,7 +941,9 @@ void keyboard_update() {
       if (keyboard_state.mousekey_repeat != UINT8_MAX)
         keyboard_state.mousekey_repeat++;
 
-      Mouse.set_buttons(keyboard_state.mouse_btn1_held, keyboard_state.mouse_btn2_held, keyboard_state.mouse_btn3_held);
+      hid_output->mouse_buttons((keyboard_state.mouse_btn1_held ? HID_MOUSE_LEFT : 0) |
+                                (keyboard_state.mouse_btn2_held ? HID_MOUSE_RIGHT : 0) |
+                                (keyboard_state.mouse_btn3_held ? HID_MOUSE_MIDDLE : 0));
 
       int8_t x = 0, y = 0;
 
@@ -586,11 +978,11 @@ void keyboard_update() {
 #ifdef DEBUG
       Serial << "[Mouse] repeat: " << keyboard_state.mousekey_repeat << " accel: " << keyboard_state.mousekey_accel << " move: (" << x << ", " << y << ")\n";
 #endif
-      Mouse.move(x, y, wheelx, wheely);
+      hid_output->mouse_move(x, y, wheelx, wheely);
     }
     else {
       // release any held buttons
-      Mouse.set_buttons(0, 0, 0);
+      hid_output->mouse_buttons(0);
       // not moving reset repeat and accel
       keyboard_state.mousekey_repeat = 0;
       keyboard_state.mousekey_accel = 0;
@@ -598,59 +990,409 @@ void keyboard_update() {
 
     keyboard_state.mousekey_last_timer = millis();
   }
+};
+#endif
+
+#ifdef ENABLE_AUTOREPEAT
+struct AutoRepeatHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    // The newest repeatable key repeats, any other key but a modifier stops it
+    if (autorepeat_allowed(event.action) && !event.consumed)
+      autorepeat.start(event.row, event.col, event.layer, event.action, event.micros);
+    else if (!modifier_key(event.action))
+      autorepeat.stop();
+  }
+  static void key_released(const KeyEvent &event) {
+    autorepeat.key_released(event.row, event.col);
+  }
+  static void tick(uint32_t now_micros) {
+    // Repeat the held key when its next deadline has passed
+    if (autorepeat.due(now_micros))
+      send_autorepeat();
+  }
+};
+#endif
+
+// Fn + , / Fn + . change the backlight brightness
+struct BacklightHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    if (!keyboard_state.modifier_fn_held)
+      return;
+    // Fn + < (comma key)
+    if (event.action == '.') {
+      brightness += brightness_step;
+      if (brightness > 255)
+        brightness = 255;
+      set_brightness(brightness);
+    }
+    // Fn + > (period key)
+    else if (event.action == ',') {
+      brightness -= brightness_step;
+      if (brightness < 5)
+        brightness = 5;
+      set_brightness(brightness);
+    }
+  }
+};
+
+// The local text buffer (and display)
+struct TextHandler : KeyEventHandler {
+  static void key_pressed(const KeyEvent &event) {
+    if (event.consumed)
+      return;
+    if (event.action == '\b')
+      press_backspace();
+    else if (printable_character(event.action))
+      press_printable_character(event.action);
+  }
+};
+
+// The last entry has no trailing comma, so it's unconditional
+typedef KeyEventPipeline<
+#ifdef ENABLE_KEY_EVENT_STREAM
+  KeyEventStreamHandler,
+#endif
+#ifdef ENABLE_KEY_STATS
+  KeyStatsHandler,
+#endif
+#ifdef ENABLE_STENO
+  StenoHandler,
+#endif
+#ifdef ENABLE_TEXT_EXPANSION
+  TextExpansionHandler,
+#endif
+#ifdef ENABLE_HID_OUTPUT
+  HidHandler,
+  MouseKeyHandler,
+#endif
+#ifdef ENABLE_AUTOREPEAT
+  AutoRepeatHandler,
+#endif
+  BacklightHandler,
+  TextHandler
+  > KeyHandlers;
+
+// Count held modifiers by their base layer key
+void modifier_update(char base_action, int8_t delta) {
+  if (base_action == ASCII_CTRL)
+    keyboard_state.modifier_ctrl_held = (keyboard_state.modifier_ctrl_count += delta) > 0;
+  else if (base_action == ASCII_ALT)
+    keyboard_state.modifier_alt_held = (keyboard_state.modifier_alt_count += delta) > 0;
+  else if (base_action == ASCII_SUPER)
+    keyboard_state.modifier_super_held = (keyboard_state.modifier_super_count += delta) > 0;
+  else if (base_action == ASCII_SHIFT)
+    keyboard_state.modifier_shift_held = (keyboard_state.modifier_shift_count += delta) > 0;
+  else if (base_action == ASCII_FN)
+    keyboard_state.modifier_fn_held = (keyboard_state.modifier_fn_count += delta) > 0;
+}
+
+void dispatch_press(PressedKey *pkey) {
+  uint8_t r = pkey->row;
+  uint8_t c = pkey->col;
+  KeyEvent event;
+
+#ifdef DEBUG
+  Serial << "pressed key: " << r << ", " << c << ", " << pkey->press_micros << '\n';
+#endif
+
+  event.row = r;
+  event.col = c;
+  event.base_action = ascii_key_matrix[0][r][c];
+  event.micros = pkey->press_micros;
+  event.consumed = false;
+
+#ifdef ENABLE_ONESHOT_SHIFT_FN
+  if (!keyboard_state.fn_lock) {
+    // enable or disable oneshot, a second press of the modifier disables it
+    if (event.base_action == ASCII_SHIFT)
+      keyboard_state.oneshot_shift = !keyboard_state.oneshot_shift;
+    else if (event.base_action == ASCII_FN)
+      keyboard_state.oneshot_fn = !keyboard_state.oneshot_fn;
+
+    // change layers for oneshot modes
+    if (keyboard_state.oneshot_shift)
+      keyboard_state.current_layer = 1;
+    else if (keyboard_state.oneshot_fn)
+      keyboard_state.current_layer = 2;
+  }
+#endif
+
+  event.layer = keyboard_state.current_layer;
+  event.action = ascii_key_matrix[event.layer][r][c];
+  // Use base layer if key is undefined
+  if (event.action == 0)
+    event.action = event.base_action;
 
+  KeyHandlers::key_pressed(event);
 
+#ifdef ENABLE_ONESHOT_SHIFT_FN
+  // if oneshot is active, and this is not the modifier key, oneshot is used up
+  if (event.action != ASCII_SHIFT && keyboard_state.oneshot_shift)
+    keyboard_state.oneshot_shift = false;
+  else if (event.action != ASCII_FN && keyboard_state.oneshot_fn)
+    keyboard_state.oneshot_fn = false;
 #endif
 
+  if (event.action == ASCII_FN_LOCK_TOGGLE)
+    keyboard_state.fn_lock = !keyboard_state.fn_lock;
+
+  key_actions[r*NUM_COLS + c] = event.action;
+  key_layers[r*NUM_COLS + c] = event.layer;
+  // held from the next scan on
+  modifier_update(event.base_action, +1);
 }
 
+void dispatch_release(ReleasedKey *rkey) {
+  uint16_t k = rkey->row*NUM_COLS + rkey->col;
+  KeyEvent event;
 
-void loop() {
-  // Check Battery pin every 3seconds
-  if (millis() > (batt_read_millis + 3000)) {
-    float batt = 3.3 * ((float) analogRead(22) / 1024.0);
-    Serial << "Batt:" << batt << "\n";
-    batt_read_millis = millis();
+#ifdef DEBUG
+  Serial << "released key: " << rkey->row << ", " << rkey->col << ", " << '\n';
+#endif
+
+  event.row = rkey->row;
+  event.col = rkey->col;
+  event.base_action = ascii_key_matrix[0][rkey->row][rkey->col];
+  event.micros = rkey->release_micros;
+  event.consumed = false;
+  // A key dropped as a ghost can be released without its press being seen
+  if (key_layers[k] != KEY_NOT_PRESSED) {
+    event.layer = key_layers[k];
+    event.action = key_actions[k];
+    modifier_update(event.base_action, -1);
+  }
+  else {
+    event.layer = 0;
+    event.action = event.base_action;
   }
 
-  // Run the keyboard update routine
-  keyboard_update();
+  KeyHandlers::key_released(event);
+  key_layers[k] = KEY_NOT_PRESSED;
+}
 
-  // Check for brightness up / down keys
+void keyboard_update() {
+  bool matrix_changed = false;
   PressedKey *pkey;
-  uint8_t ak;
-
-  // Is the Fn modifier key held?
-  if (keyboard_state.modifier_fn_held == true) {
-
-    // for each pressed key
-    for (uint8_t i=0; i<key_matrix.pressed_list.size(); i++) {
-      // get the key
-      pkey = key_matrix.pressed_list.get(i);
-
-      // If key just pressed then hold_time == 0
-      // (if pkey->hold_time > 0 then this is the second or higher time the key was seen)
-      if (pkey->hold_time == 0) {
-        ak = ascii_key_matrix[keyboard_state.current_layer][pkey->row][pkey->col];
-        // Use base layer if key is undefined
-        if (ak == 0)
-          ak = ascii_key_matrix[0][pkey->row][pkey->col];
-
-        // Fn + < (comma key)
-        if (ak == '.') {
-          brightness += 5;
-          if (brightness > 255)
-            brightness = 255;
-          set_brightness(brightness);
-        }
-        // Fn + > (period key)
-        else if (ak == ',') {
-          brightness -= 5;
-          if (brightness < 5)
-            brightness = 5;
-          set_brightness(brightness);
-        }
-      }
+
+#ifdef SPLIT_KEYBOARD_PRIMARY
+  // Pick up the other half's rows before they're debounced with ours
+  split_link.poll();
+#endif
+
+#ifdef ENABLE_SCAN_REPLAY
+  // Feed the next captured scan through debounce instead of reading the matrix
+  uint16_t replay_rows[SCAN_TRACE_MAX_ROWS];
+  uint32_t replay_micros;
+  for (uint8_t r=0; r<SCAN_TRACE_MAX_ROWS; r++)
+    replay_rows[r] = 0xFFFF;
+  while (!scan_trace_reader.has_scan() && Serial.available() > 0)
+    scan_trace_reader.feed(Serial.read());
+  if (!scan_trace_reader.next_scan(replay_rows, &replay_micros))
+    return;
+  matrix_changed = key_matrix.update_from_rows(replay_rows, replay_micros);
+#else
+  // Scan the key matrix
+  matrix_changed = key_matrix.update();
+#endif
+
+#ifdef ENABLE_SCAN_CAPTURE
+  scan_trace_writer.record(key_matrix.raw_rows(), key_matrix.scan_micros());
+#endif
+
+  // if matrix changed
+  // With ghost rejection there's at most one new key press per matrix update
+  if (matrix_changed) {
+    // Print key matrix for debugging
+#ifdef DEBUG
+    Serial << "\n\n\n";
+    // microseconds since last matrix scan
+    Serial << "delta_micros: " << key_matrix.delta_micros << '\n';
+    for (uint8_t r=0; r<key_matrix.num_rows; r++) {
+      Serial << "ROW" << r << ": ";
+      print_16_bits_reversed(key_matrix.matrix_state[r]);
+    }
+#endif
+
+    // Releases first, so released modifiers no longer count when this scan's
+    // press is resolved
+    for (uint8_t i=0; i<key_matrix.released_list.size(); i++)
+      dispatch_release(key_matrix.released_list.get(i));
+
+    // Assume layer 0
+    keyboard_state.current_layer = 0;
+
+    // change layers for held modifiers (only shift and fn)
+    if (keyboard_state.modifier_shift_held)
+      keyboard_state.current_layer = 1;
+    else if (keyboard_state.modifier_fn_held || keyboard_state.fn_lock)
+      keyboard_state.current_layer = 2;
+
+    if (key_matrix.reject_ghosts) {
+      pkey = key_matrix.new_key();
+      if (pkey != NULL)
+        dispatch_press(pkey);
+    }
+    else {
+      // Every key registered on this scan, more than one for a chord: the
+      // tail of pressed_list
+      int size = key_matrix.pressed_list.size();
+      for (int i=size - key_matrix.new_key_count(); i<size; i++)
+        dispatch_press(key_matrix.pressed_list.get(i));
     }
+
+    // print test string
+#ifdef DEBUG
+    Serial.println(test_string);
+#endif
+
+  }  // end if matrix updated
+
+  // On the scan's clock, like the events, so a replayed trace repeats exactly
+  KeyHandlers::tick(key_matrix.scan_micros());
+}
+
+
+// --- Tasks -------------------------------------------------------------------
+
+#if !defined(ENABLE_SERIAL_CONSOLE) && defined(ENABLE_KEY_STATS)
+// Next part of the key stats dump console_task is writing, or -1
+int32_t key_stats_dump_part = -1;
+#endif
+
+// True while the console is part way through writing something to Serial
+bool serial_output_in_progress() {
+#ifdef ENABLE_SERIAL_CONSOLE
+  return serial_console.listing_in_progress();
+#elif defined(ENABLE_KEY_STATS)
+  return key_stats_dump_part >= 0;
+#else
+  return false;
+#endif
+}
+
+#ifdef ENABLE_SOF_SCHEDULING
+// Follow the host's USB frames and only scan in our slots
+void scan_task(Task *) {
+  scan_scheduler.sof_poll(usb_frame_number(), micros());
+  if (scan_scheduler.scan_due(micros())) {
+    uint32_t scan_start_micros = micros();
+    keyboard_update();
+    scan_scheduler.scan_finished(scan_start_micros, micros());
+  }
+}
+#else
+void scan_task(Task *) {
+  keyboard_update();
+}
+#endif
+
+#ifdef ENABLE_HID_OUTPUT
+// Sends reports a slow output link held back
+void hid_task(Task *) {
+  hid_output->poll();
+}
+#endif
+
+#if defined(ENABLE_SCAN_CAPTURE)
+void stream_task(Task *) {
+  scan_trace_writer.stream_to(&Serial, SCAN_TRACE_STREAM_BYTES);
+}
+#elif defined(ENABLE_KEY_EVENT_STREAM)
+void stream_task(Task *) {
+  key_event_stream.stream_to(&Serial, KEY_EVENT_STREAM_BYTES);
+}
+#elif defined(ENABLE_STENO)
+void stream_task(Task *) {
+  steno_engine.stream_to(&Serial, STENO_STREAM_BYTES);
+}
+#else
+// Battery voltage every 3 seconds, printed once there's room for the line so a
+// host that isn't reading never holds up the loop, and not in the middle of a
+// console listing or stats dump
+void battery_task(Task *task) {
+  static float batt;
+
+  TASK_BEGIN(task);
+  batt = 3.3 * ((float) analogRead(22) / 1024.0);
+  TASK_WAIT_UNTIL(task, !serial_output_in_progress() && Serial.availableForWrite() >= 16);
+  Serial << "Batt:" << batt << "\n";
+  TASK_END(task);
+}
+#endif
+
+// Saves what changed a few bytes at a time
+void checkpoint_task(Task *) {
+#ifdef ENABLE_ADAPTIVE_DEBOUNCE
+  debounce_profile_store.checkpoint();
+#endif
+#ifdef ENABLE_KEY_STATS
+  key_stats.checkpoint();
+#endif
+}
+
+#ifdef ENABLE_SERIAL_CONSOLE
+void console_task(Task *) {
+  serial_console.poll();
+}
+#elif defined(ENABLE_KEY_STATS) && !defined(ENABLE_SCAN_REPLAY) && !defined(ENABLE_KEY_EVENT_STREAM) && \
+  !defined(ENABLE_STENO)
+// 'S' dumps the key stats, a part per run once there's room for it
+void console_task(Task *) {
+  if (key_stats_dump_part < 0) {
+    if (Serial.available() > 0 && Serial.read() == 'S')
+      key_stats_dump_part = 0;
+  }
+  else if (Serial.availableForWrite() >= STATS_DUMP_PART_SIZE &&
+           !key_stats.dump_part(&Serial, key_stats_dump_part++)) {
+    key_stats_dump_part = -1;
   }
 }
+#endif
+
+#ifdef ENABLE_DISPLAY
+// Starts sending the next changed cells if the last ones are done
+void display_task(Task *) {
+  text_display.update();
+}
+#endif
+
+// In priority order. Budgets are for a Teensy 3.2 at 72MHz, the "tasks"
+// console command lists how long each one really takes and its overruns. Below
+// the scan a budget decides when the task may start, so its job has to keep to
+// it: the console writes one line per run, the display one run of cells.
+//   Units are in Microseconds
+Task tasks[] = {
+  // name, function, priority, period, budget, deadline
+  Task("scan", scan_task, 0, 0, SCAN_BUDGET_MICROS, SCAN_DEADLINE_MICROS),
+#ifdef ENABLE_HID_OUTPUT
+  Task("hid", hid_task, 0, 0, 50),
+#endif
+#if defined(ENABLE_SCAN_CAPTURE) || defined(ENABLE_KEY_EVENT_STREAM) || defined(ENABLE_STENO)
+  Task("stream", stream_task, 1, 0, 100),
+#endif
+#ifdef ENABLE_DISPLAY
+  Task("display", display_task, 2, 0, 100),
+#endif
+#if defined(ENABLE_SERIAL_CONSOLE) || \
+  (defined(ENABLE_KEY_STATS) && !defined(ENABLE_SCAN_REPLAY) && !defined(ENABLE_KEY_EVENT_STREAM) && \
+   !defined(ENABLE_STENO))
+  Task("console", console_task, 2, 1000, 200),
+#endif
+  Task("checkpoint", checkpoint_task, 3, 1000, 100),
+#if !defined(ENABLE_SCAN_CAPTURE) && !defined(ENABLE_KEY_EVENT_STREAM) && !defined(ENABLE_STENO)
+  Task("battery", battery_task, 3, 3000000, 100),
+#endif
+  Task(),
+};
+
+void loop() {
+#ifdef SPLIT_KEYBOARD_SECONDARY
+  // The secondary half only scans and streams its raw rows to the primary
+  key_matrix.update();
+  split_link.poll();
+  split_link.send_rows(key_matrix.raw_rows());
+  return;
+#endif
+
+  task_scheduler.run();
+}
@@ -0,0 +1,17 @@
+#ifndef EVENTSINK_H
+#define EVENTSINK_H
+
+#include <stdint.h>
+
+// Where injected key events go: uinput in the daemon, a recording sink in
+// tests (see bench/event_stream_bench.cpp)
+class EventSink {
+public:
+  virtual ~EventSink() {}
+  // micros is the firmware's timestamp of the scan that registered the key
+  virtual void key(uint16_t code, bool pressed, uint32_t micros) = 0;
+  // End of a batch, everything since the last sync can go to the host
+  virtual void sync() = 0;
+};
+
+#endif
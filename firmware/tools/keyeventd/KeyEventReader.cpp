@@ -0,0 +1,168 @@
+#include "KeyEventReader.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/input-event-codes.h>
+
+uint8_t KeyEventReader::crc_table[256];
+
+KeyEventReader::KeyEventReader(EventSink *event_sink) {
+  for (uint16_t b=0; b<256; b++) {
+    uint8_t crc = b;
+    for (uint8_t i=0; i<8; i++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    crc_table[b] = crc;
+  }
+  sink = event_sink;
+  frames = 0;
+  crc_errors = 0;
+  sequence_errors = 0;
+  reads = 0;
+  frame_length = 0;
+  expected_seq = 0;
+  have_seq = false;
+  resynced = false;
+  last_micros = 0;
+  memset(held, 0, sizeof(held));
+  memset(down_count, 0, sizeof(down_count));
+}
+
+void KeyEventReader::feed(const uint8_t *data, size_t length) {
+  for (size_t i=0; i<length; i++) {
+    if (frame_length == 0 && data[i] != KEY_EVENT_SYNC) {
+      resynced = true;
+      continue;
+    }
+    frame[frame_length++] = data[i];
+    if (frame_length < KEY_EVENT_FRAME_SIZE)
+      continue;
+
+    uint8_t crc = 0;
+    for (uint8_t j=1; j<KEY_EVENT_FRAME_SIZE-1; j++)
+      crc = crc_table[crc ^ frame[j]];
+    if (crc == frame[KEY_EVENT_FRAME_SIZE-1] && frame[1] < keymap_num_keys()) {
+      handle_frame();
+      frame_length = 0;
+      continue;
+    }
+
+    // resync on the next SYNC inside the bad frame, if any
+    crc_errors++;
+    resynced = true;
+    uint8_t next = 1;
+    while (next < KEY_EVENT_FRAME_SIZE && frame[next] != KEY_EVENT_SYNC)
+      next++;
+    frame_length = KEY_EVENT_FRAME_SIZE - next;
+    memmove(frame, frame + next, frame_length);
+  }
+}
+
+void KeyEventReader::handle_frame() {
+  uint8_t key = frame[1];
+  bool pressed = frame[2] & 0x80;
+  uint8_t layer = (frame[2] >> 4) & 0x07;
+  uint8_t seq = frame[2] & KEY_EVENT_SEQ_MASK;
+  uint32_t micros = frame[3] | (frame[4] << 8) | ((uint32_t) frame[5] << 16) |
+    ((uint32_t) frame[6] << 24);
+
+  frames++;
+  bool in_sequence = !have_seq || seq == expected_seq;
+  if (!in_sequence)
+    sequence_errors++;
+  expected_seq = (seq + 1) & KEY_EVENT_SEQ_MASK;
+  have_seq = true;
+
+  // A frame found by searching for SYNC in noise or after lost bytes passes
+  // the CRC one time in 256, and would press a random key. So the first frame
+  // after one only picks up the sequence: everything held is released and its
+  // own event is dropped.
+  if (resynced) {
+    resynced = false;
+    release_all(last_micros);
+    return;
+  }
+  if (!in_sequence)
+    release_all(micros);
+  last_micros = micros;
+
+  if (pressed)
+    press(key, layer, micros);
+  else
+    release(key, micros);
+}
+
+void KeyEventReader::send(uint16_t code, bool pressed, uint32_t micros) {
+  // two keys on the same code (eg both space bars) hold it until both are up
+  if (pressed ? down_count[code]++ > 0 : down_count[code] == 0 || --down_count[code] > 0)
+    return;
+  sink->key(code, pressed, micros);
+}
+
+void KeyEventReader::press(uint8_t key, uint8_t layer, uint32_t micros) {
+  KeyAction action;
+  if (!keymap_action(key, layer, &action) || action.code == 0)
+    return;
+
+  // shift for a fn layer character, or a oneshot shift the host never saw held
+  bool wrap_shift = down_count[KEY_LEFTSHIFT] == 0 && down_count[KEY_RIGHTSHIFT] == 0 &&
+    (action.tap ? action.shift : layer == 1 && !action.modifier);
+
+  // pressed again without its release in between
+  if (!action.tap)
+    release(key, micros);
+
+  if (wrap_shift)
+    send(KEY_LEFTSHIFT, true, micros);
+  send(action.code, true, micros);
+  if (action.tap)
+    send(action.code, false, micros);
+  else
+    held[key] = action.code;
+  if (wrap_shift)
+    send(KEY_LEFTSHIFT, false, micros);
+}
+
+void KeyEventReader::release(uint8_t key, uint32_t micros) {
+  if (held[key] == 0)
+    return;
+  send(held[key], false, micros);
+  held[key] = 0;
+}
+
+void KeyEventReader::release_all(uint32_t micros) {
+  for (uint16_t k=0; k<KEY_EVENT_MAX_KEYS; k++)
+    release(k, micros);
+}
+
+bool KeyEventReader::drain(int fd) {
+  uint8_t buffer[KEY_EVENT_READ_SIZE];
+  bool ok = true;
+  bool got = false;
+
+  for (;;) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n > 0) {
+      reads++;
+      feed(buffer, n);
+      got = true;
+      if ((size_t) n < sizeof(buffer))
+        break;
+    }
+    else if (n < 0 && errno == EINTR)
+      continue;
+    else {
+      ok = n < 0 && errno == EAGAIN;
+      break;
+    }
+  }
+  if (!ok) {
+    release_all(last_micros);
+    // the keyboard may have been reset, start from its next frame
+    have_seq = false;
+    resynced = false;
+  }
+  if (got || !ok)
+    sink->sync();
+  return ok;
+}
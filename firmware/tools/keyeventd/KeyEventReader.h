@@ -0,0 +1,70 @@
+#ifndef KEYEVENTREADER_H
+#define KEYEVENTREADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "EventSink.h"
+#include "Keymap.h"
+
+// Decodes the firmware's binary key event stream (see KeyEventStream.h) and
+// injects each event into a sink through the keymap.
+//
+// A frame with a bad CRC (or a key id past the layout) is skipped by searching
+// for the next SYNC from the byte after its own, and the frame found that way
+// is only used to pick up the sequence again. A gap in the sequence numbers
+// means events were lost. Either way everything held is released: a missing
+// release would otherwise leave a key stuck on the host.
+
+// Mirrors KeyEventStream.h
+#define KEY_EVENT_SYNC 0xE5
+#define KEY_EVENT_FRAME_SIZE 8
+#define KEY_EVENT_SEQ_MASK 0x0F
+
+// Bytes read per read() call
+#define KEY_EVENT_READ_SIZE 4096
+#define KEY_EVENT_MAX_KEYS 256
+
+class KeyEventReader {
+public:
+  KeyEventReader(EventSink *sink);
+
+  uint32_t frames;
+  uint32_t crc_errors;
+  uint32_t sequence_errors;
+  uint32_t reads;
+
+  // Decode and inject bytes as they came off the port, without syncing
+  void feed(const uint8_t *data, size_t length);
+  // Read everything available on a non-blocking fd in as few read() calls as
+  // it takes, inject it and sync the sink once. false on end of file or an
+  // error other than EAGAIN.
+  bool drain(int fd);
+  // Release every key injected as held, eg when the port goes away
+  void release_all(uint32_t micros);
+
+private:
+  EventSink *sink;
+
+  uint8_t frame[KEY_EVENT_FRAME_SIZE];
+  uint8_t frame_length;
+  uint8_t expected_seq;
+  bool have_seq;
+  // a CRC error or bytes skipped since the last good frame
+  bool resynced;
+  uint32_t last_micros;
+
+  // Linux key code held for each key id, 0 if none
+  uint16_t held[KEY_EVENT_MAX_KEYS];
+  // keys holding each Linux key code, every code in the keymap is below 256
+  uint8_t down_count[256];
+
+  void handle_frame();
+  void press(uint8_t key, uint8_t layer, uint32_t micros);
+  void release(uint8_t key, uint32_t micros);
+  void send(uint16_t code, bool pressed, uint32_t micros);
+  // crc8 poly 0x07 of each byte value, one lookup per byte instead of eight
+  // shifts in the firmware's loop
+  static uint8_t crc_table[256];
+};
+
+#endif
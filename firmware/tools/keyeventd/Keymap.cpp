@@ -0,0 +1,82 @@
+// Built against the firmware's host Arduino.h (../../bench) for the Teensy
+// key codes the layout uses, so this file must not include the Linux input
+// headers, whose KEY_ names clash. Key codes below are numeric.
+
+#include "Keymap.h"
+#include LAYOUT_HEADER
+
+// HID keyboard usage to Linux key code, the kernel's hid_keyboard[] table
+// (drivers/hid/hid-input.c) up to the Application key
+static const uint8_t hid_to_linux[0x66] = {
+    0,   0,   0,   0,  30,  48,  46,  32,  18,  33,  34,  35,  23,  36,  37,  38,
+   50,  49,  24,  25,  16,  19,  31,  20,  22,  47,  17,  45,  21,  44,   2,   3,
+    4,   5,   6,   7,   8,   9,  10,  11,  28,   1,  14,  15,  57,  12,  13,  26,
+   27,  43,  43,  39,  40,  41,  51,  52,  53,  58,  59,  60,  61,  62,  63,  64,
+   65,  66,  67,  68,  87,  88,  99,  70, 119, 110, 102, 104, 111, 107, 109, 106,
+  105, 108, 103,  69,  98,  55,  74,  78,  96,  79,  80,  81,  75,  76,  77,  71,
+   72,  73,  82,  83,  86, 127,
+};
+
+// Modifier bits (left ctrl, shift, alt, gui, then the right ones)
+static const uint8_t modifier_to_linux[8] = {29, 42, 56, 125, 97, 54, 100, 126};
+
+// US layout usage for ASCII 32-126, 0x80 set for shifted characters
+static const uint8_t us_layout[95] = {
+  44, 30|0x80, 52|0x80, 32|0x80, 33|0x80, 34|0x80, 36|0x80, 52,        // space ! " # $ % & '
+  38|0x80, 39|0x80, 37|0x80, 46|0x80, 54, 45, 55, 56,                 // ( ) * + , - . /
+  39, 30, 31, 32, 33, 34, 35, 36, 37, 38,                             // 0-9
+  51|0x80, 51, 54|0x80, 46, 55|0x80, 56|0x80, 31|0x80,                // : ; < = > ? @
+  4|0x80, 5|0x80, 6|0x80, 7|0x80, 8|0x80, 9|0x80, 10|0x80, 11|0x80,   // A-Z
+  12|0x80, 13|0x80, 14|0x80, 15|0x80, 16|0x80, 17|0x80, 18|0x80,
+  19|0x80, 20|0x80, 21|0x80, 22|0x80, 23|0x80, 24|0x80, 25|0x80,
+  26|0x80, 27|0x80, 28|0x80, 29|0x80,
+  47, 49, 48, 35|0x80, 45|0x80, 53,                                   // [ \ ] ^ _ `
+  4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,   // a-z
+  22, 23, 24, 25, 26, 27, 28, 29,
+  47|0x80, 49|0x80, 48|0x80, 53|0x80,                                 // { | } ~
+};
+
+uint16_t keymap_num_keys() {
+  return NUM_ROWS * NUM_COLS;
+}
+
+bool keymap_action(uint8_t key, uint8_t layer, KeyAction *action) {
+  if (key >= NUM_ROWS * NUM_COLS)
+    return false;
+  uint8_t r = key / NUM_COLS;
+  uint8_t c = key % NUM_COLS;
+
+  action->code = 0;
+  action->shift = false;
+  action->tap = false;
+  action->modifier = false;
+
+  if (layer == 2) {
+    // the base layer's character where the fn layer has none
+    char a = ascii_key_matrix[2][r][c];
+    if (a == 0)
+      a = ascii_key_matrix[0][r][c];
+    if (a >= 32 && a <= 126) {
+      uint8_t usage = us_layout[a - 32];
+      action->code = hid_to_linux[usage & 0x7F];
+      action->shift = usage & 0x80;
+      action->tap = true;
+    }
+    return true;
+  }
+
+  uint16_t usb_key = usb_key_matrix[r][c];
+  if ((usb_key & 0xFF00) == 0xE000) {
+    uint8_t bits = usb_key & 0xFF;
+    for (uint8_t b=0; b<8; b++) {
+      if (bits & (1 << b)) {
+        action->code = modifier_to_linux[b];
+        break;
+      }
+    }
+    action->modifier = true;
+  }
+  else if ((usb_key & 0xFF00) == 0xF000 && (usb_key & 0xFF) < sizeof(hid_to_linux))
+    action->code = hid_to_linux[usb_key & 0xFF];
+  return true;
+}
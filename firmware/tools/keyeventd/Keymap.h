@@ -0,0 +1,27 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdint.h>
+
+// What a streamed key event turns into on the host, from the same layout
+// header the firmware is built with. Layers 0 and 1 send the key's own USB key
+// (shift is the host's job, except for a oneshot shift). The fn layer, like
+// the firmware's HID output, only types its printable characters, as a tap
+// with shift if the character needs it.
+
+struct KeyAction {
+  // Linux input key code, 0 for a key with nothing to send (fn, mouse keys)
+  uint16_t code;
+  // Shift has to be down for it (fn layer characters)
+  bool shift;
+  // Pressed and released at once instead of following the key
+  bool tap;
+  // A modifier key, never wrapped in a oneshot shift
+  bool modifier;
+};
+
+uint16_t keymap_num_keys();
+// false for a key id past the layout
+bool keymap_action(uint8_t key, uint8_t layer, KeyAction *action);
+
+#endif
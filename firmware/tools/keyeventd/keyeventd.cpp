@@ -0,0 +1,174 @@
+// Key event daemon
+//
+// Reads the firmware's binary key event stream (ENABLE_KEY_EVENT_STREAM, see
+// KeyEventStream.h) from its USB serial port and injects the events through
+// uinput as a keyboard with no rollover limit. Each key event is preceded by
+// an MSC_TIMESTAMP with the firmware's microsecond timestamp.
+//
+// The port is read without blocking: poll() wakes the daemon and everything
+// waiting is read and decoded in one batch, then written to uinput in a single
+// write(). If the port goes away (the keyboard was unplugged or reset) every
+// held key is released and the port is reopened once it's back.
+//
+// Usage: keyeventd [-n] [-v] /dev/ttyACM0
+//   -n  print the events instead of injecting them (no uinput needed)
+//   -v  print decode statistics on exit
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <linux/uinput.h>
+
+#include <vector>
+
+#include "KeyEventReader.h"
+
+#define REOPEN_SECONDS 1
+
+class UinputSink : public EventSink {
+public:
+  UinputSink() : fd(-1) {}
+  ~UinputSink() {
+    if (fd >= 0) {
+      ioctl(fd, UI_DEV_DESTROY);
+      close(fd);
+    }
+  }
+
+  bool open_device() {
+    fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if (fd < 0)
+      return false;
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    ioctl(fd, UI_SET_EVBIT, EV_MSC);
+    ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+    for (int code=KEY_ESC; code<=KEY_MICMUTE; code++)
+      ioctl(fd, UI_SET_KEYBIT, code);
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_USB;
+    setup.id.vendor = 0x16C0;
+    setup.id.product = 0x0487;
+    snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "keyeventd keyboard");
+    return ioctl(fd, UI_DEV_SETUP, &setup) == 0 && ioctl(fd, UI_DEV_CREATE) == 0;
+  }
+
+  void key(uint16_t code, bool pressed, uint32_t micros) {
+    push(EV_MSC, MSC_TIMESTAMP, micros);
+    push(EV_KEY, code, pressed ? 1 : 0);
+    push(EV_SYN, SYN_REPORT, 0);
+  }
+
+  void sync() {
+    if (events.empty())
+      return;
+    if (write(fd, events.data(), events.size() * sizeof(events[0])) < 0)
+      perror("keyeventd: uinput write");
+    events.clear();
+  }
+
+private:
+  int fd;
+  std::vector<struct input_event> events;
+
+  void push(uint16_t type, uint16_t code, int32_t value) {
+    struct input_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    events.push_back(event);
+  }
+};
+
+class PrintSink : public EventSink {
+public:
+  void key(uint16_t code, bool pressed, uint32_t micros) {
+    printf("%10u %3u %s\n", micros, code, pressed ? "down" : "up");
+  }
+  void sync() { fflush(stdout); }
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int) {
+  stopping = 1;
+}
+
+static int open_port(const char *path) {
+  int fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    return -1;
+  struct termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  bool dry_run = false;
+  bool verbose = false;
+  const char *path = NULL;
+
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-n") == 0) dry_run = true;
+    else if (strcmp(argv[i], "-v") == 0) verbose = true;
+    else if (argv[i][0] != '-' && path == NULL) path = argv[i];
+    else path = NULL, i = argc;
+  }
+  if (path == NULL) {
+    fprintf(stderr, "usage: %s [-n] [-v] /dev/ttyACM0\n", argv[0]);
+    return 2;
+  }
+
+  UinputSink uinput;
+  PrintSink printer;
+  EventSink *sink = &printer;
+  if (!dry_run) {
+    if (!uinput.open_device()) {
+      perror("keyeventd: /dev/uinput");
+      return 1;
+    }
+    sink = &uinput;
+  }
+  KeyEventReader reader(sink);
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  int fd = -1;
+  while (!stopping) {
+    if (fd < 0) {
+      fd = open_port(path);
+      if (fd < 0) {
+        sleep(REOPEN_SECONDS);
+        continue;
+      }
+    }
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0)
+      continue;
+    if (!reader.drain(fd)) {
+      close(fd);
+      fd = -1;
+      sleep(REOPEN_SECONDS);
+    }
+  }
+
+  reader.release_all(0);
+  sink->sync();
+  if (fd >= 0)
+    close(fd);
+  if (verbose)
+    fprintf(stderr, "frames %u crc_errors %u sequence_errors %u reads %u\n",
+            reader.frames, reader.crc_errors, reader.sequence_errors, reader.reads);
+  return 0;
+}
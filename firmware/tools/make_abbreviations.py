@@ -0,0 +1,196 @@
+#!/usr/bin/env python3
+"""Build the text expander's double-array trie (see TextExpander.h).
+
+Reads abbreviation lines from a text file:
+
+    # comment
+    gst     git status
+    sig     Regards,\nAnthony
+
+The first word is the abbreviation, the rest of the line (after the
+whitespace that follows it) is the expansion. \\n, \\t and \\\\ are escapes in
+expansions. Writes a header with the trie as const arrays, which end up in
+flash:
+
+    tools/make_abbreviations.py Abbreviations.txt -o Abbreviations.h
+
+--synthetic N writes a trie of N random abbreviations instead, for the host
+benchmark.
+"""
+
+import argparse
+import collections
+import random
+import string
+import sys
+
+ROOT = 0
+FREE = 0xFFFF
+NO_EXPANSION = 0xFFFF
+MAX_LENGTH = 16  # TEXT_EXPANDER_MAX_LENGTH
+
+
+def code(c):
+    return ord(c) - 32
+
+
+def unescape(text):
+    out = []
+    i = 0
+    while i < len(text):
+        if text[i] == '\\' and i + 1 < len(text):
+            out.append({'n': '\n', 't': '\t', '\\': '\\'}.get(text[i+1], text[i+1]))
+            i += 2
+        else:
+            out.append(text[i])
+            i += 1
+    return ''.join(out)
+
+
+def read_abbreviations(path):
+    entries = []
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.rstrip('\n')
+            if not line.strip() or line.lstrip().startswith('#'):
+                continue
+            parts = line.split(None, 1)
+            if len(parts) != 2:
+                sys.exit('%s:%d: abbreviation without an expansion' % (path, number))
+            entries.append((parts[0], unescape(parts[1].strip())))
+    return entries
+
+
+def synthetic_abbreviations(count, seed):
+    rng = random.Random(seed)
+    letters = string.ascii_lowercase
+    entries = {}
+    while len(entries) < count:
+        abbreviation = ''.join(rng.choice(letters) for _ in range(rng.randint(2, 6)))
+        if rng.random() < 0.1:
+            abbreviation = rng.choice(';,.') + abbreviation
+        words = [''.join(rng.choice(letters) for _ in range(rng.randint(2, 9)))
+                 for _ in range(rng.randint(1, 6))]
+        entries.setdefault(abbreviation, ' '.join(words))
+    return sorted(entries.items())
+
+
+def check_entries(entries):
+    seen = set()
+    for abbreviation, expansion in entries:
+        if len(abbreviation) > MAX_LENGTH:
+            sys.exit('%r is longer than %d characters' % (abbreviation, MAX_LENGTH))
+        if any(not 33 <= ord(c) <= 126 for c in abbreviation):
+            sys.exit('%r has a character that is not printable ASCII' % abbreviation)
+        if any(not (32 <= ord(c) <= 126 or c in '\n\t') for c in expansion):
+            sys.exit('expansion of %r has a character the keyboard cannot type' % abbreviation)
+        if abbreviation in seen:
+            sys.exit('%r is defined twice' % abbreviation)
+        seen.add(abbreviation)
+
+
+def build(entries):
+    """Returns (states, text): states are [base, check, expansion] lists."""
+    # plain trie first: node = [children dict, expansion offset]
+    text = []
+    text_length = 0
+    trie = [{}, NO_EXPANSION]
+    for abbreviation, expansion in entries:
+        node = trie
+        for c in abbreviation:
+            node = node[0].setdefault(c, [{}, NO_EXPANSION])
+        node[1] = text_length
+        text.append(expansion)
+        text_length += len(expansion) + 1
+
+    # then lay it out breadth first, each node's children at the lowest base
+    # where all of their slots are free
+    states = [[0, FREE, trie[1]]]
+    queue = collections.deque([(trie, ROOT)])
+    first_free = 1
+    while queue:
+        node, index = queue.popleft()
+        codes = sorted(code(c) for c in node[0])
+        if not codes:
+            continue
+        while first_free < len(states) and states[first_free][1] != FREE:
+            first_free += 1
+        base = max(1, first_free - codes[0])
+        while any(base + c < len(states) and (base + c == ROOT or states[base + c][1] != FREE)
+                  for c in codes):
+            base += 1
+        states[index][0] = base
+        for c in sorted(node[0]):
+            slot = base + code(c)
+            while len(states) <= slot:
+                states.append([0, FREE, NO_EXPANSION])
+            child = node[0][c]
+            states[slot] = [0, index, child[1]]
+            queue.append((child, slot))
+
+    if len(states) >= FREE or text_length >= NO_EXPANSION:
+        sys.exit('too many abbreviations for 16 bit states')
+    return states, text
+
+
+def c_string(text):
+    out = ''
+    for c in text:
+        if c == '\n':
+            out += '\\n'
+        elif c == '\t':
+            out += '\\t'
+        elif c in '"\\':
+            out += '\\' + c
+        elif c == '?':
+            # no trigraphs
+            out += '\\?'
+        else:
+            out += c
+    return out
+
+
+def write_header(out, name, source, entries, states, text):
+    guard = name.upper() + '_H'
+    flash = len(states) * 6 + sum(len(t) + 1 for t in text)
+    out.write('// Generated by tools/make_abbreviations.py from %s, don\'t edit\n' % source)
+    out.write('// %d abbreviations, %d states, %d bytes of flash\n\n' % (len(entries), len(states), flash))
+    out.write('#ifndef %s\n#define %s\n\n#include "TextExpander.h"\n\n' % (guard, guard))
+    out.write('const TextExpanderState %s_states[%d] = {\n' % (name, len(states)))
+    for base, check, expansion in states:
+        out.write('  {%d, 0x%04X, 0x%04X},\n' % (base, check, expansion))
+    out.write('};\n\n')
+    out.write('const char %s_text[] =\n' % name)
+    for expansion in text:
+        out.write('  "%s\\0"\n' % c_string(expansion))
+    out.write('  ;\n\n')
+    out.write('const TextExpansionTrie %s = {%s_states, %d, %s_text};\n\n' % (name, name, len(states), name))
+    out.write('#endif\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('source', nargs='?', help='abbreviations file')
+    parser.add_argument('-o', '--output', help='header to write (default stdout)')
+    parser.add_argument('--name', default='abbreviations', help='C name of the trie')
+    parser.add_argument('--synthetic', type=int, metavar='N', help='N random abbreviations')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    if args.synthetic:
+        entries = synthetic_abbreviations(args.synthetic, args.seed)
+        source = '--synthetic %d --seed %d' % (args.synthetic, args.seed)
+    elif args.source:
+        entries = read_abbreviations(args.source)
+        source = args.source
+    else:
+        parser.error('need an abbreviations file or --synthetic')
+
+    check_entries(entries)
+    states, text = build(entries)
+    out = open(args.output, 'w') if args.output else sys.stdout
+    write_header(out, args.name, source, entries, states, text)
+
+
+if __name__ == '__main__':
+    main()